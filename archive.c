@@ -0,0 +1,538 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <zlib.h>
+#include <sys/stat.h>
+
+#include "slimmemeter.h"
+
+/*
+ * Encoding of a telegram inside a block
+ *
+ * Every record starts with the receive time (unsigned int) and the 4 CRC
+ * characters, followed by the lines of the telegram. A line that equals
+ * the same line of the previous telegram in the block is a single
+ * A_SAME byte. Any other line is A_LINE, the number of leading bytes it
+ * shares with that previous line, the remaining bytes and a 0 byte.
+ * A_END closes the record. The first telegram of a block has no previous
+ * telegram, so every block decodes on its own.
+ */
+#define A_SAME 0x01
+#define A_LINE 0x02
+#define A_END  0x03
+
+#define ARCHIVE_BLOCK_SECONDS 600
+#define ARCHIVE_RECORD_MAX    (4 + 4 + 3 * 2048 + 1)
+
+// The longest telegram the framer accepts, its dataBlock less the 0 byte
+#define ARCHIVE_TELEGRAM_MAX  2047
+
+/*
+ * Split a telegram in lines, the '\n' is left out and restored on decode
+ *
+ * Returns the number of lines
+ */
+int archive_lines(const char *telegram, int length, const char **lines, int *sizes, int maxLines) {
+    int count = 0;
+    const char * start = telegram;
+    const char * end;
+
+    // The last line takes whatever is left
+    while (count < maxLines - 1) {
+        if ((end = memchr(start, '\n', telegram + length - start)) == NULL)
+            break;
+        lines[count] = start;
+        sizes[count++] = end - start;
+        start = end + 1;
+    }
+
+    lines[count] = start;
+    sizes[count++] = telegram + length - start;
+
+    return count;
+}
+
+/*
+ * Open the archive of a database directory for appending
+ *
+ * A block or index entry that was only partly written when the daemon
+ * stopped is cut off, the archive always ends with a complete block.
+ *
+ * Parameters:
+ *   *archive    - The archive to open
+ *   *directory  - Directory holding telegrams.arc and telegrams.idx
+ *
+ * Returns E_OK, E_MALLOC or E_FILE_ACCESS
+ */
+int open_archive(p1_archive *archive, const char *directory) {
+    struct _ARCHIVEBLOCK header;
+    struct _ARCHIVEINDEX entry;
+    char filename[512];
+    off_t dataSize;
+    off_t entries;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    memset(archive, 0, sizeof(p1_archive));
+    archive->dataFd = -1;
+    archive->indexFd = -1;
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    if (((archive->block = (char *)malloc(ARCHIVE_BLOCK_SIZE)) == NULL) || ((archive->compressed = (char *)malloc(compressBound(ARCHIVE_BLOCK_SIZE))) == NULL)) {
+        fprintf(stderr, "%s - Error claiming memory for the telegram archive: %s\n", timeStringBuffer, strerror(errno));
+        close_archive(archive);
+        return E_MALLOC;
+    }
+
+    snprintf(filename, sizeof(filename), "%s/telegrams.arc", directory);
+    if ((archive->dataFd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr, "%s - Error %i from open archive %s: %s\n", timeStringBuffer, errno, filename, strerror(errno));
+        close_archive(archive);
+        return E_FILE_ACCESS;
+    }
+
+    snprintf(filename, sizeof(filename), "%s/telegrams.idx", directory);
+    if ((archive->indexFd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr, "%s - Error %i from open archive index %s: %s\n", timeStringBuffer, errno, filename, strerror(errno));
+        close_archive(archive);
+        return E_FILE_ACCESS;
+    }
+
+    // Find the last block that is complete in both files
+    dataSize = lseek(archive->dataFd, 0, SEEK_END);
+    entries = lseek(archive->indexFd, 0, SEEK_END) / sizeof(struct _ARCHIVEINDEX);
+    archive->offset = 0;
+
+    while (entries > 0) {
+        if ((pread(archive->indexFd, &entry, sizeof(entry), (entries - 1) * sizeof(entry)) == sizeof(entry)) &&
+            (pread(archive->dataFd, &header, sizeof(header), entry.offset) == sizeof(header)) &&
+            (header.magic == ARCHIVE_MAGIC) && ((off_t)(entry.offset + sizeof(header) + header.compressedSize) <= dataSize)) {
+            archive->offset = entry.offset + sizeof(header) + header.compressedSize;
+            break;
+        }
+        entries--;
+    }
+
+    if ((ftruncate(archive->indexFd, entries * sizeof(struct _ARCHIVEINDEX)) != 0) || (ftruncate(archive->dataFd, archive->offset) != 0)) {
+        fprintf(stderr, "%s - Error %i from truncate archive in %s: %s\n", timeStringBuffer, errno, directory, strerror(errno));
+        close_archive(archive);
+        return E_FILE_ACCESS;
+    }
+
+    archive->indexOffset = entries * sizeof(struct _ARCHIVEINDEX);
+
+    return E_OK;
+}
+
+/*
+ * Compress the open block and append it to the archive
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+int flush_archive(p1_archive *archive) {
+    struct _ARCHIVEBLOCK header;
+    struct _ARCHIVEINDEX entry;
+    uLongf compressedSize = compressBound(ARCHIVE_BLOCK_SIZE);
+    int result = E_OK;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if ((archive->dataFd < 0) || (archive->count == 0))
+        return E_OK;
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    if (compress2((Bytef *)archive->compressed, &compressedSize, (Bytef *)archive->block, archive->length, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        fprintf(stderr, "%s - Error compressing archive block\n", timeStringBuffer);
+        result = E_FILE_ACCESS;
+        goto DONE;
+    }
+
+    header.magic = ARCHIVE_MAGIC;
+    header.count = archive->count;
+    header.compressedSize = compressedSize;
+    header.uncompressedSize = archive->length;
+    header.firstTime = archive->firstTime;
+    header.lastTime = archive->lastTime;
+
+    entry.firstTime = archive->firstTime;
+    entry.lastTime = archive->lastTime;
+    entry.offset = archive->offset;
+
+    // The index entry is written last, it only points at complete blocks
+    if ((pwrite(archive->dataFd, &header, sizeof(header), archive->offset) != sizeof(header)) ||
+        (pwrite(archive->dataFd, archive->compressed, compressedSize, archive->offset + sizeof(header)) != (ssize_t)compressedSize) ||
+        (pwrite(archive->indexFd, &entry, sizeof(entry), archive->indexOffset) != sizeof(entry))) {
+        fprintf(stderr, "%s - Error %i writing archive block: %s\n", timeStringBuffer, errno, strerror(errno));
+        result = E_FILE_ACCESS;
+        goto DONE;
+    }
+
+    archive->offset += sizeof(header) + compressedSize;
+    archive->indexOffset += sizeof(entry);
+
+DONE:
+    // A block that cannot be written is dropped, ingest goes on
+    archive->count = 0;
+    archive->length = 0;
+    archive->previousLength = 0;
+
+    return result;
+}
+
+/*
+ * Close an archive, writing the open block first
+ */
+void close_archive(p1_archive *archive) {
+    flush_archive(archive);
+
+    if (archive->dataFd >= 0)
+        close(archive->dataFd);
+    if (archive->indexFd >= 0)
+        close(archive->indexFd);
+    archive->dataFd = -1;
+    archive->indexFd = -1;
+
+    free(archive->block);
+    free(archive->compressed);
+    archive->block = NULL;
+    archive->compressed = NULL;
+}
+
+/*
+ * Add a CRC checked telegram to an archive
+ *
+ * Telegrams are collected in a block that is compressed and written when
+ * it is full or spans ARCHIVE_BLOCK_SECONDS, so a crash loses at most
+ * that much raw history. Must be called before parse_block(), which
+ * modifies the telegram.
+ *
+ * Parameters:
+ *   *archive    - The archive
+ *   *framer     - The framer holding the telegram
+ *   timestamp   - Receive time of the telegram
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+int archive_telegram(p1_archive *archive, p1_framer *framer, unsigned long timestamp) {
+    const char * lines[128];
+    int sizes[128];
+    const char * previousLines[128];
+    int previousSizes[128];
+    int lineCount;
+    int previousCount;
+    int prefix;
+    unsigned int recordTime = timestamp;
+    int telegramLength = framer->dataPointer - framer->dataBlock;
+    char * out;
+    int result = E_OK;
+
+    if (archive->dataFd < 0)
+        return E_OK;
+
+    if ((archive->count > 0) && ((archive->length + ARCHIVE_RECORD_MAX > ARCHIVE_BLOCK_SIZE) || (timestamp - archive->firstTime >= ARCHIVE_BLOCK_SECONDS)))
+        result = flush_archive(archive);
+
+    if (archive->count == 0)
+        archive->firstTime = timestamp;
+    archive->lastTime = timestamp;
+
+    lineCount = archive_lines(framer->dataBlock, telegramLength, lines, sizes, 128);
+    previousCount = archive_lines(archive->previous, archive->previousLength, previousLines, previousSizes, 128);
+    if (archive->previousLength == 0)
+        previousCount = 0;
+
+    out = archive->block + archive->length;
+    memcpy(out, &recordTime, sizeof(recordTime));
+    out += sizeof(recordTime);
+    memcpy(out, framer->checksumStr, 4);
+    out += 4;
+
+    for (int i = 0; i < lineCount; i++) {
+        if ((i < previousCount) && (sizes[i] == previousSizes[i]) && (memcmp(lines[i], previousLines[i], sizes[i]) == 0)) {
+            *out++ = A_SAME;
+            continue;
+        }
+
+        prefix = 0;
+        if (i < previousCount) {
+            while ((prefix < 255) && (prefix < sizes[i]) && (prefix < previousSizes[i]) && (lines[i][prefix] == previousLines[i][prefix]))
+                prefix++;
+        }
+
+        *out++ = A_LINE;
+        *out++ = (char)prefix;
+        memcpy(out, lines[i] + prefix, sizes[i] - prefix);
+        out += sizes[i] - prefix;
+        *out++ = '\0';
+    }
+    *out++ = A_END;
+
+    archive->length = out - archive->block;
+    archive->count++;
+
+    memcpy(archive->previous, framer->dataBlock, telegramLength);
+    archive->previousLength = telegramLength;
+
+    return result;
+}
+
+/*
+ * Read and decompress one block of an archive
+ *
+ * Parameters:
+ *   dataFd        - The opened telegrams.arc
+ *   offset        - Offset of the block header
+ *   *header       - Receives the block header
+ *   *compressed   - Buffer of compressBound(ARCHIVE_BLOCK_SIZE) bytes
+ *   *block        - Buffer of ARCHIVE_BLOCK_SIZE bytes
+ *
+ * Returns 1 for a block, 0 at the end of the archive and -1 for a
+ * corrupt block
+ */
+int read_archive_block(int dataFd, off_t offset, struct _ARCHIVEBLOCK *header, char *compressed, char *block) {
+    uLongf blockSize = ARCHIVE_BLOCK_SIZE;
+
+    if (pread(dataFd, header, sizeof(struct _ARCHIVEBLOCK), offset) != sizeof(struct _ARCHIVEBLOCK))
+        return 0;
+
+    if ((header->magic != ARCHIVE_MAGIC) || (header->compressedSize > compressBound(ARCHIVE_BLOCK_SIZE)) ||
+        (pread(dataFd, compressed, header->compressedSize, offset + sizeof(struct _ARCHIVEBLOCK)) != (ssize_t)header->compressedSize) ||
+        (uncompress((Bytef *)block, &blockSize, (Bytef *)compressed, header->compressedSize) != Z_OK) ||
+        (blockSize != header->uncompressedSize))
+        return -1;
+
+    return 1;
+}
+
+/*
+ * Start decoding the telegrams of a block
+ */
+void init_archive_cursor(archive_cursor *cursor, const char *block, struct _ARCHIVEBLOCK *header) {
+    cursor->in = block;
+    cursor->end = block + header->uncompressedSize;
+    cursor->remaining = header->count;
+    cursor->previousLength = 0;
+}
+
+/*
+ * Decode the next telegram of a block
+ *
+ * Parameters:
+ *   *cursor     - The block cursor
+ *   *telegram   - Buffer of 2048 bytes, receives the 0 terminated telegram
+ *   *length     - Receives the length of the telegram
+ *   *timestamp  - Receives the receive time of the telegram
+ *   *checksum   - Receives the 4 CRC characters
+ *
+ * Returns 1 for a telegram, 0 at the end of the block and -1 for a
+ * corrupt block
+ */
+int next_archive_telegram(archive_cursor *cursor, char *telegram, int *length, unsigned long *timestamp, char *checksum) {
+    const char * previousLines[128];
+    int previousSizes[128];
+    int previousCount = 0;
+    unsigned int recordTime;
+    int telegramLength = 0;
+    int size;
+
+    if ((cursor->remaining == 0) || (cursor->in + 8 > cursor->end))
+        return 0;
+
+    if (cursor->previousLength > 0)
+        previousCount = archive_lines(cursor->previous, cursor->previousLength, previousLines, previousSizes, 128);
+
+    memcpy(&recordTime, cursor->in, sizeof(recordTime));
+    memcpy(checksum, cursor->in + 4, 4);
+    cursor->in += 8;
+
+    for (int line = 0; (cursor->in < cursor->end) && (*cursor->in != A_END); line++) {
+        if (line >= 128)
+            return -1;
+        if (line > 0)
+            telegram[telegramLength++] = '\n';
+
+        if (*cursor->in == A_SAME) {
+            if ((line >= previousCount) || (telegramLength + previousSizes[line] > ARCHIVE_TELEGRAM_MAX))
+                return -1;
+            memcpy(telegram + telegramLength, previousLines[line], previousSizes[line]);
+            telegramLength += previousSizes[line];
+            cursor->in++;
+            continue;
+        }
+
+        if ((*cursor->in != A_LINE) || (cursor->in + 2 > cursor->end))
+            return -1;
+        size = (unsigned char)cursor->in[1];
+        if ((size > 0) && ((line >= previousCount) || (size > previousSizes[line]) || (telegramLength + size > ARCHIVE_TELEGRAM_MAX)))
+            return -1;
+        memcpy(telegram + telegramLength, previousLines[line], size);
+        telegramLength += size;
+        cursor->in += 2;
+
+        size = strnlen(cursor->in, cursor->end - cursor->in);
+        if ((cursor->in + size >= cursor->end) || (telegramLength + size > ARCHIVE_TELEGRAM_MAX))
+            return -1;
+        memcpy(telegram + telegramLength, cursor->in, size);
+        telegramLength += size;
+        cursor->in += size + 1;
+    }
+    if (cursor->in >= cursor->end)
+        return -1;
+    cursor->in++;
+    cursor->remaining--;
+
+    telegram[telegramLength] = '\0';
+    memcpy(cursor->previous, telegram, telegramLength);
+    cursor->previousLength = telegramLength;
+
+    *length = telegramLength;
+    *timestamp = recordTime;
+
+    return 1;
+}
+
+/*
+ * Find the first block of an archive with telegrams at or after a time
+ *
+ * Parameters:
+ *   indexFd  - The opened telegrams.idx
+ *   from     - The time
+ *   *offset  - Receives the offset of the block in telegrams.arc
+ *
+ * Returns 1 when found, 0 when all telegrams are older
+ */
+int seek_archive(int indexFd, unsigned long from, off_t *offset) {
+    struct _ARCHIVEINDEX entry;
+    long low = 0;
+    long high;
+    long middle;
+
+    high = lseek(indexFd, 0, SEEK_END) / sizeof(struct _ARCHIVEINDEX);
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (pread(indexFd, &entry, sizeof(entry), middle * sizeof(entry)) != sizeof(entry))
+            return 0;
+        if (entry.lastTime < from)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    if (pread(indexFd, &entry, sizeof(entry), low * sizeof(entry)) != sizeof(entry))
+        return 0;
+
+    *offset = entry.offset;
+
+    return 1;
+}
+
+/*
+ * Write the telegrams of an archive from a point in time to a stream
+ *
+ * The index is searched for the first block that ends at or after the
+ * start time, from there the blocks are read in order, ahead of the
+ * writing on a thread of their own. Telegrams are written exactly as
+ * received, including their CRC line.
+ *
+ * Parameters:
+ *   *directory  - Directory holding telegrams.arc and telegrams.idx
+ *   from        - Start time
+ *   *stream     - Output stream
+ *
+ * Returns E_OK, E_MALLOC or E_FILE_ACCESS
+ */
+int replay_archive(const char *directory, unsigned long from, FILE *stream) {
+    archive_cursor cursor;
+    char filename[512];
+    int dataFd = -1;
+    int indexFd = -1;
+    off_t offset;
+    block_pipeline blocks = { .blocks = NULL };
+    pipe_block * block;
+    char telegram[2048];
+    int length;
+    unsigned long timestamp;
+    char checksum[4];
+    int found = 0;
+    int result = E_OK;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    snprintf(filename, sizeof(filename), "%s/telegrams.arc", directory);
+    if ((dataFd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "%s - Error %i from open archive %s: %s\n", timeStringBuffer, errno, filename, strerror(errno));
+        result = E_FILE_ACCESS;
+        goto DONE;
+    }
+
+    snprintf(filename, sizeof(filename), "%s/telegrams.idx", directory);
+    if ((indexFd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "%s - Error %i from open archive index %s: %s\n", timeStringBuffer, errno, filename, strerror(errno));
+        result = E_FILE_ACCESS;
+        goto DONE;
+    }
+
+    if (!seek_archive(indexFd, from, &offset))
+        goto DONE;
+
+    if (start_block_pipeline(&blocks, dataFd, offset, -1) != E_OK) {
+        fprintf(stderr, "%s - Error claiming memory for the telegram archive: %s\n", timeStringBuffer, strerror(errno));
+        result = E_MALLOC;
+        goto DONE;
+    }
+
+    while ((block = next_pipeline_block(&blocks)) != NULL) {
+        init_archive_cursor(&cursor, block->block, &block->header);
+
+        while ((found = next_archive_telegram(&cursor, telegram, &length, &timestamp, checksum)) > 0) {
+            if (timestamp < from)
+                continue;
+
+            fwrite(telegram, 1, length, stream);
+            fwrite(checksum, 1, 4, stream);
+            fwrite("\r\n", 1, 2, stream);
+        }
+
+        offset = block->offset;
+        release_pipeline_block(&blocks, block);
+        if (found < 0)
+            break;
+    }
+
+    if (found == 0) {
+        found = blocks.found;
+        offset = blocks.offset;
+    }
+
+    if (found < 0) {
+        fprintf(stderr, "%s - Corrupt archive block at offset %ld in %s\n", timeStringBuffer, (long)offset, directory);
+        result = E_FILE_ACCESS;
+    }
+
+DONE:
+    stop_block_pipeline(&blocks);
+    fflush(stream);
+    if (dataFd >= 0)
+        close(dataFd);
+    if (indexFd >= 0)
+        close(indexFd);
+
+    return result;
+}
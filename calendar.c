@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "slimmemeter.h"
+
+enum CALENDAR_PERIODS {
+    CALENDAR_DAY,
+    CALENDAR_WEEK,
+    CALENDAR_MONTH,
+    CALENDAR_YEAR
+};
+
+/*
+ * The periods of the index and the number of entries kept of each, their
+ * rings follow each other in calendar_index.entries
+ */
+static const struct {
+    const char * name;
+    int          capacity;
+    int          first;
+} calendarPeriods[CALENDAR_LEVELS] = {
+    { "day",   400, 0 },
+    { "week",  110, 400 },
+    { "month", 40,  510 },
+    { "year",  16,  550 }
+};
+
+p1_calendar calendar = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Local start of the period holding a timestamp, mktime() finds the
+ * offset from UTC of that moment so a period around a DST change is 23
+ * or 25 hours longer or shorter
+ */
+static unsigned long period_start(unsigned long timestamp, int level) {
+    time_t time = (time_t)timestamp;
+    struct tm tm;
+
+    localtime_r(&time, &tm);
+    tm.tm_hour = 0;
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+
+    switch (level) {
+    case CALENDAR_WEEK:
+        tm.tm_mday -= (tm.tm_wday + 6) % 7;
+        break;
+    case CALENDAR_MONTH:
+        tm.tm_mday = 1;
+        break;
+    case CALENDAR_YEAR:
+        tm.tm_mday = 1;
+        tm.tm_mon = 0;
+        break;
+    }
+
+    return (unsigned long)mktime(&tm);
+}
+
+static calendar_entry * calendar_entry_at(calendar_index *index, int level, int offset) {
+    int capacity = calendarPeriods[level].capacity;
+
+    return &index->entries[calendarPeriods[level].first + (index->newest[level] - offset + capacity) % capacity];
+}
+
+/*
+ * Write the whole index through a temporary file that is flushed to disk
+ * and renamed over the index, for a new or replaced index
+ */
+static void save_calendar(p1_calendar *cal) {
+    char tempFilename[520];
+    char * slash;
+    FILE * fp;
+    size_t written;
+    int directoryFd;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    snprintf(tempFilename, sizeof(tempFilename), "%s.tmp", cal->filename);
+
+    if ((fp = fopen(tempFilename, "w")) == NULL) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error %i from open calendar index %s: %s\n", timeStringBuffer, errno, tempFilename, strerror(errno));
+        return;
+    }
+
+    written = fwrite(&cal->index, sizeof(calendar_index), 1, fp);
+
+    if ((written != 1) || (fflush(fp) != 0) || (fsync(fileno(fp)) != 0) || (fclose(fp) != 0) || (rename(tempFilename, cal->filename) != 0)) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error writing calendar index %s\n", timeStringBuffer, tempFilename);
+        unlink(tempFilename);
+        return;
+    }
+
+    // The rename is durable once the directory is
+    if ((slash = strrchr(cal->filename, '/')) != NULL) {
+        *slash = '\0';
+        if ((directoryFd = open(cal->filename, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+            fsync(directoryFd);
+            close(directoryFd);
+        }
+        *slash = '/';
+    }
+
+    cal->saved = 1;
+}
+
+/*
+ * Write the header and the entries that changed in place, at their
+ * offsets in calendar.idx
+ *
+ * The entries go first so a header never points at an entry that was
+ * not written. Only a new entry is flushed to disk, the latest counters
+ * change with every bucket.
+ *
+ * Parameters:
+ *   *cal      - The calendar
+ *   changed   - Bit per level that got a new entry
+ */
+static void update_calendar(p1_calendar *cal, int changed) {
+    calendar_index * index = &cal->index;
+    calendar_entry * entry;
+    off_t offset;
+    int fd;
+    int result = 0;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if (!cal->saved) {
+        save_calendar(cal);
+        return;
+    }
+
+    if ((fd = open(cal->filename, O_WRONLY | O_CLOEXEC)) < 0) {
+        save_calendar(cal);
+        return;
+    }
+
+    for (int level = 0; level < CALENDAR_LEVELS; level++) {
+        if (!(changed & (1 << level)))
+            continue;
+
+        entry = calendar_entry_at(index, level, 0);
+        offset = offsetof(calendar_index, entries) + (entry - index->entries) * sizeof(calendar_entry);
+        if (pwrite(fd, entry, sizeof(calendar_entry), offset) != sizeof(calendar_entry))
+            result = -1;
+    }
+
+    if ((changed != 0) && (result == 0) && (fdatasync(fd) != 0))
+        result = -1;
+
+    if ((result == 0) && (pwrite(fd, index, offsetof(calendar_index, entries), 0) != offsetof(calendar_index, entries)))
+        result = -1;
+
+    if ((changed != 0) && (result == 0) && (fdatasync(fd) != 0))
+        result = -1;
+
+    if ((close(fd) != 0) || (result != 0)) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error %i updating calendar index %s: %s\n", timeStringBuffer, errno, cal->filename, strerror(errno));
+
+        // Written whole the next time
+        cal->saved = 0;
+    }
+}
+
+/*
+ * Load the calendar index of a database directory
+ *
+ * A missing or unreadable index starts empty, the totals then begin at
+ * the first bucket stored.
+ *
+ * Parameters:
+ *   *cal        - The calendar, its lock initialised
+ *   *directory  - The database directory
+ */
+void init_calendar(p1_calendar *cal, const char *directory) {
+    calendar_index * loaded = &cal->index;
+    FILE * fp;
+    int valid = 0;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    pthread_mutex_lock(&cal->lock);
+
+    snprintf(cal->filename, sizeof(cal->filename), "%s/calendar.idx", directory);
+
+    if ((fp = fopen(cal->filename, "r")) != NULL) {
+        if ((fread(loaded, sizeof(calendar_index), 1, fp) == 1) && (fgetc(fp) == EOF) &&
+            (loaded->magic == CALENDAR_MAGIC) && (loaded->version == CALENDAR_VERSION) && (loaded->entrySize == sizeof(calendar_entry)))
+            valid = 1;
+        fclose(fp);
+
+        if (!valid) {
+            msgtime = time(NULL);
+            tm_info = localtime(&msgtime);
+            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+            fprintf(stderr, "%s - Calendar index %s is not valid, started a new one\n", timeStringBuffer, cal->filename);
+        }
+    }
+
+    cal->saved = valid;
+
+    // Read straight into the index of this calendar, meters are set up concurrently
+    if (!valid) {
+        memset(loaded, 0, sizeof(calendar_index));
+        loaded->magic = CALENDAR_MAGIC;
+        loaded->version = CALENDAR_VERSION;
+        loaded->entrySize = sizeof(calendar_entry);
+    }
+
+    pthread_mutex_unlock(&cal->lock);
+}
+
+/*
+ * Add a stored bucket to the calendar index
+ *
+ * The counters of a bucket are read at its end. The first bucket of a
+ * period adds an entry with the counters read at the start of that
+ * period, the previous reading or, across a gap, the reading interpolated
+ * between the previous one and this bucket. Buckets older than the
+ * latest reading are ignored.
+ *
+ * Parameters:
+ *   *cal       - The calendar
+ *   timestamp  - Start of the bucket
+ *   *data      - The bucket
+ */
+void calendar_add(p1_calendar *cal, unsigned long timestamp, const elec_data *data) {
+    calendar_index * index = &cal->index;
+    calendar_entry * entry;
+    double values[COUNTERS];
+    unsigned long readTime = timestamp + 300;
+    unsigned long start;
+    double fraction;
+    int changed = 0;
+
+#define P1_CALENDAR_COUNTER(name, obis, file, source, label, unit) \
+    values[COUNTER_##name] = data->name;
+    P1_COUNTERS(P1_CALENDAR_COUNTER)
+#undef P1_CALENDAR_COUNTER
+
+    pthread_mutex_lock(&cal->lock);
+
+    if (readTime <= index->latestTime) {
+        pthread_mutex_unlock(&cal->lock);
+        return;
+    }
+
+    for (int level = 0; level < CALENDAR_LEVELS; level++) {
+        start = period_start(timestamp, level);
+
+        if ((index->count[level] > 0) && (start <= calendar_entry_at(index, level, 0)->start))
+            continue;
+
+        if (index->count[level] < calendarPeriods[level].capacity)
+            index->count[level]++;
+        index->newest[level] = (index->newest[level] + 1) % calendarPeriods[level].capacity;
+
+        entry = calendar_entry_at(index, level, 0);
+        entry->start = start;
+        changed |= 1 << level;
+
+        if (index->latestTime == 0) {
+            memcpy(entry->counters, values, sizeof(values));
+        }
+        else if (index->latestTime < start) {
+            fraction = (double)(start - index->latestTime) / (double)(readTime - index->latestTime);
+            for (int i = 0; i < COUNTERS; i++)
+                entry->counters[i] = index->latest[i] + (values[i] - index->latest[i]) * fraction;
+        }
+        else {
+            memcpy(entry->counters, index->latest, sizeof(values));
+        }
+    }
+
+    index->latestTime = readTime;
+    memcpy(index->latest, values, sizeof(values));
+
+    update_calendar(cal, changed);
+
+    pthread_mutex_unlock(&cal->lock);
+}
+
+/*
+ * Format the totals of a period as a JSON object
+ *
+ * Parameters:
+ *   *buffer  - Output buffer
+ *   size     - Size of the buffer
+ *   *cal     - The calendar
+ *   *period  - day, week, month or year
+ *   offset   - 0 for the open period, 1 for the one before, ...
+ *
+ * Returns the length of the object, or -1 for an unknown period or one
+ * that is not in the index
+ */
+int json_totals(char *buffer, size_t size, p1_calendar *cal, const char *period, int offset) {
+    calendar_index * index = &cal->index;
+    calendar_entry * entry;
+    const double * end;
+    unsigned long endTime;
+    int level;
+    int length;
+
+    for (level = 0; level < CALENDAR_LEVELS; level++) {
+        if (strcmp(period, calendarPeriods[level].name) == 0)
+            break;
+    }
+    if (level == CALENDAR_LEVELS)
+        return -1;
+
+    pthread_mutex_lock(&cal->lock);
+
+    if ((offset < 0) || (offset >= index->count[level])) {
+        pthread_mutex_unlock(&cal->lock);
+        return -1;
+    }
+
+    entry = calendar_entry_at(index, level, offset);
+    if (offset == 0) {
+        end = index->latest;
+        endTime = index->latestTime;
+    }
+    else {
+        end = calendar_entry_at(index, level, offset - 1)->counters;
+        endTime = calendar_entry_at(index, level, offset - 1)->start;
+    }
+
+    length = snprintf(buffer, size, "{\"period\":\"%s\",\"start\":%lu,\"end\":%lu,\"open\":%s",
+        calendarPeriods[level].name, entry->start, endTime, (offset == 0) ? "true" : "false");
+
+#define P1_JSON_TOTAL(name, obis, file, source, label, unit) \
+    length += snprintf(buffer + length, size - length, ",\"" #name "\":%.3lf", end[COUNTER_##name] - entry->counters[COUNTER_##name]);
+    P1_COUNTERS(P1_JSON_TOTAL)
+#undef P1_JSON_TOTAL
+
+    pthread_mutex_unlock(&cal->lock);
+
+    length += snprintf(buffer + length, size - length, "}");
+
+    return length;
+}
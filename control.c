@@ -0,0 +1,460 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "slimmemeter.h"
+
+#define CONTROL_BUFFER_SIZE 512
+#define CONTROL_REPLY_SIZE 32768
+
+struct _CONTROLCLIENT {
+    int  fd;
+    int  length;
+    char buffer[CONTROL_BUFFER_SIZE];
+};
+
+int controlSocket = -1;
+struct _CONTROLCLIENT controlClients[CONTROL_MAX_CLIENTS];
+
+/*
+ * Open the control socket
+ *
+ * The socket is a Unix domain stream socket accepting newline terminated
+ * commands. Every command is answered with a single line of JSON.
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+int init_control(struct _CONFIGSTRUCT *config) {
+    struct sockaddr_un address;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+        controlClients[i].fd = -1;
+
+    if (config->controlSocketFilename == NULL)
+        return E_OK;
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    if (strlen(config->controlSocketFilename) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "%s - Control socket name too long: %s\n", timeStringBuffer, config->controlSocketFilename);
+        return E_FILE_ACCESS;
+    }
+
+    if ((controlSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        fprintf(stderr, "%s - Error %i from control socket: %s\n", timeStringBuffer, errno, strerror(errno));
+        return E_FILE_ACCESS;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, config->controlSocketFilename);
+
+    // Remove a stale socket from a previous run
+    unlink(config->controlSocketFilename);
+
+    if ((bind(controlSocket, (struct sockaddr *)&address, sizeof(address)) != 0) || (listen(controlSocket, 4) != 0)) {
+        fprintf(stderr, "%s - Error %i from bind control socket %s: %s\n", timeStringBuffer, errno, config->controlSocketFilename, strerror(errno));
+        close(controlSocket);
+        controlSocket = -1;
+        return E_FILE_ACCESS;
+    }
+
+    chmod(config->controlSocketFilename, 0660);
+
+    return E_OK;
+}
+
+/*
+ * Close the control socket and all connected clients
+ */
+void close_control(struct _CONFIGSTRUCT *config) {
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        if (controlClients[i].fd >= 0)
+            close(controlClients[i].fd);
+        controlClients[i].fd = -1;
+    }
+
+    if (controlSocket >= 0) {
+        close(controlSocket);
+        controlSocket = -1;
+
+        if (config->controlSocketFilename != NULL)
+            unlink(config->controlSocketFilename);
+    }
+}
+
+/*
+ * Add the control socket and its clients to a poll set
+ *
+ * Parameters:
+ *   *pollFds  - First free entry in the poll set
+ *   maxFds    - Number of free entries
+ *
+ * Returns the number of entries used
+ */
+int control_poll_fds(struct pollfd *pollFds, int maxFds) {
+    int count = 0;
+
+    if ((controlSocket < 0) || (maxFds < 1))
+        return 0;
+
+    pollFds[count].fd = controlSocket;
+    pollFds[count].events = POLLIN;
+    pollFds[count].revents = 0;
+    count++;
+
+    for (int i = 0; (i < CONTROL_MAX_CLIENTS) && (count < maxFds); i++) {
+        if (controlClients[i].fd < 0)
+            continue;
+
+        pollFds[count].fd = controlClients[i].fd;
+        pollFds[count].events = POLLIN;
+        pollFds[count].revents = 0;
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * Format a bucket as a JSON object
+ *
+ * Returns the number of characters written
+ */
+int json_bucket(char *buffer, size_t size, unsigned long timestamp, int samples, elec_data *data) {
+    int length;
+
+    length = snprintf(buffer, size, "{\"timestamp\":%lu,\"samples\":%d", timestamp, samples);
+
+#define P1_JSON_COUNTER(name, obis, file, source, label, unit) \
+    length += snprintf(buffer + length, size - length, ",\"" #name "\":%.3lf", data->name);
+#define P1_JSON_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) \
+    length += snprintf(buffer + length, size - length, ",\"" #name "\":{\"min\":" format ",\"avg\":" format ",\"max\":" format "}", data->name##_min, data->name##_avg, data->name##_max);
+    P1_COUNTERS(P1_JSON_COUNTER)
+    P1_GAUGES(P1_JSON_GAUGE)
+#undef P1_JSON_COUNTER
+#undef P1_JSON_GAUGE
+
+    for (int d = 0; d < derivedChannels.count; d++) {
+        if (data->derived_samples[d] > 0)
+            length += snprintf(buffer + length, size - length, ",\"%s\":{\"min\":%.3lf,\"avg\":%.3lf,\"max\":%.3lf}", derivedChannels.name[d], data->derived_min[d], data->derived_avg[d], data->derived_max[d]);
+        else
+            length += snprintf(buffer + length, size - length, ",\"%s\":null", derivedChannels.name[d]);
+    }
+
+    length += snprintf(buffer + length, size - length, "}");
+
+    return length;
+}
+
+/*
+ * Execute a single control command
+ *
+ * Parameters:
+ *   *command  - The command line, without line terminator
+ *   *reply    - Buffer receiving the JSON reply
+ *   size      - Size of the reply buffer
+ *   *config   - Pointer to the configuration
+ *
+ * Returns the length of the reply
+ */
+int control_command(char *command, char *reply, size_t size, struct _CONFIGSTRUCT *config) {
+    static unsigned long pendingTimes[QUEUE_SIZE];
+    static elec_data pending[QUEUE_SIZE];
+    elec_data bucket;
+    char * argument;
+    char * span;
+    char * period;
+    char * offset;
+    char * meter;
+    char * next;
+    int length;
+    int count;
+    int newSerialPort;
+    int result;
+
+    if ((argument = strchr(command, ' ')) != NULL) {
+        *argument++ = '\0';
+        while (*argument == ' ')
+            argument++;
+    }
+    else {
+        argument = "";
+    }
+
+    if (strcmp(command, "help") == 0) {
+        return snprintf(reply, size, "{\"ok\":true,\"commands\":[\"help\",\"stats\",\"flush\",\"dump bucket\",\"dump queue\",\"demand\",\"history <channel> hour|day|week|month|year\",\"totals day|week|month|year [offset] [meter]\",\"sinks\",\"graphs\",\"set log-level quiet|verbose\",\"reopen port\",\"sync\"]}");
+    }
+
+    if (strcmp(command, "stats") == 0) {
+        length = snprintf(reply, size, "{\"ok\":true,\"uptime\":%ld,\"last_telegram\":%ld,\"telegrams\":%lu,\"crc_errors\":%lu,\"overruns\":%lu,\"buckets_stored\":%lu,\"rrd_errors\":%lu,\"verbose\":%d",
+            (long)(time(NULL) - stats.startTime), (long)__atomic_load_n(&stats.lastTelegramTime, __ATOMIC_RELAXED), __atomic_load_n(&stats.telegrams, __ATOMIC_RELAXED), __atomic_load_n(&stats.crcErrors, __ATOMIC_RELAXED), stats.overruns, stats.bucketsStored, stats.rrdErrors, verbose);
+
+        // Buckets written since the last sync are lost when the power goes
+        if (config->stagingDirectory != NULL)
+            length += snprintf(reply + length, size - length, ",\"syncs\":%lu,\"sync_errors\":%lu,\"last_sync\":%ld,\"unsynced_seconds\":%ld",
+                stats.syncs, stats.syncErrors, (long)stats.lastSyncTime, (long)(time(NULL) - stats.lastSyncTime));
+
+        length += snprintf(reply + length, size - length, "}");
+        return length;
+    }
+
+    if (strcmp(command, "sync") == 0) {
+        if (config->stagingDirectory == NULL)
+            return snprintf(reply, size, "{\"ok\":false,\"error\":\"no staging directory\"}");
+
+        suspend_sinks();
+        result = sync_staging(config->stagingDirectory, config->databaseDirectory);
+        resume_sinks();
+
+        if (result != E_OK)
+            return snprintf(reply, size, "{\"ok\":false,\"error\":\"sync failed\"}");
+        return snprintf(reply, size, "{\"ok\":true,\"last_sync\":%ld}", (long)stats.lastSyncTime);
+    }
+
+    /*
+     * Only completed buckets are drained, the open bucket is stored when
+     * its interval ends. Storing it now would give its interval a second,
+     * rejected update.
+     */
+    if (strcmp(command, "flush") == 0) {
+        count = 0;
+        for (int i = bucketQueue.readDataCounter; (count < QUEUE_SIZE) && (bucketQueue.timestampArray[i] != 0); i = (i + 1) % QUEUE_SIZE)
+            count++;
+
+        if (store_queue(&bucketQueue) != E_OK)
+            return snprintf(reply, size, "{\"ok\":false,\"error\":\"storing queue failed\"}");
+
+        // Sinks waiting to retry try again now
+        wake_sinks();
+        save_state(config);
+        return snprintf(reply, size, "{\"ok\":true,\"completed_buckets\":%d,\"open_bucket_samples\":%d}", count, (aggrState.eCummPointer != NULL) ? aggrState.counter : 0);
+    }
+
+    if (strcmp(command, "sinks") == 0) {
+        length = snprintf(reply, size, "{\"ok\":true,\"sinks\":");
+        length += json_sinks(reply + length, size - length);
+        length += snprintf(reply + length, size - length, "}");
+        return length;
+    }
+
+    if (strcmp(command, "graphs") == 0) {
+        length = snprintf(reply, size, "{\"ok\":true,\"graphs\":");
+        length += json_graphs(reply + length, size - length);
+        length += snprintf(reply + length, size - length, "}");
+        return length;
+    }
+
+    if ((strcmp(command, "dump") == 0) && (strcmp(argument, "bucket") == 0)) {
+        if ((aggrState.counter == 0) || (aggrState.eCummPointer == NULL))
+            return snprintf(reply, size, "{\"ok\":true,\"bucket\":null}");
+
+        // The averages are running sums until the interval closes
+        bucket = *aggrState.eCummPointer;
+        average_data(&bucket, aggrState.counter);
+
+        length = snprintf(reply, size, "{\"ok\":true,\"bucket\":");
+        length += json_bucket(reply + length, size - length, aggrState.lastMeasureTime * 300, aggrState.counter, &bucket);
+        length += snprintf(reply + length, size - length, "}");
+        return length;
+    }
+
+    if (strcmp(command, "demand") == 0) {
+        length = snprintf(reply, size, "{\"ok\":true,\"demand\":");
+        length += json_demand(reply + length, size - length, &demandState);
+        length += snprintf(reply + length, size - length, "}");
+        return length;
+    }
+
+    if (strcmp(command, "history") == 0) {
+        if ((span = strchr(argument, ' ')) == NULL)
+            return snprintf(reply, size, "{\"ok\":false,\"error\":\"usage: history <channel> <span>\"}");
+        *span++ = '\0';
+
+        length = snprintf(reply, size, "{\"ok\":true,\"history\":");
+        if ((count = json_history(reply + length, size - length - 1, argument, span)) < 0)
+            return snprintf(reply, size, "{\"ok\":false,\"error\":\"unknown channel or span\"}");
+        length += count;
+        length += snprintf(reply + length, size - length, "}");
+        return length;
+    }
+
+    if (strcmp(command, "totals") == 0) {
+        period = strtok_r(argument, " ", &next);
+        offset = strtok_r(NULL, " ", &next);
+        meter = strtok_r(NULL, " ", &next);
+        if (period == NULL)
+            return snprintf(reply, size, "{\"ok\":false,\"error\":\"usage: totals <period> [offset] [meter]\"}");
+
+        length = snprintf(reply, size, "{\"ok\":true,\"totals\":");
+        if (meter != NULL)
+            count = json_meter_totals(reply + length, size - length - 1, meter, period, atoi(offset));
+        else
+            count = json_totals(reply + length, size - length - 1, &calendar, period, (offset != NULL) ? atoi(offset) : 0);
+        if (count < 0)
+            return snprintf(reply, size, "{\"ok\":false,\"error\":\"unknown meter or period, or period not in the index\"}");
+        length += count;
+        length += snprintf(reply + length, size - length, "}");
+        return length;
+    }
+
+    if ((strcmp(command, "dump") == 0) && (strcmp(argument, "queue") == 0)) {
+        length = snprintf(reply, size, "{\"ok\":true,\"queue\":[");
+
+        // The newest buckets still waiting for the databases
+        count = sink_pending(&sinks[SINK_RRD], pendingTimes, pending, QUEUE_SIZE);
+        for (int i = 0; (i < count) && (length < (int)size - 1024); i++) {
+            if (i > 0)
+                length += snprintf(reply + length, size - length, ",");
+            length += json_bucket(reply + length, size - length, pendingTimes[i], 0, &pending[i]);
+        }
+
+        length += snprintf(reply + length, size - length, "]}");
+        return length;
+    }
+
+    if ((strcmp(command, "set") == 0) && (strncmp(argument, "log-level ", 10) == 0)) {
+        argument += 10;
+
+        if ((strcmp(argument, "quiet") == 0) || (strcmp(argument, "0") == 0))
+            verbose = 0;
+        else if ((strcmp(argument, "verbose") == 0) || (strcmp(argument, "1") == 0))
+            verbose = 1;
+        else
+            return snprintf(reply, size, "{\"ok\":false,\"error\":\"unknown log level\"}");
+
+        return snprintf(reply, size, "{\"ok\":true,\"verbose\":%d}", verbose);
+    }
+
+    if ((strcmp(command, "reopen") == 0) && (strcmp(argument, "port") == 0)) {
+        if ((newSerialPort = init_serial(config)) < 0)
+            return snprintf(reply, size, "{\"ok\":false,\"error\":\"cannot open serial port\"}");
+
+        close(serialPort);
+        serialPort = newSerialPort;
+        init_framer(&serialFramer);
+        return snprintf(reply, size, "{\"ok\":true}");
+    }
+
+    return snprintf(reply, size, "{\"ok\":false,\"error\":\"unknown command\"}");
+}
+
+/*
+ * Handle activity on the control socket and its clients
+ *
+ * Parameters:
+ *   *pollFds  - The entries added by control_poll_fds()
+ *   numFds    - Number of entries
+ *   *config   - Pointer to the configuration
+ */
+void control_handle(struct pollfd *pollFds, int numFds, struct _CONFIGSTRUCT *config) {
+    static char reply[CONTROL_REPLY_SIZE];
+    struct _CONTROLCLIENT * client;
+    char * line;
+    char * end;
+    int clientFd;
+    int length;
+    int result;
+
+    for (int n = 0; n < numFds; n++) {
+        if (pollFds[n].revents == 0)
+            continue;
+
+        // New connection
+        if (pollFds[n].fd == controlSocket) {
+            if ((clientFd = accept4(controlSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+                continue;
+
+            for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+                if (controlClients[i].fd < 0) {
+                    controlClients[i].fd = clientFd;
+                    controlClients[i].length = 0;
+                    clientFd = -1;
+                    break;
+                }
+            }
+
+            // No free slot
+            if (clientFd >= 0)
+                close(clientFd);
+
+            continue;
+        }
+
+        client = NULL;
+        for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+            if (controlClients[i].fd == pollFds[n].fd) {
+                client = &controlClients[i];
+                break;
+            }
+        }
+        if (client == NULL)
+            continue;
+
+        result = read(client->fd, client->buffer + client->length, CONTROL_BUFFER_SIZE - 1 - client->length);
+        if ((result < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+            continue;
+        if (result <= 0) {
+            close(client->fd);
+            client->fd = -1;
+            continue;
+        }
+
+        client->length += result;
+        client->buffer[client->length] = '\0';
+
+        // Execute every complete line
+        line = client->buffer;
+        while ((end = strchr(line, '\n')) != NULL) {
+            *end = '\0';
+            if ((end > line) && (end[-1] == '\r'))
+                end[-1] = '\0';
+
+            if (*line != '\0') {
+                length = control_command(line, reply, CONTROL_REPLY_SIZE - 1, config);
+                if (length > CONTROL_REPLY_SIZE - 2)
+                    length = CONTROL_REPLY_SIZE - 2;
+                reply[length++] = '\n';
+
+                // Replies are small, a client that cannot take one is dropped
+                if (write(client->fd, reply, length) != length) {
+                    close(client->fd);
+                    client->fd = -1;
+                    break;
+                }
+            }
+
+            line = end + 1;
+        }
+
+        if (client->fd < 0)
+            continue;
+
+        client->length -= line - client->buffer;
+        memmove(client->buffer, line, client->length);
+
+        // Line too long
+        if (client->length >= CONTROL_BUFFER_SIZE - 1) {
+            close(client->fd);
+            client->fd = -1;
+        }
+    }
+}
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "slimmemeter.h"
+
+/*
+ * Set up the demand engine
+ *
+ * The window is both the length of the rolling average and the length
+ * of the blocks the peak is billed on, aligned to whole multiples of the
+ * window since the epoch. The monthly peaks are kept.
+ *
+ * Parameters:
+ *   *demand  - The demand state
+ *   window   - Window in seconds
+ *
+ * Returns E_OK or E_MALLOC
+ */
+int init_demand(p1_demand *demand, int window) {
+    free_demand(demand);
+
+    for (int d = 0; d < 2; d++) {
+        if ((demand->samples[d] = (float *)calloc(window, sizeof(float))) == NULL) {
+            free_demand(demand);
+            return E_MALLOC;
+        }
+    }
+
+    demand->window = window;
+    demand->filled = 0;
+    demand->lastTime = 0;
+    demand->blockStart = 0;
+    demand->blockSeconds = 0;
+    for (int d = 0; d < 2; d++) {
+        demand->sum[d] = 0.0;
+        demand->blockEnergy[d] = 0.0;
+        demand->lastBlock[d] = 0.0;
+        demand->current[d] = 0.0;
+    }
+
+    return E_OK;
+}
+
+void free_demand(p1_demand *demand) {
+    for (int d = 0; d < 2; d++) {
+        free(demand->samples[d]);
+        demand->samples[d] = NULL;
+    }
+    demand->window = 0;
+}
+
+/*
+ * Close the current block and update the peak of its month
+ *
+ * Seconds without data, before the first telegram or in a gap, are left
+ * out of the average.
+ */
+void close_demand_block(p1_demand *demand) {
+    time_t blockTime = (time_t)demand->blockStart;
+    struct tm blockTm;
+    int month;
+
+    localtime_r(&blockTime, &blockTm);
+    month = (blockTm.tm_year + 1900) * 12 + blockTm.tm_mon;
+
+    if (month != demand->peakMonth) {
+        demand->peakMonth = month;
+        for (int d = 0; d < 2; d++) {
+            demand->peak[d] = 0.0;
+            demand->peakTime[d] = 0;
+        }
+    }
+
+    for (int d = 0; d < 2; d++) {
+        demand->lastBlock[d] = (demand->blockSeconds > 0) ? demand->blockEnergy[d] / demand->blockSeconds : 0.0;
+        if (demand->lastBlock[d] > demand->peak[d]) {
+            demand->peak[d] = demand->lastBlock[d];
+            demand->peakTime[d] = demand->blockStart;
+        }
+        demand->blockEnergy[d] = 0.0;
+    }
+    demand->blockSeconds = 0;
+}
+
+/*
+ * Feed the power of a telegram to the demand engine
+ *
+ * The power holds for every second since the previous telegram. Of those
+ * seconds only the last window can be in the rolling window, so at most
+ * one window of slots is replaced and a gap of a window or more starts
+ * the window over. The seconds are added to the billing blocks as a
+ * whole, at most two blocks per telegram.
+ *
+ * Parameters:
+ *   *demand    - The demand state
+ *   timestamp  - Time of the telegram
+ *   kwIn       - Power usage in kW
+ *   kwOut      - Power delivery in kW
+ */
+void demand_update(p1_demand *demand, unsigned long timestamp, double kwIn, double kwOut) {
+    unsigned long window = demand->window;
+    unsigned long first;
+    unsigned long last;
+    unsigned long count;
+    unsigned long slot;
+
+    if ((window == 0) || (timestamp <= demand->lastTime))
+        return;
+
+    demand->current[0] = kwIn;
+    demand->current[1] = kwOut;
+
+    if (demand->lastTime == 0) {
+        demand->lastTime = timestamp;
+        demand->blockStart = timestamp - (timestamp % window);
+        return;
+    }
+
+    first = demand->lastTime + 1;
+    if (timestamp - demand->lastTime > window)
+        first = timestamp - window + 1;
+    count = timestamp - first + 1;
+
+    for (int d = 0; d < 2; d++) {
+        if (count == window)
+            demand->sum[d] = 0.0;
+
+        slot = first % window;
+        for (unsigned long i = 0; i < count; i++) {
+            if (count < window)
+                demand->sum[d] -= demand->samples[d][slot];
+            demand->samples[d][slot] = (float)demand->current[d];
+            demand->sum[d] += demand->samples[d][slot];
+
+            if (++slot == window)
+                slot = 0;
+        }
+    }
+
+    demand->filled += count;
+    if (demand->filled > window)
+        demand->filled = window;
+
+    while (first <= timestamp) {
+        if (first - (first % window) != demand->blockStart) {
+            close_demand_block(demand);
+            demand->blockStart = first - (first % window);
+        }
+
+        last = demand->blockStart + window - 1;
+        if (last > timestamp)
+            last = timestamp;
+
+        for (int d = 0; d < 2; d++)
+            demand->blockEnergy[d] += demand->current[d] * (last - first + 1);
+        demand->blockSeconds += last - first + 1;
+
+        first = last + 1;
+    }
+
+    demand->lastTime = timestamp;
+}
+
+/*
+ * Format the demand state as a JSON object
+ *
+ * Per direction: the rolling average, the average of the open block so
+ * far, the projected average of the open block when the current power
+ * holds until its end, the last closed block and the peak of the month.
+ *
+ * Returns the number of characters written
+ */
+int json_demand(char *buffer, size_t size, p1_demand *demand) {
+    const char * names[2] = { "in", "out" };
+    unsigned long remaining = 0;
+    double rolling;
+    double block;
+    double projected;
+    int length;
+
+    if (demand->lastTime != 0)
+        remaining = demand->blockStart + demand->window - demand->lastTime - 1;
+
+    length = snprintf(buffer, size, "{\"window\":%d,\"time\":%lu,\"block_start\":%lu", demand->window, demand->lastTime, demand->blockStart);
+
+    for (int d = 0; d < 2; d++) {
+        rolling = (demand->filled > 0) ? demand->sum[d] / demand->filled : 0.0;
+        block = (demand->blockSeconds > 0) ? demand->blockEnergy[d] / demand->blockSeconds : 0.0;
+        projected = (demand->blockSeconds + remaining > 0) ? (demand->blockEnergy[d] + demand->current[d] * remaining) / (demand->blockSeconds + remaining) : 0.0;
+
+        length += snprintf(buffer + length, size - length,
+            ",\"%s\":{\"current\":%.3lf,\"rolling\":%.3lf,\"block\":%.3lf,\"projected\":%.3lf,\"last_block\":%.3lf,\"peak\":%.3lf,\"peak_time\":%lu}",
+            names[d], demand->current[d], rolling, block, projected, demand->lastBlock[d], demand->peak[d], demand->peakTime[d]);
+    }
+
+    length += snprintf(buffer + length, size - length, "}");
+
+    return length;
+}
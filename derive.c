@@ -0,0 +1,454 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+
+#include "slimmemeter.h"
+
+p1_derived derivedChannels;
+
+/*
+ * The channels an expression can use, by name or by OBIS reference
+ */
+static const struct {
+    const char * name;
+    const char * obis;
+    int          field;
+} deriveFields[] = {
+#define P1_DERIVE_COUNTER(name, obis, file, source, label, unit) { #name, obis, FIELD_##name },
+#define P1_DERIVE_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) { #name, obis, FIELD_##name },
+    P1_COUNTERS(P1_DERIVE_COUNTER)
+    P1_GAUGES(P1_DERIVE_GAUGE)
+#undef P1_DERIVE_COUNTER
+#undef P1_DERIVE_GAUGE
+    { NULL, NULL, FIELD_NONE }
+};
+
+/*
+ * Functions, with the number of arguments
+ */
+static const struct {
+    const char * name;
+    int          op;
+    int          arguments;
+} deriveFunctions[] = {
+    { "min",  OP_MIN,  2 },
+    { "max",  OP_MAX,  2 },
+    { "abs",  OP_ABS,  1 },
+    { "sqrt", OP_SQRT, 1 },
+    { NULL,   0,       0 }
+};
+
+/*
+ * State of the compiler of one expression, a recursive descent parser
+ * that emits the program in postfix order
+ */
+typedef struct {
+    const char * text;
+    const char * error;
+    int          channel;
+    int          length;
+    int          depth;
+    int          maxDepth;
+    derived_op * program;
+} derive_compiler;
+
+static void derive_expression(derive_compiler *compiler);
+
+static void derive_emit(derive_compiler *compiler, int op, int index, double constant, int depth) {
+    if (compiler->error != NULL)
+        return;
+
+    if (compiler->length >= DERIVED_PROGRAM) {
+        compiler->error = "expression too long";
+        return;
+    }
+
+    compiler->program[compiler->length].op = op;
+    compiler->program[compiler->length].index = index;
+    compiler->program[compiler->length].constant = constant;
+    compiler->length++;
+
+    compiler->depth += depth;
+    if (compiler->depth > compiler->maxDepth)
+        compiler->maxDepth = compiler->depth;
+}
+
+static void derive_skip(derive_compiler *compiler) {
+    while (isspace((unsigned char)*compiler->text))
+        compiler->text++;
+}
+
+/*
+ * Length of an OBIS reference a-b:c.d.e at the start of text, 0 when
+ * there is none
+ */
+static size_t derive_obis(const char *text) {
+    const char * p = text;
+    const char * separators = "-:..";
+
+    for (int part = 0; part < 5; part++) {
+        if (!isdigit((unsigned char)*p))
+            return 0;
+        while (isdigit((unsigned char)*p))
+            p++;
+        if (part < 4) {
+            if (*p != separators[part])
+                return 0;
+            p++;
+        }
+    }
+
+    return p - text;
+}
+
+static void derive_primary(derive_compiler *compiler) {
+    char name[32];
+    size_t length;
+    char * end;
+    double constant;
+    int i;
+
+    derive_skip(compiler);
+
+    if (*compiler->text == '(') {
+        compiler->text++;
+        derive_expression(compiler);
+        derive_skip(compiler);
+        if (*compiler->text != ')') {
+            compiler->error = "expected )";
+            return;
+        }
+        compiler->text++;
+        return;
+    }
+
+    if ((length = derive_obis(compiler->text)) > 0) {
+        for (i = 0; deriveFields[i].obis != NULL; i++) {
+            if ((strlen(deriveFields[i].obis) == length) && (strncmp(deriveFields[i].obis, compiler->text, length) == 0))
+                break;
+        }
+        if (deriveFields[i].obis == NULL) {
+            compiler->error = "unknown OBIS reference";
+            return;
+        }
+        compiler->text += length;
+        derive_emit(compiler, OP_FIELD, deriveFields[i].field, 0.0, 1);
+        return;
+    }
+
+    if (isdigit((unsigned char)*compiler->text) || (*compiler->text == '.')) {
+        constant = strtod(compiler->text, &end);
+        if (end == compiler->text) {
+            compiler->error = "invalid number";
+            return;
+        }
+        compiler->text = end;
+        derive_emit(compiler, OP_CONST, 0, constant, 1);
+        return;
+    }
+
+    for (length = 0; isalnum((unsigned char)compiler->text[length]) || (compiler->text[length] == '_'); length++) {
+        if (length >= sizeof(name) - 1) {
+            compiler->error = "name too long";
+            return;
+        }
+        name[length] = compiler->text[length];
+    }
+    name[length] = '\0';
+
+    if (length == 0) {
+        compiler->error = "expected a channel, number or (";
+        return;
+    }
+    compiler->text += length;
+
+    for (i = 0; deriveFunctions[i].name != NULL; i++) {
+        if (strcmp(name, deriveFunctions[i].name) != 0)
+            continue;
+
+        derive_skip(compiler);
+        if (*compiler->text != '(') {
+            compiler->error = "expected ( after function";
+            return;
+        }
+        compiler->text++;
+
+        for (int argument = 0; argument < deriveFunctions[i].arguments; argument++) {
+            if (argument > 0) {
+                derive_skip(compiler);
+                if (*compiler->text != ',') {
+                    compiler->error = "expected ,";
+                    return;
+                }
+                compiler->text++;
+            }
+            derive_expression(compiler);
+        }
+
+        derive_skip(compiler);
+        if (*compiler->text != ')') {
+            compiler->error = "expected )";
+            return;
+        }
+        compiler->text++;
+        derive_emit(compiler, deriveFunctions[i].op, 0, 0.0, 1 - deriveFunctions[i].arguments);
+        return;
+    }
+
+    for (i = 0; deriveFields[i].name != NULL; i++) {
+        if (strcmp(name, deriveFields[i].name) == 0) {
+            derive_emit(compiler, OP_FIELD, deriveFields[i].field, 0.0, 1);
+            return;
+        }
+    }
+
+    // Derived channels defined before this one
+    for (i = 0; i < compiler->channel; i++) {
+        if (strcmp(name, derivedChannels.name[i]) == 0) {
+            derive_emit(compiler, OP_DERIVED, i, 0.0, 1);
+            return;
+        }
+    }
+
+    compiler->error = "unknown channel";
+}
+
+static void derive_unary(derive_compiler *compiler) {
+    derive_skip(compiler);
+
+    if (*compiler->text == '-') {
+        compiler->text++;
+        derive_unary(compiler);
+        derive_emit(compiler, OP_NEG, 0, 0.0, 0);
+        return;
+    }
+
+    derive_primary(compiler);
+}
+
+static void derive_term(derive_compiler *compiler) {
+    char op;
+
+    derive_unary(compiler);
+
+    for (;;) {
+        derive_skip(compiler);
+        if ((compiler->error != NULL) || ((*compiler->text != '*') && (*compiler->text != '/')))
+            return;
+
+        op = *compiler->text++;
+        derive_unary(compiler);
+        derive_emit(compiler, (op == '*') ? OP_MUL : OP_DIV, 0, 0.0, -1);
+    }
+}
+
+static void derive_expression(derive_compiler *compiler) {
+    char op;
+
+    derive_term(compiler);
+
+    for (;;) {
+        derive_skip(compiler);
+        if ((compiler->error != NULL) || ((*compiler->text != '+') && (*compiler->text != '-')))
+            return;
+
+        op = *compiler->text++;
+        derive_term(compiler);
+        derive_emit(compiler, (op == '+') ? OP_ADD : OP_SUB, 0, 0.0, -1);
+    }
+}
+
+/*
+ * Check the name of a new derived channel
+ *
+ * Returns NULL, or why the name cannot be used
+ */
+const char * check_derived_name(struct _CONFIGSTRUCT *config, const char *name) {
+    size_t length = strlen(name);
+
+    if (config->derivedCount >= DERIVED_MAX)
+        return "too many derived channels";
+    if ((length == 0) || (length >= sizeof(derivedChannels.name[0])))
+        return "name must have 1 to 31 characters";
+    if (!islower((unsigned char)name[0]))
+        return "name must start with a lowercase letter";
+    for (const char * p = name; *p != '\0'; p++) {
+        if (!islower((unsigned char)*p) && !isdigit((unsigned char)*p) && (*p != '_'))
+            return "name may only have lowercase letters, digits and _";
+    }
+    for (int i = 0; deriveFields[i].name != NULL; i++) {
+        if (strcmp(name, deriveFields[i].name) == 0)
+            return "name of a channel of the meter";
+    }
+    for (int i = 0; deriveFunctions[i].name != NULL; i++) {
+        if (strcmp(name, deriveFunctions[i].name) == 0)
+            return "name of a function";
+    }
+    for (int i = 0; i < config->derivedCount; i++) {
+        if (strcmp(name, config->derivedNames[i]) == 0)
+            return "defined twice";
+    }
+
+    return NULL;
+}
+
+/*
+ * Compile the derived channels of the configuration
+ *
+ * An expression uses the channels by name (kw_in) or OBIS reference
+ * (1-0:1.7.0), derived channels defined before it, numbers, + - * /,
+ * parentheses and min(a, b), max(a, b), abs(a) and sqrt(a).
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *
+ * Returns E_OK or E_CONF_FILE
+ */
+int init_derived(struct _CONFIGSTRUCT *config) {
+    derive_compiler compiler;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    memset(&derivedChannels, 0, sizeof(derivedChannels));
+
+    for (int d = 0; d < config->derivedCount; d++) {
+        snprintf(derivedChannels.name[d], sizeof(derivedChannels.name[d]), "%s", config->derivedNames[d]);
+
+        memset(&compiler, 0, sizeof(compiler));
+        compiler.text = config->derivedExpressions[d];
+        compiler.channel = d;
+        compiler.program = derivedChannels.program[d];
+
+        derive_expression(&compiler);
+        derive_skip(&compiler);
+        if ((compiler.error == NULL) && (*compiler.text != '\0'))
+            compiler.error = "unexpected text";
+        if ((compiler.error == NULL) && (compiler.maxDepth > DERIVED_STACK))
+            compiler.error = "expression too deep";
+
+        if (compiler.error != NULL) {
+            msgtime = time(NULL);
+            tm_info = localtime(&msgtime);
+            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+            fprintf(stderr, "%s - Invalid derived channel %s: %s at \"%s\"\n", timeStringBuffer, config->derivedNames[d], compiler.error, compiler.text);
+            memset(&derivedChannels, 0, sizeof(derivedChannels));
+            return E_CONF_FILE;
+        }
+
+        derivedChannels.length[d] = compiler.length;
+    }
+    derivedChannels.count = config->derivedCount;
+
+    return E_OK;
+}
+
+/*
+ * Run the program of a derived channel
+ *
+ * Returns the result, NAN when a channel is missing or the result is
+ * not finite
+ */
+static double derive_run(const derived_op *program, int length, const double *values, const double *derived) {
+    double stack[DERIVED_STACK];
+    int top = 0;
+
+    for (int i = 0; i < length; i++) {
+        switch (program[i].op) {
+        case OP_FIELD:
+            stack[top++] = values[program[i].index];
+            break;
+        case OP_DERIVED:
+            stack[top++] = derived[program[i].index];
+            break;
+        case OP_CONST:
+            stack[top++] = program[i].constant;
+            break;
+        case OP_ADD:
+            top--;
+            stack[top - 1] += stack[top];
+            break;
+        case OP_SUB:
+            top--;
+            stack[top - 1] -= stack[top];
+            break;
+        case OP_MUL:
+            top--;
+            stack[top - 1] *= stack[top];
+            break;
+        case OP_DIV:
+            top--;
+            stack[top - 1] /= stack[top];
+            break;
+        case OP_NEG:
+            stack[top - 1] = -stack[top - 1];
+            break;
+        case OP_MIN:
+            top--;
+            if (isnan(stack[top]) || (stack[top] < stack[top - 1]))
+                stack[top - 1] = stack[top];
+            break;
+        case OP_MAX:
+            top--;
+            if (isnan(stack[top]) || (stack[top] > stack[top - 1]))
+                stack[top - 1] = stack[top];
+            break;
+        case OP_ABS:
+            stack[top - 1] = fabs(stack[top - 1]);
+            break;
+        case OP_SQRT:
+            stack[top - 1] = sqrt(stack[top - 1]);
+            break;
+        }
+    }
+
+    return isfinite(stack[0]) ? stack[0] : NAN;
+}
+
+/*
+ * Compute the derived channels of a telegram and add them to the bucket
+ *
+ * Parameters:
+ *   *state   - Aggregation state, receives the values of the telegram
+ *   *bucket  - The open bucket
+ *   *values  - The channels of the telegram by FIELD, NAN when missing
+ */
+void derive_telegram(aggr_state *state, elec_data *bucket, const double *values) {
+    double value;
+
+    for (int d = 0; d < derivedChannels.count; d++) {
+        value = derive_run(derivedChannels.program[d], derivedChannels.length[d], values, state->derived);
+        state->derived[d] = value;
+
+        if (isnan(value))
+            continue;
+
+        if ((bucket->derived_samples[d] == 0) || (value < bucket->derived_min[d]))
+            bucket->derived_min[d] = value;
+        if ((bucket->derived_samples[d] == 0) || (value > bucket->derived_max[d]))
+            bucket->derived_max[d] = value;
+        bucket->derived_avg[d] += value;
+        bucket->derived_samples[d]++;
+    }
+}
+
+/*
+ * Turn the running sums of the derived channels in averages, a channel
+ * without samples is NAN
+ */
+void average_derived(elec_data *data) {
+    for (int d = 0; d < derivedChannels.count; d++) {
+        if (data->derived_samples[d] > 0) {
+            data->derived_avg[d] /= data->derived_samples[d];
+        }
+        else {
+            data->derived_min[d] = NAN;
+            data->derived_avg[d] = NAN;
+            data->derived_max[d] = NAN;
+        }
+    }
+}
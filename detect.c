@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <termios.h>
+
+#include "slimmemeter.h"
+
+#define DETECT_WINDOW 12    // Seconds listened to each setting, older meters send every 10 seconds
+#define DETECT_SAMPLE 64    // Bytes received before a setting can be rejected
+#define DETECT_CLEAN  95    // Percentage of printable bytes of a usable setting
+#define DETECT_ROUNDS 2
+
+/*
+ * Serial settings tried in turn, the DSMR 4 and 5 setting first as a
+ * 7E1 stream read as 8N1 shows its parity bits while an 8N1 stream read
+ * as 7E1 looks clean
+ */
+static const struct {
+    unsigned int speed;
+    int          bits;
+    char         parity;
+} detectSettings[] = {
+    { 115200, 8, 'n' },     // DSMR 4 and 5
+    { 9600,   7, 'e' },     // DSMR 2.2 and 3
+    { 115200, 7, 'e' },
+    { 9600,   8, 'n' }
+};
+
+static void apply_setting(struct _CONFIGSTRUCT *config, unsigned int speed, int bits, char parity) {
+    config->serialPortSpeed = get_baudrate(speed);
+    config->serialPortBits = ((bits - 5) << 4);
+    config->serialPortStopbits = NSTOPB;
+
+    if (parity == 'e')
+        config->serialPortParity = PARENB;
+    else if (parity == 'o')
+        config->serialPortParity = PARENB | PARODD;
+    else
+        config->serialPortParity = PARNON;
+}
+
+/*
+ * Listen to the serial port with the settings of the configuration
+ *
+ * The received bytes are scored on being printable, a setting is
+ * rejected as soon as too many are not and accepted on the first
+ * complete telegram of a clean stream.
+ *
+ * Returns the opened serial port with *crc set when the telegram had a
+ * CRC, or -1 when no telegram arrived
+ */
+static int probe_serial(struct _CONFIGSTRUCT *config, int *crc) {
+    static p1_framer framer;
+    struct pollfd pollFd;
+    char buffer[512];
+    unsigned char byte;
+    int received = 0;
+    int clean = 0;
+    int localSerialPort;
+    int length;
+    time_t deadline;
+    time_t now;
+
+    if ((localSerialPort = init_serial(config)) < 0)
+        return -1;
+
+    tcflush(localSerialPort, TCIFLUSH);
+
+    init_framer(&framer);
+    framer.noCrc = 1;
+
+    deadline = time(NULL) + DETECT_WINDOW;
+
+    while ((now = time(NULL)) < deadline) {
+        pollFd.fd = localSerialPort;
+        pollFd.events = POLLIN;
+
+        if ((length = poll(&pollFd, 1, (deadline - now) * 1000)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (length == 0)
+            break;
+
+        if ((length = read(localSerialPort, buffer, sizeof(buffer))) <= 0) {
+            if ((length < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+                continue;
+            break;
+        }
+
+        for (int index = 0; index < length; index++) {
+            byte = (unsigned char)buffer[index];
+            received++;
+            if (((byte >= ' ') && (byte < 0x7f)) || (byte == '\r') || (byte == '\n'))
+                clean++;
+
+            if ((p1_frame(&framer, buffer[index]) == F_TELEGRAM) && (clean * 100 >= received * DETECT_CLEAN)) {
+                *crc = (framer.checksumStr[0] != '\0');
+                return localSerialPort;
+            }
+        }
+
+        if ((received >= DETECT_SAMPLE) && (clean * 100 < received * DETECT_CLEAN))
+            break;
+    }
+
+    close(localSerialPort);
+    return -1;
+}
+
+/*
+ * Remember the detected settings, through a temporary file that is
+ * renamed over the old one so a crash leaves the old or the new settings
+ */
+static void save_detected(const char *filename, unsigned int speed, int bits, char parity, int crc) {
+    char tempFilename[530];
+    FILE * fp;
+    int result;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    snprintf(tempFilename, sizeof(tempFilename), "%s.tmp", filename);
+
+    if ((fp = fopen(tempFilename, "w")) == NULL) {
+        result = -1;
+    }
+    else {
+        result = (fprintf(fp, "%u %d%c1 %s\n", speed, bits, parity, crc ? "crc" : "nocrc") < 0) || (fflush(fp) != 0) || (fsync(fileno(fp)) != 0);
+        if ((fclose(fp) != 0) || (result != 0) || (rename(tempFilename, filename) != 0))
+            result = -1;
+    }
+
+    if (result != 0) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error %i writing detected serial settings %s: %s\n", timeStringBuffer, errno, filename, strerror(errno));
+        unlink(tempFilename);
+    }
+}
+
+/*
+ * Open the serial port with detected settings
+ *
+ * The settings found at an earlier start, kept in serial.detected in the
+ * database directory, are tried first. Without a telegram the settings
+ * of DSMR 4 and 5 and of DSMR 2.2 and 3 meters are tried in turn until
+ * one gives a clean telegram, a telegram without a CRC marks a DSMR 2.2
+ * or 3 meter. The detected settings are stored in the configuration.
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *
+ * Returns the opened serial port, or the port opened with the first
+ * settings when nothing was detected
+ */
+int detect_serial(struct _CONFIGSTRUCT *config) {
+    char filename[520];
+    char line[64];
+    char crcName[8];
+    unsigned int speed;
+    int bits;
+    char parity;
+    int stopbits;
+    int crc;
+    int localSerialPort;
+    FILE * fp;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    snprintf(filename, sizeof(filename), "%s/serial.detected", config->databaseDirectory);
+
+    if ((fp = fopen(filename, "r")) != NULL) {
+        if ((fgets(line, sizeof(line), fp) != NULL) && (sscanf(line, "%u %d%c%d %7s", &speed, &bits, &parity, &stopbits, crcName) == 5) &&
+            (get_baudrate(speed) != 0) && (bits >= 5) && (bits <= 8)) {
+            apply_setting(config, speed, bits, parity);
+
+            if ((localSerialPort = probe_serial(config, &crc)) >= 0) {
+                config->serialPortCrc = crc;
+
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                printf("%s - Serial port %s at %u %d%c1 as before, %s\n", timeStringBuffer, config->serialPortFilename, speed, bits, parity, crc ? "DSMR 4 or 5" : "DSMR 2.2 or 3");
+                fclose(fp);
+                return localSerialPort;
+            }
+        }
+        fclose(fp);
+    }
+
+    for (int round = 0; round < DETECT_ROUNDS; round++) {
+        for (size_t i = 0; i < sizeof(detectSettings) / sizeof(detectSettings[0]); i++) {
+            speed = detectSettings[i].speed;
+            bits = detectSettings[i].bits;
+            parity = detectSettings[i].parity;
+
+            if (verbose) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                printf("%s - Trying serial port %s at %u %d%c1\n", timeStringBuffer, config->serialPortFilename, speed, bits, parity);
+                fflush(stdout);
+            }
+
+            apply_setting(config, speed, bits, parity);
+
+            if ((localSerialPort = probe_serial(config, &crc)) >= 0) {
+                config->serialPortCrc = crc;
+                save_detected(filename, speed, bits, parity, crc);
+
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                printf("%s - Detected serial port %s at %u %d%c1, %s\n", timeStringBuffer, config->serialPortFilename, speed, bits, parity, crc ? "DSMR 4 or 5" : "DSMR 2.2 or 3");
+                return localSerialPort;
+            }
+        }
+    }
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    fprintf(stderr, "%s - No telegrams detected on serial port %s, using %u %d%c1\n", timeStringBuffer, config->serialPortFilename, detectSettings[0].speed, detectSettings[0].bits, detectSettings[0].parity);
+
+    apply_setting(config, detectSettings[0].speed, detectSettings[0].bits, detectSettings[0].parity);
+    config->serialPortCrc = 1;
+
+    return init_serial(config);
+}
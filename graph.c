@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <rrd.h>
+
+#include "slimmemeter.h"
+
+/*
+ * The standard graphs, every kind over every span. A kind shows the
+ * channels with its unit, counters as their use per hour.
+ */
+static const struct {
+    const char * name;
+    const char * unit;
+    const char * title;
+    int          counter;
+} graphKinds[] = {
+    { "power",   "KW",  "Power",           0 },
+    { "voltage", "V",   "Voltage",         0 },
+    { "current", "A",   "Current",         0 },
+    { "energy",  "KWh", "Energy per hour", 1 },
+    { "gas",     "m3",  "Gas per hour",    1 }
+};
+
+#define GRAPH_KINDS (int)(sizeof(graphKinds) / sizeof(graphKinds[0]))
+
+/*
+ * The spans, drawn from the archive with the row of step seconds
+ */
+static const struct {
+    const char  * name;
+    unsigned long span;
+    unsigned long step;
+    const char  * cf;
+} graphSpans[] = {
+    { "day",   86400,       300,   "LAST" },
+    { "week",  7 * 86400,   1800,  "AVERAGE" },
+    { "month", 31 * 86400,  7200,  "AVERAGE" },
+    { "year",  366 * 86400, 86400, "AVERAGE" }
+};
+
+#define GRAPH_SPANS (int)(sizeof(graphSpans) / sizeof(graphSpans[0]))
+#define GRAPHS      (GRAPH_KINDS * GRAPH_SPANS)
+
+#define P1_GRAPH_COUNTER(name, obis, file, source, label, unit) { file, source, label, unit },
+#define P1_GRAPH_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) { file, sourceAvg, label, unit },
+static const struct {
+    int          file;
+    const char * source;
+    const char * label;
+    const char * unit;
+} graphChannels[] = {
+    P1_COUNTERS(P1_GRAPH_COUNTER)
+    P1_GAUGES(P1_GRAPH_GAUGE)
+};
+#undef P1_GRAPH_COUNTER
+#undef P1_GRAPH_GAUGE
+
+#define GRAPH_CHANNELS (int)(sizeof(graphChannels) / sizeof(graphChannels[0]))
+
+#define P1_NAME_FILE(file, filename, description) filename,
+static const char *graphFiles[RRD_FILES] = { P1_RRD_FILES(P1_NAME_FILE) };
+#undef P1_NAME_FILE
+
+static const char *graphColors[] = { "0000ff", "ff0000", "00a000", "ff8000", "a000a0", "00a0a0" };
+
+#define GRAPH_COLORS (int)(sizeof(graphColors) / sizeof(graphColors[0]))
+
+/*
+ * A graph is stale when the databases hold a row of its step newer than
+ * the row it was rendered up to
+ */
+static struct {
+    int           enabled;
+    unsigned long renderedRow;
+    unsigned long renderTime;
+} graphs[GRAPHS];
+
+static pthread_mutex_t graphLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t graphWake = PTHREAD_COND_INITIALIZER;
+static pthread_t graphThread;
+static int graphRunning = 0;
+static int graphStop = 0;
+static unsigned long graphLatest = 0;
+
+static char * graphDatabaseDirectory = NULL;
+static char * graphDirectory = NULL;
+static int graphFormat = GRAPH_PNG;
+static int graphWidth = 0;
+static int graphHeight = 0;
+
+/*
+ * Render one graph to a temporary file and move it over the cached one
+ *
+ * Parameters:
+ *   graph  - Index of the graph, kind times the number of spans plus span
+ *   end    - End of the graph, a row of the step of its span
+ *
+ * Returns E_OK, E_RRD or E_FILE_ACCESS
+ */
+int render_graph(int graph, unsigned long end) {
+    int kind = graph / GRAPH_SPANS;
+    int span = graph % GRAPH_SPANS;
+    char filename[512];
+    char tempFilename[520];
+    char options[8][48];
+    char definitions[GRAPH_CHANNELS * 3][640];
+    char * argv[16 + GRAPH_CHANNELS * 3];
+    int argc = 0;
+    int count = 0;
+    int channel = 0;
+    rrd_info_t * info;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    snprintf(filename, sizeof(filename), "%s/%s-%s.%s", graphDirectory, graphKinds[kind].name, graphSpans[span].name, (graphFormat == GRAPH_SVG) ? "svg" : "png");
+    snprintf(tempFilename, sizeof(tempFilename), "%s.tmp", filename);
+
+    snprintf(options[0], sizeof(options[0]), "%lu", end - graphSpans[span].span);
+    snprintf(options[1], sizeof(options[1]), "%lu", end);
+    snprintf(options[2], sizeof(options[2]), "%d", graphWidth);
+    snprintf(options[3], sizeof(options[3]), "%d", graphHeight);
+    snprintf(options[4], sizeof(options[4]), "%s, %s", graphKinds[kind].title, graphSpans[span].name);
+
+    argv[argc++] = "graph";
+    argv[argc++] = tempFilename;
+    argv[argc++] = "--imgformat";
+    argv[argc++] = (graphFormat == GRAPH_SVG) ? "SVG" : "PNG";
+    argv[argc++] = "--start";
+    argv[argc++] = options[0];
+    argv[argc++] = "--end";
+    argv[argc++] = options[1];
+    argv[argc++] = "--width";
+    argv[argc++] = options[2];
+    argv[argc++] = "--height";
+    argv[argc++] = options[3];
+    argv[argc++] = "--title";
+    argv[argc++] = options[4];
+    argv[argc++] = "--vertical-label";
+    argv[argc++] = (char *)graphKinds[kind].unit;
+
+    for (int c = 0; c < GRAPH_CHANNELS; c++) {
+        if (strcmp(graphChannels[c].unit, graphKinds[kind].unit) != 0)
+            continue;
+
+        snprintf(definitions[count], sizeof(definitions[count]), "DEF:c%d=%s%s:%s:%s", channel,
+            graphDatabaseDirectory, graphFiles[graphChannels[c].file], graphChannels[c].source, graphSpans[span].cf);
+        argv[argc++] = definitions[count++];
+
+        // The counters are stored as a rate per second
+        if (graphKinds[kind].counter) {
+            snprintf(definitions[count], sizeof(definitions[count]), "CDEF:p%d=c%d,3600,*", channel, channel);
+            argv[argc++] = definitions[count++];
+        }
+
+        snprintf(definitions[count], sizeof(definitions[count]), "LINE1:%c%d#%s:%s", graphKinds[kind].counter ? 'p' : 'c', channel,
+            graphColors[channel % GRAPH_COLORS], graphChannels[c].label);
+        argv[argc++] = definitions[count++];
+        channel++;
+    }
+    argv[argc] = NULL;
+
+    rrd_clear_error();
+    info = rrd_graph_v(argc, argv);
+
+    if ((info == NULL) || rrd_test_error()) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - RRD graph error in %s: %s\n", timeStringBuffer, filename, rrd_get_error());
+        if (info != NULL)
+            rrd_info_free(info);
+        unlink(tempFilename);
+        return E_RRD;
+    }
+    rrd_info_free(info);
+
+    if (rename(tempFilename, filename) != 0) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error %i from rename graph %s: %s\n", timeStringBuffer, errno, filename, strerror(errno));
+        unlink(tempFilename);
+        return E_FILE_ACCESS;
+    }
+
+    return E_OK;
+}
+
+/*
+ * Thread rendering the stale graphs
+ *
+ * One graph is rendered at a time so the lock is free while rendering.
+ * A graph that fails is tried again at its next row.
+ *
+ * Parameters:
+ *   *argument  - Not used
+ *
+ * Returns NULL when close_graphs() stops it
+ */
+void * graph_thread(void *argument) {
+    unsigned long row;
+    unsigned long end;
+    int graph;
+
+    (void)argument;
+
+    pthread_mutex_lock(&graphLock);
+
+    while (!graphStop) {
+        end = 0;
+        for (graph = 0; graph < GRAPHS; graph++) {
+            if (!graphs[graph].enabled || (graphLatest == 0))
+                continue;
+
+            row = graphLatest / graphSpans[graph % GRAPH_SPANS].step;
+            if (row > graphs[graph].renderedRow) {
+                graphs[graph].renderedRow = row;
+                end = row * graphSpans[graph % GRAPH_SPANS].step;
+                break;
+            }
+        }
+
+        if (end == 0) {
+            pthread_cond_wait(&graphWake, &graphLock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&graphLock);
+        if (render_graph(graph, end) == E_OK) {
+            pthread_mutex_lock(&graphLock);
+            graphs[graph].renderTime = (unsigned long)time(NULL);
+        }
+        else {
+            pthread_mutex_lock(&graphLock);
+        }
+    }
+
+    pthread_mutex_unlock(&graphLock);
+
+    return NULL;
+}
+
+/*
+ * Start rendering the graphs selected in the configuration
+ *
+ * A cached graph newer than the last update of the databases is kept,
+ * the others are rendered right away.
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *
+ * Returns E_OK, E_CONF_FILE for an unknown graph or E_MALLOC
+ */
+int init_graphs(struct _CONFIGSTRUCT *config) {
+    char name[64];
+    char filename[512];
+    struct stat fileStat;
+    time_t latest;
+    const char * next;
+    size_t length;
+    int graph;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if (config->graphDirectory == NULL)
+        return E_OK;
+
+    memset(graphs, 0, sizeof(graphs));
+
+    // Comma separated <kind>-<span>, all graphs when not set
+    if (config->graphs == NULL) {
+        for (graph = 0; graph < GRAPHS; graph++)
+            graphs[graph].enabled = 1;
+    }
+    for (const char * p = config->graphs; (p != NULL) && (*p != '\0'); p = next) {
+        next = strchr(p, ',');
+        length = (next != NULL) ? (size_t)(next++ - p) : strlen(p);
+        while ((length > 0) && (*p == ' ')) {
+            p++;
+            length--;
+        }
+        while ((length > 0) && (p[length - 1] == ' '))
+            length--;
+        if (length == 0)
+            continue;
+
+        for (graph = 0; graph < GRAPHS; graph++) {
+            snprintf(name, sizeof(name), "%s-%s", graphKinds[graph / GRAPH_SPANS].name, graphSpans[graph % GRAPH_SPANS].name);
+            if ((strlen(name) == length) && (strncmp(name, p, length) == 0))
+                break;
+        }
+
+        if (graph == GRAPHS) {
+            msgtime = time(NULL);
+            tm_info = localtime(&msgtime);
+            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+            fprintf(stderr, "%s - Unknown graph: %.*s\n", timeStringBuffer, (int)length, p);
+            return E_CONF_FILE;
+        }
+        graphs[graph].enabled = 1;
+    }
+
+    if (((graphDatabaseDirectory = strdup(rrd_directory(config))) == NULL) ||
+        ((graphDirectory = strdup(config->graphDirectory)) == NULL)) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error claiming memory for graphs: %s\n", timeStringBuffer, strerror(errno));
+        free(graphDatabaseDirectory);
+        graphDatabaseDirectory = NULL;
+        return E_MALLOC;
+    }
+    graphFormat = config->graphFormat;
+    graphWidth = config->graphWidth;
+    graphHeight = config->graphHeight;
+
+    rrd_clear_error();
+    latest = rrd_last_r(config->rrdFilenames[RRD_COUNTERS]);
+
+    pthread_mutex_lock(&graphLock);
+    if (!rrd_test_error() && (latest > 0) && ((unsigned long)latest > graphLatest))
+        graphLatest = (unsigned long)latest;
+
+    for (graph = 0; graph < GRAPHS; graph++) {
+        snprintf(filename, sizeof(filename), "%s/%s-%s.%s", graphDirectory, graphKinds[graph / GRAPH_SPANS].name,
+            graphSpans[graph % GRAPH_SPANS].name, (graphFormat == GRAPH_SVG) ? "svg" : "png");
+
+        if ((graphLatest > 0) && (stat(filename, &fileStat) == 0) && ((unsigned long)fileStat.st_mtime >= graphLatest)) {
+            graphs[graph].renderedRow = graphLatest / graphSpans[graph % GRAPH_SPANS].step;
+            graphs[graph].renderTime = (unsigned long)fileStat.st_mtime;
+        }
+    }
+    pthread_mutex_unlock(&graphLock);
+
+    graphStop = 0;
+    pthread_create(&graphThread, NULL, graph_thread, NULL);
+    graphRunning = 1;
+
+    return E_OK;
+}
+
+/*
+ * Note the end of a bucket written to the databases, the graphs it
+ * makes stale are rendered on the graph thread
+ *
+ * Parameters:
+ *   timestamp  - Start of the bucket
+ */
+void graph_update(unsigned long timestamp) {
+    pthread_mutex_lock(&graphLock);
+    if (timestamp + 300 > graphLatest) {
+        graphLatest = timestamp + 300;
+        pthread_cond_signal(&graphWake);
+    }
+    pthread_mutex_unlock(&graphLock);
+}
+
+/*
+ * Stop the graph thread and release the settings
+ */
+void close_graphs(void) {
+    if (graphRunning) {
+        pthread_mutex_lock(&graphLock);
+        graphStop = 1;
+        pthread_cond_signal(&graphWake);
+        pthread_mutex_unlock(&graphLock);
+
+        pthread_join(graphThread, NULL);
+        graphRunning = 0;
+    }
+
+    free(graphDatabaseDirectory);
+    graphDatabaseDirectory = NULL;
+    free(graphDirectory);
+    graphDirectory = NULL;
+}
+
+/*
+ * Format the graphs as a JSON array of { name, file, rendered }
+ *
+ * Parameters:
+ *   *buffer  - Output buffer
+ *   size     - Size of the buffer
+ *
+ * Returns the length of the array
+ */
+int json_graphs(char *buffer, size_t size) {
+    int length;
+    int count = 0;
+
+    length = snprintf(buffer, size, "[");
+
+    pthread_mutex_lock(&graphLock);
+    for (int graph = 0; graphRunning && (graph < GRAPHS); graph++) {
+        if (!graphs[graph].enabled)
+            continue;
+
+        length += snprintf(buffer + length, size - length, "%s{\"name\":\"%s-%s\",\"file\":\"%s/%s-%s.%s\",\"rendered\":%lu}", (count++ > 0) ? "," : "",
+            graphKinds[graph / GRAPH_SPANS].name, graphSpans[graph % GRAPH_SPANS].name,
+            graphDirectory, graphKinds[graph / GRAPH_SPANS].name, graphSpans[graph % GRAPH_SPANS].name, (graphFormat == GRAPH_SVG) ? "svg" : "png",
+            graphs[graph].renderTime);
+    }
+    pthread_mutex_unlock(&graphLock);
+
+    length += snprintf(buffer + length, size - length, "]");
+
+    return length;
+}
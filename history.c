@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <rrd.h>
+
+#include "slimmemeter.h"
+
+/*
+ * Values of a history row, a counter has one value and a gauge its
+ * minimum, average and maximum
+ */
+#define P1_HISTORY_COUNTER(name, obis, file, source, label, unit) HISTORY_##name,
+#define P1_HISTORY_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) HISTORY_##name##_min, HISTORY_##name##_avg, HISTORY_##name##_max,
+enum HISTORY_VALUES {
+    P1_COUNTERS(P1_HISTORY_COUNTER)
+    P1_GAUGES(P1_HISTORY_GAUGE)
+    HISTORY_VALUES
+};
+#undef P1_HISTORY_COUNTER
+#undef P1_HISTORY_GAUGE
+
+enum HISTORY_CF {
+    CF_LAST,
+    CF_AVERAGE,
+    CF_MAX,
+    CF_MIN
+};
+
+/*
+ * The data sources of the databases and their consolidation in the
+ * coarser archives. A counter is kept as its rate per hour, kWh per hour
+ * or m3 per hour: its DCOUNTER source holds the rate per second.
+ */
+#define HISTORY_RATE 3600.0
+
+#define P1_HISTORY_COUNTER(name, obis, file, source, label, unit) \
+    { file, source, HISTORY_##name, CF_AVERAGE, 1 },
+#define P1_HISTORY_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) \
+    { file, sourceMax, HISTORY_##name##_max, CF_MAX, 0 }, \
+    { file, sourceAvg, HISTORY_##name##_avg, CF_AVERAGE, 0 }, \
+    { file, sourceMin, HISTORY_##name##_min, CF_MIN, 0 },
+static const struct {
+    int          file;
+    const char * source;
+    int          value;
+    int          cf;
+    int          counter;
+} historySources[] = {
+    P1_COUNTERS(P1_HISTORY_COUNTER)
+    P1_GAUGES(P1_HISTORY_GAUGE)
+};
+#undef P1_HISTORY_COUNTER
+#undef P1_HISTORY_GAUGE
+
+#define HISTORY_SOURCES (int)(sizeof(historySources) / sizeof(historySources[0]))
+
+/*
+ * The channels that can be queried, the first value of a gauge is its
+ * minimum
+ */
+#define P1_HISTORY_COUNTER(name, obis, file, source, label, unit) { #name, HISTORY_##name, 1, "%.3lf" },
+#define P1_HISTORY_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) { #name, HISTORY_##name##_min, 3, format },
+static const struct {
+    const char * name;
+    int          value;
+    int          values;
+    const char * format;
+} historyChannels[] = {
+    P1_COUNTERS(P1_HISTORY_COUNTER)
+    P1_GAUGES(P1_HISTORY_GAUGE)
+    { NULL, 0, 0, NULL }
+};
+#undef P1_HISTORY_COUNTER
+#undef P1_HISTORY_GAUGE
+
+// The archives of init_rrd_database(), in buckets per row
+static const int historySteps[HISTORY_RESOLUTIONS] = { 1, 6, 24, 288 };
+static const char * historyCf[] = { "LAST", "AVERAGE", "MAX", "MIN" };
+
+/*
+ * The spans that can be queried, with the resolution and number of rows
+ * they are served from
+ */
+static const struct {
+    const char * name;
+    int          resolution;
+    int          rows;
+} historySpans[] = {
+    { "hour",  0, 12 },
+    { "day",   0, 288 },
+    { "week",  1, 336 },
+    { "month", 2, 372 },
+    { "year",  3, 365 },
+    { NULL,    0, 0 }
+};
+
+typedef struct {
+    unsigned long time;
+    int           samples[HISTORY_VALUES];
+    double        values[HISTORY_VALUES];
+} history_row;
+
+/*
+ * Ring of rows per resolution, a row holds the interval up to its time,
+ * as in the database
+ */
+typedef struct {
+    history_row   rows[HISTORY_ROWS];
+    int           newest;
+    int           count;
+} history_ring;
+
+static history_ring historyRings[HISTORY_RESOLUTIONS];
+static pthread_mutex_t historyLock = PTHREAD_MUTEX_INITIALIZER;
+
+// The counter readings of the last bucket, for the rate of the next one
+static double historyReadings[HISTORY_VALUES];
+static unsigned long historyReadingTime = 0;
+
+/*
+ * Append a row to a ring, the oldest row is overwritten
+ */
+history_row * history_append(history_ring *ring, unsigned long time) {
+    history_row * row;
+
+    ring->newest = (ring->newest + 1) % HISTORY_ROWS;
+    if (ring->count < HISTORY_ROWS)
+        ring->count++;
+
+    row = &ring->rows[ring->newest];
+    row->time = time;
+    for (int v = 0; v < HISTORY_VALUES; v++) {
+        row->samples[v] = 0;
+        row->values[v] = NAN;
+    }
+
+    return row;
+}
+
+/*
+ * Fill the rings from the databases
+ *
+ * Every archive of init_rrd_database() is fetched once, the rows of the
+ * files and consolidation functions of a resolution are merged by time.
+ * A database that cannot be read leaves its values unknown, the rings
+ * fill up from the buckets that are stored.
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ */
+void warm_history(struct _CONFIGSTRUCT *config) {
+    static history_row rows[HISTORY_ROWS];
+    unsigned long step;
+    time_t first;
+    time_t start;
+    time_t end;
+    unsigned long fetchStep;
+    unsigned long sourceCount;
+    char ** sourceNames;
+    rrd_value_t * data;
+    int row;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    pthread_mutex_lock(&historyLock);
+
+    for (int r = 0; r < HISTORY_RESOLUTIONS; r++) {
+        step = historySteps[r] * 300;
+        first = time(NULL) / step * step - (HISTORY_ROWS - 1) * step;
+
+        for (int i = 0; i < HISTORY_ROWS; i++) {
+            rows[i].time = first + i * step;
+            for (int v = 0; v < HISTORY_VALUES; v++) {
+                rows[i].samples[v] = 0;
+                rows[i].values[v] = NAN;
+            }
+        }
+
+        for (int f = 0; f < RRD_FILES; f++) {
+            for (int cf = (r == 0) ? CF_LAST : CF_AVERAGE; cf <= ((r == 0) ? CF_LAST : CF_MIN); cf++) {
+                start = first - step;
+                end = rows[HISTORY_ROWS - 1].time;
+                fetchStep = step;
+
+                rrd_clear_error();
+                if ((rrd_fetch_r(config->rrdFilenames[f], historyCf[cf], &start, &end, &fetchStep, &sourceCount, &sourceNames, &data) != 0) || rrd_test_error()) {
+                    if (r == 0) {
+                        msgtime = time(NULL);
+                        tm_info = localtime(&msgtime);
+                        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                        fprintf(stderr, "%s - History not loaded from %s: %s\n", timeStringBuffer, config->rrdFilenames[f], rrd_get_error());
+                    }
+                    break;
+                }
+
+                // The rows of another archive do not fit the ring
+                for (unsigned long s = 0; (s < sourceCount) && (fetchStep == step); s++) {
+                    for (int i = 0; i < HISTORY_SOURCES; i++) {
+                        if ((historySources[i].file != f) || (strcmp(historySources[i].source, sourceNames[s]) != 0) || ((cf != CF_LAST) && (historySources[i].cf != cf)))
+                            continue;
+
+                        // Row n of the fetch ends at start + (n + 1) * step
+                        for (time_t t = start + step; t <= end; t += step) {
+                            if ((t < first) || ((row = (t - first) / step) >= HISTORY_ROWS))
+                                continue;
+                            rows[row].values[historySources[i].value] = data[((t - start) / step - 1) * sourceCount + s];
+                            if (historySources[i].counter)
+                                rows[row].values[historySources[i].value] *= HISTORY_RATE;
+                            if (!isnan(rows[row].values[historySources[i].value]))
+                                rows[row].samples[historySources[i].value] = historySteps[r];
+                        }
+                    }
+                }
+
+                for (unsigned long s = 0; s < sourceCount; s++)
+                    rrd_freemem(sourceNames[s]);
+                rrd_freemem(sourceNames);
+                rrd_freemem(data);
+            }
+        }
+
+        // Rows without any known value are left out
+        historyRings[r].newest = HISTORY_ROWS - 1;
+        historyRings[r].count = 0;
+        for (int i = 0; i < HISTORY_ROWS; i++) {
+            for (int v = 0; v < HISTORY_VALUES; v++) {
+                if (!isnan(rows[i].values[v])) {
+                    memcpy(history_append(&historyRings[r], rows[i].time), &rows[i], sizeof(history_row));
+                    break;
+                }
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&historyLock);
+}
+
+/*
+ * Add a stored bucket to every resolution
+ *
+ * The bucket ends up in the row that ends at or after the end of the
+ * bucket. The finest resolution keeps the bucket as it is, the coarser
+ * ones consolidate like their archives. A bucket older than the newest
+ * row is left out.
+ *
+ * A counter is added as its rate per hour since the previous bucket, as
+ * the database holds it. The first bucket after a start, or a counter
+ * that went back, has no rate and leaves the counter unknown.
+ *
+ * Parameters:
+ *   timestamp  - Start of the bucket
+ *   *data      - The averaged bucket
+ */
+void history_add(unsigned long timestamp, const elec_data *data) {
+    double values[HISTORY_VALUES];
+    double readings[HISTORY_VALUES];
+    history_ring * ring;
+    history_row * row;
+    unsigned long step;
+    unsigned long time;
+
+#define P1_HISTORY_COUNTER(name, obis, file, source, label, unit) \
+    readings[HISTORY_##name] = data->name;
+#define P1_HISTORY_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) \
+    values[HISTORY_##name##_min] = data->name##_min; \
+    values[HISTORY_##name##_avg] = data->name##_avg; \
+    values[HISTORY_##name##_max] = data->name##_max;
+    P1_COUNTERS(P1_HISTORY_COUNTER)
+    P1_GAUGES(P1_HISTORY_GAUGE)
+#undef P1_HISTORY_COUNTER
+#undef P1_HISTORY_GAUGE
+
+    pthread_mutex_lock(&historyLock);
+
+    for (int i = 0; i < HISTORY_SOURCES; i++) {
+        int v = historySources[i].value;
+
+        if (!historySources[i].counter)
+            continue;
+
+        if ((historyReadingTime == 0) || (timestamp <= historyReadingTime) || (readings[v] < historyReadings[v]))
+            values[v] = NAN;
+        else
+            values[v] = (readings[v] - historyReadings[v]) * HISTORY_RATE / (timestamp - historyReadingTime);
+        historyReadings[v] = readings[v];
+    }
+    historyReadingTime = timestamp;
+
+    for (int r = 0; r < HISTORY_RESOLUTIONS; r++) {
+        ring = &historyRings[r];
+        step = historySteps[r] * 300;
+        time = (timestamp + 300 + step - 1) / step * step;
+
+        row = (ring->count > 0) ? &ring->rows[ring->newest] : NULL;
+        if ((row != NULL) && (time < row->time))
+            continue;
+        if ((row == NULL) || (time > row->time))
+            row = history_append(ring, time);
+
+        for (int i = 0; i < HISTORY_SOURCES; i++) {
+            double * value = &row->values[historySources[i].value];
+            double sample = values[historySources[i].value];
+
+            // An unknown sample is left out of the consolidation
+            if (isnan(sample))
+                continue;
+
+            if ((r == 0) || (row->samples[historySources[i].value]++ == 0))
+                *value = sample;
+            else if (historySources[i].cf == CF_MAX)
+                *value = (sample > *value) ? sample : *value;
+            else if (historySources[i].cf == CF_MIN)
+                *value = (sample < *value) ? sample : *value;
+            else
+                *value += (sample - *value) / row->samples[historySources[i].value];
+        }
+    }
+
+    pthread_mutex_unlock(&historyLock);
+}
+
+/*
+ * Format the recent history of a channel as a JSON object
+ *
+ * Rows are [time, value] for a counter and [time, min, avg, max] for a
+ * gauge, oldest first, unknown values are null. The value of a counter
+ * is its average rate per hour over the row, kWh per hour or m3 per
+ * hour, not the meter reading.
+ *
+ * Parameters:
+ *   *buffer   - Receives the object
+ *   size      - Size of the buffer
+ *   *channel  - Name of the channel, as in the JSON of a bucket
+ *   *span     - hour, day, week, month or year
+ *
+ * Returns the number of characters written, or -1 for an unknown
+ * channel or span
+ */
+int json_history(char *buffer, size_t size, const char *channel, const char *span) {
+    history_ring * ring;
+    history_row * row;
+    unsigned long since;
+    int c;
+    int s;
+    int first;
+    int length;
+
+    for (c = 0; (historyChannels[c].name != NULL) && (strcmp(historyChannels[c].name, channel) != 0); c++)
+        ;
+    for (s = 0; (historySpans[s].name != NULL) && (strcmp(historySpans[s].name, span) != 0); s++)
+        ;
+    if ((historyChannels[c].name == NULL) || (historySpans[s].name == NULL))
+        return -1;
+
+    pthread_mutex_lock(&historyLock);
+
+    ring = &historyRings[historySpans[s].resolution];
+    since = (unsigned long)time(NULL) - (unsigned long)historySpans[s].rows * historySteps[historySpans[s].resolution] * 300;
+
+    // The oldest row within the span
+    for (first = 0; first < ring->count; first++) {
+        if (ring->rows[(ring->newest - ring->count + 1 + first + HISTORY_ROWS) % HISTORY_ROWS].time > since)
+            break;
+    }
+
+    length = snprintf(buffer, size, "{\"channel\":\"%s\",\"span\":\"%s\",\"step\":%d,\"rows\":[",
+        channel, span, historySteps[historySpans[s].resolution] * 300);
+
+    for (int i = first; (i < ring->count) && (length < (int)size - 128); i++) {
+        row = &ring->rows[(ring->newest - ring->count + 1 + i + HISTORY_ROWS) % HISTORY_ROWS];
+
+        length += snprintf(buffer + length, size - length, "%s[%lu", (i > first) ? "," : "", row->time);
+        for (int v = 0; v < historyChannels[c].values; v++) {
+            if (isnan(row->values[historyChannels[c].value + v])) {
+                length += snprintf(buffer + length, size - length, ",null");
+            }
+            else {
+                length += snprintf(buffer + length, size - length, ",");
+                length += snprintf(buffer + length, size - length, historyChannels[c].format, row->values[historyChannels[c].value + v]);
+            }
+        }
+        length += snprintf(buffer + length, size - length, "]");
+    }
+
+    pthread_mutex_unlock(&historyLock);
+
+    length += snprintf(buffer + length, size - length, "]}");
+
+    return length;
+}
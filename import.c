@@ -0,0 +1,871 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <rrd.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "slimmemeter.h"
+
+#define IMPORT_UNIT_BYTES   (4 * 1024 * 1024)
+#define IMPORT_UNIT_BLOCKS  64
+#define IMPORT_RRD_BATCH    256
+#define IMPORT_FLUSH        1024
+
+/*
+ * A closed bucket produced by an import worker
+ *
+ * samples is needed to merge the two halves of a bucket that was split
+ * between two units.
+ */
+typedef struct {
+    unsigned long timestamp;
+    unsigned long order;
+    int           samples;
+    elec_data   * elec;
+} import_bucket;
+
+struct _IMPORT;
+
+/*
+ * A piece of input processed by one worker: a byte range of a capture
+ * file, a range of blocks of an archive or a whole stream that cannot be
+ * split, like a pipe. A unit owns the telegrams that start inside it.
+ * Its closed buckets wait in buckets until they are written, under the
+ * lock of the import.
+ */
+typedef struct {
+    struct _IMPORT * import;
+    const char    * data;
+    size_t          size;
+    size_t          start;
+    size_t          end;
+    int             dataFd;
+    int             streamFd;
+    off_t           blockOffset;
+    int             blockCount;
+    int             owner;
+    import_bucket * buckets;
+    int             bucketCount;
+    int             bucketSize;
+    unsigned long   produced;
+    unsigned long   lastTimestamp;
+    int             done;
+    unsigned long   telegrams;
+    unsigned long   crcErrors;
+    unsigned long   skipped;
+} import_unit;
+
+/*
+ * Buckets are written while the workers run. Workers wake the writer
+ * when a unit is done or IMPORT_FLUSH more buckets were closed.
+ */
+struct _IMPORT {
+    import_unit   * units;
+    int             unitCount;
+    int             nextUnit;
+    int             result;
+    pthread_mutex_t lock;
+    pthread_cond_t  progress;
+    unsigned long   drained;
+    int             unitsDone;
+    import_bucket * flush;
+    long            flushSize;
+    sketch_rollup   rollups[SKETCH_RESOLUTIONS - 1];
+    long            bucketCount;
+    long            merged;
+    long            stored;
+};
+
+/*
+ * Get the meter time from the 0-0:1.0.0(YYMMDDhhmmssX) line of a telegram
+ *
+ * X is S for summer and W for winter time.
+ *
+ * Returns the time, or 0 when the telegram has no timestamp
+ */
+unsigned long telegram_time(const char *telegram) {
+    const char * p;
+    struct tm meterTime;
+    int digits[12];
+
+    if ((p = strstr(telegram, "0-0:1.0.0(")) == NULL)
+        return 0;
+    p += 10;
+
+    for (int i = 0; i < 12; i++) {
+        if ((p[i] < '0') || (p[i] > '9'))
+            return 0;
+        digits[i] = p[i] - '0';
+    }
+
+    memset(&meterTime, 0, sizeof(meterTime));
+    meterTime.tm_year = 100 + digits[0] * 10 + digits[1];
+    meterTime.tm_mon = digits[2] * 10 + digits[3] - 1;
+    meterTime.tm_mday = digits[4] * 10 + digits[5];
+    meterTime.tm_hour = digits[6] * 10 + digits[7];
+    meterTime.tm_min = digits[8] * 10 + digits[9];
+    meterTime.tm_sec = digits[10] * 10 + digits[11];
+    meterTime.tm_isdst = (p[12] == 'S') ? 1 : (p[12] == 'W') ? 0 : -1;
+
+    return (unsigned long)mktime(&meterTime);
+}
+
+/*
+ * Move the closed buckets from the queue of a unit to its bucket list
+ *
+ * The order of a bucket is its unit followed by its place in the unit,
+ * the input order that decides how halves of a bucket are merged.
+ *
+ * Returns E_OK or E_MALLOC
+ */
+int import_drain(import_unit *unit, bucket_queue *queue, int samples) {
+    struct _IMPORT * import = unit->import;
+    import_bucket * grown;
+    int drained = 0;
+    int result = E_OK;
+
+    pthread_mutex_lock(&import->lock);
+
+    while (queue->timestampArray[queue->readDataCounter] != 0) {
+        if (unit->bucketCount >= unit->bucketSize) {
+            if ((grown = (import_bucket *)realloc(unit->buckets, (unit->bucketSize + 1024) * sizeof(import_bucket))) == NULL) {
+                free(queue->elecDataArray[queue->readDataCounter]);
+                queue->timestampArray[queue->readDataCounter] = 0;
+                result = E_MALLOC;
+                break;
+            }
+            unit->buckets = grown;
+            unit->bucketSize += 1024;
+        }
+
+        unit->buckets[unit->bucketCount].timestamp = queue->timestampArray[queue->readDataCounter];
+        unit->buckets[unit->bucketCount].order = ((unsigned long)(unit - import->units) << 32) | unit->produced++;
+        unit->buckets[unit->bucketCount].samples = samples;
+        unit->buckets[unit->bucketCount].elec = queue->elecDataArray[queue->readDataCounter];
+        unit->lastTimestamp = unit->buckets[unit->bucketCount].timestamp;
+        unit->bucketCount++;
+        drained++;
+
+        queue->timestampArray[queue->readDataCounter] = 0;
+        queue->elecDataArray[queue->readDataCounter] = NULL;
+        if (++queue->readDataCounter >= QUEUE_SIZE)
+            queue->readDataCounter = 0;
+    }
+
+    // Wake the writer once enough buckets are waiting
+    if ((import->drained / IMPORT_FLUSH) != ((import->drained + drained) / IMPORT_FLUSH))
+        pthread_cond_signal(&import->progress);
+    import->drained += drained;
+
+    pthread_mutex_unlock(&import->lock);
+
+    return result;
+}
+
+/*
+ * Feed one telegram to the aggregation of a unit
+ *
+ * Buckets closed by parse_block() are taken from the queue right away,
+ * together with the number of samples they hold.
+ *
+ * Returns E_OK or an error code
+ */
+int import_telegram(import_unit *unit, aggr_state *state, char *telegram, unsigned long timestamp) {
+    int samples = state->counter;
+    int result;
+
+    unit->telegrams++;
+
+    if ((result = parse_block(state, telegram, timestamp)) != E_OK)
+        return result;
+
+    return import_drain(unit, state->queue, samples);
+}
+
+/*
+ * Frame and aggregate the telegrams of a capture file unit
+ */
+int import_capture(import_unit *unit, aggr_state *state) {
+    p1_framer framer = { .noCrc = 0 };
+    unsigned long timestamp;
+    int result;
+
+    init_framer(&framer);
+
+    for (size_t index = unit->start; index < unit->size; index++) {
+        // Telegrams starting after the unit belong to the next unit
+        if ((index >= unit->end) && (framer.status == S_IDLE))
+            break;
+
+        switch (p1_frame(&framer, unit->data[index])) {
+        case F_OVERRUN:
+        case F_CRC_ERROR:
+            unit->crcErrors++;
+            break;
+        case F_TELEGRAM:
+            if ((timestamp = telegram_time(framer.dataBlock)) == 0) {
+                unit->skipped++;
+                break;
+            }
+            if ((result = import_telegram(unit, state, framer.dataBlock, timestamp)) != E_OK)
+                return result;
+            break;
+        }
+    }
+
+    return E_OK;
+}
+
+/*
+ * Aggregate the telegrams of a stream unit
+ *
+ * A stream is read and framed on two more threads, so parsing overlaps
+ * with reading and CRC checking.
+ */
+int import_stream(import_unit *unit, aggr_state *state) {
+    p1_pipeline pipeline;
+    pipe_telegram * telegram;
+    unsigned long timestamp;
+    int result = E_OK;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if ((result = start_pipeline(&pipeline, unit->streamFd)) != E_OK)
+        return result;
+
+    while ((telegram = next_pipeline_telegram(&pipeline)) != NULL) {
+        // After an error the rest of the stream is drained
+        if (result == E_OK) {
+            if ((timestamp = telegram_time(telegram->framer.dataBlock)) == 0)
+                unit->skipped++;
+            else
+                result = import_telegram(unit, state, telegram->framer.dataBlock, timestamp);
+        }
+
+        release_pipeline_telegram(&pipeline, telegram);
+    }
+
+    stop_pipeline(&pipeline);
+    unit->crcErrors += pipeline.crcErrors;
+
+    if (pipeline.error != 0) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error %i reading import stream: %s\n", timeStringBuffer, pipeline.error, strerror(pipeline.error));
+        if (result == E_OK)
+            result = E_FILE_ACCESS;
+    }
+
+    return result;
+}
+
+/*
+ * Decode and aggregate the telegrams of an archive unit
+ *
+ * Archived telegrams are aggregated on their receive time, like they
+ * were when they came in. The blocks are read and inflated on another
+ * thread while the telegrams are decoded.
+ */
+int import_archive(import_unit *unit, aggr_state *state) {
+    block_pipeline blocks;
+    pipe_block * block;
+    archive_cursor cursor;
+    char telegram[2048];
+    int length;
+    unsigned long timestamp;
+    char checksum[4];
+    int found;
+    int result = E_OK;
+
+    if ((result = start_block_pipeline(&blocks, unit->dataFd, unit->blockOffset, unit->blockCount)) != E_OK)
+        return result;
+
+    while ((block = next_pipeline_block(&blocks)) != NULL) {
+        init_archive_cursor(&cursor, block->block, &block->header);
+        while ((found = next_archive_telegram(&cursor, telegram, &length, &timestamp, checksum)) > 0) {
+            if ((result = import_telegram(unit, state, telegram, timestamp)) != E_OK)
+                break;
+        }
+        unit->crcErrors += (found < 0);
+
+        release_pipeline_block(&blocks, block);
+        if (result != E_OK)
+            break;
+    }
+    unit->crcErrors += (blocks.found < 0);
+
+    stop_block_pipeline(&blocks);
+
+    return result;
+}
+
+/*
+ * Import worker, takes units until none are left
+ */
+void * import_thread(void *argument) {
+    struct _IMPORT * import = (struct _IMPORT *)argument;
+    import_unit * unit;
+    bucket_queue queue;
+    aggr_state state;
+    int index;
+    int result;
+
+    while ((index = __atomic_fetch_add(&import->nextUnit, 1, __ATOMIC_RELAXED)) < import->unitCount) {
+        unit = &import->units[index];
+
+        memset(&queue, 0, sizeof(queue));
+        init_arrays(&queue);
+        memset(&state, 0, sizeof(state));
+        state.queue = &queue;
+
+        if (unit->data != NULL)
+            result = import_capture(unit, &state);
+        else if (unit->streamFd >= 0)
+            result = import_stream(unit, &state);
+        else
+            result = import_archive(unit, &state);
+
+        // Close the last bucket of the unit
+        if ((result == E_OK) && (state.counter > 0)) {
+            store_data(&queue, state.lastMeasureTime * 300, state.eCummPointer, state.counter);
+            result = import_drain(unit, &queue, state.counter);
+        }
+        else if (state.counter > 0) {
+            free(state.eCummPointer);
+        }
+
+        pthread_mutex_lock(&import->lock);
+        if (result != E_OK)
+            import->result = result;
+        unit->done = 1;
+        import->unitsDone++;
+        pthread_cond_signal(&import->progress);
+        pthread_mutex_unlock(&import->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Order buckets on time, then on input order
+ */
+int compare_buckets(const void *a, const void *b) {
+    const import_bucket * left = (const import_bucket *)a;
+    const import_bucket * right = (const import_bucket *)b;
+
+    if (left->timestamp != right->timestamp)
+        return (left->timestamp < right->timestamp) ? -1 : 1;
+    if (left->order != right->order)
+        return (left->order < right->order) ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Merge a bucket into the bucket of the same interval before it
+ *
+ * Averages are weighted by their samples, percentile sketches are added,
+ * counters come from the later part. A derived channel is weighted by
+ * its own samples, a part without any leaves it as it is.
+ */
+void merge_bucket(import_bucket *into, import_bucket *from) {
+    elec_data * a = into->elec;
+    elec_data * b = from->elec;
+    double total = into->samples + from->samples;
+
+#define MERGE_COUNTER(name, obis, file, source, label, unit) \
+    a->name = b->name;
+#define MERGE_CHANNEL(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) \
+    a->name##_avg = (a->name##_avg * into->samples + b->name##_avg * from->samples) / total; \
+    if (b->name##_min < a->name##_min) a->name##_min = b->name##_min; \
+    if (b->name##_max > a->name##_max) a->name##_max = b->name##_max;
+
+    P1_GAUGES(MERGE_CHANNEL)
+    P1_COUNTERS(MERGE_COUNTER)
+#undef MERGE_CHANNEL
+#undef MERGE_COUNTER
+
+    sketch_merge(&a->sketch, &b->sketch);
+
+    for (int d = 0; d < derivedChannels.count; d++) {
+        if (b->derived_samples[d] == 0)
+            continue;
+
+        if (a->derived_samples[d] == 0) {
+            a->derived_min[d] = b->derived_min[d];
+            a->derived_avg[d] = b->derived_avg[d];
+            a->derived_max[d] = b->derived_max[d];
+        }
+        else {
+            a->derived_avg[d] = (a->derived_avg[d] * a->derived_samples[d] + b->derived_avg[d] * b->derived_samples[d]) / (a->derived_samples[d] + b->derived_samples[d]);
+            if (b->derived_min[d] < a->derived_min[d]) a->derived_min[d] = b->derived_min[d];
+            if (b->derived_max[d] > a->derived_max[d]) a->derived_max[d] = b->derived_max[d];
+        }
+        a->derived_samples[d] += b->derived_samples[d];
+    }
+
+    into->samples += from->samples;
+
+    free(from->elec);
+    from->elec = NULL;
+}
+
+/*
+ * Write a batch of buckets to one RRD file with a single update
+ *
+ * Returns E_OK or E_RRD
+ */
+int import_rrd_batch(const char *filename, char **values, int count) {
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    rrd_clear_error();
+    rrd_update_r(filename, NULL, count, (const char **)values);
+
+    if (rrd_test_error()) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - RRD error in file %s: %s\n", timeStringBuffer, filename, rrd_get_error());
+        return E_RRD;
+    }
+
+    return E_OK;
+}
+
+/*
+ * Write merged buckets to the databases
+ *
+ * Buckets that are not newer than the last update of the databases are
+ * skipped, so an import can be repeated or resumed. Updates are batched,
+ * one rrd_update_r() call handles IMPORT_RRD_BATCH buckets. As for a
+ * live bucket, a derived channel that cannot be written does not stop
+ * the import. The open hour and day are kept in rollups between calls.
+ *
+ * Returns the number of buckets written, or a negative value on error
+ */
+long import_store(struct _CONFIGSTRUCT *config, sketch_rollup *rollups, import_bucket *buckets, long count) {
+    static char rrdValues[RRD_FILES][IMPORT_RRD_BATCH][256];
+    static char percentileValues[IMPORT_RRD_BATCH][512];
+    static char derivedValues[DERIVED_MAX][IMPORT_RRD_BATCH][128];
+    char * rrdArgs[RRD_FILES][IMPORT_RRD_BATCH];
+    char * percentileArgs[IMPORT_RRD_BATCH];
+    char * derivedArgs[DERIVED_MAX][IMPORT_RRD_BATCH];
+    char derivedFilename[512];
+    double min[SKETCH_CHANNELS];
+    double max[SKETCH_CHANNELS];
+    unsigned long lastUpdate;
+    long stored = 0;
+    int batch = 0;
+    elec_data * e;
+
+    lastUpdate = rrd_last_r(config->rrdFilenames[RRD_COUNTERS]);
+
+    for (long i = 0; i <= count; i++) {
+        if ((i < count) && (buckets[i].elec != NULL) && (buckets[i].timestamp + 300 > lastUpdate)) {
+            e = buckets[i].elec;
+
+            for (int f = 0; f < RRD_FILES; f++) {
+                format_rrd_update(rrdValues[f][batch], sizeof(rrdValues[f][batch]), f, buckets[i].timestamp + 300, e);
+                rrdArgs[f][batch] = rrdValues[f][batch];
+            }
+            bucket_range(e, min, max);
+            format_percentiles(percentileValues[batch], sizeof(percentileValues[batch]), buckets[i].timestamp + 300, &e->sketch, min, max);
+            percentileArgs[batch] = percentileValues[batch];
+            for (int d = 0; d < derivedChannels.count; d++) {
+                if (e->derived_samples[d] > 0)
+                    snprintf(derivedValues[d][batch], sizeof(derivedValues[d][batch]), "%lu:%1.3lf:%1.3lf:%1.3lf", buckets[i].timestamp + 300, e->derived_max[d], e->derived_avg[d], e->derived_min[d]);
+                else
+                    snprintf(derivedValues[d][batch], sizeof(derivedValues[d][batch]), "%lu:U:U:U", buckets[i].timestamp + 300);
+                derivedArgs[d][batch] = derivedValues[d][batch];
+            }
+            batch++;
+
+            // Hours and days are merged in time order, the open ones are left unwritten
+            store_rollups(config, rollups, buckets[i].timestamp, e);
+        }
+
+        if ((batch == IMPORT_RRD_BATCH) || ((i == count) && (batch > 0))) {
+            for (int f = 0; f < RRD_FILES; f++) {
+                if (import_rrd_batch(config->rrdFilenames[f], rrdArgs[f], batch) != E_OK)
+                    return -1;
+            }
+            if (import_rrd_batch(config->percentileFilenames[0], percentileArgs, batch) != E_OK)
+                return -1;
+            for (int d = 0; d < derivedChannels.count; d++) {
+                snprintf(derivedFilename, sizeof(derivedFilename), "%s/derived-%s.rrd", rrd_directory(config), derivedChannels.name[d]);
+                import_rrd_batch(derivedFilename, derivedArgs[d], batch);
+            }
+
+            stored += batch;
+            batch = 0;
+        }
+    }
+
+    return stored;
+}
+
+/*
+ * Write the buckets that no unit can add to anymore
+ *
+ * Inputs are expected in time order, so a unit only adds buckets from
+ * the last bucket it closed on, and a unit that has not closed any yet
+ * from the last bucket of the units before it. Buckets before that point
+ * in the first unit that is not done are taken from all units, sorted
+ * on time, merged with the other half of a bucket split between two
+ * units and written. A bucket of an input out of order that is older
+ * than the databases by then is not written.
+ *
+ * Parameters:
+ *   *import  - The import, locked
+ *   *config  - Pointer to the configuration
+ *   all      - Write all buckets, the workers are done
+ *
+ * Returns E_OK, E_MALLOC or E_RRD
+ */
+int import_flush(struct _IMPORT *import, struct _CONFIGSTRUCT *config, int all) {
+    import_bucket * grown;
+    import_unit * unit;
+    unsigned long before = 0;
+    long count = 0;
+    long pending = 0;
+    long stored;
+    int kept;
+
+    if (!all) {
+        for (int i = 0; i < import->unitCount; i++) {
+            unit = &import->units[i];
+            if (!unit->done) {
+                if (unit->lastTimestamp != 0)
+                    before = unit->lastTimestamp;
+                break;
+            }
+            if (unit->lastTimestamp > before)
+                before = unit->lastTimestamp;
+        }
+    }
+
+    for (int i = 0; i < import->unitCount; i++)
+        pending += import->units[i].bucketCount;
+
+    if (pending > import->flushSize) {
+        if ((grown = (import_bucket *)realloc(import->flush, pending * sizeof(import_bucket))) == NULL)
+            return E_MALLOC;
+        import->flush = grown;
+        import->flushSize = pending;
+    }
+
+    for (int i = 0; i < import->unitCount; i++) {
+        unit = &import->units[i];
+        kept = 0;
+        for (int j = 0; j < unit->bucketCount; j++) {
+            if (all || (unit->buckets[j].timestamp < before))
+                import->flush[count++] = unit->buckets[j];
+            else
+                unit->buckets[kept++] = unit->buckets[j];
+        }
+        unit->bucketCount = kept;
+    }
+
+    if (count == 0)
+        return E_OK;
+
+    // Written without the lock, the workers go on
+    pthread_mutex_unlock(&import->lock);
+
+    qsort(import->flush, count, sizeof(import_bucket), compare_buckets);
+
+    for (long i = 0, last = -1; i < count; i++) {
+        if ((last >= 0) && (import->flush[last].timestamp == import->flush[i].timestamp)) {
+            merge_bucket(&import->flush[last], &import->flush[i]);
+            import->merged++;
+            continue;
+        }
+        last = i;
+    }
+
+    stored = import_store(config, import->rollups, import->flush, count);
+
+    for (long i = 0; i < count; i++)
+        free(import->flush[i].elec);
+
+    pthread_mutex_lock(&import->lock);
+
+    import->bucketCount += count;
+    if (stored < 0)
+        return E_RRD;
+    import->stored += stored;
+
+    return E_OK;
+}
+
+/*
+ * Split one input in units, a capture file or an archive directory
+ *
+ * Standard input ("-"), pipes and devices become a single stream unit.
+ *
+ * Returns E_OK, E_MALLOC or E_FILE_ACCESS
+ */
+int import_add_input(struct _IMPORT *import, const char *path) {
+    struct _ARCHIVEINDEX entry;
+    struct stat info;
+    import_unit * grown;
+    import_unit * unit;
+    char filename[512];
+    const char * data;
+    int fd;
+    int indexFd;
+    long entries;
+    long units;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    if ((strcmp(path, "-") == 0) || ((stat(path, &info) == 0) && !S_ISDIR(info.st_mode) && !S_ISREG(info.st_mode))) {
+        if (strcmp(path, "-") == 0)
+            fd = dup(STDIN_FILENO);
+        else
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "%s - Error %i from open %s: %s\n", timeStringBuffer, errno, path, strerror(errno));
+            return E_FILE_ACCESS;
+        }
+
+        if ((grown = (import_unit *)realloc(import->units, (import->unitCount + 1) * sizeof(import_unit))) == NULL) {
+            fprintf(stderr, "%s - Error claiming memory for import of %s: %s\n", timeStringBuffer, path, strerror(errno));
+            close(fd);
+            return E_MALLOC;
+        }
+        import->units = grown;
+
+        unit = &import->units[import->unitCount++];
+        memset(unit, 0, sizeof(import_unit));
+        unit->import = import;
+        unit->owner = 1;
+        unit->streamFd = fd;
+
+        return E_OK;
+    }
+
+    if (stat(path, &info) != 0) {
+        fprintf(stderr, "%s - Error %i from import %s: %s\n", timeStringBuffer, errno, path, strerror(errno));
+        return E_FILE_ACCESS;
+    }
+
+    if (S_ISDIR(info.st_mode)) {
+        snprintf(filename, sizeof(filename), "%s/telegrams.idx", path);
+        if ((indexFd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "%s - Error %i from open archive index %s: %s\n", timeStringBuffer, errno, filename, strerror(errno));
+            return E_FILE_ACCESS;
+        }
+        snprintf(filename, sizeof(filename), "%s/telegrams.arc", path);
+        if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "%s - Error %i from open archive %s: %s\n", timeStringBuffer, errno, filename, strerror(errno));
+            close(indexFd);
+            return E_FILE_ACCESS;
+        }
+
+        entries = lseek(indexFd, 0, SEEK_END) / sizeof(struct _ARCHIVEINDEX);
+        units = (entries + IMPORT_UNIT_BLOCKS - 1) / IMPORT_UNIT_BLOCKS;
+    }
+    else {
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "%s - Error %i from open %s: %s\n", timeStringBuffer, errno, path, strerror(errno));
+            return E_FILE_ACCESS;
+        }
+        if (info.st_size == 0) {
+            close(fd);
+            return E_OK;
+        }
+        if ((data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+            fprintf(stderr, "%s - Error %i from mmap %s: %s\n", timeStringBuffer, errno, path, strerror(errno));
+            close(fd);
+            return E_FILE_ACCESS;
+        }
+        close(fd);
+        madvise((void *)data, info.st_size, MADV_SEQUENTIAL);
+
+        indexFd = -1;
+        entries = 0;
+        units = (info.st_size + IMPORT_UNIT_BYTES - 1) / IMPORT_UNIT_BYTES;
+    }
+
+    if ((grown = (import_unit *)realloc(import->units, (import->unitCount + units) * sizeof(import_unit))) == NULL) {
+        fprintf(stderr, "%s - Error claiming memory for import of %s: %s\n", timeStringBuffer, path, strerror(errno));
+        if (indexFd >= 0) {
+            close(indexFd);
+            close(fd);
+        }
+        return E_MALLOC;
+    }
+    import->units = grown;
+
+    // An empty archive has no unit to own the descriptor
+    if ((units == 0) && (indexFd >= 0))
+        close(fd);
+
+    for (long i = 0; i < units; i++) {
+        unit = &import->units[import->unitCount++];
+        memset(unit, 0, sizeof(import_unit));
+        unit->import = import;
+        unit->owner = (i == 0);
+        unit->streamFd = -1;
+
+        if (indexFd >= 0) {
+            unit->dataFd = fd;
+            unit->blockCount = (entries - i * IMPORT_UNIT_BLOCKS < IMPORT_UNIT_BLOCKS) ? entries - i * IMPORT_UNIT_BLOCKS : IMPORT_UNIT_BLOCKS;
+            if (pread(indexFd, &entry, sizeof(entry), i * IMPORT_UNIT_BLOCKS * sizeof(entry)) == sizeof(entry))
+                unit->blockOffset = entry.offset;
+            else
+                unit->blockCount = 0;
+        }
+        else {
+            unit->data = data;
+            unit->size = info.st_size;
+            unit->start = i * IMPORT_UNIT_BYTES;
+            unit->end = unit->start + IMPORT_UNIT_BYTES;
+        }
+    }
+
+    if (indexFd >= 0)
+        close(indexFd);
+
+    return E_OK;
+}
+
+/*
+ * Import archived telegrams in the databases
+ *
+ * Inputs are raw P1 capture files or archive directories, given oldest
+ * first. They are cut in units that are framed, CRC checked and parsed
+ * with parse_block() on all cores. While the workers run, the buckets no
+ * unit can add to anymore are sorted on time, halves of a bucket split
+ * between two units are merged and the result is written to the
+ * databases in the same format as the live updates. Memory use does not
+ * grow with the length of the import.
+ *
+ * Capture files are aggregated on the meter time in the telegram, so
+ * telegrams without 0-0:1.0.0 are skipped.
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *
+ * Returns E_OK or an error code
+ */
+int run_import(struct _CONFIGSTRUCT *config) {
+    struct _IMPORT import;
+    pthread_t * threads;
+    unsigned long drained = 0;
+    unsigned long telegrams = 0;
+    unsigned long crcErrors = 0;
+    unsigned long skipped = 0;
+    int unitsDone = 0;
+    int threadCount;
+    int result;
+    struct timespec started;
+    struct timespec finished;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    memset(&import, 0, sizeof(import));
+    pthread_mutex_init(&import.lock, NULL);
+    pthread_cond_init(&import.progress, NULL);
+
+    if ((result = init_rrd_database(config)) != E_OK)
+        return result;
+
+    for (int i = 0; i < config->importCount; i++) {
+        if ((result = import_add_input(&import, config->importPaths[i])) != E_OK)
+            return result;
+    }
+
+    threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount > import.unitCount)
+        threadCount = import.unitCount;
+    if (threadCount < 1)
+        threadCount = 1;
+
+    if ((threads = (pthread_t *)malloc(threadCount * sizeof(pthread_t))) == NULL)
+        return E_MALLOC;
+
+    for (int i = 0; i < threadCount; i++)
+        pthread_create(&threads[i], NULL, import_thread, &import);
+
+    // Write what the workers closed while they go on
+    pthread_mutex_lock(&import.lock);
+    while (import.unitsDone < import.unitCount) {
+        while ((import.unitsDone == unitsDone) && (import.drained - drained < IMPORT_FLUSH))
+            pthread_cond_wait(&import.progress, &import.lock);
+        unitsDone = import.unitsDone;
+        drained = import.drained;
+
+        if ((import.result == E_OK) && ((result = import_flush(&import, config, 0)) != E_OK))
+            import.result = result;
+    }
+    pthread_mutex_unlock(&import.lock);
+
+    for (int i = 0; i < threadCount; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    if ((import.result == E_OK) && ((result = import_flush(&import, config, 1)) != E_OK))
+        import.result = result;
+
+    for (int i = 0; i < import.unitCount; i++) {
+        telegrams += import.units[i].telegrams;
+        crcErrors += import.units[i].crcErrors;
+        skipped += import.units[i].skipped;
+
+        for (int j = 0; j < import.units[i].bucketCount; j++)
+            free(import.units[i].buckets[j].elec);
+        free(import.units[i].buckets);
+
+        if (import.units[i].owner && (import.units[i].data != NULL))
+            munmap((void *)import.units[i].data, import.units[i].size);
+        else if (import.units[i].owner && (import.units[i].streamFd >= 0))
+            close(import.units[i].streamFd);
+        else if (import.units[i].owner)
+            close(import.units[i].dataFd);
+    }
+    free(import.units);
+    free(import.flush);
+    pthread_mutex_destroy(&import.lock);
+    pthread_cond_destroy(&import.progress);
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    if (import.result != E_OK) {
+        fprintf(stderr, "%s - Import failed with error %d, %ld buckets stored\n", timeStringBuffer, import.result, import.stored);
+        return import.result;
+    }
+
+    printf("%s - Imported %lu telegrams (%lu CRC errors, %lu without time) in %ld buckets, %ld stored, %d threads, %.1lf seconds\n",
+        timeStringBuffer, telegrams, crcErrors, skipped, import.bucketCount - import.merged, import.stored, threadCount,
+        (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9);
+    fflush(stdout);
+
+    return E_OK;
+}
@@ -0,0 +1,457 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <zlib.h>
+#include <sys/socket.h>
+
+#include "slimmemeter.h"
+
+/*
+ * Private state of the InfluxDB sink, the settings are copied so the
+ * configuration can be reloaded while the sink runs
+ */
+typedef struct {
+    int             udp;
+    char            host[256];
+    char            port[16];
+    char            path[768];
+    char            url[1024];
+    char          * measurement;
+    char          * tags;
+    char          * authorization;
+    int             gzip;
+    int             batch;
+    int             fd;
+    char          * buffer;
+    size_t          length;
+    int             lines;
+    unsigned char * compressed;
+    size_t          compressedSize;
+} influx_sink;
+
+/*
+ * Field names of the telegram lines, by OBIS reference
+ */
+static const struct {
+    const char * obis;
+    const char * name;
+} influxFields[] = {
+#define P1_INFLUX_COUNTER(name, obis, file, source, label, unit) { obis, #name },
+#define P1_INFLUX_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) { obis, #name },
+    P1_COUNTERS(P1_INFLUX_COUNTER)
+    P1_GAUGES(P1_INFLUX_GAUGE)
+#undef P1_INFLUX_COUNTER
+#undef P1_INFLUX_GAUGE
+    { NULL, NULL }
+};
+
+/*
+ * Format a bucket as a line, at the start of its interval
+ *
+ * Returns the length of the line
+ */
+int influx_bucket_line(influx_sink *influx, char *line, size_t size, unsigned long timestamp, const elec_data *data) {
+    int length;
+
+    length = snprintf(line, size, "%s%s", influx->measurement, influx->tags);
+
+#define P1_INFLUX_COUNTER(name, obis, file, source, label, unit) \
+    length += snprintf(line + length, size - length, "%c" #name "=%.3lf", (length == start) ? ' ' : ',', data->name);
+#define P1_INFLUX_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) \
+    length += snprintf(line + length, size - length, "," #name "_min=%.3lf," #name "_avg=%.3lf," #name "_max=%.3lf", data->name##_min, data->name##_avg, data->name##_max);
+    {
+        int start = length;
+
+        P1_COUNTERS(P1_INFLUX_COUNTER)
+    }
+    P1_GAUGES(P1_INFLUX_GAUGE)
+#undef P1_INFLUX_COUNTER
+#undef P1_INFLUX_GAUGE
+
+    for (int d = 0; d < derivedChannels.count; d++) {
+        if (data->derived_samples[d] > 0)
+            length += snprintf(line + length, size - length, ",%s_min=%.3lf,%s_avg=%.3lf,%s_max=%.3lf",
+                derivedChannels.name[d], data->derived_min[d], derivedChannels.name[d], data->derived_avg[d], derivedChannels.name[d], data->derived_max[d]);
+    }
+
+    length += snprintf(line + length, size - length, " %lu000000000\n", timestamp);
+
+    return length;
+}
+
+/*
+ * Format the known lines of a raw telegram as a line
+ *
+ * The value of a telegram line is the last parenthesized value, without
+ * its unit.
+ *
+ * Returns the length of the line, 0 when the telegram has no known lines
+ */
+int influx_telegram_line(influx_sink *influx, char *line, size_t size, unsigned long timestamp, const char *telegram) {
+    const char * lineStart = telegram;
+    const char * lineEnd;
+    const char * value;
+    size_t keyLength;
+    int length;
+    int start;
+
+    length = snprintf(line, size, "%s_telegram%s", influx->measurement, influx->tags);
+    start = length;
+
+    for (; *lineStart != '\0'; lineStart = (*lineEnd == '\0') ? lineEnd : lineEnd + 1) {
+        if ((lineEnd = strchr(lineStart, '\n')) == NULL)
+            lineEnd = lineStart + strlen(lineStart);
+
+        if ((value = memchr(lineStart, '(', lineEnd - lineStart)) == NULL)
+            continue;
+        keyLength = value - lineStart;
+
+        for (int i = 0; influxFields[i].obis != NULL; i++) {
+            if ((strlen(influxFields[i].obis) != keyLength) || (strncmp(lineStart, influxFields[i].obis, keyLength) != 0))
+                continue;
+
+            // The gas line has the time of the reading in front of the value
+            for (const char * c = value; c < lineEnd; c++) {
+                if (*c == '(')
+                    value = c;
+            }
+
+            length += snprintf(line + length, size - length, "%c%s=%.3lf", (length == start) ? ' ' : ',', influxFields[i].name, atof(value + 1));
+            break;
+        }
+    }
+
+    if (length == start)
+        return 0;
+
+    length += snprintf(line + length, size - length, " %lu000000000\n", timestamp);
+
+    return length;
+}
+
+/*
+ * Send all of a buffer on a stream socket
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+int influx_send_all(int fd, const void *data, size_t length) {
+    ssize_t sent;
+
+    while (length > 0) {
+        if ((sent = send(fd, data, length, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return E_FILE_ACCESS;
+        }
+        data = (const char *)data + sent;
+        length -= sent;
+    }
+
+    return E_OK;
+}
+
+/*
+ * Post the buffer in one HTTP request on a kept alive connection
+ *
+ * A rejected batch (HTTP 4xx other than 429) is dropped, sending it again
+ * would not help. Other failures are retried.
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+int influx_post(influx_sink *influx) {
+    char header[2048];
+    char response[4096];
+    const void * body = influx->buffer;
+    size_t bodyLength = influx->length;
+    z_stream stream;
+    int headerLength;
+    int responseLength = 0;
+    int status;
+    ssize_t result;
+    char * end;
+    char * contentLength;
+    long remaining;
+    int keepAlive;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if (influx->gzip) {
+        memset(&stream, 0, sizeof(stream));
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return E_MALLOC;
+
+        stream.next_in = (unsigned char *)influx->buffer;
+        stream.avail_in = influx->length;
+        stream.next_out = influx->compressed;
+        stream.avail_out = influx->compressedSize;
+
+        if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+            deflateEnd(&stream);
+            return E_MALLOC;
+        }
+
+        body = influx->compressed;
+        bodyLength = stream.total_out;
+        deflateEnd(&stream);
+    }
+
+    headerLength = snprintf(header, sizeof(header),
+        "POST %s HTTP/1.1\r\nHost: %s:%s\r\nUser-Agent: slimmemeter\r\nContent-Type: text/plain; charset=utf-8\r\nContent-Length: %zu\r\n%s%s%s%sConnection: keep-alive\r\n\r\n",
+        influx->path, influx->host, influx->port, bodyLength, influx->gzip ? "Content-Encoding: gzip\r\n" : "",
+        (influx->authorization != NULL) ? "Authorization: " : "", (influx->authorization != NULL) ? influx->authorization : "", (influx->authorization != NULL) ? "\r\n" : "");
+
+    // A kept alive connection may have been closed by the server, try a new one once
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if ((influx->fd < 0) && ((influx->fd = connect_host(influx->host, influx->port, SOCK_STREAM, INFLUX_TIMEOUT)) < 0))
+            break;
+
+        if ((influx_send_all(influx->fd, header, headerLength) == E_OK) && (influx_send_all(influx->fd, body, bodyLength) == E_OK)) {
+            responseLength = 0;
+            end = NULL;
+            while ((responseLength < (int)sizeof(response) - 1) && ((result = recv(influx->fd, response + responseLength, sizeof(response) - 1 - responseLength, 0)) > 0)) {
+                responseLength += result;
+                response[responseLength] = '\0';
+                if ((end = strstr(response, "\r\n\r\n")) != NULL)
+                    break;
+            }
+
+            if (end != NULL)
+                break;
+        }
+
+        close(influx->fd);
+        influx->fd = -1;
+    }
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    if (influx->fd < 0) {
+        fprintf(stderr, "%s - Error %i sending to %s: %s\n", timeStringBuffer, errno, influx->url, strerror(errno));
+        return E_FILE_ACCESS;
+    }
+
+    if (sscanf(response, "HTTP/%*s %d", &status) != 1)
+        status = 0;
+
+    // Skip the body, an error message, so the connection can be kept
+    *end = '\0';
+    keepAlive = (strcasestr(response, "\r\nConnection: close") == NULL);
+    remaining = -1;
+    if ((contentLength = strcasestr(response, "\r\nContent-Length:")) != NULL)
+        remaining = atol(contentLength + 17) - (responseLength - (end + 4 - response));
+    while (remaining > 0) {
+        if ((result = recv(influx->fd, response, (remaining < (long)sizeof(response)) ? remaining : (long)sizeof(response), 0)) <= 0)
+            break;
+        remaining -= result;
+    }
+    if ((remaining != 0) || !keepAlive) {
+        close(influx->fd);
+        influx->fd = -1;
+    }
+
+    if ((status >= 200) && (status < 300))
+        return E_OK;
+
+    if ((status >= 400) && (status < 500) && (status != 429)) {
+        fprintf(stderr, "%s - %s rejected %d lines with HTTP status %d, dropped\n", timeStringBuffer, influx->url, influx->lines, status);
+        return E_OK;
+    }
+
+    fprintf(stderr, "%s - %s failed with HTTP status %d\n", timeStringBuffer, influx->url, status);
+    return E_FILE_ACCESS;
+}
+
+/*
+ * Send the buffer in datagrams, split between lines
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+int influx_datagrams(influx_sink *influx) {
+    size_t start = 0;
+    size_t end;
+    size_t next;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if ((influx->fd < 0) && ((influx->fd = connect_host(influx->host, influx->port, SOCK_DGRAM, INFLUX_TIMEOUT)) < 0)) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error %i sending to %s: %s\n", timeStringBuffer, errno, influx->url, strerror(errno));
+        return E_FILE_ACCESS;
+    }
+
+    while (start < influx->length) {
+        // As many whole lines as fit, at least one
+        end = start;
+        do {
+            next = (char *)memchr(influx->buffer + end, '\n', influx->length - end) - influx->buffer + 1;
+            if ((end > start) && (next - start > INFLUX_UDP_PAYLOAD))
+                break;
+            end = next;
+        } while (end < influx->length);
+
+        if (send(influx->fd, influx->buffer + start, end - start, MSG_NOSIGNAL) < 0) {
+            msgtime = time(NULL);
+            tm_info = localtime(&msgtime);
+            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+            fprintf(stderr, "%s - Error %i sending to %s: %s\n", timeStringBuffer, errno, influx->url, strerror(errno));
+            close(influx->fd);
+            influx->fd = -1;
+
+            // Keep what was not sent
+            memmove(influx->buffer, influx->buffer + start, influx->length - start);
+            influx->length -= start;
+            return E_FILE_ACCESS;
+        }
+
+        start = end;
+    }
+
+    return E_OK;
+}
+
+int influx_sink_flush(p1_sink *sink) {
+    influx_sink * influx = (influx_sink *)sink->data;
+    int result;
+
+    if (influx->length == 0)
+        return E_OK;
+
+    if ((result = influx->udp ? influx_datagrams(influx) : influx_post(influx)) != E_OK)
+        return result;
+
+    influx->length = 0;
+    influx->lines = 0;
+
+    return E_OK;
+}
+
+/*
+ * Add items to the batch, the batch is sent when it is full
+ */
+int influx_sink_write(p1_sink *sink, sink_item *items, int count) {
+    influx_sink * influx = (influx_sink *)sink->data;
+    int length;
+
+    for (int i = 0; i < count; i++) {
+        if ((influx->lines >= influx->batch) || (influx->length + INFLUX_MAX_LINE > INFLUX_BUFFER_SIZE)) {
+            if (influx_sink_flush(sink) != E_OK)
+                return i;
+        }
+
+        if (items[i].type == SINK_BUCKET)
+            length = influx_bucket_line(influx, influx->buffer + influx->length, INFLUX_MAX_LINE, items[i].timestamp, items[i].data);
+        else
+            length = influx_telegram_line(influx, influx->buffer + influx->length, INFLUX_MAX_LINE, items[i].timestamp, items[i].telegram);
+
+        // A line that did not fit is left out
+        if ((length > 0) && (length < INFLUX_MAX_LINE)) {
+            influx->length += length;
+            influx->lines++;
+        }
+    }
+
+    return count;
+}
+
+void influx_sink_close(p1_sink *sink) {
+    influx_sink * influx = (influx_sink *)sink->data;
+
+    if (influx == NULL)
+        return;
+
+    if (influx->fd >= 0)
+        close(influx->fd);
+    free(influx->measurement);
+    free(influx->tags);
+    free(influx->authorization);
+    free(influx->buffer);
+    free(influx->compressed);
+    free(influx);
+    sink->data = NULL;
+}
+
+/*
+ * Set up the InfluxDB sink from the configuration
+ *
+ * Returns E_OK, E_CONF_FILE or E_MALLOC
+ */
+int influx_sink_init(p1_sink *sink) {
+    struct _CONFIGSTRUCT * config = sink->config;
+    influx_sink * influx;
+    char scheme[8];
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if ((influx = (influx_sink *)calloc(1, sizeof(influx_sink))) == NULL)
+        return E_MALLOC;
+    sink->data = influx;
+    influx->fd = -1;
+
+    strcpy(influx->port, "8086");
+    if ((config->influxUrl == NULL) || (strlen(config->influxUrl) >= sizeof(influx->url)) ||
+        (split_url(config->influxUrl, scheme, sizeof(scheme), influx->host, sizeof(influx->host), influx->port, sizeof(influx->port), influx->path, sizeof(influx->path)) != E_OK) ||
+        ((strcmp(scheme, "http") != 0) && (strcmp(scheme, "udp") != 0))) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Invalid influx url %s, expected http://host[:port]/path or udp://host[:port]\n", timeStringBuffer, (config->influxUrl != NULL) ? config->influxUrl : "");
+        influx_sink_close(sink);
+        return E_CONF_FILE;
+    }
+    strcpy(influx->url, config->influxUrl);
+
+    influx->udp = (strcmp(scheme, "udp") == 0);
+    influx->gzip = config->influxGzip && !influx->udp;
+    influx->batch = config->influxBatch;
+
+    if (((influx->measurement = strdup((config->influxMeasurement != NULL) ? config->influxMeasurement : "p1")) == NULL) ||
+        ((influx->tags = (char *)malloc(((config->influxTags != NULL) ? strlen(config->influxTags) : 0) + 2)) == NULL) ||
+        ((influx->buffer = (char *)malloc(INFLUX_BUFFER_SIZE)) == NULL)) {
+        influx_sink_close(sink);
+        return E_MALLOC;
+    }
+
+    // Tags are written as given, "tag=value,tag=value"
+    if ((config->influxTags != NULL) && (*config->influxTags != '\0'))
+        sprintf(influx->tags, ",%s", config->influxTags);
+    else
+        influx->tags[0] = '\0';
+
+    if (config->influxToken != NULL) {
+        if ((influx->authorization = (char *)malloc(strlen(config->influxToken) + 7)) == NULL) {
+            influx_sink_close(sink);
+            return E_MALLOC;
+        }
+        sprintf(influx->authorization, "Token %s", config->influxToken);
+    }
+
+    if (influx->gzip) {
+        influx->compressedSize = compressBound(INFLUX_BUFFER_SIZE) + 32;
+        if ((influx->compressed = (unsigned char *)malloc(influx->compressedSize)) == NULL) {
+            influx_sink_close(sink);
+            return E_MALLOC;
+        }
+    }
+
+    if (config->influxTelegrams)
+        sink->accepts |= SINK_TELEGRAM;
+    sink->flushInterval = config->influxFlushInterval;
+
+    return E_OK;
+}
+
+const sink_type influxSink = { "influx", SINK_BUCKET, influx_sink_init, influx_sink_write, influx_sink_flush, influx_sink_close };
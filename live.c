@@ -0,0 +1,580 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "slimmemeter.h"
+
+#define LIVE_RING_SIZE    131072
+#define LIVE_REQUEST_SIZE 2048
+#define LIVE_TIMEOUT      10
+
+enum LIVE_STATES {
+    LIVE_REQUEST,
+    LIVE_SSE,
+    LIVE_WEBSOCKET
+};
+
+enum LIVE_STREAMS {
+    STREAM_SSE,
+    STREAM_WEBSOCKET,
+    LIVE_STREAMS
+};
+
+/*
+ * A live stream client. Until its request is complete it has its own
+ * buffer, after the response it only holds its position in the ring of
+ * its protocol, like a relay subscriber.
+ */
+struct _LIVECLIENT {
+    int                fd;
+    int                state;
+    time_t             connected;
+    char               request[LIVE_REQUEST_SIZE];
+    int                requestLength;
+    char               response[256];
+    int                responseLength;
+    int                responseSent;
+    unsigned long long cursor;
+};
+
+/*
+ * Every message is framed once per protocol, into the ring of that
+ * protocol, and shared by all its clients
+ */
+struct _LIVERING {
+    char               data[LIVE_RING_SIZE];
+    unsigned long long head;
+};
+
+int liveSocket = -1;
+struct _LIVECLIENT liveClients[LIVE_MAX_CLIENTS];
+struct _LIVERING liveRings[LIVE_STREAMS];
+
+/*
+ * Names of the channels, by FIELD
+ */
+static const char * liveFields[FIELDS] = {
+#define P1_LIVE_COUNTER(name, obis, file, source, label, unit) [FIELD_##name] = #name,
+#define P1_LIVE_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) [FIELD_##name] = #name,
+    P1_COUNTERS(P1_LIVE_COUNTER)
+    P1_GAUGES(P1_LIVE_GAUGE)
+#undef P1_LIVE_COUNTER
+#undef P1_LIVE_GAUGE
+};
+
+/*
+ * SHA-1 of a short message, for the WebSocket handshake only
+ */
+void live_sha1(const unsigned char *message, size_t length, unsigned char *digest) {
+    unsigned int h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    unsigned char block[64];
+    unsigned int w[80];
+    unsigned int a, b, c, d, e, f, k, temp;
+    unsigned long long bits = (unsigned long long)length * 8;
+    size_t total = ((length + 8) / 64 + 1) * 64;
+
+    for (size_t offset = 0; offset < total; offset += 64) {
+        for (int i = 0; i < 64; i++) {
+            if (offset + i < length)
+                block[i] = message[offset + i];
+            else if (offset + i == length)
+                block[i] = 0x80;
+            else if (offset + i >= total - 8)
+                block[i] = bits >> ((total - 1 - offset - i) * 8);
+            else
+                block[i] = 0;
+        }
+
+        for (int i = 0; i < 16; i++)
+            w[i] = (block[i * 4] << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+        for (int i = 16; i < 80; i++) {
+            temp = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = (temp << 1) | (temp >> 31);
+        }
+
+        a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+        for (int i = 0; i < 80; i++) {
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }
+            else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }
+            else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            temp = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = temp;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for (int i = 0; i < 20; i++)
+        digest[i] = h[i / 4] >> ((3 - (i % 4)) * 8);
+}
+
+void live_base64(const unsigned char *data, size_t length, char *text) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned int triple;
+
+    for (size_t i = 0; i < length; i += 3) {
+        triple = data[i] << 16;
+        if (i + 1 < length)
+            triple |= data[i + 1] << 8;
+        if (i + 2 < length)
+            triple |= data[i + 2];
+
+        *text++ = alphabet[(triple >> 18) & 63];
+        *text++ = alphabet[(triple >> 12) & 63];
+        *text++ = (i + 1 < length) ? alphabet[(triple >> 6) & 63] : '=';
+        *text++ = (i + 2 < length) ? alphabet[triple & 63] : '=';
+    }
+    *text = '\0';
+}
+
+/*
+ * Open the live stream listening socket
+ *
+ * Clients connect with an HTTP GET of /events, as Server-Sent Events or
+ * upgraded to a WebSocket, and receive a JSON message for every decoded
+ * telegram and every closed interval.
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+int init_live(struct _CONFIGSTRUCT *config) {
+    for (int i = 0; i < LIVE_MAX_CLIENTS; i++)
+        liveClients[i].fd = -1;
+
+    if (config->liveListen == NULL)
+        return E_OK;
+
+    if ((liveSocket = init_listen_socket(config->liveListen)) < 0)
+        return E_FILE_ACCESS;
+
+    return E_OK;
+}
+
+/*
+ * Close the live stream socket and all clients
+ */
+void close_live(void) {
+    for (int i = 0; i < LIVE_MAX_CLIENTS; i++) {
+        if (liveClients[i].fd >= 0)
+            close(liveClients[i].fd);
+        liveClients[i].fd = -1;
+    }
+
+    if (liveSocket >= 0) {
+        close(liveSocket);
+        liveSocket = -1;
+    }
+}
+
+/*
+ * Drop a client
+ */
+void drop_live_client(struct _LIVECLIENT *client, const char *reason) {
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if (verbose) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        printf("%s - Live stream client dropped: %s\n", timeStringBuffer, reason);
+    }
+
+    close(client->fd);
+    client->fd = -1;
+}
+
+/*
+ * Write the response and as much of the ring as a client accepts without
+ * blocking
+ */
+void flush_live_client(struct _LIVECLIENT *client) {
+    struct _LIVERING * ring;
+    size_t offset;
+    size_t length;
+    ssize_t result;
+
+    if (client->state == LIVE_REQUEST)
+        return;
+
+    while (client->responseSent < client->responseLength) {
+        result = send(client->fd, client->response + client->responseSent, client->responseLength - client->responseSent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (result < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+                return;
+
+            drop_live_client(client, strerror(errno));
+            return;
+        }
+
+        client->responseSent += result;
+    }
+
+    ring = &liveRings[(client->state == LIVE_WEBSOCKET) ? STREAM_WEBSOCKET : STREAM_SSE];
+
+    while (client->cursor < ring->head) {
+        if (ring->head - client->cursor > LIVE_RING_SIZE) {
+            drop_live_client(client, "too slow");
+            return;
+        }
+
+        offset = client->cursor % LIVE_RING_SIZE;
+        length = ring->head - client->cursor;
+        if (offset + length > LIVE_RING_SIZE)
+            length = LIVE_RING_SIZE - offset;
+
+        result = send(client->fd, ring->data + offset, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (result < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+                return;
+
+            drop_live_client(client, strerror(errno));
+            return;
+        }
+
+        client->cursor += result;
+    }
+}
+
+/*
+ * Append to a ring
+ */
+void live_ring_write(struct _LIVERING *ring, const char *data, size_t size) {
+    size_t length;
+
+    for (size_t done = 0; done < size; done += length) {
+        length = size - done;
+        if ((ring->head % LIVE_RING_SIZE) + length > LIVE_RING_SIZE)
+            length = LIVE_RING_SIZE - (ring->head % LIVE_RING_SIZE);
+
+        memcpy(ring->data + (ring->head % LIVE_RING_SIZE), data + done, length);
+        ring->head += length;
+    }
+}
+
+/*
+ * Frame a message once per protocol and write it to all clients
+ *
+ * Parameters:
+ *   *event   - SSE event name, also in the message as "event"
+ *   *json    - The message
+ *   length   - Length of the message
+ */
+void live_publish(const char *event, const char *json, size_t length) {
+    unsigned char header[4];
+    size_t headerLength;
+    char eventLine[64];
+    time_t now = time(NULL);
+
+    snprintf(eventLine, sizeof(eventLine), "event: %s\ndata: ", event);
+    live_ring_write(&liveRings[STREAM_SSE], eventLine, strlen(eventLine));
+    live_ring_write(&liveRings[STREAM_SSE], json, length);
+    live_ring_write(&liveRings[STREAM_SSE], "\n\n", 2);
+
+    // Unmasked text frame
+    header[0] = 0x81;
+    if (length < 126) {
+        header[1] = length;
+        headerLength = 2;
+    }
+    else {
+        header[1] = 126;
+        header[2] = length >> 8;
+        header[3] = length & 0xff;
+        headerLength = 4;
+    }
+    live_ring_write(&liveRings[STREAM_WEBSOCKET], (const char *)header, headerLength);
+    live_ring_write(&liveRings[STREAM_WEBSOCKET], json, length);
+
+    for (int i = 0; i < LIVE_MAX_CLIENTS; i++) {
+        if (liveClients[i].fd < 0)
+            continue;
+
+        // A request that never completes does not hold a slot
+        if ((liveClients[i].state == LIVE_REQUEST) && (now - liveClients[i].connected > LIVE_TIMEOUT)) {
+            drop_live_client(&liveClients[i], "no request");
+            continue;
+        }
+
+        flush_live_client(&liveClients[i]);
+    }
+}
+
+/*
+ * Check if any client is streaming, formatting is skipped without one
+ */
+int live_subscribers(void) {
+    for (int i = 0; i < LIVE_MAX_CLIENTS; i++) {
+        if (liveClients[i].fd >= 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Publish the values of the telegram parse_block() just decoded
+ *
+ * Parameters:
+ *   *state     - Aggregation state of the meter
+ *   timestamp  - Time of the telegram
+ */
+void live_telegram(const aggr_state *state, unsigned long timestamp) {
+    char json[1024];
+    int count = (state->lineCount < PARSE_MAX_LINES) ? state->lineCount : PARSE_MAX_LINES;
+    int length;
+
+    if (!live_subscribers())
+        return;
+
+    length = snprintf(json, sizeof(json), "{\"event\":\"telegram\",\"timestamp\":%lu", timestamp);
+    for (int l = 0; (l < count) && (length < (int)sizeof(json)); l++) {
+        if (state->lines[l].field != FIELD_NONE)
+            length += snprintf(json + length, sizeof(json) - length, ",\"%s\":%.3lf", liveFields[state->lines[l].field], state->lines[l].value);
+    }
+    for (int d = 0; (d < derivedChannels.count) && (length < (int)sizeof(json)); d++) {
+        if (!isnan(state->derived[d]))
+            length += snprintf(json + length, sizeof(json) - length, ",\"%s\":%.3lf", derivedChannels.name[d], state->derived[d]);
+    }
+    if (length < (int)sizeof(json) - 1)
+        length += snprintf(json + length, sizeof(json) - length, "}");
+
+    if (length < (int)sizeof(json))
+        live_publish("telegram", json, length);
+}
+
+/*
+ * Publish a closed interval
+ *
+ * Parameters:
+ *   timestamp  - Start of the interval
+ *   *data      - The averaged interval
+ */
+void live_bucket(unsigned long timestamp, elec_data *data) {
+    char json[2048];
+    int length;
+
+    if (!live_subscribers())
+        return;
+
+    length = snprintf(json, sizeof(json), "{\"event\":\"interval\",\"interval\":");
+    length += json_bucket(json + length, sizeof(json) - length, timestamp, 0, data);
+    if (length < (int)sizeof(json) - 1)
+        length += snprintf(json + length, sizeof(json) - length, "}");
+
+    if (length < (int)sizeof(json))
+        live_publish("interval", json, length);
+}
+
+/*
+ * Answer a complete request, with the stream headers or an error
+ */
+void live_request(struct _LIVECLIENT *client) {
+    char path[256];
+    char key[64];
+    char accept[29];
+    unsigned char digest[20];
+    char * header;
+    int websocket = 0;
+
+    if (sscanf(client->request, "GET %255s HTTP/1.%*d", path) != 1) {
+        client->responseLength = snprintf(client->response, sizeof(client->response), "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        send(client->fd, client->response, client->responseLength, MSG_NOSIGNAL | MSG_DONTWAIT);
+        drop_live_client(client, "bad request");
+        return;
+    }
+
+    if ((strcmp(path, "/events") != 0) && (strncmp(path, "/events?", 8) != 0)) {
+        client->responseLength = snprintf(client->response, sizeof(client->response), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        send(client->fd, client->response, client->responseLength, MSG_NOSIGNAL | MSG_DONTWAIT);
+        drop_live_client(client, "not found");
+        return;
+    }
+
+    if (((header = strcasestr(client->request, "\r\nUpgrade:")) != NULL) && (strncasecmp(header + 10 + strspn(header + 10, " "), "websocket", 9) == 0))
+        websocket = 1;
+
+    if (websocket) {
+        if (((header = strcasestr(client->request, "\r\nSec-WebSocket-Key:")) == NULL) || (sscanf(header + 20, " %63[^\r\n ]", key) != 1)) {
+            client->responseLength = snprintf(client->response, sizeof(client->response), "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+            send(client->fd, client->response, client->responseLength, MSG_NOSIGNAL | MSG_DONTWAIT);
+            drop_live_client(client, "no websocket key");
+            return;
+        }
+
+        snprintf(path, sizeof(path), "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", key);
+        live_sha1((const unsigned char *)path, strlen(path), digest);
+        live_base64(digest, sizeof(digest), accept);
+
+        client->responseLength = snprintf(client->response, sizeof(client->response),
+            "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+        client->state = LIVE_WEBSOCKET;
+        client->cursor = liveRings[STREAM_WEBSOCKET].head;
+    }
+    else {
+        client->responseLength = snprintf(client->response, sizeof(client->response),
+            "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nAccess-Control-Allow-Origin: *\r\nConnection: keep-alive\r\n\r\n");
+        client->state = LIVE_SSE;
+        client->cursor = liveRings[STREAM_SSE].head;
+    }
+    client->responseSent = 0;
+
+    flush_live_client(client);
+}
+
+/*
+ * Add the live stream socket and clients to a poll set
+ *
+ * Parameters:
+ *   *pollFds  - First free entry in the poll set
+ *   maxFds    - Number of free entries
+ *
+ * Returns the number of entries used
+ */
+int live_poll_fds(struct pollfd *pollFds, int maxFds) {
+    struct _LIVECLIENT * client;
+    int count = 0;
+
+    if ((liveSocket >= 0) && (count < maxFds)) {
+        pollFds[count].fd = liveSocket;
+        pollFds[count].events = POLLIN;
+        pollFds[count].revents = 0;
+        count++;
+    }
+
+    for (int i = 0; (i < LIVE_MAX_CLIENTS) && (count < maxFds); i++) {
+        client = &liveClients[i];
+        if (client->fd < 0)
+            continue;
+
+        pollFds[count].fd = client->fd;
+        pollFds[count].events = POLLIN;
+        if ((client->state != LIVE_REQUEST) &&
+            ((client->responseSent < client->responseLength) || (client->cursor < liveRings[(client->state == LIVE_WEBSOCKET) ? STREAM_WEBSOCKET : STREAM_SSE].head)))
+            pollFds[count].events |= POLLOUT;
+        pollFds[count].revents = 0;
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * Handle events on the live stream part of a poll set
+ *
+ * Parameters:
+ *   *pollFds  - The live stream entries of the poll set
+ *   numFds    - Number of entries
+ */
+void live_handle(struct pollfd *pollFds, int numFds) {
+    struct _LIVECLIENT * client;
+    char discard[256];
+    int clientFd;
+    int sendBuffer = LIVE_RING_SIZE / 4;
+    int result;
+
+    for (int n = 0; n < numFds; n++) {
+        if (pollFds[n].revents == 0)
+            continue;
+
+        if (pollFds[n].fd == liveSocket) {
+            if ((clientFd = accept4(liveSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+                continue;
+
+            // Keep the backlog of a client in the ring, not in the kernel
+            setsockopt(clientFd, SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer));
+
+            for (int i = 0; i < LIVE_MAX_CLIENTS; i++) {
+                if (liveClients[i].fd < 0) {
+                    liveClients[i].fd = clientFd;
+                    liveClients[i].state = LIVE_REQUEST;
+                    liveClients[i].connected = time(NULL);
+                    liveClients[i].request[0] = '\0';
+                    liveClients[i].requestLength = 0;
+                    liveClients[i].responseLength = 0;
+                    liveClients[i].responseSent = 0;
+                    clientFd = -1;
+                    break;
+                }
+            }
+
+            // No free slot
+            if (clientFd >= 0) {
+                send(clientFd, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", 75, MSG_NOSIGNAL | MSG_DONTWAIT);
+                close(clientFd);
+            }
+
+            continue;
+        }
+
+        client = NULL;
+        for (int i = 0; i < LIVE_MAX_CLIENTS; i++) {
+            if (liveClients[i].fd == pollFds[n].fd) {
+                client = &liveClients[i];
+                break;
+            }
+        }
+        if (client == NULL)
+            continue;
+
+        if (pollFds[n].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (client->state == LIVE_REQUEST) {
+                result = read(client->fd, client->request + client->requestLength, LIVE_REQUEST_SIZE - 1 - client->requestLength);
+                if ((result == 0) || ((result < 0) && (errno != EAGAIN) && (errno != EINTR))) {
+                    drop_live_client(client, "closed by peer");
+                    continue;
+                }
+                if (result > 0) {
+                    client->requestLength += result;
+                    client->request[client->requestLength] = '\0';
+                }
+
+                if (strstr(client->request, "\r\n\r\n") != NULL)
+                    live_request(client);
+                else if (client->requestLength >= LIVE_REQUEST_SIZE - 1)
+                    drop_live_client(client, "request too long");
+                continue;
+            }
+
+            // Only a close frame or a hangup is looked for, pings are not answered
+            result = read(client->fd, discard, sizeof(discard));
+            if ((result == 0) || ((result < 0) && (errno != EAGAIN) && (errno != EINTR)) ||
+                ((result > 0) && (client->state == LIVE_WEBSOCKET) && ((discard[0] & 0x0f) == 0x08))) {
+                drop_live_client(client, "closed by peer");
+                continue;
+            }
+        }
+
+        if ((client->fd >= 0) && (pollFds[n].revents & POLLOUT))
+            flush_live_client(client);
+    }
+}
@@ -0,0 +1,595 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "slimmemeter.h"
+
+/*
+ * A closed bucket waiting for the broker
+ */
+typedef struct {
+    unsigned long   timestamp;
+    elec_data     * data;
+} mqtt_bucket;
+
+/*
+ * Private state of the MQTT sink, the settings are copied so the
+ * configuration can be reloaded while the sink runs
+ */
+typedef struct {
+    char            host[256];
+    char            port[16];
+    char            url[1024];
+    char          * clientId;
+    char          * username;
+    char          * password;
+    char          * liveTopic;
+    char          * bucketTopic;
+    int             qos;
+    int             retain;
+    int             fd;
+    unsigned short  packetId;
+    int             acks;
+    unsigned long   oversized;
+    double          live[LIVE_VALUES];
+    int             changed[LIVE_VALUES];
+    unsigned long   liveTime;
+    mqtt_bucket   * buckets;
+    int             size;
+    int             head;
+    int             count;
+    unsigned char   packet[MQTT_MAX_PACKET];
+} mqtt_sink;
+
+/*
+ * Names and formats of the channels, by FIELD
+ */
+static const struct {
+    const char * name;
+    const char * format;
+} mqttFields[FIELDS] = {
+#define P1_MQTT_COUNTER(name, obis, file, source, label, unit) [FIELD_##name] = { #name, "%.3lf" },
+#define P1_MQTT_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) [FIELD_##name] = { #name, format },
+    P1_COUNTERS(P1_MQTT_COUNTER)
+    P1_GAUGES(P1_MQTT_GAUGE)
+#undef P1_MQTT_COUNTER
+#undef P1_MQTT_GAUGE
+};
+
+/*
+ * Name and format of a live value, the derived channels follow the
+ * FIELDS
+ */
+static const char * mqtt_name(int value) {
+    return (value < FIELDS) ? mqttFields[value].name : derivedChannels.name[value - FIELDS];
+}
+
+static const char * mqtt_format(int value) {
+    return (value < FIELDS) ? mqttFields[value].format : "%.3lf";
+}
+
+/*
+ * Write the remaining length of a packet
+ *
+ * Returns the number of bytes used
+ */
+int mqtt_length(unsigned char *buffer, size_t length) {
+    int used = 0;
+
+    do {
+        buffer[used] = length % 128;
+        length /= 128;
+        if (length > 0)
+            buffer[used] |= 128;
+        used++;
+    } while (length > 0);
+
+    return used;
+}
+
+/*
+ * Write a length prefixed string
+ *
+ * Returns the number of bytes used
+ */
+int mqtt_string(unsigned char *buffer, const char *string, size_t length) {
+    buffer[0] = length >> 8;
+    buffer[1] = length & 0xff;
+    memcpy(buffer + 2, string, length);
+
+    return length + 2;
+}
+
+int mqtt_send(mqtt_sink *mqtt, const unsigned char *data, size_t length) {
+    ssize_t sent;
+
+    while (length > 0) {
+        if ((sent = send(mqtt->fd, data, length, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return E_FILE_ACCESS;
+        }
+        data += sent;
+        length -= sent;
+    }
+
+    return E_OK;
+}
+
+/*
+ * Read one packet from the broker
+ *
+ * Returns the packet type and flags, or -1 on an error or timeout
+ */
+int mqtt_receive(mqtt_sink *mqtt, unsigned char *payload, size_t size, size_t *length) {
+    unsigned char header;
+    unsigned char byte;
+    size_t remaining = 0;
+    size_t received = 0;
+    ssize_t result;
+    int shift = 0;
+
+    // A closed connection reads as a reset
+    errno = ECONNRESET;
+    if (recv(mqtt->fd, &header, 1, MSG_WAITALL) != 1)
+        return -1;
+
+    do {
+        if ((recv(mqtt->fd, &byte, 1, MSG_WAITALL) != 1) || (shift > 21))
+            return -1;
+        remaining |= (size_t)(byte & 127) << shift;
+        shift += 7;
+    } while (byte & 128);
+
+    if (remaining > size)
+        return -1;
+
+    while (received < remaining) {
+        if ((result = recv(mqtt->fd, payload + received, remaining - received, 0)) <= 0)
+            return -1;
+        received += result;
+    }
+    *length = remaining;
+
+    return header;
+}
+
+void mqtt_disconnect(mqtt_sink *mqtt) {
+    if (mqtt->fd < 0)
+        return;
+
+    close(mqtt->fd);
+    mqtt->fd = -1;
+}
+
+/*
+ * Connect to the broker with a clean session and without keep alive,
+ * a dead connection shows up as a failed publish or a missing PUBACK
+ *
+ * The client identifier, username and password come from the
+ * configfile, a CONNECT that does not fit in a packet is refused before
+ * anything is written.
+ *
+ * Returns E_OK, E_FILE_ACCESS or E_CONF_FILE
+ */
+int mqtt_connect(mqtt_sink *mqtt) {
+    unsigned char * packet = mqtt->packet;
+    unsigned char reply[16];
+    size_t replyLength;
+    size_t clientIdLength = strlen(mqtt->clientId);
+    size_t usernameLength = (mqtt->username != NULL) ? strlen(mqtt->username) : 0;
+    size_t passwordLength = (mqtt->password != NULL) ? strlen(mqtt->password) : 0;
+    size_t length = 10 + 2 + clientIdLength + ((mqtt->username != NULL) ? 2 + usernameLength : 0) + ((mqtt->password != NULL) ? 2 + passwordLength : 0);
+    size_t used;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if (length + 5 > sizeof(mqtt->packet)) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - MQTT client identifier, username and password do not fit in %d bytes\n", timeStringBuffer, MQTT_MAX_PACKET);
+        errno = EMSGSIZE;
+        return E_CONF_FILE;
+    }
+
+    if ((mqtt->fd = connect_host(mqtt->host, mqtt->port, SOCK_STREAM, MQTT_TIMEOUT)) < 0)
+        return E_FILE_ACCESS;
+
+    packet[0] = 0x10;
+    used = 1 + mqtt_length(packet + 1, length);
+    used += mqtt_string(packet + used, "MQTT", 4);
+    packet[used++] = 4;
+    packet[used++] = 0x02 | ((mqtt->username != NULL) ? 0x80 : 0) | ((mqtt->password != NULL) ? 0x40 : 0);
+    packet[used++] = 0;
+    packet[used++] = 0;
+    used += mqtt_string(packet + used, mqtt->clientId, clientIdLength);
+    if (mqtt->username != NULL)
+        used += mqtt_string(packet + used, mqtt->username, usernameLength);
+    if (mqtt->password != NULL)
+        used += mqtt_string(packet + used, mqtt->password, passwordLength);
+
+    if ((mqtt_send(mqtt, packet, used) != E_OK) ||
+        (mqtt_receive(mqtt, reply, sizeof(reply), &replyLength) != 0x20) || (replyLength != 2)) {
+        mqtt_disconnect(mqtt);
+        errno = ECONNRESET;
+        return E_FILE_ACCESS;
+    }
+
+    if (reply[1] != 0) {
+        mqtt_disconnect(mqtt);
+        errno = ECONNREFUSED;
+        return E_FILE_ACCESS;
+    }
+
+    mqtt->acks = 0;
+
+    return E_OK;
+}
+
+/*
+ * Publish a message, with QoS 1 the PUBACK is collected by mqtt_wait()
+ *
+ * A message that does not fit in a packet is logged and counted as
+ * dropped, sending it again would not help.
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+int mqtt_publish(mqtt_sink *mqtt, const char *topic, const char *payload, int retain) {
+    unsigned char * packet = mqtt->packet;
+    size_t topicLength = strlen(topic);
+    size_t payloadLength = strlen(payload);
+    size_t length = 2 + topicLength + payloadLength + ((mqtt->qos > 0) ? 2 : 0);
+    size_t used;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if (length + 5 > sizeof(mqtt->packet)) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Message of %zu bytes on %s does not fit in %d bytes, dropped\n", timeStringBuffer, length, topic, MQTT_MAX_PACKET);
+        mqtt->oversized++;
+        return E_OK;
+    }
+
+    packet[0] = 0x30 | (mqtt->qos << 1) | (retain ? 1 : 0);
+    used = 1 + mqtt_length(packet + 1, length);
+    used += mqtt_string(packet + used, topic, topicLength);
+    if (mqtt->qos > 0) {
+        if (++mqtt->packetId == 0)
+            mqtt->packetId = 1;
+        packet[used++] = mqtt->packetId >> 8;
+        packet[used++] = mqtt->packetId & 0xff;
+        mqtt->acks++;
+    }
+    memcpy(packet + used, payload, payloadLength);
+
+    return mqtt_send(mqtt, packet, used + payloadLength);
+}
+
+/*
+ * Wait for the PUBACKs of the messages published so far
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+int mqtt_wait(mqtt_sink *mqtt) {
+    unsigned char reply[MQTT_MAX_PACKET];
+    size_t replyLength;
+    int type;
+
+    while (mqtt->acks > 0) {
+        if ((type = mqtt_receive(mqtt, reply, sizeof(reply), &replyLength)) < 0) {
+            if (errno == EAGAIN)
+                errno = ETIMEDOUT;
+            return E_FILE_ACCESS;
+        }
+
+        if ((type & 0xf0) == 0x40)
+            mqtt->acks--;
+    }
+
+    return E_OK;
+}
+
+/*
+ * Expand a topic template, {channel} is replaced by the name of the
+ * channel
+ */
+void mqtt_topic(char *topic, size_t size, const char *template, const char *channel) {
+    const char * marker = strstr(template, "{channel}");
+
+    if (marker == NULL)
+        snprintf(topic, size, "%s", template);
+    else
+        snprintf(topic, size, "%.*s%s%s", (int)(marker - template), template, channel, marker + 9);
+}
+
+/*
+ * Publish a closed bucket, per channel when the topic has {channel} or
+ * else as one object
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+int mqtt_publish_bucket(mqtt_sink *mqtt, mqtt_bucket *bucket) {
+    const elec_data * data = bucket->data;
+    char topic[512];
+    char payload[2048];
+    int length;
+    int result = E_OK;
+
+    if (strstr(mqtt->bucketTopic, "{channel}") != NULL) {
+#define P1_MQTT_COUNTER(name, obis, file, source, label, unit) \
+        if (result == E_OK) { \
+            mqtt_topic(topic, sizeof(topic), mqtt->bucketTopic, #name); \
+            snprintf(payload, sizeof(payload), "{\"time\":%lu,\"value\":%.3lf}", bucket->timestamp, data->name); \
+            result = mqtt_publish(mqtt, topic, payload, mqtt->retain); \
+        }
+#define P1_MQTT_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) \
+        if (result == E_OK) { \
+            mqtt_topic(topic, sizeof(topic), mqtt->bucketTopic, #name); \
+            snprintf(payload, sizeof(payload), "{\"time\":%lu,\"min\":%.3lf,\"avg\":%.3lf,\"max\":%.3lf}", bucket->timestamp, data->name##_min, data->name##_avg, data->name##_max); \
+            result = mqtt_publish(mqtt, topic, payload, mqtt->retain); \
+        }
+        P1_COUNTERS(P1_MQTT_COUNTER)
+        P1_GAUGES(P1_MQTT_GAUGE)
+#undef P1_MQTT_COUNTER
+#undef P1_MQTT_GAUGE
+
+        for (int d = 0; (d < derivedChannels.count) && (result == E_OK); d++) {
+            if (data->derived_samples[d] == 0)
+                continue;
+
+            mqtt_topic(topic, sizeof(topic), mqtt->bucketTopic, derivedChannels.name[d]);
+            snprintf(payload, sizeof(payload), "{\"time\":%lu,\"min\":%.3lf,\"avg\":%.3lf,\"max\":%.3lf}", bucket->timestamp, data->derived_min[d], data->derived_avg[d], data->derived_max[d]);
+            result = mqtt_publish(mqtt, topic, payload, mqtt->retain);
+        }
+
+        return result;
+    }
+
+    length = snprintf(payload, sizeof(payload), "{\"time\":%lu", bucket->timestamp);
+#define P1_MQTT_COUNTER(name, obis, file, source, label, unit) \
+    length += snprintf(payload + length, sizeof(payload) - length, ",\"" #name "\":%.3lf", data->name);
+#define P1_MQTT_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) \
+    length += snprintf(payload + length, sizeof(payload) - length, ",\"" #name "\":{\"min\":%.3lf,\"avg\":%.3lf,\"max\":%.3lf}", data->name##_min, data->name##_avg, data->name##_max);
+    P1_COUNTERS(P1_MQTT_COUNTER)
+    P1_GAUGES(P1_MQTT_GAUGE)
+#undef P1_MQTT_COUNTER
+#undef P1_MQTT_GAUGE
+    for (int d = 0; d < derivedChannels.count; d++) {
+        if (data->derived_samples[d] > 0)
+            length += snprintf(payload + length, sizeof(payload) - length, ",\"%s\":{\"min\":%.3lf,\"avg\":%.3lf,\"max\":%.3lf}", derivedChannels.name[d], data->derived_min[d], data->derived_avg[d], data->derived_max[d]);
+    }
+    snprintf(payload + length, sizeof(payload) - length, "}");
+
+    return mqtt_publish(mqtt, mqtt->bucketTopic, payload, mqtt->retain);
+}
+
+/*
+ * Publish the live values that changed since the last publish, per
+ * channel when the topic has {channel} or else as one object
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+int mqtt_publish_live(mqtt_sink *mqtt) {
+    char topic[512];
+    char payload[2048];
+    char value[32];
+    int length;
+    int changed = 0;
+
+    for (int f = 1; f < FIELDS + derivedChannels.count; f++)
+        changed |= mqtt->changed[f];
+    if (!changed)
+        return E_OK;
+
+    if (strstr(mqtt->liveTopic, "{channel}") != NULL) {
+        for (int f = 1; f < FIELDS + derivedChannels.count; f++) {
+            if (!mqtt->changed[f])
+                continue;
+
+            mqtt_topic(topic, sizeof(topic), mqtt->liveTopic, mqtt_name(f));
+            snprintf(value, sizeof(value), mqtt_format(f), mqtt->live[f]);
+            if (mqtt_publish(mqtt, topic, value, mqtt->retain) != E_OK)
+                return E_FILE_ACCESS;
+        }
+
+        return E_OK;
+    }
+
+    length = snprintf(payload, sizeof(payload), "{\"time\":%lu", mqtt->liveTime);
+    for (int f = 1; f < FIELDS + derivedChannels.count; f++) {
+        if (isnan(mqtt->live[f]))
+            continue;
+
+        snprintf(value, sizeof(value), mqtt_format(f), mqtt->live[f]);
+        length += snprintf(payload + length, sizeof(payload) - length, ",\"%s\":%s", mqtt_name(f), value);
+    }
+    snprintf(payload + length, sizeof(payload) - length, "}");
+
+    return mqtt_publish(mqtt, mqtt->liveTopic, payload, mqtt->retain);
+}
+
+/*
+ * Publish the buffered buckets, oldest first, and the live values
+ *
+ * A bucket leaves the buffer once the broker has it, what is left is
+ * tried again with the next flush. With QoS 1 a bucket can be published
+ * twice when the connection drops before its PUBACK.
+ */
+int mqtt_sink_flush(p1_sink *sink) {
+    mqtt_sink * mqtt = (mqtt_sink *)sink->data;
+    mqtt_bucket * bucket;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if ((mqtt->fd < 0) && (mqtt_connect(mqtt) != E_OK))
+        goto FAILED;
+
+    while (mqtt->count > 0) {
+        bucket = &mqtt->buckets[mqtt->head];
+
+        if ((mqtt_publish_bucket(mqtt, bucket) != E_OK) || (mqtt_wait(mqtt) != E_OK))
+            goto FAILED;
+
+        free(bucket->data);
+        bucket->data = NULL;
+        mqtt->head = (mqtt->head + 1) % mqtt->size;
+        mqtt->count--;
+    }
+
+    if ((mqtt_publish_live(mqtt) != E_OK) || (mqtt_wait(mqtt) != E_OK))
+        goto FAILED;
+    memset(mqtt->changed, 0, sizeof(mqtt->changed));
+
+    // Messages too large to publish show up with the dropped items
+    if (mqtt->oversized > 0) {
+        pthread_mutex_lock(&sink->lock);
+        sink->dropped += mqtt->oversized;
+        pthread_mutex_unlock(&sink->lock);
+        mqtt->oversized = 0;
+    }
+
+    return E_OK;
+
+FAILED:
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    fprintf(stderr, "%s - Error %i publishing to %s: %s, %d intervals buffered\n", timeStringBuffer, errno, mqtt->url, strerror(errno), mqtt->count);
+    mqtt_disconnect(mqtt);
+
+    return E_FILE_ACCESS;
+}
+
+/*
+ * Take items off the queue, live values are coalesced and buckets are
+ * buffered until the next flush
+ *
+ * A full buffer drops its oldest bucket.
+ */
+int mqtt_sink_write(p1_sink *sink, sink_item *items, int count) {
+    mqtt_sink * mqtt = (mqtt_sink *)sink->data;
+    mqtt_bucket * bucket;
+
+    for (int i = 0; i < count; i++) {
+        if (items[i].type == SINK_LIVE) {
+            for (int f = 1; f < FIELDS + derivedChannels.count; f++) {
+                if (isnan(items[i].values[f]) || (items[i].values[f] == mqtt->live[f]))
+                    continue;
+                mqtt->live[f] = items[i].values[f];
+                mqtt->changed[f] = 1;
+            }
+            mqtt->liveTime = items[i].timestamp;
+            continue;
+        }
+
+        if (mqtt->count == mqtt->size) {
+            free(mqtt->buckets[mqtt->head].data);
+            mqtt->head = (mqtt->head + 1) % mqtt->size;
+            mqtt->count--;
+
+            pthread_mutex_lock(&sink->lock);
+            sink->dropped++;
+            pthread_mutex_unlock(&sink->lock);
+        }
+
+        // The bucket now belongs to the buffer
+        bucket = &mqtt->buckets[(mqtt->head + mqtt->count) % mqtt->size];
+        bucket->timestamp = items[i].timestamp;
+        bucket->data = items[i].data;
+        items[i].data = NULL;
+        mqtt->count++;
+    }
+
+    return count;
+}
+
+void mqtt_sink_close(p1_sink *sink) {
+    mqtt_sink * mqtt = (mqtt_sink *)sink->data;
+
+    if (mqtt == NULL)
+        return;
+
+    mqtt_disconnect(mqtt);
+    for (int i = 0; i < mqtt->count; i++)
+        free(mqtt->buckets[(mqtt->head + i) % mqtt->size].data);
+    free(mqtt->buckets);
+    free(mqtt->clientId);
+    free(mqtt->username);
+    free(mqtt->password);
+    free(mqtt->liveTopic);
+    free(mqtt->bucketTopic);
+    free(mqtt);
+    sink->data = NULL;
+}
+
+/*
+ * Set up the MQTT sink from the configuration
+ *
+ * Returns E_OK, E_CONF_FILE or E_MALLOC
+ */
+int mqtt_sink_init(p1_sink *sink) {
+    struct _CONFIGSTRUCT * config = sink->config;
+    mqtt_sink * mqtt;
+    char scheme[8];
+    char path[256];
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if ((mqtt = (mqtt_sink *)calloc(1, sizeof(mqtt_sink))) == NULL)
+        return E_MALLOC;
+    sink->data = mqtt;
+    mqtt->fd = -1;
+
+    strcpy(mqtt->port, "1883");
+    if ((config->mqttUrl == NULL) || (strlen(config->mqttUrl) >= sizeof(mqtt->url)) ||
+        (split_url(config->mqttUrl, scheme, sizeof(scheme), mqtt->host, sizeof(mqtt->host), mqtt->port, sizeof(mqtt->port), path, sizeof(path)) != E_OK) ||
+        (strcmp(scheme, "mqtt") != 0)) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Invalid mqtt url %s, expected mqtt://host[:port]\n", timeStringBuffer, (config->mqttUrl != NULL) ? config->mqttUrl : "");
+        mqtt_sink_close(sink);
+        return E_CONF_FILE;
+    }
+    strcpy(mqtt->url, config->mqttUrl);
+
+    mqtt->qos = config->mqttQos;
+    mqtt->retain = config->mqttRetain;
+    mqtt->size = config->mqttBuffer;
+    for (int f = 0; f < LIVE_VALUES; f++)
+        mqtt->live[f] = NAN;
+
+    if (((mqtt->clientId = strdup((config->mqttClientId != NULL) ? config->mqttClientId : "slimmemeter")) == NULL) ||
+        ((mqtt->liveTopic = strdup((config->mqttLiveTopic != NULL) ? config->mqttLiveTopic : "p1/live/{channel}")) == NULL) ||
+        ((mqtt->bucketTopic = strdup((config->mqttBucketTopic != NULL) ? config->mqttBucketTopic : "p1/interval")) == NULL) ||
+        ((config->mqttUsername != NULL) && ((mqtt->username = strdup(config->mqttUsername)) == NULL)) ||
+        ((config->mqttPassword != NULL) && ((mqtt->password = strdup(config->mqttPassword)) == NULL)) ||
+        ((mqtt->buckets = (mqtt_bucket *)calloc(mqtt->size, sizeof(mqtt_bucket))) == NULL)) {
+        mqtt_sink_close(sink);
+        return E_MALLOC;
+    }
+
+    sink->accepts |= SINK_LIVE;
+    sink->flushInterval = config->mqttInterval;
+
+    return E_OK;
+}
+
+const sink_type mqttSink = { "mqtt", SINK_BUCKET, mqtt_sink_init, mqtt_sink_write, mqtt_sink_flush, mqtt_sink_close };
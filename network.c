@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+#include "slimmemeter.h"
+
+time_t reconnectTime = 0;
+time_t lastDataTime = 0;
+int reconnectDelay = 1;
+
+/*
+ * Check if a device name refers to a network P1 dongle
+ *
+ * Returns 1 for "tcp://host:port" devices, 0 otherwise
+ */
+int is_tcp_device(const char *device) {
+    return (device != NULL) && (strncmp(device, "tcp://", 6) == 0);
+}
+
+/*
+ * Split "tcp://host:port" in host and port
+ *
+ * IPv6 addresses may be written as "tcp://[::1]:port".
+ *
+ * Returns E_OK or E_CONF_FILE
+ */
+int split_tcp_device(const char *device, char *host, size_t hostSize, char *port, size_t portSize) {
+    const char * hostStart = device + 6;
+    const char * hostEnd;
+    const char * portStart;
+
+    if (*hostStart == '[') {
+        hostStart++;
+        if ((hostEnd = strchr(hostStart, ']')) == NULL)
+            return E_CONF_FILE;
+        portStart = hostEnd + 1;
+    }
+    else {
+        if ((hostEnd = strrchr(hostStart, ':')) == NULL)
+            return E_CONF_FILE;
+        portStart = hostEnd;
+    }
+
+    if ((*portStart != ':') || (portStart[1] == '\0') || (hostEnd == hostStart))
+        return E_CONF_FILE;
+    portStart++;
+
+    if (((size_t)(hostEnd - hostStart) >= hostSize) || (strlen(portStart) >= portSize))
+        return E_CONF_FILE;
+
+    memcpy(host, hostStart, hostEnd - hostStart);
+    host[hostEnd - hostStart] = '\0';
+    strcpy(port, portStart);
+
+    return E_OK;
+}
+
+/*
+ * Connect to a network P1 dongle
+ *
+ * The socket is non-blocking and the connect may still be in progress
+ * when this returns. A failed connect shows up as a read error in the
+ * main loop, which then schedules a reconnect. TCP keepalive is enabled
+ * so a dongle that silently disappears is detected.
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *
+ * Returns the socket or a negative value on error
+ */
+int init_tcp(struct _CONFIGSTRUCT *config) {
+    struct addrinfo hints;
+    struct addrinfo * addresses;
+    struct addrinfo * address;
+    char host[256];
+    char port[16];
+    int localSocket = -1;
+    int option;
+    int result;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    if (split_tcp_device(config->serialPortFilename, host, sizeof(host), port, sizeof(port)) != E_OK) {
+        fprintf(stderr, "%s - Invalid network device %s, expected tcp://host:port\n", timeStringBuffer, config->serialPortFilename);
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((result = getaddrinfo(host, port, &hints, &addresses)) != 0) {
+        fprintf(stderr, "%s - Cannot resolve %s: %s\n", timeStringBuffer, config->serialPortFilename, gai_strerror(result));
+        return -1;
+    }
+
+    for (address = addresses; address != NULL; address = address->ai_next) {
+        if ((localSocket = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol)) < 0)
+            continue;
+
+        option = 1;
+        setsockopt(localSocket, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof(option));
+        option = 10;
+        setsockopt(localSocket, IPPROTO_TCP, TCP_KEEPIDLE, &option, sizeof(option));
+        option = 5;
+        setsockopt(localSocket, IPPROTO_TCP, TCP_KEEPINTVL, &option, sizeof(option));
+        option = 3;
+        setsockopt(localSocket, IPPROTO_TCP, TCP_KEEPCNT, &option, sizeof(option));
+
+        if ((connect(localSocket, address->ai_addr, address->ai_addrlen) == 0) || (errno == EINPROGRESS))
+            break;
+
+        close(localSocket);
+        localSocket = -1;
+    }
+
+    freeaddrinfo(addresses);
+
+    if (localSocket < 0) {
+        fprintf(stderr, "%s - Error %i from connect %s: %s\n", timeStringBuffer, errno, config->serialPortFilename, strerror(errno));
+        return -1;
+    }
+
+    return localSocket;
+}
+
+/*
+ * Drop the connection to a network P1 dongle and schedule a reconnect
+ *
+ * The reconnect delay doubles on every consecutive failure, up to a
+ * minute.
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *   *reason  - Why the connection is dropped, for logging
+ */
+void drop_tcp(struct _CONFIGSTRUCT *config, const char *reason) {
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    if (serialPort >= 0) {
+        close(serialPort);
+        serialPort = -1;
+    }
+
+    fprintf(stderr, "%s - Connection to %s lost (%s), reconnecting in %d seconds\n", timeStringBuffer, config->serialPortFilename, reason, reconnectDelay);
+
+    reconnectTime = msgtime + reconnectDelay;
+    if (reconnectDelay < 60)
+        reconnectDelay *= 2;
+    if (reconnectDelay > 60)
+        reconnectDelay = 60;
+}
+
+/*
+ * Reconnect to a network P1 dongle when the reconnect delay expired
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *
+ * Returns 1 when a new connection was started, 0 otherwise
+ */
+int reconnect_tcp(struct _CONFIGSTRUCT *config) {
+    if ((serialPort >= 0) || (time(NULL) < reconnectTime))
+        return 0;
+
+    if ((serialPort = init_serial(config)) < 0) {
+        drop_tcp(config, "connect failed");
+        return 0;
+    }
+
+    lastDataTime = time(NULL);
+
+    return 1;
+}
+
+/*
+ * Milliseconds the main loop may wait before the network input needs attention
+ *
+ * Returns -1 for a local serial port, which never times out
+ */
+int tcp_poll_timeout(struct _CONFIGSTRUCT *config) {
+    time_t now;
+
+    if (!is_tcp_device(config->serialPortFilename))
+        return -1;
+
+    now = time(NULL);
+
+    if (serialPort < 0)
+        return (reconnectTime > now) ? (reconnectTime - now) * 1000 : 0;
+
+    return 1000;
+}
+
+/*
+ * Open a non-blocking listening socket on "tcp://host:port"
+ *
+ * Parameters:
+ *   *address  - The address to listen on
+ *
+ * Returns the socket or a negative value on error
+ */
+int init_listen_socket(const char *address) {
+    struct addrinfo hints;
+    struct addrinfo * addresses;
+    char host[256];
+    char port[16];
+    int listenSocket;
+    int option = 1;
+    int result;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    if (split_tcp_device(address, host, sizeof(host), port, sizeof(port)) != E_OK) {
+        fprintf(stderr, "%s - Invalid listen address %s, expected tcp://host:port\n", timeStringBuffer, address);
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if ((result = getaddrinfo(host, port, &hints, &addresses)) != 0) {
+        fprintf(stderr, "%s - Cannot resolve %s: %s\n", timeStringBuffer, address, gai_strerror(result));
+        return -1;
+    }
+
+    if ((listenSocket = socket(addresses->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        fprintf(stderr, "%s - Error %i from server socket: %s\n", timeStringBuffer, errno, strerror(errno));
+        freeaddrinfo(addresses);
+        return -1;
+    }
+
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+
+    if ((bind(listenSocket, addresses->ai_addr, addresses->ai_addrlen) != 0) || (listen(listenSocket, 1024) != 0)) {
+        fprintf(stderr, "%s - Error %i from bind %s: %s\n", timeStringBuffer, errno, address, strerror(errno));
+        freeaddrinfo(addresses);
+        close(listenSocket);
+        return -1;
+    }
+
+    freeaddrinfo(addresses);
+
+    return listenSocket;
+}
+
+/*
+ * Split a URL "scheme://host[:port][/path]" in its parts
+ *
+ * An IPv6 host is written in brackets. The port is left unchanged when
+ * the URL has none, so the caller can fill in the default, and the path
+ * is "/" when there is none.
+ *
+ * Returns E_OK, or E_CONF_FILE when the URL is invalid or a part too long
+ */
+int split_url(const char *url, char *scheme, size_t schemeSize, char *host, size_t hostSize, char *port, size_t portSize, char *path, size_t pathSize) {
+    const char * hostStart;
+    const char * hostEnd;
+    const char * pathStart;
+    const char * portStart = NULL;
+
+    if (((hostStart = strstr(url, "://")) == NULL) || ((size_t)(hostStart - url) >= schemeSize))
+        return E_CONF_FILE;
+    memcpy(scheme, url, hostStart - url);
+    scheme[hostStart - url] = '\0';
+    hostStart += 3;
+
+    if ((pathStart = strchr(hostStart, '/')) == NULL)
+        pathStart = hostStart + strlen(hostStart);
+
+    if (*hostStart == '[') {
+        hostStart++;
+        if (((hostEnd = strchr(hostStart, ']')) == NULL) || (hostEnd > pathStart))
+            return E_CONF_FILE;
+        if (hostEnd[1] == ':')
+            portStart = hostEnd + 2;
+        else if (hostEnd + 1 != pathStart)
+            return E_CONF_FILE;
+    }
+    else {
+        hostEnd = pathStart;
+        for (const char * c = hostStart; c < pathStart; c++) {
+            if (*c == ':') {
+                hostEnd = c;
+                portStart = c + 1;
+                break;
+            }
+        }
+    }
+
+    if ((hostEnd == hostStart) || ((size_t)(hostEnd - hostStart) >= hostSize))
+        return E_CONF_FILE;
+    memcpy(host, hostStart, hostEnd - hostStart);
+    host[hostEnd - hostStart] = '\0';
+
+    if (portStart != NULL) {
+        if ((portStart == pathStart) || ((size_t)(pathStart - portStart) >= portSize))
+            return E_CONF_FILE;
+        memcpy(port, portStart, pathStart - portStart);
+        port[pathStart - portStart] = '\0';
+    }
+
+    if (*pathStart == '\0')
+        pathStart = "/";
+    if (strlen(pathStart) >= pathSize)
+        return E_CONF_FILE;
+    strcpy(path, pathStart);
+
+    return E_OK;
+}
+
+/*
+ * Open a blocking connection to a host, with a timeout on the connect and
+ * on every later send and receive
+ *
+ * Parameters:
+ *   *host    - Host name or address
+ *   *port    - Port or service name
+ *   type     - SOCK_STREAM or SOCK_DGRAM
+ *   timeout  - Timeout in seconds
+ *
+ * Returns the socket, or -1 with errno set
+ */
+int connect_host(const char *host, const char *port, int type, int timeout) {
+    struct addrinfo hints;
+    struct addrinfo * addresses;
+    struct addrinfo * address;
+    struct timeval interval;
+    struct pollfd pollFd;
+    socklen_t length;
+    int hostSocket = -1;
+    int error;
+    int flags;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = type;
+
+    if (getaddrinfo(host, port, &hints, &addresses) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    interval.tv_sec = timeout;
+    interval.tv_usec = 0;
+
+    for (address = addresses; address != NULL; address = address->ai_next) {
+        if ((hostSocket = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol)) < 0)
+            continue;
+
+        setsockopt(hostSocket, SOL_SOCKET, SO_SNDTIMEO, &interval, sizeof(interval));
+        setsockopt(hostSocket, SOL_SOCKET, SO_RCVTIMEO, &interval, sizeof(interval));
+
+        // Connect without blocking, so the connect has the timeout as well
+        flags = fcntl(hostSocket, F_GETFL);
+        fcntl(hostSocket, F_SETFL, flags | O_NONBLOCK);
+
+        if (connect(hostSocket, address->ai_addr, address->ai_addrlen) == 0)
+            error = 0;
+        else if (errno != EINPROGRESS)
+            error = errno;
+        else {
+            pollFd.fd = hostSocket;
+            pollFd.events = POLLOUT;
+            length = sizeof(error);
+            if (poll(&pollFd, 1, timeout * 1000) <= 0)
+                error = ETIMEDOUT;
+            else if (getsockopt(hostSocket, SOL_SOCKET, SO_ERROR, &error, &length) != 0)
+                error = errno;
+        }
+
+        if (error == 0) {
+            fcntl(hostSocket, F_SETFL, flags);
+            break;
+        }
+
+        close(hostSocket);
+        hostSocket = -1;
+        errno = error;
+    }
+
+    freeaddrinfo(addresses);
+
+    return hostSocket;
+}
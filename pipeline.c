@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "slimmemeter.h"
+
+/*
+ * Block until *address no longer holds value
+ */
+void futex_wait(unsigned int *address, unsigned int value) {
+    syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+void futex_wake(unsigned int *address) {
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Put an item in a single producer, single consumer queue
+ *
+ * Only the producer writes tail and only the consumer writes head, so no
+ * lock is needed. A side that has to wait sleeps on the counter of the
+ * other side, which wakes it after moving that counter.
+ */
+void pipe_push(pipe_queue *queue, void *item) {
+    unsigned int tail = queue->tail;
+    unsigned int head;
+
+    while (tail - (head = __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST)) >= PIPE_QUEUE_SIZE) {
+        __atomic_store_n(&queue->producerWaiting, 1, __ATOMIC_SEQ_CST);
+        if (tail - __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) >= PIPE_QUEUE_SIZE)
+            futex_wait(&queue->head, head);
+        __atomic_store_n(&queue->producerWaiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+    queue->items[tail % PIPE_QUEUE_SIZE] = item;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&queue->consumerWaiting, __ATOMIC_SEQ_CST))
+        futex_wake(&queue->tail);
+}
+
+/*
+ * Take the oldest item from a single producer, single consumer queue
+ */
+void * pipe_pop(pipe_queue *queue) {
+    unsigned int head = queue->head;
+    unsigned int tail;
+    void * item;
+
+    while ((tail = __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST)) == head) {
+        __atomic_store_n(&queue->consumerWaiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) == head)
+            futex_wait(&queue->tail, tail);
+        __atomic_store_n(&queue->consumerWaiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+    item = queue->items[head % PIPE_QUEUE_SIZE];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&queue->producerWaiting, __ATOMIC_SEQ_CST))
+        futex_wake(&queue->head);
+
+    return item;
+}
+
+/*
+ * Reader stage, fills empty buffers from the input
+ *
+ * A buffer with length 0 marks the end of the input.
+ */
+void * pipeline_reader(void *argument) {
+    p1_pipeline * pipeline = (p1_pipeline *)argument;
+    pipe_buffer * buffer;
+    ssize_t result;
+
+    do {
+        buffer = (pipe_buffer *)pipe_pop(&pipeline->empty);
+
+        while (((result = read(pipeline->fd, buffer->data, PIPE_BUFFER_SIZE)) < 0) && (errno == EINTR))
+            ;
+        if (result < 0)
+            pipeline->error = errno;
+
+        buffer->length = (result > 0) ? result : 0;
+        pipe_push(&pipeline->filled, buffer);
+    } while (buffer->length > 0);
+
+    return NULL;
+}
+
+/*
+ * Framing stage, cuts buffers in CRC checked telegrams
+ *
+ * Telegrams are framed in place in a spare telegram, which goes to the
+ * caller as it is when complete. Buffers go back to the reader as soon as
+ * they are framed. A telegram with end set marks the end of the input.
+ */
+void * pipeline_framer(void *argument) {
+    p1_pipeline * pipeline = (p1_pipeline *)argument;
+    pipe_buffer * buffer;
+    pipe_telegram * telegram;
+
+    telegram = (pipe_telegram *)pipe_pop(&pipeline->spare);
+    init_framer(&telegram->framer);
+
+    while ((buffer = (pipe_buffer *)pipe_pop(&pipeline->filled))->length > 0) {
+        for (int index = 0; index < buffer->length; index++) {
+            switch (p1_frame(&telegram->framer, buffer->data[index])) {
+            case F_OVERRUN:
+            case F_CRC_ERROR:
+                pipeline->crcErrors++;
+                break;
+            case F_TELEGRAM:
+                telegram->end = 0;
+                pipe_push(&pipeline->ready, telegram);
+
+                // The framer is idle after a telegram, a reset one continues
+                telegram = (pipe_telegram *)pipe_pop(&pipeline->spare);
+                init_framer(&telegram->framer);
+                break;
+            }
+        }
+
+        pipe_push(&pipeline->empty, buffer);
+    }
+
+    telegram->end = 1;
+    pipe_push(&pipeline->ready, telegram);
+
+    return NULL;
+}
+
+/*
+ * Start reading, framing and CRC checking a stream on two threads
+ *
+ * The caller is the third stage and takes the telegrams with
+ * next_pipeline_telegram(). Buffers and telegrams circulate between the
+ * stages through the queues, they are allocated once and never copied
+ * between stages.
+ *
+ * Parameters:
+ *   *pipeline  - The pipeline
+ *   fd         - The input, read until end of file
+ *
+ * Returns E_OK or E_MALLOC
+ */
+int start_pipeline(p1_pipeline *pipeline, int fd) {
+    memset(pipeline, 0, sizeof(p1_pipeline));
+    pipeline->fd = fd;
+
+    if (((pipeline->buffers = (pipe_buffer *)malloc(PIPE_BUFFERS * sizeof(pipe_buffer))) == NULL) ||
+        ((pipeline->telegrams = (pipe_telegram *)malloc(PIPE_TELEGRAMS * sizeof(pipe_telegram))) == NULL)) {
+        free(pipeline->buffers);
+        return E_MALLOC;
+    }
+
+    for (int i = 0; i < PIPE_BUFFERS; i++)
+        pipe_push(&pipeline->empty, &pipeline->buffers[i]);
+    for (int i = 0; i < PIPE_TELEGRAMS; i++) {
+        pipeline->telegrams[i].framer.noCrc = 0;
+        pipe_push(&pipeline->spare, &pipeline->telegrams[i]);
+    }
+
+    pthread_create(&pipeline->reader, NULL, pipeline_reader, pipeline);
+    pthread_create(&pipeline->framer, NULL, pipeline_framer, pipeline);
+
+    return E_OK;
+}
+
+/*
+ * Take the next telegram from a pipeline
+ *
+ * Returns the telegram, to be given back with release_pipeline_telegram(),
+ * or NULL at the end of the input
+ */
+pipe_telegram * next_pipeline_telegram(p1_pipeline *pipeline) {
+    pipe_telegram * telegram = (pipe_telegram *)pipe_pop(&pipeline->ready);
+
+    if (telegram->end)
+        return NULL;
+
+    return telegram;
+}
+
+void release_pipeline_telegram(p1_pipeline *pipeline, pipe_telegram *telegram) {
+    pipe_push(&pipeline->spare, telegram);
+}
+
+/*
+ * Wait for the stages to finish and release the pipeline
+ *
+ * Must be called after next_pipeline_telegram() returned NULL.
+ */
+void stop_pipeline(p1_pipeline *pipeline) {
+    pthread_join(pipeline->reader, NULL);
+    pthread_join(pipeline->framer, NULL);
+
+    free(pipeline->buffers);
+    free(pipeline->telegrams);
+    pipeline->buffers = NULL;
+    pipeline->telegrams = NULL;
+}
+
+/*
+ * Archive reader stage, reads and inflates blocks ahead of the caller
+ *
+ * A block with found 0 or -1 marks the end of the archive or a corrupt
+ * block.
+ */
+void * pipeline_block_reader(void *argument) {
+    block_pipeline * pipeline = (block_pipeline *)argument;
+    pipe_block * block;
+    off_t offset = pipeline->offset;
+    int count = 0;
+    int found;
+
+    do {
+        block = (pipe_block *)pipe_pop(&pipeline->empty);
+
+        found = 0;
+        if ((pipeline->blockCount < 0) || (count < pipeline->blockCount))
+            found = read_archive_block(pipeline->dataFd, offset, &block->header, pipeline->compressed, block->block);
+
+        block->found = found;
+        block->offset = offset;
+        if (found > 0) {
+            offset += sizeof(struct _ARCHIVEBLOCK) + block->header.compressedSize;
+            count++;
+        }
+
+        pipe_push(&pipeline->filled, block);
+    } while (found > 0);
+
+    return NULL;
+}
+
+/*
+ * Start reading and inflating the blocks of an archive on a thread
+ *
+ * The caller decodes the blocks it takes with next_pipeline_block() while
+ * the next ones are read.
+ *
+ * Parameters:
+ *   *pipeline   - The pipeline
+ *   dataFd      - The opened telegrams.arc
+ *   offset      - Offset of the first block header
+ *   blockCount  - Number of blocks to read, -1 for all up to the end
+ *
+ * Returns E_OK or E_MALLOC
+ */
+int start_block_pipeline(block_pipeline *pipeline, int dataFd, off_t offset, int blockCount) {
+    memset(pipeline, 0, sizeof(block_pipeline));
+    pipeline->dataFd = dataFd;
+    pipeline->offset = offset;
+    pipeline->blockCount = blockCount;
+    pipeline->found = 1;
+
+    if (((pipeline->blocks = (pipe_block *)malloc(PIPE_BLOCKS * sizeof(pipe_block))) == NULL) ||
+        ((pipeline->compressed = (char *)malloc(compressBound(ARCHIVE_BLOCK_SIZE))) == NULL)) {
+        free(pipeline->blocks);
+        pipeline->blocks = NULL;
+        return E_MALLOC;
+    }
+
+    for (int i = 0; i < PIPE_BLOCKS; i++)
+        pipe_push(&pipeline->empty, &pipeline->blocks[i]);
+
+    pthread_create(&pipeline->reader, NULL, pipeline_block_reader, pipeline);
+
+    return E_OK;
+}
+
+/*
+ * Take the next block from an archive pipeline
+ *
+ * found holds 1 until the end, then 0 for the end of the archive or -1
+ * for a corrupt block, with offset where reading stopped.
+ *
+ * Returns the block, to be given back with release_pipeline_block(), or
+ * NULL at the end
+ */
+pipe_block * next_pipeline_block(block_pipeline *pipeline) {
+    pipe_block * block = (pipe_block *)pipe_pop(&pipeline->filled);
+
+    if (block->found > 0)
+        return block;
+
+    pipeline->found = block->found;
+    pipeline->offset = block->offset;
+    pipe_push(&pipeline->empty, block);
+
+    return NULL;
+}
+
+void release_pipeline_block(block_pipeline *pipeline, pipe_block *block) {
+    pipe_push(&pipeline->empty, block);
+}
+
+/*
+ * Stop an archive pipeline and release it
+ *
+ * The caller may stop before the end, the blocks read ahead are skipped.
+ */
+void stop_block_pipeline(block_pipeline *pipeline) {
+    pipe_block * block;
+
+    if (pipeline->blocks == NULL)
+        return;
+
+    while ((pipeline->found > 0) && ((block = next_pipeline_block(pipeline)) != NULL))
+        release_pipeline_block(pipeline, block);
+
+    pthread_join(pipeline->reader, NULL);
+
+    free(pipeline->blocks);
+    free(pipeline->compressed);
+    pipeline->blocks = NULL;
+    pipeline->compressed = NULL;
+}
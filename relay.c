@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "slimmemeter.h"
+
+#define RELAY_RING_SIZE 65536
+
+/*
+ * A relay subscriber only holds its position in the shared ring. The
+ * position counts all bytes ever published, so a subscriber that falls
+ * more than RELAY_RING_SIZE bytes behind has lost data and is dropped.
+ */
+struct _RELAYCLIENT {
+    int                fd;
+    unsigned long long cursor;
+};
+
+int relayTcpSocket = -1;
+int relayUnixSocket = -1;
+struct _RELAYCLIENT relayClients[RELAY_MAX_CLIENTS];
+char relayRing[RELAY_RING_SIZE];
+unsigned long long relayHead = 0;
+
+/*
+ * Open the relay listening sockets
+ *
+ * Subscribers receive every CRC checked telegram, including its CRC
+ * line, exactly as it came from the meter. Nothing is read from them.
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+int init_relay(struct _CONFIGSTRUCT *config) {
+    struct sockaddr_un address;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    for (int i = 0; i < RELAY_MAX_CLIENTS; i++)
+        relayClients[i].fd = -1;
+
+    if (config->relayListen != NULL) {
+        if ((relayTcpSocket = init_listen_socket(config->relayListen)) < 0)
+            return E_FILE_ACCESS;
+    }
+
+    if (config->relaySocketFilename == NULL)
+        return E_OK;
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    if (strlen(config->relaySocketFilename) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "%s - Relay socket name too long: %s\n", timeStringBuffer, config->relaySocketFilename);
+        return E_FILE_ACCESS;
+    }
+
+    if ((relayUnixSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        fprintf(stderr, "%s - Error %i from relay socket: %s\n", timeStringBuffer, errno, strerror(errno));
+        return E_FILE_ACCESS;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, config->relaySocketFilename);
+
+    // Remove a stale socket from a previous run
+    unlink(config->relaySocketFilename);
+
+    if ((bind(relayUnixSocket, (struct sockaddr *)&address, sizeof(address)) != 0) || (listen(relayUnixSocket, 4) != 0)) {
+        fprintf(stderr, "%s - Error %i from bind relay socket %s: %s\n", timeStringBuffer, errno, config->relaySocketFilename, strerror(errno));
+        close(relayUnixSocket);
+        relayUnixSocket = -1;
+        return E_FILE_ACCESS;
+    }
+
+    chmod(config->relaySocketFilename, 0660);
+
+    return E_OK;
+}
+
+/*
+ * Close the relay sockets and all subscribers
+ */
+void close_relay(struct _CONFIGSTRUCT *config) {
+    for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+        if (relayClients[i].fd >= 0)
+            close(relayClients[i].fd);
+        relayClients[i].fd = -1;
+    }
+
+    if (relayTcpSocket >= 0) {
+        close(relayTcpSocket);
+        relayTcpSocket = -1;
+    }
+
+    if (relayUnixSocket >= 0) {
+        close(relayUnixSocket);
+        relayUnixSocket = -1;
+
+        if (config->relaySocketFilename != NULL)
+            unlink(config->relaySocketFilename);
+    }
+}
+
+/*
+ * Drop a subscriber
+ */
+void drop_relay_client(struct _RELAYCLIENT *client, const char *reason) {
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if (verbose) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        printf("%s - Relay subscriber dropped: %s\n", timeStringBuffer, reason);
+    }
+
+    close(client->fd);
+    client->fd = -1;
+}
+
+/*
+ * Write as much of the ring as a subscriber accepts without blocking
+ */
+void flush_relay_client(struct _RELAYCLIENT *client) {
+    size_t offset;
+    size_t length;
+    ssize_t result;
+
+    while (client->cursor < relayHead) {
+        if (relayHead - client->cursor > RELAY_RING_SIZE) {
+            drop_relay_client(client, "too slow");
+            return;
+        }
+
+        // Write up to the end of the pending data or the wrap of the ring
+        offset = client->cursor % RELAY_RING_SIZE;
+        length = relayHead - client->cursor;
+        if (offset + length > RELAY_RING_SIZE)
+            length = RELAY_RING_SIZE - offset;
+
+        result = send(client->fd, relayRing + offset, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (result < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+                return;
+
+            drop_relay_client(client, strerror(errno));
+            return;
+        }
+
+        client->cursor += result;
+    }
+}
+
+/*
+ * Publish a CRC checked telegram to all subscribers
+ *
+ * The telegram is copied into the ring once and every subscriber is
+ * written to without blocking. A subscriber that cannot keep up is left
+ * behind by the ring and dropped, ingest never waits for it.
+ *
+ * Parameters:
+ *   *framer  - The framer holding the telegram
+ */
+void relay_publish(p1_framer *framer) {
+    char crcLine[8];
+    size_t length;
+    int subscribers = 0;
+    const char * parts[2];
+    size_t sizes[2];
+
+    for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+        if (relayClients[i].fd >= 0)
+            subscribers++;
+    }
+    if (subscribers == 0)
+        return;
+
+    snprintf(crcLine, sizeof(crcLine), "%s\r\n", framer->checksumStr);
+
+    parts[0] = framer->dataBlock;
+    sizes[0] = framer->dataPointer - framer->dataBlock;
+    parts[1] = crcLine;
+    sizes[1] = strlen(crcLine);
+
+    for (int p = 0; p < 2; p++) {
+        for (size_t done = 0; done < sizes[p]; done += length) {
+            length = sizes[p] - done;
+            if ((relayHead % RELAY_RING_SIZE) + length > RELAY_RING_SIZE)
+                length = RELAY_RING_SIZE - (relayHead % RELAY_RING_SIZE);
+
+            memcpy(relayRing + (relayHead % RELAY_RING_SIZE), parts[p] + done, length);
+            relayHead += length;
+        }
+    }
+
+    for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+        if (relayClients[i].fd >= 0)
+            flush_relay_client(&relayClients[i]);
+    }
+}
+
+/*
+ * Add the relay sockets and subscribers to a poll set
+ *
+ * Subscribers are only polled while they have unsent data, or for
+ * hangup detection.
+ *
+ * Parameters:
+ *   *pollFds  - First free entry in the poll set
+ *   maxFds    - Number of free entries
+ *
+ * Returns the number of entries used
+ */
+int relay_poll_fds(struct pollfd *pollFds, int maxFds) {
+    int count = 0;
+
+    if ((relayTcpSocket >= 0) && (count < maxFds)) {
+        pollFds[count].fd = relayTcpSocket;
+        pollFds[count].events = POLLIN;
+        pollFds[count].revents = 0;
+        count++;
+    }
+
+    if ((relayUnixSocket >= 0) && (count < maxFds)) {
+        pollFds[count].fd = relayUnixSocket;
+        pollFds[count].events = POLLIN;
+        pollFds[count].revents = 0;
+        count++;
+    }
+
+    for (int i = 0; (i < RELAY_MAX_CLIENTS) && (count < maxFds); i++) {
+        if (relayClients[i].fd < 0)
+            continue;
+
+        pollFds[count].fd = relayClients[i].fd;
+        pollFds[count].events = POLLIN | ((relayClients[i].cursor < relayHead) ? POLLOUT : 0);
+        pollFds[count].revents = 0;
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * Handle events on the relay part of a poll set
+ *
+ * Parameters:
+ *   *pollFds  - The relay entries of the poll set
+ *   numFds    - Number of entries
+ */
+void relay_handle(struct pollfd *pollFds, int numFds) {
+    struct _RELAYCLIENT * client;
+    char discard[256];
+    int clientFd;
+    int sendBuffer = RELAY_RING_SIZE / 4;
+    int result;
+
+    for (int n = 0; n < numFds; n++) {
+        if (pollFds[n].revents == 0)
+            continue;
+
+        // New subscriber, starts at the next telegram
+        if ((pollFds[n].fd == relayTcpSocket) || (pollFds[n].fd == relayUnixSocket)) {
+            if ((clientFd = accept4(pollFds[n].fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+                continue;
+
+            // Keep the backlog of a subscriber in the ring, not in the kernel
+            setsockopt(clientFd, SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer));
+
+            for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+                if (relayClients[i].fd < 0) {
+                    relayClients[i].fd = clientFd;
+                    relayClients[i].cursor = relayHead;
+                    clientFd = -1;
+                    break;
+                }
+            }
+
+            // No free slot
+            if (clientFd >= 0)
+                close(clientFd);
+
+            continue;
+        }
+
+        client = NULL;
+        for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+            if (relayClients[i].fd == pollFds[n].fd) {
+                client = &relayClients[i];
+                break;
+            }
+        }
+        if (client == NULL)
+            continue;
+
+        // Subscribers have nothing to say, input is only read to see a hangup
+        if (pollFds[n].revents & (POLLIN | POLLHUP | POLLERR)) {
+            result = read(client->fd, discard, sizeof(discard));
+            if ((result == 0) || ((result < 0) && (errno != EAGAIN) && (errno != EINTR))) {
+                drop_relay_client(client, "closed by peer");
+                continue;
+            }
+        }
+
+        if (pollFds[n].revents & POLLOUT)
+            flush_relay_client(client);
+    }
+}
@@ -0,0 +1,975 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "slimmemeter.h"
+
+#define SERVER_MAX_WORKERS 64
+#define SERVER_READ_SIZE 16384
+#define SERVER_HASH_SIZE 4096
+#define SERVER_URING_BUFFERS 256
+#define SERVER_STORE_QUEUE 4096
+
+// io_uring user_data of requests that are not a read on a connection
+#define URING_WAKE    1
+#define URING_TICK    2
+#define URING_CANCEL  3
+#define URING_PROVIDE 4
+
+/*
+ * Aggregation state of one meter, kept across reconnects of its dongle
+ */
+typedef struct _METERSTATE {
+    char                  id[64];
+    int                   attached;
+    int                   ready;
+    int                   store;
+    aggr_state            aggr;
+    bucket_queue          queue;
+    p1_archive            archive;
+    p1_calendar           calendar;
+    struct _CONFIGSTRUCT  files;
+    struct _METERSTATE  * next;
+} meter_state;
+
+/*
+ * One pushed P1 stream, owned by exactly one worker at a time
+ */
+typedef struct _CONNECTION {
+    int                   fd;
+    unsigned long         bytes;
+    char                  peer[INET6_ADDRSTRLEN];
+    meter_state         * meter;
+    p1_framer             framer;
+    struct _WORKER      * moveTo;
+    struct _CONNECTION  * retry;
+    struct _CONNECTION  * next;
+} connection;
+
+struct _WORKER {
+    pthread_t         thread;
+    int               index;
+    int               epollFd;
+    int               wakeFd;
+    pthread_mutex_t   inboxLock;
+    connection      * inbox;
+    connection      * connections;
+    int               connectionCount;
+    unsigned long     load;
+    int               stealRequest;
+    p1_uring          ring;
+    char            * buffers;
+    uint64_t          wakeCounter;
+};
+
+/*
+ * A closed bucket of a meter on its way to the database
+ */
+typedef struct {
+    struct _METERSTATE  * meter;
+    unsigned long         timestamp;
+    elec_data           * data;
+} store_item;
+
+/*
+ * Storage thread, writes the buckets of the meters assigned to it so the
+ * workers never wait for the disk. A meter always uses the same storage
+ * thread, its buckets are written in order.
+ */
+struct _STORE {
+    pthread_t         thread;
+    pthread_mutex_t   lock;
+    pthread_cond_t    wake;
+    store_item        items[SERVER_STORE_QUEUE];
+    int               head;
+    int               count;
+    int               stop;
+};
+
+struct _WORKER serverWorkers[SERVER_MAX_WORKERS];
+struct _STORE serverStores[SERVER_MAX_WORKERS];
+int serverWorkerCount = 0;
+int serverStop = 0;
+struct _CONFIGSTRUCT * serverConfig;
+
+meter_state * meterTable[SERVER_HASH_SIZE];
+pthread_mutex_t meterTableLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Set up the database directory, RRD files, calendar and archive of a
+ * new meter
+ *
+ * Returns E_OK or an error
+ */
+int init_meter(meter_state *meter) {
+    meter->aggr.queue = &meter->queue;
+    init_arrays(&meter->queue);
+
+    // Every meter gets its own database directory
+    if ((meter->files.databaseDirectory = (char *)malloc(strlen(serverConfig->databaseDirectory) + strlen(meter->id) + 2)) == NULL)
+        return E_MALLOC;
+    sprintf(meter->files.databaseDirectory, "%s/%s", serverConfig->databaseDirectory, meter->id);
+    mkdir(meter->files.databaseDirectory, 0755);
+
+    if (init_rrd_database(&meter->files) != E_OK) {
+        free_config(&meter->files);
+        return E_FILE_ACCESS;
+    }
+
+    pthread_mutex_init(&meter->calendar.lock, NULL);
+    init_calendar(&meter->calendar, meter->files.databaseDirectory);
+
+    meter->archive.dataFd = -1;
+    meter->archive.indexFd = -1;
+    if (serverConfig->archive)
+        open_archive(&meter->archive, meter->files.databaseDirectory);
+
+    return E_OK;
+}
+
+meter_state * find_meter(const char *id, unsigned int hash) {
+    meter_state * meter;
+
+    for (meter = meterTable[hash]; meter != NULL; meter = meter->next) {
+        if (strcmp(meter->id, id) == 0)
+            break;
+    }
+
+    return meter;
+}
+
+/*
+ * Find or create the state of a meter and attach a connection to it
+ *
+ * A new meter is created outside the table lock, creating its files
+ * takes long and would stall every other worker meeting a meter. It is
+ * entered in the table attached but not ready first, so a second
+ * connection of the same meter is turned away and lookups skip it until
+ * its files exist.
+ *
+ * Returns the meter, or NULL when it is already attached to another
+ * connection or cannot be initialised
+ */
+meter_state * attach_meter(const char *id) {
+    meter_state * meter;
+    meter_state * created = NULL;
+    meter_state ** link;
+    unsigned int hash = 5381;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    for (const char * p = id; *p; p++)
+        hash = hash * 33 + (unsigned char)*p;
+    hash %= SERVER_HASH_SIZE;
+
+    pthread_mutex_lock(&meterTableLock);
+
+    if ((meter = find_meter(id, hash)) == NULL) {
+        pthread_mutex_unlock(&meterTableLock);
+
+        if ((created = (meter_state *)calloc(1, sizeof(meter_state))) == NULL)
+            return NULL;
+        strcpy(created->id, id);
+        created->store = hash % serverWorkerCount;
+
+        // Another connection of the meter may have come first meanwhile
+        pthread_mutex_lock(&meterTableLock);
+        if ((meter = find_meter(id, hash)) == NULL) {
+            meter = created;
+            meter->next = meterTable[hash];
+            meterTable[hash] = meter;
+        } else {
+            free(created);
+            created = NULL;
+        }
+    }
+
+    if ((meter != created) && meter->attached) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Meter %s is already connected\n", timeStringBuffer, id);
+        pthread_mutex_unlock(&meterTableLock);
+        return NULL;
+    }
+    meter->attached = 1;
+
+    pthread_mutex_unlock(&meterTableLock);
+
+    if (created == NULL)
+        return meter;
+
+    if (init_meter(created) != E_OK) {
+        pthread_mutex_lock(&meterTableLock);
+        for (link = &meterTable[hash]; *link != NULL; link = &(*link)->next) {
+            if (*link == created) {
+                *link = created->next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&meterTableLock);
+
+        free(created);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&meterTableLock);
+    created->ready = 1;
+    pthread_mutex_unlock(&meterTableLock);
+
+    return created;
+}
+
+void detach_meter(meter_state *meter) {
+    pthread_mutex_lock(&meterTableLock);
+    meter->attached = 0;
+    pthread_mutex_unlock(&meterTableLock);
+}
+
+/*
+ * Format the totals of a period of one meter as a JSON object
+ *
+ * Returns the length of the object, or -1 for an unknown meter, an
+ * unknown period or one that is not in its index
+ */
+int json_meter_totals(char *buffer, size_t size, const char *id, const char *period, int offset) {
+    meter_state * meter;
+    unsigned int hash = 5381;
+
+    for (const char * p = id; *p; p++)
+        hash = hash * 33 + (unsigned char)*p;
+    hash %= SERVER_HASH_SIZE;
+
+    // Ready meters are never removed, the lookup only needs the table lock
+    pthread_mutex_lock(&meterTableLock);
+    if (((meter = find_meter(id, hash)) != NULL) && !meter->ready)
+        meter = NULL;
+    pthread_mutex_unlock(&meterTableLock);
+
+    if (meter == NULL)
+        return -1;
+
+    return json_totals(buffer, size, &meter->calendar, period, offset);
+}
+
+/*
+ * Identify the meter sending a telegram
+ *
+ * Uses the equipment identifier (0-0:96.1.1), falling back to the peer
+ * address for meters that do not send one. Only [A-Za-z0-9_-] is kept
+ * so the identifier is safe as a directory name.
+ */
+void meter_id(const char *telegram, const char *peer, char *id, size_t size) {
+    const char * p;
+    size_t length = 0;
+
+    if ((p = strstr(telegram, "0-0:96.1.1(")) != NULL)
+        p += 11;
+    else
+        p = peer;
+
+    for (; *p && (*p != ')') && (length < size - 1); p++) {
+        if (((*p >= 'A') && (*p <= 'Z')) || ((*p >= 'a') && (*p <= 'z')) || ((*p >= '0') && (*p <= '9')) || (*p == '-'))
+            id[length++] = *p;
+        else
+            id[length++] = '_';
+    }
+    id[length] = '\0';
+}
+
+/*
+ * Close a connection, its meter state stays for a reconnect
+ */
+void close_connection(struct _WORKER *worker, connection *conn) {
+    connection ** link;
+
+    if (worker->ring.fd < 0)
+        epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+
+    for (link = &worker->connections; *link != NULL; link = &(*link)->next) {
+        if (*link == conn) {
+            *link = conn->next;
+            break;
+        }
+    }
+    __atomic_sub_fetch(&worker->connectionCount, 1, __ATOMIC_RELAXED);
+
+    if (conn->meter != NULL)
+        detach_meter(conn->meter);
+
+    free(conn);
+}
+
+/*
+ * Hand a connection to a worker
+ */
+void post_connection(struct _WORKER *worker, connection *conn) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&worker->inboxLock);
+    conn->next = worker->inbox;
+    worker->inbox = conn;
+    pthread_mutex_unlock(&worker->inboxLock);
+
+    __atomic_add_fetch(&worker->connectionCount, 1, __ATOMIC_RELAXED);
+
+    if (write(worker->wakeFd, &one, sizeof(one)) != sizeof(one))
+        return;
+}
+
+/*
+ * Hand a closed bucket of a meter to its storage thread, which takes
+ * ownership of the data
+ *
+ * A full queue drops the bucket, the worker never waits for the disk.
+ */
+void store_bucket(meter_state *meter, unsigned long timestamp, elec_data *data) {
+    struct _STORE * store = &serverStores[meter->store];
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    pthread_mutex_lock(&store->lock);
+
+    if (store->count == SERVER_STORE_QUEUE) {
+        pthread_mutex_unlock(&store->lock);
+        free(data);
+        __atomic_add_fetch(&stats.rrdErrors, 1, __ATOMIC_RELAXED);
+
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Storage queue full, dropped the bucket of %lu of meter %s\n", timeStringBuffer, timestamp, meter->id);
+        return;
+    }
+
+    store->items[(store->head + store->count) % SERVER_STORE_QUEUE] = (store_item){ meter, timestamp, data };
+    store->count++;
+
+    pthread_cond_signal(&store->wake);
+    pthread_mutex_unlock(&store->lock);
+}
+
+/*
+ * Thread of a storage queue, writes the RRD files, rollups and calendar
+ * of its meters. A bucket that cannot be written is counted and dropped.
+ * On stop the queue is written first.
+ */
+void * store_thread(void *argument) {
+    struct _STORE * store = (struct _STORE *)argument;
+    store_item item;
+
+    pthread_mutex_lock(&store->lock);
+
+    for (;;) {
+        while ((store->count == 0) && !store->stop)
+            pthread_cond_wait(&store->wake, &store->lock);
+        if (store->count == 0)
+            break;
+
+        item = store->items[store->head];
+        store->head = (store->head + 1) % SERVER_STORE_QUEUE;
+        store->count--;
+        pthread_mutex_unlock(&store->lock);
+
+        if (update_rrd_bucket(&item.meter->files, item.timestamp, item.data) != E_OK) {
+            __atomic_add_fetch(&stats.rrdErrors, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch(&stats.bucketsStored, 1, __ATOMIC_RELAXED);
+
+            // A lost hour or day does not hold up the bucket
+            store_rollups(&item.meter->files, item.meter->queue.rollups, item.timestamp, item.data);
+            calendar_add(&item.meter->calendar, item.timestamp, item.data);
+        }
+        free(item.data);
+
+        pthread_mutex_lock(&store->lock);
+    }
+
+    pthread_mutex_unlock(&store->lock);
+
+    return NULL;
+}
+
+/*
+ * Process the bytes received on a connection
+ *
+ * Returns E_OK, or an error when the connection must be closed
+ */
+int process_connection(connection *conn, char *buffer, int length) {
+    char id[64];
+    bucket_queue * queue;
+    unsigned long timestamp;
+    int result;
+
+    for (int index = 0; index < length; index++) {
+        switch (p1_frame(&conn->framer, buffer[index])) {
+        case F_OVERRUN:
+            __atomic_add_fetch(&stats.overruns, 1, __ATOMIC_RELAXED);
+            break;
+        case F_CRC_ERROR:
+            __atomic_add_fetch(&stats.crcErrors, 1, __ATOMIC_RELAXED);
+            break;
+        case F_TELEGRAM:
+            __atomic_add_fetch(&stats.telegrams, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&stats.lastTelegramTime, time(NULL), __ATOMIC_RELAXED);
+
+            if (conn->meter == NULL) {
+                meter_id(conn->framer.dataBlock, conn->peer, id, sizeof(id));
+                if ((conn->meter = attach_meter(id)) == NULL)
+                    return E_FILE_ACCESS;
+            }
+
+            archive_telegram(&conn->meter->archive, &conn->framer, (unsigned long)time(NULL));
+
+            if ((result = parse_block(&conn->meter->aggr, conn->framer.dataBlock, (unsigned long)time(NULL))) != E_OK)
+                return result;
+
+            // The closed buckets go to the storage thread of the meter
+            queue = &conn->meter->queue;
+            while ((timestamp = queue->timestampArray[queue->readDataCounter]) != 0) {
+                store_bucket(conn->meter, timestamp, queue->elecDataArray[queue->readDataCounter]);
+
+                queue->timestampArray[queue->readDataCounter] = 0;
+                queue->elecDataArray[queue->readDataCounter] = NULL;
+                queue->readDataCounter++;
+                if (queue->readDataCounter >= QUEUE_SIZE)
+                    queue->readDataCounter = 0;
+            }
+            break;
+        }
+    }
+
+    return E_OK;
+}
+
+/*
+ * Balance the load between the workers
+ *
+ * Streams stay pinned to their worker so telegrams are processed in
+ * order. A worker that is mostly idle asks the busiest worker to hand
+ * over one stream; the busiest worker moves it between two batches of
+ * events, so a stream is never processed by two workers at once.
+ */
+void balance_workers(struct _WORKER *worker) {
+    struct _WORKER * busiest = NULL;
+    struct _WORKER * thief;
+    connection * conn;
+    connection * candidate = NULL;
+    connection ** link;
+    unsigned long total = 0;
+    unsigned long load = 0;
+    unsigned long average;
+    unsigned long target;
+    int thiefIndex;
+
+    // Publish the load of the last period
+    for (conn = worker->connections; conn != NULL; conn = conn->next)
+        load += conn->bytes;
+    __atomic_store_n(&worker->load, load, __ATOMIC_RELAXED);
+
+    // Hand over a stream when asked to
+    if ((thiefIndex = __atomic_exchange_n(&worker->stealRequest, 0, __ATOMIC_ACQ_REL)) > 0) {
+        thief = &serverWorkers[thiefIndex - 1];
+        target = load / 2;
+        if (__atomic_load_n(&thief->load, __ATOMIC_RELAXED) < load)
+            target = (load - __atomic_load_n(&thief->load, __ATOMIC_RELAXED)) / 2;
+
+        for (conn = worker->connections; conn != NULL; conn = conn->next) {
+            if ((conn->bytes <= target) && ((candidate == NULL) || (conn->bytes > candidate->bytes)))
+                candidate = conn;
+        }
+
+        if ((candidate != NULL) && (worker->connectionCount > 1)) {
+            for (link = &worker->connections; *link != NULL; link = &(*link)->next) {
+                if (*link == candidate) {
+                    *link = candidate->next;
+                    break;
+                }
+            }
+            __atomic_sub_fetch(&worker->connectionCount, 1, __ATOMIC_RELAXED);
+
+            if (worker->ring.fd >= 0) {
+                // Handed over when its posted read completes or is cancelled
+                struct io_uring_sqe * sqe = uring_sqe(&worker->ring);
+
+                candidate->moveTo = thief;
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = (uint64_t)(uintptr_t)candidate;
+                sqe->user_data = URING_CANCEL;
+            }
+            else {
+                epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, candidate->fd, NULL);
+                post_connection(thief, candidate);
+            }
+        }
+    }
+
+    for (conn = worker->connections; conn != NULL; conn = conn->next)
+        conn->bytes = 0;
+
+    // Ask the busiest worker for work when idle
+    for (int i = 0; i < serverWorkerCount; i++) {
+        unsigned long workerLoad = __atomic_load_n(&serverWorkers[i].load, __ATOMIC_RELAXED);
+
+        total += workerLoad;
+        if ((busiest == NULL) || (workerLoad > __atomic_load_n(&busiest->load, __ATOMIC_RELAXED)))
+            busiest = &serverWorkers[i];
+    }
+    average = total / serverWorkerCount;
+
+    if ((busiest != NULL) && (busiest != worker) && (load < average / 2) && (__atomic_load_n(&busiest->load, __ATOMIC_RELAXED) > average * 2) && (__atomic_load_n(&busiest->connectionCount, __ATOMIC_RELAXED) > 1)) {
+        int expected = 0;
+        __atomic_compare_exchange_n(&busiest->stealRequest, &expected, worker->index + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Post a read on a connection, into a buffer the kernel picks from the pool
+ */
+void uring_post_read(struct _WORKER *worker, connection *conn) {
+    struct io_uring_sqe * sqe = uring_sqe(&worker->ring);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->len = SERVER_READ_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (uint64_t)(uintptr_t)conn;
+}
+
+/*
+ * Give pool buffers back to the kernel
+ */
+void uring_provide(struct _WORKER *worker, int first, int count) {
+    struct io_uring_sqe * sqe = uring_sqe(&worker->ring);
+
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uint64_t)(uintptr_t)(worker->buffers + (size_t)first * SERVER_READ_SIZE);
+    sqe->len = SERVER_READ_SIZE;
+    sqe->off = first;
+    sqe->buf_group = 0;
+    sqe->user_data = URING_PROVIDE;
+}
+
+void uring_post_wake(struct _WORKER *worker) {
+    struct io_uring_sqe * sqe = uring_sqe(&worker->ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = worker->wakeFd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_WAKE;
+}
+
+void uring_post_tick(struct _WORKER *worker) {
+    static struct __kernel_timespec second = { 1, 0 };
+    struct io_uring_sqe * sqe = uring_sqe(&worker->ring);
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&second;
+    sqe->len = 1;
+    sqe->user_data = URING_TICK;
+}
+
+/*
+ * Set up the io_uring backend of a worker
+ *
+ * A read stays posted on every stream. The kernel fills a buffer from a
+ * pool shared by all streams of the worker, so memory does not grow
+ * with the number of streams. Completions are handled in batches and
+ * all new requests of a batch go to the kernel in one system call.
+ *
+ * Returns E_OK, or an error when the kernel lacks the needed features
+ */
+int init_worker_uring(struct _WORKER *worker) {
+    struct io_uring_cqe cqe;
+
+    if (init_uring(&worker->ring, 256) != E_OK)
+        return E_FILE_ACCESS;
+
+    if ((worker->buffers = (char *)malloc((size_t)SERVER_URING_BUFFERS * SERVER_READ_SIZE)) == NULL) {
+        close_uring(&worker->ring);
+        return E_MALLOC;
+    }
+
+    // Buffer selection needs 5.7, check before relying on it
+    uring_provide(worker, 0, SERVER_URING_BUFFERS);
+    if ((uring_submit(&worker->ring, 1) < 0) || (uring_cqe(&worker->ring, &cqe) == 0) || (cqe.res < 0)) {
+        close_uring(&worker->ring);
+        free(worker->buffers);
+        worker->buffers = NULL;
+        return E_FILE_ACCESS;
+    }
+
+    uring_post_wake(worker);
+    uring_post_tick(worker);
+
+    return E_OK;
+}
+
+/*
+ * Worker loop on io_uring
+ */
+void uring_worker(struct _WORKER *worker) {
+    struct io_uring_cqe cqe;
+    connection * conn;
+    connection * inbox;
+    connection * retry = NULL;
+    int buffer;
+
+    while (__atomic_load_n(&serverStop, __ATOMIC_RELAXED) == 0) {
+        if (uring_submit(&worker->ring, 1) < 0)
+            break;
+
+        while (uring_cqe(&worker->ring, &cqe)) {
+            switch (cqe.user_data) {
+            case URING_WAKE:
+                // New streams from the acceptor or another worker
+                read(worker->wakeFd, &worker->wakeCounter, sizeof(worker->wakeCounter));
+                pthread_mutex_lock(&worker->inboxLock);
+                inbox = worker->inbox;
+                worker->inbox = NULL;
+                pthread_mutex_unlock(&worker->inboxLock);
+
+                while ((conn = inbox) != NULL) {
+                    inbox = conn->next;
+                    conn->next = worker->connections;
+                    conn->moveTo = NULL;
+                    worker->connections = conn;
+                    uring_post_read(worker, conn);
+                }
+                uring_post_wake(worker);
+                continue;
+            case URING_TICK:
+                balance_workers(worker);
+                uring_post_tick(worker);
+                continue;
+            case URING_CANCEL:
+            case URING_PROVIDE:
+                continue;
+            }
+
+            conn = (connection *)(uintptr_t)cqe.user_data;
+
+            if (cqe.res > 0) {
+                buffer = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                if (process_connection(conn, worker->buffers + (size_t)buffer * SERVER_READ_SIZE, cqe.res) != E_OK)
+                    cqe.res = 0;
+                else
+                    conn->bytes += cqe.res;
+                uring_provide(worker, buffer, 1);
+            }
+
+            // Pool exhausted, post again once this batch returned buffers
+            if ((cqe.res == -ENOBUFS) && (conn->moveTo == NULL)) {
+                conn->retry = retry;
+                retry = conn;
+                continue;
+            }
+
+            // Moving to another worker, no read is posted here any more
+            if (conn->moveTo != NULL) {
+                post_connection(conn->moveTo, conn);
+                continue;
+            }
+
+            if (cqe.res <= 0) {
+                close_connection(worker, conn);
+                continue;
+            }
+
+            uring_post_read(worker, conn);
+        }
+
+        while ((conn = retry) != NULL) {
+            retry = conn->retry;
+            uring_post_read(worker, conn);
+        }
+    }
+}
+
+void * worker_thread(void *argument) {
+    struct _WORKER * worker = (struct _WORKER *)argument;
+    struct epoll_event events[64];
+    struct epoll_event event;
+    connection * conn;
+    connection * inbox;
+    char buffer[SERVER_READ_SIZE];
+    uint64_t counter;
+    time_t lastBalance = time(NULL);
+    int count;
+    int result;
+
+    if (worker->ring.fd >= 0) {
+        uring_worker(worker);
+
+        while ((conn = worker->connections) != NULL)
+            close_connection(worker, conn);
+
+        return NULL;
+    }
+
+    while (__atomic_load_n(&serverStop, __ATOMIC_RELAXED) == 0) {
+        count = epoll_wait(worker->epollFd, events, 64, 1000);
+
+        for (int i = 0; i < count; i++) {
+            // New streams from the acceptor or another worker
+            if (events[i].data.ptr == NULL) {
+                if (read(worker->wakeFd, &counter, sizeof(counter)) < 0)
+                    continue;
+
+                pthread_mutex_lock(&worker->inboxLock);
+                inbox = worker->inbox;
+                worker->inbox = NULL;
+                pthread_mutex_unlock(&worker->inboxLock);
+
+                while ((conn = inbox) != NULL) {
+                    inbox = conn->next;
+                    conn->next = worker->connections;
+                    worker->connections = conn;
+
+                    event.events = EPOLLIN | EPOLLRDHUP;
+                    event.data.ptr = conn;
+                    epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, conn->fd, &event);
+                }
+                continue;
+            }
+
+            conn = (connection *)events[i].data.ptr;
+
+            // Bounded reads keep one chatty stream from starving the others
+            result = read(conn->fd, buffer, SERVER_READ_SIZE);
+            if ((result < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+                continue;
+            if ((result <= 0) || (process_connection(conn, buffer, result) != E_OK)) {
+                close_connection(worker, conn);
+                continue;
+            }
+
+            conn->bytes += result;
+        }
+
+        if (time(NULL) != lastBalance) {
+            lastBalance = time(NULL);
+            balance_workers(worker);
+        }
+    }
+
+    while ((conn = worker->connections) != NULL)
+        close_connection(worker, conn);
+
+    return NULL;
+}
+
+/*
+ * Accept all pending streams and pin each to the least loaded worker
+ */
+void accept_connections(int listenSocket) {
+    struct sockaddr_storage address;
+    socklen_t addressLength;
+    connection * conn;
+    struct _WORKER * worker;
+    int fd;
+    int option = 1;
+
+    while (1) {
+        addressLength = sizeof(address);
+        if ((fd = accept4(listenSocket, (struct sockaddr *)&address, &addressLength, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+            return;
+
+        if ((conn = (connection *)calloc(1, sizeof(connection))) == NULL) {
+            close(fd);
+            continue;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof(option));
+
+        conn->fd = fd;
+        init_framer(&conn->framer);
+
+        if (address.ss_family == AF_INET6)
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&address)->sin6_addr, conn->peer, sizeof(conn->peer));
+        else
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&address)->sin_addr, conn->peer, sizeof(conn->peer));
+
+        worker = &serverWorkers[0];
+        for (int i = 1; i < serverWorkerCount; i++) {
+            if (__atomic_load_n(&serverWorkers[i].connectionCount, __ATOMIC_RELAXED) < __atomic_load_n(&worker->connectionCount, __ATOMIC_RELAXED))
+                worker = &serverWorkers[i];
+        }
+
+        post_connection(worker, conn);
+    }
+}
+
+/*
+ * Run as a concentrator for pushed P1 streams
+ *
+ * The main thread accepts connections and serves signals and the control
+ * socket, server-workers threads frame and parse the streams and as many
+ * storage threads write the closed buckets, so the file writes never
+ * hold up the reads of an io_uring or epoll worker.
+ * Every meter, identified by its equipment identifier, gets its own
+ * database directory below db-directory.
+ *
+ * Parameters:
+ *   *config   - Pointer to the configuration
+ *   signalFd  - The signalfd of the process
+ *
+ * Returns E_OK or an error code
+ */
+int run_server(struct _CONFIGSTRUCT *config, int signalFd) {
+    struct pollfd pollFds[2 + CONTROL_MAX_CLIENTS + 1];
+    struct signalfd_siginfo sigInfo;
+    struct epoll_event event;
+    struct rlimit limit;
+    int listenSocket;
+    int pollCount;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    serverConfig = config;
+
+    // Thousands of streams need thousands of descriptors
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if ((listenSocket = init_listen_socket(config->serverListen)) < 0)
+        return E_SERIAL_PORT;
+
+    serverWorkerCount = config->serverWorkers;
+    if (serverWorkerCount <= 0)
+        serverWorkerCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (serverWorkerCount > SERVER_MAX_WORKERS)
+        serverWorkerCount = SERVER_MAX_WORKERS;
+    if (serverWorkerCount < 1)
+        serverWorkerCount = 1;
+
+    for (int i = 0; i < serverWorkerCount; i++) {
+        memset(&serverWorkers[i], 0, sizeof(struct _WORKER));
+        serverWorkers[i].index = i;
+        serverWorkers[i].epollFd = epoll_create1(EPOLL_CLOEXEC);
+        serverWorkers[i].wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        serverWorkers[i].ring.fd = -1;
+        pthread_mutex_init(&serverWorkers[i].inboxLock, NULL);
+
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(serverWorkers[i].epollFd, EPOLL_CTL_ADD, serverWorkers[i].wakeFd, &event);
+    }
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    // Streams move between workers, so all workers use the same backend
+    if (config->serverIo != SERVER_IO_EPOLL) {
+        for (int i = 0; i < serverWorkerCount; i++) {
+            if (init_worker_uring(&serverWorkers[i]) == E_OK)
+                continue;
+
+            for (int j = 0; j < i; j++) {
+                close_uring(&serverWorkers[j].ring);
+                free(serverWorkers[j].buffers);
+                serverWorkers[j].buffers = NULL;
+            }
+
+            if (config->serverIo == SERVER_IO_URING)
+                fprintf(stderr, "%s - io_uring not available, using epoll\n", timeStringBuffer);
+            break;
+        }
+    }
+
+    for (int i = 0; i < serverWorkerCount; i++) {
+        memset(&serverStores[i], 0, sizeof(struct _STORE));
+        pthread_mutex_init(&serverStores[i].lock, NULL);
+        pthread_cond_init(&serverStores[i].wake, NULL);
+        pthread_create(&serverStores[i].thread, NULL, store_thread, &serverStores[i]);
+    }
+
+    for (int i = 0; i < serverWorkerCount; i++)
+        pthread_create(&serverWorkers[i].thread, NULL, worker_thread, &serverWorkers[i]);
+
+    printf("%s - Concentrator listening on %s with %d workers on %s\n", timeStringBuffer, config->serverListen, serverWorkerCount,
+           (serverWorkers[0].ring.fd >= 0) ? "io_uring" : "epoll");
+    fflush(stdout);
+
+    pollFds[0].fd = listenSocket;
+    pollFds[0].events = POLLIN;
+    pollFds[1].fd = signalFd;
+    pollFds[1].events = POLLIN;
+
+    while (terminate == 0) {
+        pollCount = 2 + control_poll_fds(&pollFds[2], CONTROL_MAX_CLIENTS + 1);
+
+        if (poll(pollFds, pollCount, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (pollFds[1].revents & POLLIN) {
+            if (read(signalFd, &sigInfo, sizeof(sigInfo)) == sizeof(sigInfo))
+                handle_signal(sigInfo.ssi_signo, config, NULL, 0, NULL);
+        }
+
+        if (pollFds[0].revents & POLLIN)
+            accept_connections(listenSocket);
+
+        control_handle(&pollFds[2], pollCount - 2, config);
+    }
+
+    __atomic_store_n(&serverStop, 1, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < serverWorkerCount; i++) {
+        pthread_join(serverWorkers[i].thread, NULL);
+        close_uring(&serverWorkers[i].ring);
+        free(serverWorkers[i].buffers);
+        close(serverWorkers[i].epollFd);
+        close(serverWorkers[i].wakeFd);
+    }
+
+    // Write what is still queued
+    for (int i = 0; i < serverWorkerCount; i++) {
+        pthread_mutex_lock(&serverStores[i].lock);
+        serverStores[i].stop = 1;
+        pthread_cond_signal(&serverStores[i].wake);
+        pthread_mutex_unlock(&serverStores[i].lock);
+        pthread_join(serverStores[i].thread, NULL);
+    }
+
+    // Write the open archive blocks
+    for (int i = 0; i < SERVER_HASH_SIZE; i++) {
+        for (meter_state * meter = meterTable[i]; meter != NULL; meter = meter->next) {
+            if (meter->ready)
+                close_archive(&meter->archive);
+        }
+    }
+
+    close(listenSocket);
+
+    return E_OK;
+}
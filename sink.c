@@ -0,0 +1,595 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "slimmemeter.h"
+
+p1_sink sinks[SINK_TYPES];
+
+/*
+ * RRD sink, the databases in the database directory
+ *
+ * The open hour and day percentiles are kept by the sink. After every
+ * bucket they are copied to bucketQueue.rollups, where the checkpoint
+ * picks them up.
+ */
+int rrd_sink_init(p1_sink *sink) {
+    if ((sink->data = malloc(sizeof(bucketQueue.rollups))) == NULL)
+        return E_MALLOC;
+
+    // Continue the hour and day restored from the state file
+    memcpy(sink->data, bucketQueue.rollups, sizeof(bucketQueue.rollups));
+
+    return E_OK;
+}
+
+int rrd_sink_write(p1_sink *sink, sink_item *items, int count) {
+    sketch_rollup * rollups = (sketch_rollup *)sink->data;
+    int written;
+
+    for (written = 0; written < count; written++) {
+        if (update_rrd_bucket(sink->config, items[written].timestamp, items[written].data) != E_OK) {
+            __atomic_add_fetch(&stats.rrdErrors, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        __atomic_add_fetch(&stats.bucketsStored, 1, __ATOMIC_RELAXED);
+        history_add(items[written].timestamp, items[written].data);
+        calendar_add(&calendar, items[written].timestamp, items[written].data);
+        graph_update(items[written].timestamp);
+
+        // A lost hour or day does not hold up the bucket
+        store_rollups(sink->config, rollups, items[written].timestamp, items[written].data);
+        sink_snapshot(sink, bucketQueue.rollups, rollups, sizeof(bucketQueue.rollups));
+    }
+
+    sync_staging_due(sink->config);
+
+    return written;
+}
+
+void rrd_sink_close(p1_sink *sink) {
+    free(sink->data);
+    sink->data = NULL;
+}
+
+static const sink_type rrdSink = { "rrd", SINK_BUCKET, rrd_sink_init, rrd_sink_write, NULL, rrd_sink_close };
+
+static const sink_type * sinkTypes[SINK_TYPES] = {
+    &rrdSink,
+    &influxSink,
+    &mqttSink
+};
+
+/*
+ * Find the sink of a configuration key "<sink>-<setting>"
+ *
+ * Returns the sink type, or -1 when the key does not belong to a sink
+ */
+int find_sink_key(const char *key, const char **setting) {
+    size_t length;
+
+    for (int t = 0; t < SINK_TYPES; t++) {
+        length = strlen(sinkTypes[t]->name);
+        if ((strncmp(key, sinkTypes[t]->name, length) == 0) && (key[length] == '-')) {
+            *setting = &key[length + 1];
+            return t;
+        }
+    }
+
+    return -1;
+}
+
+void init_sink_settings(sink_settings *settings) {
+    for (int t = 0; t < SINK_TYPES; t++) {
+        settings[t].enabled = 0;
+        settings[t].queueSize = 256;
+        settings[t].retries = 9;
+        settings[t].whenFull = SINK_DROP_OLDEST;
+    }
+
+    // The databases are always written, unless switched off
+    settings[SINK_RRD].enabled = 1;
+}
+
+void free_sink_item(sink_item *item) {
+    free(item->data);
+    free(item->telegram);
+    free(item->values);
+    item->data = NULL;
+    item->telegram = NULL;
+    item->values = NULL;
+}
+
+/*
+ * Put an item on the queue of a sink, the queue takes ownership
+ *
+ * A full queue drops its oldest or the new item, as configured, it never
+ * waits for the sink.
+ */
+void sink_push(p1_sink *sink, sink_item *item) {
+    pthread_mutex_lock(&sink->lock);
+
+    if (sink->count == sink->size) {
+        sink->dropped++;
+
+        if (sink->whenFull == SINK_DROP_NEWEST) {
+            pthread_mutex_unlock(&sink->lock);
+            free_sink_item(item);
+            return;
+        }
+
+        free_sink_item(&sink->items[sink->head]);
+        sink->head = (sink->head + 1) % sink->size;
+        sink->count--;
+    }
+
+    sink->items[(sink->head + sink->count) % sink->size] = *item;
+    sink->count++;
+    sink->queued++;
+
+    pthread_cond_signal(&sink->wake);
+    pthread_mutex_unlock(&sink->lock);
+}
+
+/*
+ * Delay before the next attempt after a number of failed attempts
+ */
+int sink_backoff(int attempts) {
+    if (attempts >= 7)
+        return SINK_MAX_BACKOFF;
+
+    return ((1 << (attempts - 1)) < SINK_MAX_BACKOFF) ? (1 << (attempts - 1)) : SINK_MAX_BACKOFF;
+}
+
+/*
+ * Flush the buffer of a sink, called on its thread with the lock held
+ */
+void flush_sink(p1_sink *sink) {
+    int result;
+
+    pthread_mutex_unlock(&sink->lock);
+    pthread_mutex_lock(&sink->busy);
+    result = sink->type->flush(sink);
+    pthread_mutex_unlock(&sink->busy);
+    pthread_mutex_lock(&sink->lock);
+
+    if (result == E_OK) {
+        sink->dirty = 0;
+        sink->flushFailures = 0;
+        return;
+    }
+
+    sink->errors++;
+    sink->lastError = time(NULL);
+    sink->flushAt = time(NULL) + sink_backoff(++sink->flushFailures);
+}
+
+/*
+ * Thread of a sink, writes the queue in batches
+ *
+ * A batch is taken off the queue while it is written, it still counts as
+ * pending for the checkpoint. The item that failed is retried with a
+ * growing delay, up to the configured number of retries, and then
+ * dropped. On stop the queue is written and flushed once more, what is
+ * left is kept for the checkpoint.
+ */
+void * sink_thread(void *argument) {
+    p1_sink * sink = (p1_sink *)argument;
+    int attempts = 0;
+    int written;
+    struct timespec until;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    pthread_mutex_lock(&sink->lock);
+
+    for (;;) {
+        if (sink->batchFirst == sink->batchCount) {
+            for (;;) {
+                // Without an interval the buffer is flushed when the queue runs empty
+                if (sink->dirty && (sink->stop || ((time(NULL) >= sink->flushAt) && ((sink->flushInterval > 0) || (sink->count == 0))))) {
+                    flush_sink(sink);
+                    if (sink->stop)
+                        sink->dirty = 0;
+                    continue;
+                }
+
+                if ((sink->count > 0) || sink->stop)
+                    break;
+
+                if (sink->dirty) {
+                    until.tv_sec = sink->flushAt;
+                    until.tv_nsec = 0;
+                    pthread_cond_timedwait(&sink->wake, &sink->lock, &until);
+                }
+                else
+                    pthread_cond_wait(&sink->wake, &sink->lock);
+            }
+            if (sink->count == 0)
+                break;
+
+            for (sink->batchFirst = 0, sink->batchCount = 0; (sink->batchCount < SINK_BATCH) && (sink->count > 0); sink->batchCount++) {
+                sink->batch[sink->batchCount] = sink->items[sink->head];
+                sink->head = (sink->head + 1) % sink->size;
+                sink->count--;
+            }
+        }
+        pthread_mutex_unlock(&sink->lock);
+
+        // Only this thread changes the batch, it is read without the lock
+        pthread_mutex_lock(&sink->busy);
+        written = sink->type->write(sink, &sink->batch[sink->batchFirst], sink->batchCount - sink->batchFirst);
+        pthread_mutex_unlock(&sink->busy);
+
+        pthread_mutex_lock(&sink->lock);
+        for (int i = 0; i < written; i++)
+            free_sink_item(&sink->batch[sink->batchFirst++]);
+        sink->written += written;
+
+        if ((written > 0) && (sink->type->flush != NULL) && !sink->dirty) {
+            sink->dirty = 1;
+            sink->flushAt = time(NULL) + sink->flushInterval;
+        }
+
+        if (sink->batchFirst == sink->batchCount) {
+            attempts = 0;
+            continue;
+        }
+
+        sink->errors++;
+        sink->lastError = time(NULL);
+
+        if (++attempts > sink->retries) {
+            msgtime = time(NULL);
+            tm_info = localtime(&msgtime);
+            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+            fprintf(stderr, "%s - Sink %s dropped the item of %lu after %d attempts\n", timeStringBuffer, sink->type->name, sink->batch[sink->batchFirst].timestamp, attempts);
+            free_sink_item(&sink->batch[sink->batchFirst++]);
+            sink->dropped++;
+            attempts = 0;
+            continue;
+        }
+
+        if (sink->stop)
+            break;
+
+        sink->retried++;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += sink_backoff(attempts);
+
+        // A flush or stop retries right away
+        sink->wakeUp = 0;
+        while (!sink->stop && !sink->wakeUp && (pthread_cond_timedwait(&sink->wake, &sink->lock, &until) != ETIMEDOUT))
+            ;
+    }
+
+    pthread_mutex_unlock(&sink->lock);
+
+    return NULL;
+}
+
+/*
+ * Start the enabled sinks
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration, used by the sinks
+ *
+ * Returns E_OK, E_MALLOC or the error of a sink
+ */
+int start_sinks(struct _CONFIGSTRUCT *config) {
+    p1_sink * sink;
+    int result;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    for (int t = 0; t < SINK_TYPES; t++) {
+        if (!config->sinks[t].enabled)
+            continue;
+
+        sink = &sinks[t];
+        memset(sink, 0, sizeof(p1_sink));
+        sink->config = config;
+        sink->size = config->sinks[t].queueSize;
+        sink->retries = config->sinks[t].retries;
+        sink->whenFull = config->sinks[t].whenFull;
+        sink->accepts = sinkTypes[t]->accepts;
+
+        if ((sink->items = (sink_item *)calloc(sink->size, sizeof(sink_item))) == NULL) {
+            msgtime = time(NULL);
+            tm_info = localtime(&msgtime);
+            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+            fprintf(stderr, "%s - Error, could not allocate %lu bytes of memory!", timeStringBuffer, sink->size * sizeof(sink_item));
+            return E_MALLOC;
+        }
+
+        if ((result = sinkTypes[t]->init(sink)) != E_OK) {
+            msgtime = time(NULL);
+            tm_info = localtime(&msgtime);
+            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+            fprintf(stderr, "%s - Error %d starting sink %s\n", timeStringBuffer, result, sinkTypes[t]->name);
+            free(sink->items);
+            sink->items = NULL;
+            return result;
+        }
+
+        pthread_mutex_init(&sink->lock, NULL);
+        pthread_mutex_init(&sink->busy, NULL);
+        pthread_cond_init(&sink->wake, NULL);
+        sink->type = sinkTypes[t];
+
+        pthread_create(&sink->thread, NULL, sink_thread, sink);
+    }
+
+    return E_OK;
+}
+
+/*
+ * Hand a closed bucket to one sink, when it takes buckets
+ */
+void sink_bucket_to(p1_sink *sink, unsigned long timestamp, const elec_data *data) {
+    sink_item item;
+
+    if ((sink->type == NULL) || !(sink->accepts & SINK_BUCKET))
+        return;
+
+    memset(&item, 0, sizeof(item));
+    item.type = SINK_BUCKET;
+    item.timestamp = timestamp;
+
+    if ((item.data = (elec_data *)malloc(sizeof(elec_data))) == NULL) {
+        pthread_mutex_lock(&sink->lock);
+        sink->dropped++;
+        pthread_mutex_unlock(&sink->lock);
+        return;
+    }
+    memcpy(item.data, data, sizeof(elec_data));
+
+    sink_push(sink, &item);
+}
+
+/*
+ * Hand a closed bucket to every sink that takes buckets
+ */
+void sink_bucket(unsigned long timestamp, const elec_data *data) {
+    for (int t = 0; t < SINK_TYPES; t++)
+        sink_bucket_to(&sinks[t], timestamp, data);
+}
+
+/*
+ * Hand a CRC checked telegram to every sink that takes telegrams
+ *
+ * Must be called before parse_block() splits the telegram.
+ */
+void sink_telegram(p1_framer *framer, unsigned long timestamp) {
+    sink_item item;
+    int length = framer->dataPointer - framer->dataBlock;
+
+    for (int t = 0; t < SINK_TYPES; t++) {
+        if ((sinks[t].type == NULL) || !(sinks[t].accepts & SINK_TELEGRAM))
+            continue;
+
+        memset(&item, 0, sizeof(item));
+        item.type = SINK_TELEGRAM;
+        item.timestamp = timestamp;
+
+        if ((item.telegram = (char *)malloc(length + 1)) == NULL) {
+            pthread_mutex_lock(&sinks[t].lock);
+            sinks[t].dropped++;
+            pthread_mutex_unlock(&sinks[t].lock);
+            continue;
+        }
+        memcpy(item.telegram, framer->dataBlock, length);
+        item.telegram[length] = '\0';
+
+        sink_push(&sinks[t], &item);
+    }
+}
+
+/*
+ * Hand the values of the telegram parse_block() just decoded to every
+ * sink that takes live values
+ */
+void sink_live(const aggr_state *state, unsigned long timestamp) {
+    sink_item item;
+    int count = (state->lineCount < PARSE_MAX_LINES) ? state->lineCount : PARSE_MAX_LINES;
+
+    for (int t = 0; t < SINK_TYPES; t++) {
+        if ((sinks[t].type == NULL) || !(sinks[t].accepts & SINK_LIVE))
+            continue;
+
+        memset(&item, 0, sizeof(item));
+        item.type = SINK_LIVE;
+        item.timestamp = timestamp;
+
+        if ((item.values = (double *)malloc(LIVE_VALUES * sizeof(double))) == NULL) {
+            pthread_mutex_lock(&sinks[t].lock);
+            sinks[t].dropped++;
+            pthread_mutex_unlock(&sinks[t].lock);
+            continue;
+        }
+        for (int f = 0; f < FIELDS; f++)
+            item.values[f] = NAN;
+        for (int l = 0; l < count; l++) {
+            if (state->lines[l].field != FIELD_NONE)
+                item.values[state->lines[l].field] = state->lines[l].value;
+        }
+        for (int d = 0; d < DERIVED_MAX; d++)
+            item.values[FIELDS + d] = (d < derivedChannels.count) ? state->derived[d] : NAN;
+
+        sink_push(&sinks[t], &item);
+    }
+}
+
+/*
+ * Let sinks that wait to retry try again right away
+ */
+void wake_sinks(void) {
+    for (int t = 0; t < SINK_TYPES; t++) {
+        if (sinks[t].type == NULL)
+            continue;
+
+        pthread_mutex_lock(&sinks[t].lock);
+        sinks[t].wakeUp = 1;
+        pthread_cond_broadcast(&sinks[t].wake);
+        pthread_mutex_unlock(&sinks[t].lock);
+    }
+}
+
+/*
+ * Wait until no sink is writing and keep them from starting, so the
+ * configuration they use can be replaced
+ */
+void suspend_sinks(void) {
+    for (int t = 0; t < SINK_TYPES; t++) {
+        if (sinks[t].type != NULL)
+            pthread_mutex_lock(&sinks[t].busy);
+    }
+}
+
+void resume_sinks(void) {
+    for (int t = SINK_TYPES - 1; t >= 0; t--) {
+        if (sinks[t].type != NULL)
+            pthread_mutex_unlock(&sinks[t].busy);
+    }
+}
+
+/*
+ * Stop the sink threads, after one more attempt to write their queues
+ *
+ * The queues are kept for the checkpoint until close_sinks().
+ */
+void stop_sinks(void) {
+    for (int t = 0; t < SINK_TYPES; t++) {
+        if ((sinks[t].type == NULL) || (sinks[t].stop))
+            continue;
+
+        pthread_mutex_lock(&sinks[t].lock);
+        sinks[t].stop = 1;
+        pthread_cond_broadcast(&sinks[t].wake);
+        pthread_mutex_unlock(&sinks[t].lock);
+
+        pthread_join(sinks[t].thread, NULL);
+    }
+}
+
+void close_sinks(void) {
+    p1_sink * sink;
+
+    stop_sinks();
+
+    for (int t = 0; t < SINK_TYPES; t++) {
+        sink = &sinks[t];
+        if (sink->type == NULL)
+            continue;
+
+        if (sink->type->close != NULL)
+            sink->type->close(sink);
+
+        for (int i = sink->batchFirst; i < sink->batchCount; i++)
+            free_sink_item(&sink->batch[i]);
+        for (int i = 0; i < sink->count; i++)
+            free_sink_item(&sink->items[(sink->head + i) % sink->size]);
+        free(sink->items);
+
+        pthread_mutex_destroy(&sink->lock);
+        pthread_mutex_destroy(&sink->busy);
+        pthread_cond_destroy(&sink->wake);
+        memset(sink, 0, sizeof(p1_sink));
+    }
+}
+
+/*
+ * Copy the newest buckets waiting for a sink, oldest first
+ *
+ * Returns the number of buckets copied
+ */
+int sink_pending(p1_sink *sink, unsigned long *timestamps, elec_data *data, int max) {
+    sink_item * item;
+    int found = 0;
+    int skip;
+
+    if ((sink->type == NULL) || (max <= 0))
+        return 0;
+
+    pthread_mutex_lock(&sink->lock);
+
+    // The batch that is being written comes before the queue
+    for (int i = sink->batchFirst; i < sink->batchCount + sink->count; i++) {
+        item = (i < sink->batchCount) ? &sink->batch[i] : &sink->items[(sink->head + i - sink->batchCount) % sink->size];
+        if (item->type == SINK_BUCKET)
+            found++;
+    }
+    skip = (found > max) ? found - max : 0;
+
+    found = 0;
+    for (int i = sink->batchFirst; i < sink->batchCount + sink->count; i++) {
+        item = (i < sink->batchCount) ? &sink->batch[i] : &sink->items[(sink->head + i - sink->batchCount) % sink->size];
+        if (item->type != SINK_BUCKET)
+            continue;
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+
+        timestamps[found] = item->timestamp;
+        memcpy(&data[found], item->data, sizeof(elec_data));
+        found++;
+    }
+
+    pthread_mutex_unlock(&sink->lock);
+
+    return found;
+}
+
+/*
+ * Copy state shared with the thread of a sink under the lock of the sink
+ */
+void sink_snapshot(p1_sink *sink, void *copy, const void *state, size_t size) {
+    if (sink->type == NULL) {
+        memcpy(copy, state, size);
+        return;
+    }
+
+    pthread_mutex_lock(&sink->lock);
+    memcpy(copy, state, size);
+    pthread_mutex_unlock(&sink->lock);
+}
+
+/*
+ * Format the queues and counters of the running sinks as a JSON array
+ *
+ * Returns the number of characters written
+ */
+int json_sinks(char *buffer, size_t size) {
+    p1_sink * sink;
+    int length;
+    int first = 1;
+
+    length = snprintf(buffer, size, "[");
+
+    for (int t = 0; t < SINK_TYPES; t++) {
+        sink = &sinks[t];
+        if (sink->type == NULL)
+            continue;
+
+        pthread_mutex_lock(&sink->lock);
+        length += snprintf(buffer + length, size - length,
+            "%s{\"name\":\"%s\",\"queue\":%d,\"queue_size\":%d,\"queued\":%lu,\"written\":%lu,\"dropped\":%lu,\"errors\":%lu,\"retries\":%lu,\"last_error\":%ld}",
+            first ? "" : ",", sink->type->name, sink->count + sink->batchCount - sink->batchFirst, sink->size, sink->queued, sink->written, sink->dropped, sink->errors, sink->retried, (long)sink->lastError);
+        pthread_mutex_unlock(&sink->lock);
+        first = 0;
+    }
+
+    length += snprintf(buffer + length, size - length, "]");
+
+    return length;
+}
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <rrd.h>
+
+#include "slimmemeter.h"
+
+/*
+ * Expected range of every channel, the bins between these bounds have a
+ * constant relative width, set by the ratio of the bounds in P1_GAUGES.
+ */
+#define P1_SKETCH_LOW(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) low,
+#define P1_SKETCH_HIGH(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) high,
+static const double sketchLow[SKETCH_CHANNELS] = { P1_GAUGES(P1_SKETCH_LOW) };
+static const double sketchHigh[SKETCH_CHANNELS] = { P1_GAUGES(P1_SKETCH_HIGH) };
+#undef P1_SKETCH_LOW
+#undef P1_SKETCH_HIGH
+
+static const unsigned long rollupPeriods[SKETCH_RESOLUTIONS - 1] = { 3600, 86400 };
+
+/*
+ * Count a sample of a channel
+ */
+void sketch_add(p1_sketch *sketch, int channel, double value) {
+    int bin;
+
+    if (value < sketchLow[channel])
+        bin = 0;
+    else if (value >= sketchHigh[channel])
+        bin = SKETCH_BINS - 1;
+    else {
+        bin = 1 + (int)(log(value / sketchLow[channel]) * (SKETCH_BINS - 2) / log(sketchHigh[channel] / sketchLow[channel]));
+        if (bin > SKETCH_BINS - 2)
+            bin = SKETCH_BINS - 2;
+    }
+
+    sketch->count[channel][bin]++;
+}
+
+void sketch_merge(p1_sketch *into, const p1_sketch *from) {
+    for (int channel = 0; channel < SKETCH_CHANNELS; channel++) {
+        for (int bin = 0; bin < SKETCH_BINS; bin++)
+            into->count[channel][bin] += from->count[channel][bin];
+    }
+}
+
+/*
+ * Estimate a quantile of a channel
+ *
+ * A bin is represented by its geometric center. The outer bins have no
+ * upper or lower bound, they are represented by the exact minimum and
+ * maximum, which also bound every estimate.
+ *
+ * Parameters:
+ *   *sketch  - The sketch
+ *   channel  - The channel
+ *   q        - The quantile, 0.0 to 1.0
+ *   min      - Smallest sample of the channel
+ *   max      - Largest sample of the channel
+ *
+ * Returns the estimate, 0.0 when the channel has no samples
+ */
+double sketch_quantile(const p1_sketch *sketch, int channel, double q, double min, double max) {
+    unsigned long total = 0;
+    unsigned long rank;
+    unsigned long seen = 0;
+    double value;
+    int bin;
+
+    for (bin = 0; bin < SKETCH_BINS; bin++)
+        total += sketch->count[channel][bin];
+    if (total == 0)
+        return 0.0;
+
+    rank = (unsigned long)ceil(q * total);
+    if (rank < 1)
+        rank = 1;
+
+    for (bin = 0; bin < SKETCH_BINS - 1; bin++) {
+        seen += sketch->count[channel][bin];
+        if (seen >= rank)
+            break;
+    }
+
+    if (bin == 0)
+        return min;
+    if (bin == SKETCH_BINS - 1)
+        return max;
+
+    value = sketchLow[channel] * exp((bin - 0.5) * log(sketchHigh[channel] / sketchLow[channel]) / (SKETCH_BINS - 2));
+    if (value < min)
+        value = min;
+    if (value > max)
+        value = max;
+
+    return value;
+}
+
+/*
+ * Get the minimum and maximum of every sketch channel of a bucket
+ */
+void bucket_range(const elec_data *data, double *min, double *max) {
+#define P1_SKETCH_RANGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) \
+    min[SKETCH_##name] = data->name##_min; \
+    max[SKETCH_##name] = data->name##_max;
+    P1_GAUGES(P1_SKETCH_RANGE)
+#undef P1_SKETCH_RANGE
+}
+
+/*
+ * Format an RRD update of the percentile databases
+ *
+ * Every channel gets p50, p95 and p99, in the order of SKETCH_CHANNELS.
+ *
+ * Returns the number of characters written
+ */
+int format_percentiles(char *buffer, size_t size, unsigned long timestamp, const p1_sketch *sketch, const double *min, const double *max) {
+    int length;
+
+    length = snprintf(buffer, size, "%ld", timestamp);
+
+    for (int channel = 0; channel < SKETCH_CHANNELS; channel++) {
+        length += snprintf(buffer + length, size - length, ":%1.3lf:%1.3lf:%1.3lf",
+            sketch_quantile(sketch, channel, 0.50, min[channel], max[channel]),
+            sketch_quantile(sketch, channel, 0.95, min[channel], max[channel]),
+            sketch_quantile(sketch, channel, 0.99, min[channel], max[channel]));
+    }
+
+    return length;
+}
+
+/*
+ * Merge a stored bucket into the hour and day percentiles
+ *
+ * An hour or day is written when the first bucket of the next one
+ * arrives, so buckets must be passed in time order.
+ *
+ * Parameters:
+ *   *config    - Pointer to the configuration
+ *   *rollups   - The open hour and day
+ *   timestamp  - Start of the bucket
+ *   *data      - The bucket
+ *
+ * Returns E_OK or E_RRD
+ */
+int store_rollups(struct _CONFIGSTRUCT *config, sketch_rollup *rollups, unsigned long timestamp, const elec_data *data) {
+    char values[512];
+    double min[SKETCH_CHANNELS];
+    double max[SKETCH_CHANNELS];
+    unsigned long start;
+    int result = E_OK;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+    const char *updatePercentiles[] = {
+        values,
+        NULL
+    };
+
+    bucket_range(data, min, max);
+
+    for (int r = 0; r < SKETCH_RESOLUTIONS - 1; r++) {
+        start = timestamp - (timestamp % rollupPeriods[r]);
+
+        if ((rollups[r].start != 0) && (rollups[r].start != start)) {
+            format_percentiles(values, sizeof(values), rollups[r].start + rollupPeriods[r], &rollups[r].sketch, rollups[r].min, rollups[r].max);
+
+            rrd_clear_error();
+            rrd_update_r(config->percentileFilenames[r + 1], NULL, 1, updatePercentiles);
+
+            if (rrd_test_error()) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - RRD error in file %s: %s\n", timeStringBuffer, config->percentileFilenames[r + 1], rrd_get_error());
+                result = E_RRD;
+            }
+
+            rollups[r].start = 0;
+        }
+
+        if (rollups[r].start == 0) {
+            memset(&rollups[r], 0, sizeof(sketch_rollup));
+            rollups[r].start = start;
+            memcpy(rollups[r].min, min, sizeof(min));
+            memcpy(rollups[r].max, max, sizeof(max));
+        }
+        else {
+            for (int channel = 0; channel < SKETCH_CHANNELS; channel++) {
+                if (min[channel] < rollups[r].min[channel])
+                    rollups[r].min[channel] = min[channel];
+                if (max[channel] > rollups[r].max[channel])
+                    rollups[r].max[channel] = max[channel];
+            }
+        }
+
+        sketch_merge(&rollups[r].sketch, &data->sketch);
+    }
+
+    return result;
+}
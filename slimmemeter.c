@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -8,19 +10,38 @@
 #include <unistd.h>
 #include <regex.h>
 #include <time.h>
+#include <math.h>
 #include <rrd.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
 
 #include "slimmemeter.h"
 
 int serialPort;
-
-unsigned long timestampArray[12];
-elec_data * elecDataArray[12];
-double * gasDataArray[12];
-int storeDataCounter = 0;
-int readDataCounter = 0;
+p1_framer serialFramer = { .noCrc = 0 };
+
+struct _baud_set _baud_table[] = {
+    {1200, B1200},
+    {2400, B2400},
+    {4800, B4800},
+    {9600, B9600},
+    {19200, B19200},
+    {38400, B38400},
+    {57600, B57600},
+    {115200, B115200}
+};
+
+bucket_queue bucketQueue;
+bucket_queue rrdQueue;
 int verbose = 0;
+int terminate = 0;
+time_t lastCheckpoint = 0;
+
+p1_demand demandState;
+aggr_state aggrState = { .queue = &bucketQueue, .demand = &demandState };
+struct _STATS stats;
+p1_archive telegramArchive = { .dataFd = -1, .indexFd = -1 };
 
 char * str_tolower(char * s) {
     for (char * p=s; *p ; p++)
@@ -41,27 +62,6 @@ speed_t get_baudrate(int baudrate) {
     return 0;
 }
 
-void signal_handler(int signal) {
-    char timeStringBuffer[26];
-    struct tm * tm_info;
-    time_t msgtime;
-
-    if (signal == SIGUSR1) {
-        msgtime = time(NULL);
-        tm_info = localtime(&msgtime);
-        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
-    
-        if ((verbose = (verbose == 0)?1:0) == 1) {
-            printf("%s - Enable verbose mode\n", timeStringBuffer);
-        }
-        else {
-            printf("%s - Disable verbose mode\n", timeStringBuffer);
-        }
-
-        fflush(stdout);
-    }
-}
-
 /*
  * CRC-16 calculation for data frame
  *
@@ -93,62 +93,216 @@ unsigned short crc_16(char *data_p) {
     return crc;
 }
 
+/*
+ * Reset a telegram framer to wait for the start of a telegram, noCrc is
+ * left as the owner set it
+ */
+void init_framer(p1_framer *framer) {
+    framer->status = S_IDLE;
+    framer->numchars = 0;
+    framer->dataPointer = framer->dataBlock;
+    framer->checksumPointer = framer->checksumStr;
+}
+
+/*
+ * Feed one byte of the P1 stream into a telegram framer
+ *
+ * A telegram runs from '/' up to and including '!', followed by the
+ * 4 hex digit CRC-16 of that range. With noCrc set a telegram may end at
+ * the '!', as DSMR 2.2 and 3 meters send them.
+ *
+ * Parameters:
+ *   *framer  - The framer of the stream
+ *   buffer   - The received byte
+ *
+ * Returns F_TELEGRAM when dataBlock holds a complete telegram,
+ * F_CRC_ERROR or F_OVERRUN for a rejected telegram and F_NONE otherwise
+ */
+int p1_frame(p1_framer *framer, char buffer) {
+    switch (framer->status) {
+    case S_IDLE:
+        if (buffer != '/')
+            break;
+
+        framer->dataPointer = framer->dataBlock;
+        framer->status = S_DATA;
+    case S_DATA:
+        if (framer->dataPointer >= framer->dataBlock + sizeof(framer->dataBlock) - 1) {
+            framer->status = S_IDLE;
+            return F_OVERRUN;
+        }
+
+        *framer->dataPointer = buffer;
+        framer->dataPointer++;
+
+        if (buffer == '!') {
+            *framer->dataPointer = '\0';
+            framer->checksumPointer = framer->checksumStr;
+            framer->status = S_CHECKSUM;
+            framer->numchars = 4;
+        }
+
+        break;
+    case S_CHECKSUM:
+        if ((buffer != '\r') && (buffer != '\n') && (framer->numchars-- > 0)) {
+            *framer->checksumPointer++ = buffer;
+            if (framer->numchars > 0)
+                break;
+        }
+
+        *framer->checksumPointer = '\0';
+        framer->status = S_IDLE;
+
+        if (framer->noCrc && (framer->checksumStr[0] == '\0'))
+            return F_TELEGRAM;
+
+        if (crc_16(framer->dataBlock) != (unsigned short)strtol(framer->checksumStr, NULL, 16))
+            return F_CRC_ERROR;
+
+        return F_TELEGRAM;
+    default:
+        init_framer(framer);
+    }
+
+    return F_NONE;
+}
+
+/*
+ * Tokenize one line of an INI style configfile
+ *
+ * The line is split in place: leading and trailing whitespace is removed
+ * and the section name, key and value are terminated within the line.
+ * Section names and keys are converted to lowercase.
+ *
+ * Parameters:
+ *   *line     - The line to tokenize, modified in place
+ *   **name    - Receives the section name or key
+ *   **value   - Receives the value of a key/value pair
+ *   *column   - Receives the 1-based column of a syntax error
+ *   **error   - Receives the description of a syntax error
+ *
+ * Returns INI_EMPTY, INI_SECTION, INI_KEYVALUE or INI_ERROR
+ */
+int ini_parse_line(char *line, char **name, char **value, int *column, const char **error) {
+    char * p = line;
+    char * end;
+    char * keyEnd;
+
+    while ((*p == ' ') || (*p == '\t'))
+        p++;
+
+    // Empty lines and comments
+    if ((*p == '\0') || (*p == '\r') || (*p == '\n') || (*p == '#') || (*p == ';'))
+        return INI_EMPTY;
+
+    // Section header
+    if (*p == '[') {
+        *name = ++p;
+        while ((*p != ']') && (*p != '\0') && (*p != '\r') && (*p != '\n'))
+            p++;
+
+        if (*p != ']') {
+            *column = p - line + 1;
+            *error = "missing ']'";
+            return INI_ERROR;
+        }
+
+        end = p++;
+        while ((*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n'))
+            p++;
+
+        if (*p != '\0') {
+            *column = p - line + 1;
+            *error = "unexpected text after section";
+            return INI_ERROR;
+        }
+
+        while ((end > *name) && ((end[-1] == ' ') || (end[-1] == '\t')))
+            end--;
+        while ((**name == ' ') || (**name == '\t'))
+            (*name)++;
+        *end = '\0';
+        str_tolower(*name);
+
+        return INI_SECTION;
+    }
+
+    // Key
+    *name = p;
+    while ((*p != '\0') && (*p != '=') && (*p != ':') && (*p != ' ') && (*p != '\t') && (*p != '\r') && (*p != '\n'))
+        p++;
+    end = p;
+
+    if (end == *name) {
+        *column = p - line + 1;
+        *error = "missing key";
+        return INI_ERROR;
+    }
+
+    while ((*p == ' ') || (*p == '\t'))
+        p++;
+
+    if ((*p != '=') && (*p != ':')) {
+        *column = p - line + 1;
+        *error = "expected '=' or ':'";
+        return INI_ERROR;
+    }
+    keyEnd = end;
+    p++;
+
+    // Value
+    while ((*p == ' ') || (*p == '\t'))
+        p++;
+    *value = p;
+
+    end = p + strlen(p);
+    while ((end > p) && ((end[-1] == ' ') || (end[-1] == '\t') || (end[-1] == '\r') || (end[-1] == '\n')))
+        end--;
+
+    if (end == p) {
+        *column = p - line + 1;
+        *error = "missing value";
+        return INI_ERROR;
+    }
+    *end = '\0';
+    *keyEnd = '\0';
+    str_tolower(*name);
+
+    return INI_KEYVALUE;
+}
+
+/*
+ * Read the configfile into the configuration
+ *
+ * A key in a section [name] is read as name-key, so the keys of a sink
+ * or the derived channels can be grouped. Keys before the first section
+ * and in [general] are read as they are.
+ *
+ * Parameters:
+ *   *config          - Pointer to the configuration
+ *   *configFilename  - The configfile to read
+ *
+ * Returns E_OK, E_CONF_FILE or E_MALLOC
+ */
 int read_config(struct _CONFIGSTRUCT *config, char *configFilename) {
-    regex_t reEmptyLine;
-    regex_t reCommentedOut;
-    regex_t reSection;
-    regex_t reKeyValuePair;
-    regmatch_t pmatch[4];
     FILE * fp;
     char * line = NULL;
     size_t len = 0;
     ssize_t read;
-    int reError;
+    int result = E_OK;
     int lineNumber = 0;
-    char key[32];
-    char value[256];
+    int column;
+    const char * error;
+    char * key;
+    char * value;
     char * sectionName = NULL;
+    char scopedKey[256];
+    const char * setting;
+    const char * derivedError;
+    int sink;
     char timeStringBuffer[26];
     struct tm * tm_info;
     time_t msgtime;
- 
-    // Compile regular expressions
-    if ((reError = regcomp(&reEmptyLine, "^\\s*$", REG_NOSUB | REG_EXTENDED)) != 0) {
-        msgtime = time(NULL);
-        tm_info = localtime(&msgtime);
-        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
-
-        regerror(reError, &reEmptyLine, value, 256);
-        fprintf(stderr, "%s - RE compile of \"^\\s*$\" failed: %s\n", timeStringBuffer, value);
-        return E_REGEX_COMP;
-    }
-    if ((reError = regcomp(&reCommentedOut, "^\\s*[;#]", REG_NOSUB | REG_EXTENDED)) != 0) {
-        msgtime = time(NULL);
-        tm_info = localtime(&msgtime);
-        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
-
-        regerror(reError, &reCommentedOut, value, 256);
-        fprintf(stderr, "%s - RE compile of \"^\\s*[;#]\" failed: %s\n", timeStringBuffer, value);
-        return E_REGEX_COMP;
-    }
-    if ((reError = regcomp(&reSection, "^\\s*\\[(.*)\\]\\s*$", REG_NEWLINE | REG_EXTENDED)) != 0) {
-        msgtime = time(NULL);
-        tm_info = localtime(&msgtime);
-        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
-
-        regerror(reError, &reSection, value, 256);
-        fprintf(stderr, "%s - RE compile of \"^\\s*\\[(.*)\\]\\s*$\" failed: %s\n", timeStringBuffer, value);
-        return E_REGEX_COMP;
-    }
-    if ((reError = regcomp(&reKeyValuePair, "^\\s*(\\S+)\\s*[=:]\\s*(.+?)\\s*$", REG_NEWLINE | REG_EXTENDED)) != 0) {
-        msgtime = time(NULL);
-        tm_info = localtime(&msgtime);
-        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
-
-        regerror(reError, &reKeyValuePair, value, 256);
-        fprintf(stderr, "%s - RE compile of \"^\\s*(\\S+)\\s*[=:]\\s*(.+?)\\s*$\" failed: %s\n", timeStringBuffer, value);
-        return E_REGEX_COMP;
-    }
 
     // Open config file
     fp = fopen(configFilename, "r");
@@ -165,51 +319,51 @@ int read_config(struct _CONFIGSTRUCT *config, char *configFilename) {
     while ((read = getline(&line, &len, fp)) != -1) {
         lineNumber++;
 
-        // Skip empty lines
-        if (regexec(&reEmptyLine, line, 0, NULL, 0) == 0)
-            continue;
-        // Skip commented lines
-        if (regexec(&reCommentedOut, line, 0, NULL, 0) == 0)
+        switch (ini_parse_line(line, &key, &value, &column, &error)) {
+        case INI_EMPTY:
             continue;
-        // Get section name
-        if (regexec(&reSection, line, 3, pmatch, 0) == 0) {
-            if (sectionName != NULL) 
+        case INI_SECTION:
+            // Get section name
+            if (sectionName != NULL)
                 free(sectionName);
-            
-            if ((sectionName = (char *)malloc(sizeof(char) * (pmatch[1].rm_eo - pmatch[1].rm_so + 1))) == NULL) {;
+
+            if ((sectionName = (char *)malloc(strlen(key) + 1)) == NULL) {
                 msgtime = time(NULL);
                 tm_info = localtime(&msgtime);
                 strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
                 fprintf(stderr, "%s - Error claiming memory for section name: %s\n", timeStringBuffer, strerror(errno));
-                return E_MALLOC;
+                result = E_MALLOC;
+                goto DONE;
             }
-
-            memcpy(sectionName, &line[pmatch[1].rm_so], pmatch[1].rm_eo - pmatch[1].rm_so);
-            sectionName[pmatch[1].rm_eo - pmatch[1].rm_so] = '\0';
-            str_tolower(sectionName);
-
+            strcpy(sectionName, key);
             continue;
-        }
-        // Exit if the line doesn't match key value syntax
-        if ((reError = regexec(&reKeyValuePair, line, 4, pmatch, 0)) != 0) {
-            regerror(reError, &reKeyValuePair, value, 256);
-            line[strlen(line) - 1] = '\0';
+        case INI_ERROR:
+            // Exit if the line doesn't match key value syntax
+            line[strcspn(line, "\r\n")] = '\0';
             msgtime = time(NULL);
             tm_info = localtime(&msgtime);
             strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-            fprintf(stderr, "%s - Syntax error (%s) on line %d in file \"%s\": \"%s\"\n", timeStringBuffer, value, lineNumber, configFilename, line);
-            return E_CONF_FILE;
+            fprintf(stderr, "%s - Syntax error (%s) on line %d column %d in file \"%s\": \"%s\"\n", timeStringBuffer, error, lineNumber, column, configFilename, line);
+            result = E_CONF_FILE;
+            goto DONE;
         }
 
-        // Get key/value from input
-        memcpy(key, &line[pmatch[1].rm_so], pmatch[1].rm_eo - pmatch[1].rm_so);
-        key[pmatch[1].rm_eo - pmatch[1].rm_so] = '\0';
-        str_tolower(key);
+        // Keys in a section are scoped by its name
+        if ((sectionName != NULL) && (*sectionName != '\0') && (strcmp(sectionName, "general") != 0)) {
+            if ((size_t)snprintf(scopedKey, sizeof(scopedKey), "%s-%s", sectionName, key) >= sizeof(scopedKey)) {
+                line[strcspn(line, "\r\n")] = '\0';
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-        memcpy(value, &line[pmatch[2].rm_so], pmatch[2].rm_eo - pmatch[2].rm_so);
-        value[pmatch[2].rm_eo - pmatch[2].rm_so] = '\0';
+                fprintf(stderr, "%s - Syntax error (key too long) on line %d column 1 in file \"%s\": \"%s\"\n", timeStringBuffer, lineNumber, configFilename, line);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            key = scopedKey;
+        }
 
         if (strcmp(key, "device") == 0) {
             if (config->serialPortFilename != NULL)
@@ -220,19 +374,26 @@ int read_config(struct _CONFIGSTRUCT *config, char *configFilename) {
                 strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
                 fprintf(stderr, "%s - Error claiming memory for serial device name: %s\n", timeStringBuffer, strerror(errno));
-                return E_MALLOC;
+                result = E_MALLOC;
+                goto DONE;
             }
             strcpy(config->serialPortFilename, value);
             continue;
         }
         if ((strcmp(key, "speed") == 0) || (strcmp(key, "baud") == 0)) {
+            if (strcmp(str_tolower(value), "auto") == 0) {
+                config->serialAutodetect = 1;
+                continue;
+            }
+            config->serialAutodetect = 0;
             if ((config->serialPortSpeed = get_baudrate(atoi(value))) == 0) {
                 msgtime = time(NULL);
                 tm_info = localtime(&msgtime);
                 strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
                 fprintf(stderr, "%s - Invalid baudrate value: %s\n", timeStringBuffer, value);
-                return E_CONF_FILE;
+                result = E_CONF_FILE;
+                goto DONE;
             }
             continue;
         }
@@ -251,7 +412,26 @@ int read_config(struct _CONFIGSTRUCT *config, char *configFilename) {
                 strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
                 fprintf(stderr, "%s - Invalid parity: %s\n", timeStringBuffer, value);
-                return E_CONF_FILE;
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "crc") == 0) {
+            str_tolower(value);
+
+            if ((strcmp(value, "yes") == 0) || (strcmp(value, "1") == 0))
+                config->serialPortCrc = 1;
+            else if ((strcmp(value, "no") == 0) || (strcmp(value, "0") == 0))
+                config->serialPortCrc = 0;
+            else {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid crc value: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
             }
             continue;
         }
@@ -264,7 +444,8 @@ int read_config(struct _CONFIGSTRUCT *config, char *configFilename) {
                 strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
                 fprintf(stderr, "%s - Invalid number of bits: %s\n", timeStringBuffer, value);
-                return E_CONF_FILE;
+                result = E_CONF_FILE;
+                goto DONE;
             }
             config->serialPortBits = ((bits - 5) << 4);
             continue;
@@ -278,7 +459,8 @@ int read_config(struct _CONFIGSTRUCT *config, char *configFilename) {
                 strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
                 fprintf(stderr, "%s - Invalid number of stopbits: %s\n", timeStringBuffer, value);
-                return E_CONF_FILE;
+                result = E_CONF_FILE;
+                goto DONE;
             }
             config->serialPortStopbits = ((stopbits - 1) << 6);
             continue;
@@ -292,199 +474,818 @@ int read_config(struct _CONFIGSTRUCT *config, char *configFilename) {
                 strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
                 fprintf(stderr, "%s - Error claiming memory for database directory name: %s\n", timeStringBuffer, strerror(errno));
-                return E_MALLOC;
+                result = E_MALLOC;
+                goto DONE;
             }
             strcpy(config->databaseDirectory, value);
             continue;
         }
-    }
+        if (strcmp(key, "state-file") == 0) {
+            if (config->stateFilename != NULL)
+                free(config->stateFilename);
+            if ((config->stateFilename = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-    fclose(fp);
-    if (line)
-        free(line);
+                fprintf(stderr, "%s - Error claiming memory for state filename: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->stateFilename, value);
+            continue;
+        }
+        if (strcmp(key, "control-socket") == 0) {
+            if (config->controlSocketFilename != NULL)
+                free(config->controlSocketFilename);
+            if ((config->controlSocketFilename = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-    return 0;
-}
+                fprintf(stderr, "%s - Error claiming memory for control socket name: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->controlSocketFilename, value);
+            continue;
+        }
+        if (strcmp(key, "network-timeout") == 0) {
+            if ((config->networkTimeout = atoi(value)) < 0) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-int init_serial(struct _CONFIGSTRUCT * config) {
-    struct termios tty;
-    int localSerialPort = open(config->serialPortFilename, O_RDWR);
-    char timeStringBuffer[26];
-    struct tm * tm_info;
-    time_t msgtime;
+                fprintf(stderr, "%s - Invalid network timeout: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "server-listen") == 0) {
+            if (config->serverListen != NULL)
+                free(config->serverListen);
+            if ((config->serverListen = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-    if (localSerialPort < 0) {
-        msgtime = time(NULL);
-        tm_info = localtime(&msgtime);
-        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+                fprintf(stderr, "%s - Error claiming memory for server address: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->serverListen, value);
+            continue;
+        }
+        if (strcmp(key, "relay-listen") == 0) {
+            if (config->relayListen != NULL)
+                free(config->relayListen);
+            if ((config->relayListen = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-        fprintf(stderr, "%s - Error %i from open serialport %s: %s\n", timeStringBuffer, errno, config->serialPortFilename, strerror(errno));
-        return -1;
-    }
+                fprintf(stderr, "%s - Error claiming memory for relay address: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->relayListen, value);
+            continue;
+        }
+        if (strcmp(key, "relay-socket") == 0) {
+            if (config->relaySocketFilename != NULL)
+                free(config->relaySocketFilename);
+            if ((config->relaySocketFilename = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-    if (tcgetattr(localSerialPort, &tty) != 0) {
-        msgtime = time(NULL);
-        tm_info = localtime(&msgtime);
-        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+                fprintf(stderr, "%s - Error claiming memory for relay socket name: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->relaySocketFilename, value);
+            continue;
+        }
+        if (strcmp(key, "live-listen") == 0) {
+            if (config->liveListen != NULL)
+                free(config->liveListen);
+            if ((config->liveListen = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-        fprintf(stderr, "%s - Error %i from tcgetattr: %s\n", timeStringBuffer, errno, strerror(errno));
-        return -2;
-    }
+                fprintf(stderr, "%s - Error claiming memory for live stream address: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->liveListen, value);
+            continue;
+        }
+        if (strcmp(key, "server-workers") == 0) {
+            if ((config->serverWorkers = atoi(value)) < 0) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-    tty.c_cflag &= ~PARENB;         // No parity
-    tty.c_cflag |= config->serialPortParity;
-    tty.c_cflag &= ~CSTOPB;         // 1 stopbit
-    tty.c_cflag |= config->serialPortStopbits;
-    tty.c_cflag &= ~CSIZE;
-    tty.c_cflag |= config->serialPortBits;             // 8 bits
-    tty.c_cflag &= ~CRTSCTS;        // No hw flow control
-    tty.c_cflag |= CREAD | CLOCAL;
+                fprintf(stderr, "%s - Invalid number of server workers: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "server-io") == 0) {
+            str_tolower(value);
+            if (strcmp(value, "auto") == 0)
+                config->serverIo = SERVER_IO_AUTO;
+            else if (strcmp(value, "io_uring") == 0)
+                config->serverIo = SERVER_IO_URING;
+            else if (strcmp(value, "epoll") == 0)
+                config->serverIo = SERVER_IO_EPOLL;
+            else {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-    tty.c_lflag &= ~ICANON;
-    tty.c_lflag &= ~ECHO;
-    tty.c_lflag &= ~ISIG;
+                fprintf(stderr, "%s - Invalid server io setting: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "archive") == 0) {
+            str_tolower(value);
+            if ((strcmp(value, "yes") == 0) || (strcmp(value, "on") == 0) || (strcmp(value, "true") == 0) || (strcmp(value, "1") == 0))
+                config->archive = 1;
+            else if ((strcmp(value, "no") == 0) || (strcmp(value, "off") == 0) || (strcmp(value, "false") == 0) || (strcmp(value, "0") == 0))
+                config->archive = 0;
+            else {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-    tty.c_iflag &= ~(IXON | IXOFF | IXANY);
-    tty.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL);
+                fprintf(stderr, "%s - Invalid archive setting: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "demand-window") == 0) {
+            if (((config->demandWindow = atoi(value)) < 60) || (config->demandWindow > DEMAND_MAX_WINDOW)) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-    tty.c_oflag &= ~OPOST;
-    tty.c_oflag &= ~ONLCR;
+                fprintf(stderr, "%s - Invalid demand window, 60 to %d seconds: %s\n", timeStringBuffer, DEMAND_MAX_WINDOW, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "staging-directory") == 0) {
+            if (config->stagingDirectory != NULL)
+                free(config->stagingDirectory);
+            if ((config->stagingDirectory = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-    cfsetispeed(&tty, config->serialPortSpeed);
-    cfsetospeed(&tty, config->serialPortSpeed);
+                fprintf(stderr, "%s - Error claiming memory for staging directory name: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->stagingDirectory, value);
+            continue;
+        }
+        if (strcmp(key, "sync-interval") == 0) {
+            if ((config->syncInterval = atoi(value)) < 0) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-    if (tcsetattr(localSerialPort, TCSANOW, &tty) != 0) {
-        msgtime = time(NULL);
-        tm_info = localtime(&msgtime);
-        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+                fprintf(stderr, "%s - Invalid sync interval: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "checkpoint-interval") == 0) {
+            if ((config->checkpointInterval = atoi(value)) < 0) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-        fprintf(stderr, "%s - Error %i from tcsetattr: %s\n", timeStringBuffer, errno, strerror(errno));
-        return -3;
+                fprintf(stderr, "%s - Invalid checkpoint interval: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "influx-url") == 0) {
+            if (config->influxUrl != NULL)
+                free(config->influxUrl);
+            if ((config->influxUrl = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for influx url: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->influxUrl, value);
+            config->sinks[SINK_INFLUX].enabled = 1;
+            continue;
+        }
+        if (strcmp(key, "influx-measurement") == 0) {
+            if (config->influxMeasurement != NULL)
+                free(config->influxMeasurement);
+            if ((config->influxMeasurement = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for influx measurement: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->influxMeasurement, value);
+            continue;
+        }
+        if (strcmp(key, "influx-tags") == 0) {
+            if (config->influxTags != NULL)
+                free(config->influxTags);
+            if ((config->influxTags = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for influx tags: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->influxTags, value);
+            continue;
+        }
+        if (strcmp(key, "influx-token") == 0) {
+            if (config->influxToken != NULL)
+                free(config->influxToken);
+            if ((config->influxToken = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for influx token: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->influxToken, value);
+            continue;
+        }
+        if (strcmp(key, "influx-telegrams") == 0) {
+            str_tolower(value);
+            if ((strcmp(value, "yes") == 0) || (strcmp(value, "on") == 0) || (strcmp(value, "true") == 0) || (strcmp(value, "1") == 0))
+                config->influxTelegrams = 1;
+            else if ((strcmp(value, "no") == 0) || (strcmp(value, "off") == 0) || (strcmp(value, "false") == 0) || (strcmp(value, "0") == 0))
+                config->influxTelegrams = 0;
+            else {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid influx telegrams setting: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "influx-gzip") == 0) {
+            str_tolower(value);
+            if ((strcmp(value, "yes") == 0) || (strcmp(value, "on") == 0) || (strcmp(value, "true") == 0) || (strcmp(value, "1") == 0))
+                config->influxGzip = 1;
+            else if ((strcmp(value, "no") == 0) || (strcmp(value, "off") == 0) || (strcmp(value, "false") == 0) || (strcmp(value, "0") == 0))
+                config->influxGzip = 0;
+            else {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid influx gzip setting: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "influx-batch") == 0) {
+            if ((config->influxBatch = atoi(value)) < 1) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid influx batch size: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "influx-flush-interval") == 0) {
+            if ((config->influxFlushInterval = atoi(value)) < 0) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid influx flush interval: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "mqtt-url") == 0) {
+            if (config->mqttUrl != NULL)
+                free(config->mqttUrl);
+            if ((config->mqttUrl = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for mqtt url: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->mqttUrl, value);
+            config->sinks[SINK_MQTT].enabled = 1;
+            continue;
+        }
+        if (strcmp(key, "mqtt-client-id") == 0) {
+            if (config->mqttClientId != NULL)
+                free(config->mqttClientId);
+            if ((config->mqttClientId = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for mqtt client id: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->mqttClientId, value);
+            continue;
+        }
+        if (strcmp(key, "mqtt-username") == 0) {
+            if (config->mqttUsername != NULL)
+                free(config->mqttUsername);
+            if ((config->mqttUsername = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for mqtt username: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->mqttUsername, value);
+            continue;
+        }
+        if (strcmp(key, "mqtt-password") == 0) {
+            if (config->mqttPassword != NULL)
+                free(config->mqttPassword);
+            if ((config->mqttPassword = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for mqtt password: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->mqttPassword, value);
+            continue;
+        }
+        if (strcmp(key, "mqtt-live-topic") == 0) {
+            if (config->mqttLiveTopic != NULL)
+                free(config->mqttLiveTopic);
+            if ((config->mqttLiveTopic = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for mqtt live topic: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->mqttLiveTopic, value);
+            continue;
+        }
+        if (strcmp(key, "mqtt-interval-topic") == 0) {
+            if (config->mqttBucketTopic != NULL)
+                free(config->mqttBucketTopic);
+            if ((config->mqttBucketTopic = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for mqtt interval topic: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->mqttBucketTopic, value);
+            continue;
+        }
+        if (strcmp(key, "mqtt-qos") == 0) {
+            config->mqttQos = atoi(value);
+            if ((config->mqttQos < 0) || (config->mqttQos > 1)) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid mqtt qos, 0 or 1: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "mqtt-retain") == 0) {
+            str_tolower(value);
+            if ((strcmp(value, "yes") == 0) || (strcmp(value, "on") == 0) || (strcmp(value, "true") == 0) || (strcmp(value, "1") == 0))
+                config->mqttRetain = 1;
+            else if ((strcmp(value, "no") == 0) || (strcmp(value, "off") == 0) || (strcmp(value, "false") == 0) || (strcmp(value, "0") == 0))
+                config->mqttRetain = 0;
+            else {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid mqtt retain setting: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "mqtt-interval") == 0) {
+            config->mqttInterval = atoi(value);
+            if (config->mqttInterval < 0) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid mqtt interval: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "mqtt-buffer") == 0) {
+            config->mqttBuffer = atoi(value);
+            if (config->mqttBuffer < 1) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid mqtt buffer size: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "graph-directory") == 0) {
+            if (config->graphDirectory != NULL)
+                free(config->graphDirectory);
+            if ((config->graphDirectory = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for graph directory name: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->graphDirectory, value);
+            continue;
+        }
+        if (strcmp(key, "graphs") == 0) {
+            if (config->graphs != NULL)
+                free(config->graphs);
+            if ((config->graphs = (char *)malloc(strlen(value) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for graph names: %s\n", timeStringBuffer, strerror(errno));
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->graphs, value);
+            continue;
+        }
+        if (strcmp(key, "graph-format") == 0) {
+            str_tolower(value);
+            if (strcmp(value, "png") == 0)
+                config->graphFormat = GRAPH_PNG;
+            else if (strcmp(value, "svg") == 0)
+                config->graphFormat = GRAPH_SVG;
+            else {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid graph format: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "graph-width") == 0) {
+            config->graphWidth = atoi(value);
+            if ((config->graphWidth < 16) || (config->graphWidth > 4096)) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid graph width: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strcmp(key, "graph-height") == 0) {
+            config->graphHeight = atoi(value);
+            if ((config->graphHeight < 16) || (config->graphHeight > 4096)) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid graph height: %s\n", timeStringBuffer, value);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            continue;
+        }
+        if (strncmp(key, "derived-", 8) == 0) {
+            if ((derivedError = check_derived_name(config, key + 8)) != NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid derived channel %s: %s\n", timeStringBuffer, key + 8, derivedError);
+                result = E_CONF_FILE;
+                goto DONE;
+            }
+            if (((config->derivedNames[config->derivedCount] = (char *)malloc(strlen(key + 8) + 1)) == NULL) ||
+                ((config->derivedExpressions[config->derivedCount] = (char *)malloc(strlen(value) + 1)) == NULL)) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for derived channel: %s\n", timeStringBuffer, strerror(errno));
+                free(config->derivedNames[config->derivedCount]);
+                config->derivedNames[config->derivedCount] = NULL;
+                result = E_MALLOC;
+                goto DONE;
+            }
+            strcpy(config->derivedNames[config->derivedCount], key + 8);
+            strcpy(config->derivedExpressions[config->derivedCount], value);
+            config->derivedCount++;
+            continue;
+        }
+        if ((sink = find_sink_key(key, &setting)) >= 0) {
+            if (strcmp(setting, "sink") == 0) {
+                str_tolower(value);
+                if ((strcmp(value, "yes") == 0) || (strcmp(value, "on") == 0) || (strcmp(value, "true") == 0) || (strcmp(value, "1") == 0))
+                    config->sinks[sink].enabled = 1;
+                else if ((strcmp(value, "no") == 0) || (strcmp(value, "off") == 0) || (strcmp(value, "false") == 0) || (strcmp(value, "0") == 0))
+                    config->sinks[sink].enabled = 0;
+                else {
+                    msgtime = time(NULL);
+                    tm_info = localtime(&msgtime);
+                    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                    fprintf(stderr, "%s - Invalid %s setting: %s\n", timeStringBuffer, key, value);
+                    result = E_CONF_FILE;
+                    goto DONE;
+                }
+            }
+            else if (strcmp(setting, "queue") == 0) {
+                if ((config->sinks[sink].queueSize = atoi(value)) < 1) {
+                    msgtime = time(NULL);
+                    tm_info = localtime(&msgtime);
+                    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                    fprintf(stderr, "%s - Invalid %s size: %s\n", timeStringBuffer, key, value);
+                    result = E_CONF_FILE;
+                    goto DONE;
+                }
+            }
+            else if (strcmp(setting, "retries") == 0) {
+                if ((config->sinks[sink].retries = atoi(value)) < 0) {
+                    msgtime = time(NULL);
+                    tm_info = localtime(&msgtime);
+                    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                    fprintf(stderr, "%s - Invalid number of %s: %s\n", timeStringBuffer, key, value);
+                    result = E_CONF_FILE;
+                    goto DONE;
+                }
+            }
+            else if (strcmp(setting, "when-full") == 0) {
+                str_tolower(value);
+                if (strcmp(value, "drop-oldest") == 0)
+                    config->sinks[sink].whenFull = SINK_DROP_OLDEST;
+                else if (strcmp(value, "drop-newest") == 0)
+                    config->sinks[sink].whenFull = SINK_DROP_NEWEST;
+                else {
+                    msgtime = time(NULL);
+                    tm_info = localtime(&msgtime);
+                    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                    fprintf(stderr, "%s - Invalid %s setting: %s\n", timeStringBuffer, key, value);
+                    result = E_CONF_FILE;
+                    goto DONE;
+                }
+            }
+            continue;
+        }
     }
 
-    return localSerialPort;
+DONE:
+    fclose(fp);
+    if (line)
+        free(line);
+    if (sectionName)
+        free(sectionName);
+
+    return result;
 }
 
-int init_rrd_database(struct _CONFIGSTRUCT *config) {
-    // Check counter databases
-    int result;
-    int baseLength;
+int init_serial(struct _CONFIGSTRUCT * config) {
+    struct termios tty;
+    int localSerialPort;
     char timeStringBuffer[26];
     struct tm * tm_info;
     time_t msgtime;
 
-    const char *createCounterDB[] = {
-        "DS:KWh_1_in:DCOUNTER:900:0.0:99999.0",
-        "DS:KWh_2_in:DCOUNTER:900:0.0:99999.0",
-        "DS:KWh_1_out:DCOUNTER:900:0.0:99999.0",
-        "DS:KWh_2_out:DCOUNTER:900:0.0:99999.0",
-        "DS:gas_in:DCOUNTER:900:0.0:99999.0",
-        "RRA:LAST:0.5:1:800",
-        "RRA:AVERAGE:0.5:6:800",
-        "RRA:AVERAGE:0.5:24:800",
-        "RRA:AVERAGE:0.5:288:800",
-        "RRA:MAX:0.5:6:800",
-        "RRA:MAX:0.5:24:800",
-        "RRA:MAX:0.5:288:800",
-        "RRA:MIN:0.5:6:800",
-        "RRA:MIN:0.5:24:800",
-        "RRA:MIN:0.5:288:800",
-        NULL
-    };
-    const char *createVoltageDB[] = {
-        "DS:V_max:GAUGE:900:0.0:999.0",
-        "DS:V_avg:GAUGE:900:0.0:999.0",
-        "DS:V_min:GAUGE:900:0.0:999.0",
-        "RRA:LAST:0.5:1:800",
-        "RRA:AVERAGE:0.5:6:800",
-        "RRA:AVERAGE:0.5:24:800",
-        "RRA:AVERAGE:0.5:288:800",
-        "RRA:MAX:0.5:6:800",
-        "RRA:MAX:0.5:24:800",
-        "RRA:MAX:0.5:288:800",
-        "RRA:MIN:0.5:6:800",
-        "RRA:MIN:0.5:24:800",
-        "RRA:MIN:0.5:288:800",
-        NULL
-    };
-    const char *createKwinoutDB[] = {
-        "DS:KW_max_in:GAUGE:900:0.0:999.0",
-        "DS:KW_avg_in:GAUGE:900:0.0:999.0",
-        "DS:KW_min_in:GAUGE:900:0.0:999.0",
-        "DS:KW_max_out:GAUGE:900:0.0:999.0",
-        "DS:KW_avg_out:GAUGE:900:0.0:999.0",
-        "DS:KW_min_out:GAUGE:900:0.0:999.0",
-        "RRA:LAST:0.5:1:800",
-        "RRA:AVERAGE:0.5:6:800",
-        "RRA:AVERAGE:0.5:24:800",
-        "RRA:AVERAGE:0.5:288:800",
-        "RRA:MAX:0.5:6:800",
-        "RRA:MAX:0.5:24:800",
-        "RRA:MAX:0.5:288:800",
-        "RRA:MIN:0.5:6:800",
-        "RRA:MIN:0.5:24:800",
-        "RRA:MIN:0.5:288:800",
-        NULL
-    };
+    // Network P1 dongle
+    if (is_tcp_device(config->serialPortFilename))
+        return init_tcp(config);
 
-    baseLength = strlen(config->databaseDirectory) + 15;
+    localSerialPort = open(config->serialPortFilename, O_RDWR);
 
-    if (access(config->databaseDirectory, R_OK | W_OK | X_OK) != 0) {
+    if (localSerialPort < 0) {
         msgtime = time(NULL);
         tm_info = localtime(&msgtime);
         strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-        fprintf(stderr, "%s - Cannot write in directory %s\n", timeStringBuffer, config->databaseDirectory);
-        return E_FILE_ACCESS;
+        fprintf(stderr, "%s - Error %i from open serialport %s: %s\n", timeStringBuffer, errno, config->serialPortFilename, strerror(errno));
+        return -1;
     }
 
-    if ((config->countersFilename = (char *)malloc(baseLength)) == NULL) {
+    if (tcgetattr(localSerialPort, &tty) != 0) {
         msgtime = time(NULL);
         tm_info = localtime(&msgtime);
         strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-        fprintf(stderr, "%s - Error claiming memory for counters filename name: %s\n", timeStringBuffer, strerror(errno));
-        return E_MALLOC;
+        fprintf(stderr, "%s - Error %i from tcgetattr: %s\n", timeStringBuffer, errno, strerror(errno));
+        close(localSerialPort);
+        return -2;
     }
-    strcpy(config->countersFilename, config->databaseDirectory);
-    strcat(config->countersFilename, "/counters.rrd");
 
-    if (access(config->countersFilename, F_OK) != 0) {
+    tty.c_cflag &= ~PARENB;         // No parity
+    tty.c_cflag |= config->serialPortParity;
+    tty.c_cflag &= ~CSTOPB;         // 1 stopbit
+    tty.c_cflag |= config->serialPortStopbits;
+    tty.c_cflag &= ~CSIZE;
+    tty.c_cflag |= config->serialPortBits;             // 8 bits
+    tty.c_cflag &= ~CRTSCTS;        // No hw flow control
+    tty.c_cflag |= CREAD | CLOCAL;
+
+    tty.c_lflag &= ~ICANON;
+    tty.c_lflag &= ~ECHO;
+    tty.c_lflag &= ~ISIG;
+
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY);
+    tty.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL);
+
+    tty.c_oflag &= ~OPOST;
+    tty.c_oflag &= ~ONLCR;
+
+    cfsetispeed(&tty, config->serialPortSpeed);
+    cfsetospeed(&tty, config->serialPortSpeed);
+
+    if (tcsetattr(localSerialPort, TCSANOW, &tty) != 0) {
         msgtime = time(NULL);
         tm_info = localtime(&msgtime);
         strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-        printf("%s - Create counters database file %s\n", timeStringBuffer, config->countersFilename);
-        fflush(stdout);
-        rrd_clear_error();
-        result = rrd_create_r(config->countersFilename, 300, 0, 15, createCounterDB);
-
-        if (rrd_test_error()) {
-            fprintf(stderr, "%s - RRD create error: %s\n", timeStringBuffer, rrd_get_error());
-            return E_RRD;
-        }
+        fprintf(stderr, "%s - Error %i from tcsetattr: %s\n", timeStringBuffer, errno, strerror(errno));
+        close(localSerialPort);
+        return -3;
     }
 
-    if ((config->voltageFilename = (char *)malloc(baseLength)) == NULL) {
+    return localSerialPort;
+}
+
+/*
+ * Data sources of every RRD file, generated from the channel tables
+ */
+#define P1_SOURCE_COUNTER(name, obis, file, source, label, unit) \
+    { file, "DS:" source ":DCOUNTER:900:0.0:99999.0" },
+#define P1_SOURCE_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) \
+    { file, "DS:" sourceMax ":GAUGE:900:0.0:999.0" }, \
+    { file, "DS:" sourceAvg ":GAUGE:900:0.0:999.0" }, \
+    { file, "DS:" sourceMin ":GAUGE:900:0.0:999.0" },
+static const struct {
+    int          file;
+    const char * definition;
+} rrdSources[] = {
+    P1_COUNTERS(P1_SOURCE_COUNTER)
+    P1_GAUGES(P1_SOURCE_GAUGE)
+};
+#undef P1_SOURCE_COUNTER
+#undef P1_SOURCE_GAUGE
+
+#define RRD_SOURCES (int)(sizeof(rrdSources) / sizeof(rrdSources[0]))
+
+#define P1_NAME_FILE(file, filename, description) filename,
+#define P1_DESCRIBE_FILE(file, filename, description) description,
+static const char *rrdNames[RRD_FILES] = { P1_RRD_FILES(P1_NAME_FILE) };
+static const char *rrdDescriptions[RRD_FILES] = { P1_RRD_FILES(P1_DESCRIBE_FILE) };
+#undef P1_NAME_FILE
+#undef P1_DESCRIBE_FILE
+
+static const char *rrdArchives[] = {
+    "RRA:LAST:0.5:1:800",
+    "RRA:AVERAGE:0.5:6:800",
+    "RRA:AVERAGE:0.5:24:800",
+    "RRA:AVERAGE:0.5:288:800",
+    "RRA:MAX:0.5:6:800",
+    "RRA:MAX:0.5:24:800",
+    "RRA:MAX:0.5:288:800",
+    "RRA:MIN:0.5:6:800",
+    "RRA:MIN:0.5:24:800",
+    "RRA:MIN:0.5:288:800"
+};
+
+#define RRD_ARCHIVES (int)(sizeof(rrdArchives) / sizeof(rrdArchives[0]))
+
+int init_rrd_database(struct _CONFIGSTRUCT *config) {
+    // Check counter databases
+    int result;
+    int count;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    const char *createDB[RRD_SOURCES + RRD_ARCHIVES + 1];
+#define P1_SKETCH_NAME(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) sketchName,
+    const char *channelNames[SKETCH_CHANNELS] = { P1_GAUGES(P1_SKETCH_NAME) };
+#undef P1_SKETCH_NAME
+    const char *percentileNames[SKETCH_RESOLUTIONS] = { "/percentiles.rrd", "/percentiles-hour.rrd", "/percentiles-day.rrd" };
+    const unsigned long percentileSteps[SKETCH_RESOLUTIONS] = { 300, 3600, 86400 };
+    const char *percentileLevels[3] = { "p50", "p95", "p99" };
+    char percentileSources[SKETCH_CHANNELS * 3][48];
+    const char *createPercentileDB[SKETCH_CHANNELS * 3 + 2];
+    char derivedFilename[512];
+
+    if (access(rrd_directory(config), R_OK | W_OK | X_OK) != 0) {
         msgtime = time(NULL);
         tm_info = localtime(&msgtime);
         strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-        fprintf(stderr, "%s - Error claiming memory for voltage filename name: %s\n", timeStringBuffer, strerror(errno));
-        return E_MALLOC;
+        fprintf(stderr, "%s - Cannot write in directory %s\n", timeStringBuffer, rrd_directory(config));
+        return E_FILE_ACCESS;
     }
-    strcpy(config->voltageFilename, config->databaseDirectory);
-    strcat(config->voltageFilename, "/voltage.rrd");
 
-    if (access(config->voltageFilename, F_OK) != 0) {
+    for (int f = 0; f < RRD_FILES; f++) {
+        if ((config->rrdFilenames[f] = (char *)malloc(strlen(rrd_directory(config)) + strlen(rrdNames[f]) + 1)) == NULL) {
+            msgtime = time(NULL);
+            tm_info = localtime(&msgtime);
+            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+            fprintf(stderr, "%s - Error claiming memory for %s filename name: %s\n", timeStringBuffer, rrdDescriptions[f], strerror(errno));
+            return E_MALLOC;
+        }
+        strcpy(config->rrdFilenames[f], rrd_directory(config));
+        strcat(config->rrdFilenames[f], rrdNames[f]);
+
+        if (access(config->rrdFilenames[f], F_OK) == 0)
+            continue;
+
+        count = 0;
+        for (int i = 0; i < RRD_SOURCES; i++) {
+            if (rrdSources[i].file == f)
+                createDB[count++] = rrdSources[i].definition;
+        }
+        for (int i = 0; i < RRD_ARCHIVES; i++)
+            createDB[count++] = rrdArchives[i];
+        createDB[count] = NULL;
+
         msgtime = time(NULL);
         tm_info = localtime(&msgtime);
         strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-        printf("%s - Create voltage database file %s\n", timeStringBuffer, config->voltageFilename);
+        printf("%s - Create %s database file %s\n", timeStringBuffer, rrdDescriptions[f], config->rrdFilenames[f]);
         fflush(stdout);
         rrd_clear_error();
-        result = rrd_create_r(config->voltageFilename, 300, 0, 13, createVoltageDB);
+        result = rrd_create_r(config->rrdFilenames[f], 300, 0, count, createDB);
 
         if (rrd_test_error()) {
             fprintf(stderr, "%s - RRD create error: %s\n", timeStringBuffer, rrd_get_error());
@@ -492,26 +1293,65 @@ int init_rrd_database(struct _CONFIGSTRUCT *config) {
         }
     }
 
-    if ((config->kwInOutFilename = (char *)malloc(baseLength)) == NULL) {
+    // Percentiles per bucket, hour and day, p50, p95 and p99 per channel
+    for (int r = 0; r < SKETCH_RESOLUTIONS; r++) {
+        if ((config->percentileFilenames[r] = (char *)malloc(strlen(rrd_directory(config)) + strlen(percentileNames[r]) + 1)) == NULL) {
+            msgtime = time(NULL);
+            tm_info = localtime(&msgtime);
+            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+            fprintf(stderr, "%s - Error claiming memory for percentile filename name: %s\n", timeStringBuffer, strerror(errno));
+            return E_MALLOC;
+        }
+        strcpy(config->percentileFilenames[r], rrd_directory(config));
+        strcat(config->percentileFilenames[r], percentileNames[r]);
+
+        if (access(config->percentileFilenames[r], F_OK) == 0)
+            continue;
+
+        for (int i = 0; i < SKETCH_CHANNELS * 3; i++) {
+            snprintf(percentileSources[i], sizeof(percentileSources[i]), "DS:%s_%s:GAUGE:%lu:0.0:999.0", channelNames[i / 3], percentileLevels[i % 3], percentileSteps[r] * 3);
+            createPercentileDB[i] = percentileSources[i];
+        }
+        createPercentileDB[SKETCH_CHANNELS * 3] = "RRA:LAST:0.5:1:800";
+        createPercentileDB[SKETCH_CHANNELS * 3 + 1] = NULL;
+
         msgtime = time(NULL);
         tm_info = localtime(&msgtime);
         strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-        fprintf(stderr, "%s - Error claiming memory for database directory name: %s\n", timeStringBuffer, strerror(errno));
-        return E_MALLOC;
+        printf("%s - Create percentile database file %s\n", timeStringBuffer, config->percentileFilenames[r]);
+        fflush(stdout);
+        rrd_clear_error();
+        result = rrd_create_r(config->percentileFilenames[r], percentileSteps[r], 0, SKETCH_CHANNELS * 3 + 1, createPercentileDB);
+
+        if (rrd_test_error()) {
+            fprintf(stderr, "%s - RRD create error: %s\n", timeStringBuffer, rrd_get_error());
+            return E_RRD;
+        }
     }
-    strcpy(config->kwInOutFilename, config->databaseDirectory);
-    strcat(config->kwInOutFilename, "/kwinout.rrd");
 
-    if (access(config->kwInOutFilename, F_OK) != 0) {
+    // Every derived channel has a file of its own, so channels can be added
+    for (int d = 0; d < derivedChannels.count; d++) {
+        snprintf(derivedFilename, sizeof(derivedFilename), "%s/derived-%s.rrd", rrd_directory(config), derivedChannels.name[d]);
+        if (access(derivedFilename, F_OK) == 0)
+            continue;
+
+        createDB[0] = "DS:max:GAUGE:900:U:U";
+        createDB[1] = "DS:avg:GAUGE:900:U:U";
+        createDB[2] = "DS:min:GAUGE:900:U:U";
+        for (int i = 0; i < RRD_ARCHIVES; i++)
+            createDB[3 + i] = rrdArchives[i];
+        createDB[3 + RRD_ARCHIVES] = NULL;
+
         msgtime = time(NULL);
         tm_info = localtime(&msgtime);
         strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-        printf("%s - Create kw database file %s\n\n", timeStringBuffer, config->kwInOutFilename);
+        printf("%s - Create derived database file %s\n", timeStringBuffer, derivedFilename);
         fflush(stdout);
         rrd_clear_error();
-        result = rrd_create_r(config->kwInOutFilename, 300, 0, 16, createKwinoutDB);
+        result = rrd_create_r(derivedFilename, 300, 0, 3 + RRD_ARCHIVES, createDB);
 
         if (rrd_test_error()) {
             fprintf(stderr, "%s - RRD create error: %s\n", timeStringBuffer, rrd_get_error());
@@ -522,16 +1362,48 @@ int init_rrd_database(struct _CONFIGSTRUCT *config) {
     return E_OK;
 }
 
-void init_arrays() {
-    for (int i = 0; i < 10; i++) {
-        timestampArray[i] = 0;
-        elecDataArray[i] = NULL;
-        gasDataArray[i] = NULL;
+void init_arrays(bucket_queue *queue) {
+    for (int i = 0; i < QUEUE_SIZE; i++) {
+        queue->timestampArray[i] = 0;
+        queue->elecDataArray[i] = NULL;
     }
+    memset(queue->rollups, 0, sizeof(queue->rollups));
+}
+
+/*
+ * Format the RRD update of one file for a bucket
+ *
+ * Returns the number of characters written
+ */
+int format_rrd_update(char *buffer, size_t size, int file, unsigned long timestamp, const elec_data *data) {
+    int length;
+
+    length = snprintf(buffer, size, "%ld", timestamp);
+
+#define P1_UPDATE_COUNTER(name, obis, rrdFile, source, label, unit) \
+    if (rrdFile == file) \
+        length += snprintf(buffer + length, size - length, ":%1.3lf", data->name);
+#define P1_UPDATE_GAUGE(name, obis, rrdFile, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) \
+    if (rrdFile == file) \
+        length += snprintf(buffer + length, size - length, ":%1.3lf:%1.3lf:%1.3lf", data->name##_max, data->name##_avg, data->name##_min);
+    P1_COUNTERS(P1_UPDATE_COUNTER)
+    P1_GAUGES(P1_UPDATE_GAUGE)
+#undef P1_UPDATE_COUNTER
+#undef P1_UPDATE_GAUGE
+
+    return length;
 }
 
-int update_rrd_database(struct _CONFIGSTRUCT *config) {
-    char values[128];
+/*
+ * Write a bucket to the databases and the bucket percentiles
+ *
+ * Returns E_OK or E_RRD
+ */
+int update_rrd_bucket(struct _CONFIGSTRUCT *config, unsigned long timestamp, const elec_data *data) {
+    char values[512];
+    char derivedFilename[512];
+    double min[SKETCH_CHANNELS];
+    double max[SKETCH_CHANNELS];
     int result;
     char timeStringBuffer[26];
     struct tm * tm_info;
@@ -541,142 +1413,456 @@ int update_rrd_database(struct _CONFIGSTRUCT *config) {
         NULL
     };
 
-    sprintf(values, "%ld:%1.3lf:%1.3lf:%1.3lf:%1.3lf:%1.3lf", timestampArray[readDataCounter] + 300, elecDataArray[readDataCounter]->kwh_1_in, elecDataArray[readDataCounter]->kwh_2_in, elecDataArray[readDataCounter]->kwh_1_out, elecDataArray[readDataCounter]->kwh_2_out, *gasDataArray[readDataCounter]);
+    for (int f = 0; f < RRD_FILES; f++) {
+        format_rrd_update(values, sizeof(values), f, timestamp + 300, data);
 
-    rrd_clear_error();
-    result = rrd_update_r(config->countersFilename, NULL, 1, updateCounters);
+        rrd_clear_error();
+        result = rrd_update_r(config->rrdFilenames[f], NULL, 1, updateCounters);
 
-    if (rrd_test_error()) {
-        msgtime = time(NULL);
-        tm_info = localtime(&msgtime);
-        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+        if (rrd_test_error()) {
+            msgtime = time(NULL);
+            tm_info = localtime(&msgtime);
+            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-        fprintf(stderr, "%s - RRD error in file %s: %s\n", timeStringBuffer, config->countersFilename, rrd_get_error());
-        return E_RRD;
+            fprintf(stderr, "%s - RRD error in file %s: %s\n", timeStringBuffer, config->rrdFilenames[f], rrd_get_error());
+            return E_RRD;
+        }
     }
 
-    sprintf(values, "%ld:%1.3lf:%1.3lf:%1.3lf", timestampArray[readDataCounter] + 300, elecDataArray[readDataCounter]->v_l1_max, elecDataArray[readDataCounter]->v_l1_avg, elecDataArray[readDataCounter]->v_l1_min);
+    bucket_range(data, min, max);
+    format_percentiles(values, sizeof(values), timestamp + 300, &data->sketch, min, max);
 
     rrd_clear_error();
-    result = rrd_update_r(config->voltageFilename, NULL, 1, updateCounters);
+    result = rrd_update_r(config->percentileFilenames[0], NULL, 1, updateCounters);
 
     if (rrd_test_error()) {
         msgtime = time(NULL);
         tm_info = localtime(&msgtime);
         strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-        fprintf(stderr, "%s - RRD error in file %s: %s\n", timeStringBuffer, config->voltageFilename, rrd_get_error());
+        fprintf(stderr, "%s - RRD error in file %s: %s\n", timeStringBuffer, config->percentileFilenames[0], rrd_get_error());
         return E_RRD;
     }
 
-    sprintf(values, "%ld:%1.3lf:%1.3lf:%1.3lf:%1.3lf:%1.3lf:%1.3lf", timestampArray[readDataCounter] + 300, elecDataArray[readDataCounter]->kw_in_max, elecDataArray[readDataCounter]->kw_in_avg, elecDataArray[readDataCounter]->kw_in_min, elecDataArray[readDataCounter]->kw_out_max, elecDataArray[readDataCounter]->kw_out_avg, elecDataArray[readDataCounter]->kw_out_min);
-
-    rrd_clear_error();
-    result = rrd_update_r(config->kwInOutFilename, NULL, 1, updateCounters);
-
-    if (rrd_test_error()) {
-        msgtime = time(NULL);
-        tm_info = localtime(&msgtime);
-        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+    // A lost derived channel does not hold up the bucket
+    for (int d = 0; d < derivedChannels.count; d++) {
+        snprintf(derivedFilename, sizeof(derivedFilename), "%s/derived-%s.rrd", rrd_directory(config), derivedChannels.name[d]);
+        if (data->derived_samples[d] > 0)
+            snprintf(values, sizeof(values), "%lu:%1.3lf:%1.3lf:%1.3lf", timestamp + 300, data->derived_max[d], data->derived_avg[d], data->derived_min[d]);
+        else
+            snprintf(values, sizeof(values), "%lu:U:U:U", timestamp + 300);
 
-        fprintf(stderr, "%s - RRD error in file %s: %s\n", timeStringBuffer, config->kwInOutFilename, rrd_get_error());
-        return E_RRD;
-    }
+        rrd_clear_error();
+        result = rrd_update_r(derivedFilename, NULL, 1, updateCounters);
 
-    timestampArray[readDataCounter] = 0;
-    free(elecDataArray[readDataCounter]);
-    elecDataArray[readDataCounter] = NULL;
-    free(gasDataArray[readDataCounter]);
-    gasDataArray[readDataCounter] = NULL;
+        if (rrd_test_error()) {
+            msgtime = time(NULL);
+            tm_info = localtime(&msgtime);
+            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-    if (readDataCounter != storeDataCounter) {
-        readDataCounter++;
-        if (readDataCounter >= 10)
-            readDataCounter = 0;
+            fprintf(stderr, "%s - RRD error in file %s: %s\n", timeStringBuffer, derivedFilename, rrd_get_error());
+        }
     }
 
     return E_OK;
 }
 
-int print_data(struct _CONFIGSTRUCT *config) {
+int print_data(bucket_queue *queue) {
     char timeStringBuffer[26];
     struct tm * tm_info;
-    time_t msgtime;
+    elec_data * data = queue->elecDataArray[queue->readDataCounter];
     int result = 0;
 
-    tm_info = localtime(&timestampArray[readDataCounter]);
+    tm_info = localtime((time_t *)&queue->timestampArray[queue->readDataCounter]);
     strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
     printf("-------------------------------------------------------\n");
     printf("Report time : %s\n", timeStringBuffer);
     printf("-------------------------------------------------------\n");
-    printf("Tariff group              1               2\n");
-    printf("Energy consumed   : %10.3lf KWh  %10.3lf KWh\n", elecDataArray[readDataCounter]->kwh_1_in, elecDataArray[readDataCounter]->kwh_2_in);
-    printf("Energt delivered  : %10.3lf KWh  %10.3lf KWh\n", elecDataArray[readDataCounter]->kwh_1_out, elecDataArray[readDataCounter]->kwh_2_out);
-    printf("                      min         avg         max\n");
-    printf("Power consumption : %7.3lf KW  %7.3lf KW  %7.3lf KW\n", elecDataArray[readDataCounter]->kw_in_min, elecDataArray[readDataCounter]->kw_in_avg, elecDataArray[readDataCounter]->kw_in_max);
-    printf("Power delivery    : %7.3lf KW  %7.3lf KW  %7.3lf KW\n", elecDataArray[readDataCounter]->kw_out_min, elecDataArray[readDataCounter]->kw_out_avg, elecDataArray[readDataCounter]->kw_out_max);
-    printf("L1 voltage drift  : %7.3lf V   %7.3lf V   %7.3lf V\n", elecDataArray[readDataCounter]->v_l1_min, elecDataArray[readDataCounter]->v_l1_avg, elecDataArray[readDataCounter]->v_l1_max);
-    printf("L1 Currents       : %7.3lf A   %7.3lf A   %7.3lf A\n", elecDataArray[readDataCounter]->i_l1_min, elecDataArray[readDataCounter]->i_l1_avg, elecDataArray[readDataCounter]->i_l1_max);
-    printf("\n");
-    printf("Gas consumpion    : %10.3lf m3\n", *gasDataArray[readDataCounter]);
+#define P1_PRINT_COUNTER(name, obis, file, source, label, unit) \
+    printf("%-20s: %10.3lf %s\n", label, data->name, unit);
+#define P1_PRINT_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) \
+    printf("%-20s: %7.3lf %-3s %7.3lf %-3s %7.3lf %s\n", label, data->name##_min, unit, data->name##_avg, unit, data->name##_max, unit);
+    P1_COUNTERS(P1_PRINT_COUNTER)
+    printf("                        min         avg         max\n");
+    P1_GAUGES(P1_PRINT_GAUGE)
+#undef P1_PRINT_COUNTER
+#undef P1_PRINT_GAUGE
+    for (int d = 0; d < derivedChannels.count; d++) {
+        if (data->derived_samples[d] > 0)
+            printf("%-20s: %11.3lf %11.3lf %11.3lf\n", derivedChannels.name[d], data->derived_min[d], data->derived_avg[d], data->derived_max[d]);
+    }
     printf("\n");
     fflush(stdout);
 
     return result;
 }
 
-int store_data(unsigned long timestamp, elec_data * eCummPointer, double * gCummPointer, int counter) {
+/*
+ * Turn the running sums of the gauges in averages
+ */
+void average_data(elec_data *data, int counter) {
+#define P1_AVERAGE_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) \
+    data->name##_avg /= counter;
+    P1_GAUGES(P1_AVERAGE_GAUGE)
+#undef P1_AVERAGE_GAUGE
+
+    average_derived(data);
+}
+
+int store_data(bucket_queue *queue, unsigned long timestamp, elec_data * eCummPointer, int counter) {
 
     if (counter == 0)
         return 0;
     
     // Calculate averages
-    eCummPointer->kw_in_avg /= counter;
-    eCummPointer->kw_out_avg /= counter;
-    eCummPointer->v_l1_avg /= counter;
-    eCummPointer->v_l2_avg /= counter;
-    eCummPointer->v_l3_avg /= counter;
-    eCummPointer->i_l1_avg /= counter;
-    eCummPointer->i_l2_avg /= counter;
-    eCummPointer->i_l3_avg /= counter;
+    average_data(eCummPointer, counter);
+
+    // Queue full, drop the oldest bucket
+    if (queue->timestampArray[queue->storeDataCounter] != 0) {
+        free(queue->elecDataArray[queue->storeDataCounter]);
+
+        queue->readDataCounter++;
+        if (queue->readDataCounter >= QUEUE_SIZE)
+            queue->readDataCounter = 0;
+    }
+
+    queue->timestampArray[queue->storeDataCounter] = timestamp;
+    queue->elecDataArray[queue->storeDataCounter] = eCummPointer;
+    queue->storeDataCounter++;
+
+    if (queue->storeDataCounter >= QUEUE_SIZE)
+        queue->storeDataCounter = 0;
+
+    return 0;
+}
+
+/*
+ * Hand all closed buckets to the sinks
+ *
+ * The sinks write on their own threads, a slow or failing sink does not
+ * hold up the main loop.
+ *
+ * Parameters:
+ *   *queue  - The queue of closed buckets
+ *
+ * Returns E_OK
+ */
+int store_queue(bucket_queue *queue) {
+    while (queue->timestampArray[queue->readDataCounter] != 0) {
+        if (verbose != 0)
+            print_data(queue);
+
+        sink_bucket(queue->timestampArray[queue->readDataCounter], queue->elecDataArray[queue->readDataCounter]);
+        live_bucket(queue->timestampArray[queue->readDataCounter], queue->elecDataArray[queue->readDataCounter]);
+
+        queue->timestampArray[queue->readDataCounter] = 0;
+        free(queue->elecDataArray[queue->readDataCounter]);
+        queue->elecDataArray[queue->readDataCounter] = NULL;
+
+        queue->readDataCounter++;
+        if (queue->readDataCounter >= QUEUE_SIZE)
+            queue->readDataCounter = 0;
+    }
+
+    return E_OK;
+}
+
+/*
+ * Hand the buckets restored for the RRD sink to that sink only, the
+ * other sinks had them before the restart
+ *
+ * Parameters:
+ *   *queue  - The queue of restored buckets
+ *
+ * Returns E_OK
+ */
+int store_rrd_queue(bucket_queue *queue) {
+    while (queue->timestampArray[queue->readDataCounter] != 0) {
+        sink_bucket_to(&sinks[SINK_RRD], queue->timestampArray[queue->readDataCounter], queue->elecDataArray[queue->readDataCounter]);
+
+        queue->timestampArray[queue->readDataCounter] = 0;
+        free(queue->elecDataArray[queue->readDataCounter]);
+        queue->elecDataArray[queue->readDataCounter] = NULL;
+
+        queue->readDataCounter++;
+        if (queue->readDataCounter >= QUEUE_SIZE)
+            queue->readDataCounter = 0;
+    }
+
+    return E_OK;
+}
+
+/*
+ * Checkpoint the open bucket and the pending queue to the state file
+ *
+ * The pending buckets are the ones still waiting for the RRD sink,
+ * followed by the ones not yet handed to the sinks, QUEUE_SIZE at most.
+ * They are written before the open bucket, in the order restore_state()
+ * reads them. The state is written to a temporary file which is renamed over the
+ * previous checkpoint, so a crash never leaves a half written state file.
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+int save_state(struct _CONFIGSTRUCT *config) {
+    struct _STATEHEADER header;
+    static unsigned long pendingTimes[QUEUE_SIZE];
+    static elec_data pending[QUEUE_SIZE];
+    static sketch_rollup rollups[SKETCH_RESOLUTIONS - 1];
+    int pendingCount;
+    char tempFilename[512];
+    char * slash;
+    FILE * fp;
+    int directoryFd;
+    int index;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if (config->stateFilename == NULL)
+        return E_OK;
+
+    header.magic = STATE_MAGIC;
+    header.version = STATE_VERSION;
+    header.elecDataSize = sizeof(elec_data);
+    header.lastMeasureTime = aggrState.lastMeasureTime;
+    header.counter = (aggrState.eCummPointer != NULL) ? aggrState.counter : 0;
+    header.queueLength = 0;
+
+    index = bucketQueue.readDataCounter;
+    for (int i = 0; i < QUEUE_SIZE && bucketQueue.timestampArray[index] != 0; i++) {
+        header.queueLength++;
+        if (++index >= QUEUE_SIZE)
+            index = 0;
+    }
+
+    pendingCount = sink_pending(&sinks[SINK_RRD], pendingTimes, pending, QUEUE_SIZE - header.queueLength);
+    sink_snapshot(&sinks[SINK_RRD], rollups, bucketQueue.rollups, sizeof(rollups));
+    header.queueLength += pendingCount;
+    header.rrdPending = pendingCount;
+
+    snprintf(tempFilename, sizeof(tempFilename), "%s.tmp", config->stateFilename);
+
+    if ((fp = fopen(tempFilename, "w")) == NULL) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error %i from open statefile %s: %s\n", timeStringBuffer, errno, tempFilename, strerror(errno));
+        return E_FILE_ACCESS;
+    }
+
+    fwrite(&header, sizeof(header), 1, fp);
+
+    for (int i = 0; i < pendingCount; i++) {
+        fwrite(&pendingTimes[i], sizeof(unsigned long), 1, fp);
+        fwrite(&pending[i], sizeof(elec_data), 1, fp);
+    }
 
-    timestampArray[storeDataCounter] = timestamp;
-    elecDataArray[storeDataCounter] = eCummPointer;
-    gasDataArray[storeDataCounter] = gCummPointer;
-    storeDataCounter++;
+    index = bucketQueue.readDataCounter;
+    for (int i = pendingCount; i < header.queueLength; i++) {
+        fwrite(&bucketQueue.timestampArray[index], sizeof(unsigned long), 1, fp);
+        fwrite(bucketQueue.elecDataArray[index], sizeof(elec_data), 1, fp);
+        if (++index >= QUEUE_SIZE)
+            index = 0;
+    }
+
+    if (header.counter > 0) {
+        fwrite(aggrState.eCummPointer, sizeof(elec_data), 1, fp);
+    }
+
+    fwrite(rollups, sizeof(rollups), 1, fp);
+
+    fwrite(&demandState.peakMonth, sizeof(int), 1, fp);
+    fwrite(demandState.peak, sizeof(demandState.peak), 1, fp);
+    fwrite(demandState.peakTime, sizeof(demandState.peakTime), 1, fp);
+
+    // On disk before the rename, a power cut leaves the old or the new checkpoint
+    if ((fflush(fp) != 0) || ferror(fp) || (fsync(fileno(fp)) != 0)) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error writing statefile %s: %s\n", timeStringBuffer, tempFilename, strerror(errno));
+        fclose(fp);
+        unlink(tempFilename);
+        return E_FILE_ACCESS;
+    }
+    fclose(fp);
+
+    if (rename(tempFilename, config->stateFilename) != 0) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error %i from rename statefile %s: %s\n", timeStringBuffer, errno, config->stateFilename, strerror(errno));
+        unlink(tempFilename);
+        return E_FILE_ACCESS;
+    }
+
+    // The rename is durable once the directory is
+    if ((slash = strrchr(tempFilename, '/')) != NULL)
+        *(slash == tempFilename ? slash + 1 : slash) = '\0';
+    else
+        strcpy(tempFilename, ".");
+    if ((directoryFd = open(tempFilename, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+        fsync(directoryFd);
+        close(directoryFd);
+    }
+
+    lastCheckpoint = time(NULL);
+
+    return E_OK;
+}
+
+/*
+ * Restore the open bucket and the pending queue from the state file
+ *
+ * The open bucket is only resumed when it still belongs to the current
+ * interval, an older bucket is closed and queued for storage. A missing,
+ * truncated or incompatible state file is ignored.
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *
+ * Returns E_OK or E_MALLOC
+ */
+int restore_state(struct _CONFIGSTRUCT *config) {
+    struct _STATEHEADER header;
+    unsigned long timestamp;
+    elec_data * elecPointer;
+    FILE * fp;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if ((config->stateFilename == NULL) || ((fp = fopen(config->stateFilename, "r")) == NULL))
+        return E_OK;
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    if ((fread(&header, sizeof(header), 1, fp) != 1) || (header.magic != STATE_MAGIC) || (header.version != STATE_VERSION) || (header.elecDataSize != sizeof(elec_data)) || (header.counter < 0) || (header.queueLength < 0) || (header.queueLength > QUEUE_SIZE) || (header.rrdPending < 0) || (header.rrdPending > header.queueLength)) {
+        fprintf(stderr, "%s - Ignoring invalid statefile %s\n", timeStringBuffer, config->stateFilename);
+        fclose(fp);
+        return E_OK;
+    }
+
+    // Pending buckets first, they are older than the open bucket
+    for (int i = 0; i < header.queueLength + ((header.counter > 0) ? 1 : 0); i++) {
+        if ((elecPointer = (elec_data *)malloc(sizeof(elec_data))) == NULL) {
+            fprintf(stderr, "%s - Error, could not allocate %lu bytes of memory!", timeStringBuffer, sizeof(elec_data));
+            fclose(fp);
+            return E_MALLOC;
+        }
 
-    if (storeDataCounter >= 10) {
-        storeDataCounter = 0;
-        if (storeDataCounter == readDataCounter) {
-            readDataCounter++;
-            if (readDataCounter >= 10)
-                readDataCounter = 0;
+        if (i < header.queueLength) {
+            if ((fread(&timestamp, sizeof(unsigned long), 1, fp) != 1) || (fread(elecPointer, sizeof(elec_data), 1, fp) != 1)) {
+                free(elecPointer);
+                break;
+            }
+
+            // Already averaged, store as a single sample. The first ones only
+            // the RRD sink still needs, the other sinks had them
+            store_data((i < header.rrdPending) ? &rrdQueue : &bucketQueue, timestamp, elecPointer, 1);
+            continue;
+        }
+
+        // The open bucket
+        if (fread(elecPointer, sizeof(elec_data), 1, fp) != 1) {
+            free(elecPointer);
+            break;
+        }
+
+        if (header.lastMeasureTime == (unsigned long)msgtime / 300) {
+            aggrState.lastMeasureTime = header.lastMeasureTime;
+            aggrState.counter = header.counter;
+            aggrState.eCummPointer = elecPointer;
+
+            printf("%s - Resumed interval with %d samples from statefile %s\n", timeStringBuffer, header.counter, config->stateFilename);
+        }
+        else {
+            store_data(&bucketQueue, header.lastMeasureTime * 300, elecPointer, header.counter);
+
+            printf("%s - Closed interval with %d samples from statefile %s\n", timeStringBuffer, header.counter, config->stateFilename);
+        }
+        fflush(stdout);
+    }
 
-            timestampArray[readDataCounter] = 0;
-            free (elecDataArray[readDataCounter]);
-            free (gasDataArray[readDataCounter]);
-        }
+    // Continue the open hour and day, they are written when they close
+    if (fread(bucketQueue.rollups, sizeof(bucketQueue.rollups), 1, fp) != 1)
+        memset(bucketQueue.rollups, 0, sizeof(bucketQueue.rollups));
+
+    // The peak of the month so far, replaced when the month has passed
+    if ((fread(&demandState.peakMonth, sizeof(int), 1, fp) != 1) ||
+        (fread(demandState.peak, sizeof(demandState.peak), 1, fp) != 1) ||
+        (fread(demandState.peakTime, sizeof(demandState.peakTime), 1, fp) != 1)) {
+        demandState.peakMonth = 0;
+        memset(demandState.peak, 0, sizeof(demandState.peak));
+        memset(demandState.peakTime, 0, sizeof(demandState.peakTime));
     }
 
-    return 0;
+    fclose(fp);
+
+    return E_OK;
 }
 
-int parse_block(char * dataPointer) {
-    static regex_t * reElecPointer = NULL;
-    static regex_t * reGasPointer = NULL;
-    static int counter = 0;
-    static elec_data * eCummPointer = NULL;
-    static double * gCummPointer = NULL;
-    static unsigned long lastMeasureTime = 0;
+/*
+ * OBIS references of the telegram lines that are stored
+ */
+static const struct {
+    const char * key;
+    int          field;
+} parseFields[] = {
+#define P1_PARSE_COUNTER(name, obis, file, source, label, unit) { obis, FIELD_##name },
+#define P1_PARSE_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) { obis, FIELD_##name },
+    P1_COUNTERS(P1_PARSE_COUNTER)
+    P1_GAUGES(P1_PARSE_GAUGE)
+#undef P1_PARSE_COUNTER
+#undef P1_PARSE_GAUGE
+    { NULL, FIELD_NONE }
+};
+
+/*
+ * Parse a CRC checked telegram into the open bucket of a meter
+ *
+ * The regular expressions are compiled once per thread, so meters can be
+ * parsed concurrently from worker threads. Most lines do not change from
+ * one telegram to the next. A line with the same fingerprint as the line
+ * at the same position in the previous telegram is not matched and
+ * converted again, only its value is aggregated.
+ *
+ * Parameters:
+ *   *state              - Aggregation state of the meter
+ *   *dataPointer        - The telegram, modified in place
+ *   currentMeasureTime  - Time of the telegram, selects the bucket
+ *
+ * Returns E_OK or an error code
+ */
+int parse_block(aggr_state *state, char * dataPointer, unsigned long currentMeasureTime) {
+    static __thread regex_t * reElecPointer = NULL;
+    static __thread regex_t * reGasPointer = NULL;
 
     regmatch_t matchPointer[5];
+    elec_data * eCummPointer;
+    int counter;
     double tempValue;
-    unsigned long currentMeasureTime;
+    double kwIn = -1.0;
+    double kwOut = 0.0;
     char error[80];
     char key[15];
     char value[15];
     char * currLinePointer;
     char * nextLinePointer;
+    unsigned long long hash;
+    int length;
+    int lineNumber = 0;
+    int field;
+    line_fingerprint * line;
+    double values[FIELDS];
     int reError;
     char timeStringBuffer[26];
     struct tm * tm_info;
@@ -713,18 +1899,19 @@ int parse_block(char * dataPointer) {
         return 0;
     }
 
-    currentMeasureTime = (unsigned long)time(NULL);
-
-    if (lastMeasureTime == 0) {
-        lastMeasureTime = currentMeasureTime / 300;
+    if (state->lastMeasureTime == 0) {
+        state->lastMeasureTime = currentMeasureTime / 300;
     }
 
-    if ((currentMeasureTime / 300) != lastMeasureTime) {
-        store_data(lastMeasureTime * 300, eCummPointer, gCummPointer, counter);
-        counter = 0;
-        lastMeasureTime = currentMeasureTime / 300;
+    if ((currentMeasureTime / 300) != state->lastMeasureTime) {
+        store_data(state->queue, state->lastMeasureTime * 300, state->eCummPointer, state->counter);
+        state->counter = 0;
+        state->lastMeasureTime = currentMeasureTime / 300;
     }
 
+    eCummPointer = state->eCummPointer;
+    counter = state->counter;
+
     if (counter == 0) {
         if ((eCummPointer = (elec_data *)malloc(sizeof(elec_data))) == NULL) {
             msgtime = time(NULL);
@@ -736,22 +1923,26 @@ int parse_block(char * dataPointer) {
         }
         memset(eCummPointer, '\0', sizeof(elec_data));
 
-        if ((gCummPointer = (double *)malloc(sizeof(double))) == NULL) {
-            msgtime = time(NULL);
-            tm_info = localtime(&msgtime);
-            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+        state->eCummPointer = eCummPointer;
+    }
 
-            fprintf(stderr, "%s - Error, could not allocate %d bytes of memory!", timeStringBuffer, sizeof(double));
-            return E_MALLOC;
-        }
+    // The channels of this telegram, for the derived channels
+    if (derivedChannels.count > 0) {
+        for (int f = 0; f < FIELDS; f++)
+            values[f] = NAN;
     }
 
     while ((currLinePointer = nextLinePointer)) {
-        if ((nextLinePointer = strchr(currLinePointer, '\n')) == NULL) {
+        // Find the end of the line and fingerprint it in the same pass
+        hash = 14695981039346656037ULL;
+        for (nextLinePointer = currLinePointer; (*nextLinePointer != '\n') && (*nextLinePointer != '\0'); nextLinePointer++)
+            hash = (hash ^ (unsigned char)*nextLinePointer) * 1099511628211ULL;
+
+        if (*nextLinePointer == '\0') {
             break;
         }
 
-
+        length = nextLinePointer - currLinePointer;
         *nextLinePointer = '\0';
         nextLinePointer++;
 
@@ -764,256 +1955,813 @@ int parse_block(char * dataPointer) {
         if (*currLinePointer == '!')
             break;
 
-        // Parse line
-        if (regexec(reElecPointer, currLinePointer, 4, matchPointer, 0) != 0) {
-            if (regexec(reGasPointer, currLinePointer, 4, matchPointer, 0) != 0) {
-                continue;
+        line = (lineNumber < PARSE_MAX_LINES) ? &state->lines[lineNumber] : NULL;
+        lineNumber++;
+
+        // Unchanged since the previous telegram, the decoded line still holds
+        if ((line != NULL) && (line->length == length) && (line->hash == hash)) {
+            field = line->field;
+            tempValue = line->value;
+        }
+        else {
+            field = FIELD_NONE;
+            tempValue = 0.0;
+
+            // Parse line
+            if ((regexec(reElecPointer, currLinePointer, 4, matchPointer, 0) == 0) || (regexec(reGasPointer, currLinePointer, 4, matchPointer, 0) == 0)) {
+                // Get key/value from input
+                if ((matchPointer[1].rm_eo - matchPointer[1].rm_so) >=  sizeof(key)) {
+                    msgtime = time(NULL);
+                    tm_info = localtime(&msgtime);
+                    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                    fprintf(stderr, "%s - Error, size of match > key!", timeStringBuffer);
+                    return E_REGEX_EXEC;
+                }
+                memcpy(key, &currLinePointer[matchPointer[1].rm_so], matchPointer[1].rm_eo - matchPointer[1].rm_so);
+                key[matchPointer[1].rm_eo - matchPointer[1].rm_so] = '\0';
+
+
+                if ((matchPointer[2].rm_eo - matchPointer[2].rm_so) >=  sizeof(value)) {
+                    msgtime = time(NULL);
+                    tm_info = localtime(&msgtime);
+                    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                    fprintf(stderr, "%s - Error, size of match > value!", timeStringBuffer);
+                    return E_REGEX_EXEC;
+                }
+                memcpy(value, &currLinePointer[matchPointer[2].rm_so], matchPointer[2].rm_eo - matchPointer[2].rm_so);
+                value[matchPointer[2].rm_eo - matchPointer[2].rm_so] = '\0';
+
+                for (int i = 0; parseFields[i].key != NULL; i++) {
+                    if (strcmp(key, parseFields[i].key) == 0) {
+                        field = parseFields[i].field;
+                        tempValue = atof(value);
+                        break;
+                    }
+                }
+            }
+
+            if (line != NULL) {
+                line->hash = hash;
+                line->length = length;
+                line->field = field;
+                line->value = tempValue;
             }
         }
 
-        // Get key/value from input
-        if ((matchPointer[1].rm_eo - matchPointer[1].rm_so) >=  sizeof(key)) {
-            msgtime = time(NULL);
-            tm_info = localtime(&msgtime);
-            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+#define AGGREGATE(name, channel) \
+    if ((counter == 0) || (tempValue < eCummPointer->name##_min)) eCummPointer->name##_min = tempValue; \
+    eCummPointer->name##_avg += tempValue; \
+    if (tempValue > eCummPointer->name##_max) eCummPointer->name##_max = tempValue; \
+    sketch_add(&eCummPointer->sketch, channel, tempValue);
+
+#define P1_CASE_COUNTER(name, obis, file, source, label, unit) \
+        case FIELD_##name: \
+            eCummPointer->name = tempValue; \
+            break;
+#define P1_CASE_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) \
+        case FIELD_##name: \
+            AGGREGATE(name, SKETCH_##name) \
+            break;
 
-            fprintf(stderr, "%s - Error, size of match > key!", timeStringBuffer);
-            return E_REGEX_EXEC;
+        switch (field) {
+        P1_COUNTERS(P1_CASE_COUNTER)
+        P1_GAUGES(P1_CASE_GAUGE)
         }
-        memcpy(key, &currLinePointer[matchPointer[1].rm_so], matchPointer[1].rm_eo - matchPointer[1].rm_so);
-        key[matchPointer[1].rm_eo - matchPointer[1].rm_so] = '\0';
+#undef P1_CASE_COUNTER
+#undef P1_CASE_GAUGE
+#undef AGGREGATE
+
+        values[field] = tempValue;
+
+        // The power also feeds the demand engine
+        if (field == FIELD_kw_in)
+            kwIn = tempValue;
+        else if (field == FIELD_kw_out)
+            kwOut = tempValue;
+    }
+
+    if ((state->demand != NULL) && (kwIn >= 0.0))
+        demand_update(state->demand, currentMeasureTime, kwIn, kwOut);
+
+    if (derivedChannels.count > 0)
+        derive_telegram(state, eCummPointer, values);
+
+    state->lineCount = lineNumber;
+    state->counter++;
+    return 0;
+}
 
+void help_message(char * name) {
+    printf("Usage: %s [OPTIONS]\n\nOptions:\n", name);
+    printf("  -h|--help                      This message/n");
+    printf("  -v|--verbose                   /n");
+    printf("/n");
+    printf("  -c|--config <configfile>       The configfile location\n");
+    printf("  -d|--device <serialdevice>     The serial port to the meter, or tcp://host:port\n");
+    printf("  -s|--speed <serialspeed>       Communication speed (115200) or auto\n");
+    printf("  -p|--parity <parity>           Protocol parity bit (None)\n");
+    printf("  -b|--bits <databits>           Protocol databits   (8)\n");
+    printf("  -t|--stopbits <stopbits>       Protocol stopbits   (1)\n");
+    printf("/n");
+    printf("  --dbdir|--db-directory <Dir>   Directory to store databases>\n");
+    printf("/n");
+    printf("  --replay <time>                Write the archived telegrams from <time> (unix time or\n");
+    printf("                                 \"YYYY-MM-DD[ HH:MM:SS]\") to stdout and exit\n");
+    printf("  --import <file|archive dir>    Import P1 capture files or archives in the databases\n");
+    printf("                                 and exit, may be repeated, \"-\" reads stdin\n");
+    printf("/n");
+    fflush(stdout);
+}
+
+/*
+ * Set the configuration to the defaults
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *
+ * Returns E_OK or E_MALLOC
+ */
+int init_config(struct _CONFIGSTRUCT *config) {
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    memset(config, 0, sizeof(struct _CONFIGSTRUCT));
+
+    if ((config->databaseDirectory = (char *)malloc(sizeof(char) * 2)) == NULL) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error claiming memory for database directory name: %s\n", timeStringBuffer, strerror(errno));
+        return E_MALLOC;
+    }
+
+    config->serialPortFilename = NULL;
+    config->serialPortSpeed = B115200;
+    config->serialPortBits = CS8;
+    config->serialPortParity = PARNON;
+    config->serialPortStopbits = NSTOPB;
+    config->serialPortCrc = 1;
+    config->serialAutodetect = 0;
+    strcpy(config->databaseDirectory, ".");
+    for (int i = 0; i < RRD_FILES; i++)
+        config->rrdFilenames[i] = NULL;
+    for (int i = 0; i < SKETCH_RESOLUTIONS; i++)
+        config->percentileFilenames[i] = NULL;
+    config->stateFilename = NULL;
+    config->checkpointInterval = 10;
+    config->stagingDirectory = NULL;
+    config->syncInterval = 3600;
+    config->demandWindow = 900;
+    init_sink_settings(config->sinks);
+    config->influxUrl = NULL;
+    config->influxMeasurement = NULL;
+    config->influxTags = NULL;
+    config->influxToken = NULL;
+    config->influxTelegrams = 0;
+    config->influxBatch = 5000;
+    config->influxFlushInterval = 10;
+    config->influxGzip = 1;
+    config->mqttUrl = NULL;
+    config->mqttClientId = NULL;
+    config->mqttUsername = NULL;
+    config->mqttPassword = NULL;
+    config->mqttLiveTopic = NULL;
+    config->mqttBucketTopic = NULL;
+    config->mqttQos = 0;
+    config->mqttRetain = 1;
+    config->mqttInterval = 1;
+    config->mqttBuffer = 288;
+    config->graphDirectory = NULL;
+    config->graphs = NULL;
+    config->graphFormat = GRAPH_PNG;
+    config->graphWidth = 600;
+    config->graphHeight = 200;
+    config->derivedCount = 0;
+    config->controlSocketFilename = NULL;
+    config->networkTimeout = 30;
+    config->serverListen = NULL;
+    config->serverWorkers = 0;
+    config->serverIo = SERVER_IO_AUTO;
+    config->relayListen = NULL;
+    config->relaySocketFilename = NULL;
+    config->liveListen = NULL;
+    config->archive = 0;
+    config->replayFrom = -1;
+    config->importPaths = NULL;
+    config->importCount = 0;
+
+    return E_OK;
+}
+
+/*
+ * Release the memory claimed by the configuration
+ */
+void free_config(struct _CONFIGSTRUCT *config) {
+    free(config->serialPortFilename);
+    free(config->databaseDirectory);
+    for (int i = 0; i < RRD_FILES; i++)
+        free(config->rrdFilenames[i]);
+    for (int i = 0; i < SKETCH_RESOLUTIONS; i++)
+        free(config->percentileFilenames[i]);
+    free(config->stateFilename);
+    free(config->influxUrl);
+    free(config->influxMeasurement);
+    free(config->influxTags);
+    free(config->influxToken);
+    free(config->mqttUrl);
+    free(config->mqttClientId);
+    free(config->mqttUsername);
+    free(config->mqttPassword);
+    free(config->mqttLiveTopic);
+    free(config->mqttBucketTopic);
+    free(config->graphDirectory);
+    free(config->graphs);
+    free(config->stagingDirectory);
+    for (int i = 0; i < config->derivedCount; i++) {
+        free(config->derivedNames[i]);
+        free(config->derivedExpressions[i]);
+    }
+    free(config->controlSocketFilename);
+    free(config->serverListen);
+    free(config->relayListen);
+    free(config->relaySocketFilename);
+    free(config->liveListen);
+    for (int i = 0; i < config->importCount; i++)
+        free(config->importPaths[i]);
+    free(config->importPaths);
+    memset(config, 0, sizeof(struct _CONFIGSTRUCT));
+}
+
+/*
+ * Apply the commandline options on top of the configuration
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *   argc     - Number of commandline arguments
+ *   **argv   - The commandline arguments
+ *
+ * Returns E_OK, E_CLI_PARAM or E_MALLOC
+ */
+int parse_cmdline(struct _CONFIGSTRUCT *config, int argc, char **argv) {
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
 
-        if ((matchPointer[2].rm_eo - matchPointer[2].rm_so) >=  sizeof(value)) {
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-c") == 0) || (strcmp(argv[i], "--config") == 0)) {
+            // Skip, already read
+            i++;
+            continue;
+        }
+        if ((i + 1 >= argc) && (strcmp(argv[i], "-v") != 0) && (strcmp(argv[i], "--verbose") != 0)) {
             msgtime = time(NULL);
             tm_info = localtime(&msgtime);
             strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-            fprintf(stderr, "%s - Error, size of match > value!", timeStringBuffer);
-            return E_REGEX_EXEC;
+            fprintf(stderr, "%s - Missing value for option \"%s\"\n\n", timeStringBuffer, argv[i]);
+            return E_CLI_PARAM;
+        }
+        if ((strcmp(argv[i], "-d") == 0) || (strcmp(argv[i], "--device") == 0)) {
+            i++;
+            if (config->serialPortFilename != NULL)
+                free(config->serialPortFilename);
+            if ((config->serialPortFilename = (char *)malloc(strlen(argv[i]) + 1)) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for serial device name: %s\n", timeStringBuffer, strerror(errno));
+                return E_MALLOC;
+            }
+            strcpy(config->serialPortFilename, argv[i]);
+            continue;
+        }
+        if ((strcmp(argv[i], "-s") == 0) || (strcmp(argv[i], "--speed") == 0)) {
+            if (strcmp(str_tolower(argv[++i]), "auto") == 0) {
+                config->serialAutodetect = 1;
+                continue;
+            }
+            config->serialAutodetect = 0;
+            if ((config->serialPortSpeed = get_baudrate(atoi(argv[i]))) == 0) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid baudrate value: %s\n", timeStringBuffer, argv[i]);
+                return E_CLI_PARAM;
+            }
+            continue;
+        }
+        if ((strcmp(argv[i], "-p") == 0) || (strcmp(argv[i], "--parity") == 0)) {
+            char * val = str_tolower(argv[++i]);
+
+            if ((strcmp(val, "n") == 0) || (strcmp(val, "none") == 0))
+                config->serialPortParity = PARNON;
+            else if ((strcmp(val, "e") == 0) || (strcmp(val, "even") == 0))
+                config->serialPortParity = PARENB;
+            else if ((strcmp(val, "o") == 0) || (strcmp(val, "odd") == 0))
+                config->serialPortParity = PARENB | PARODD;
+            else {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid parity: %s\n", timeStringBuffer, argv[i]);
+                return E_CLI_PARAM;
+            }
+            continue;
+        }
+        if ((strcmp(argv[i], "-b") == 0) || (strcmp(argv[i], "--bits") == 0)) {
+            int bits = atoi(argv[++i]);
+            if ((bits < 5) || (bits > 8)) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid number of bits: %s\n", timeStringBuffer, argv[i]);
+                return E_CLI_PARAM;
+            }
+            config->serialPortBits = ((bits - 5) << 4);
+            continue;
+        }
+        if ((strcmp(argv[i], "-t") == 0) || (strcmp(argv[i], "--stopbits") == 0)) {
+            int stopbits = atoi(argv[++i]);
+            if ((stopbits < 1) || (stopbits > 2)) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Invalid number of stopbits: %s\n", timeStringBuffer, argv[i]);
+                return E_CLI_PARAM;
+            }
+            config->serialPortStopbits = ((stopbits - 1) << 6);
+            continue;
+        }
+        if ((strcmp(argv[i], "--dbdir") == 0) || (strcmp(argv[i], "--db-directory") == 0)) {
+            if (config->databaseDirectory != NULL)
+                free(config->databaseDirectory);
+            if ((config->databaseDirectory = (char *)malloc(sizeof(char) * (strlen(argv[++i]) + 1))) == NULL) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for database directory name: %s\n", timeStringBuffer, strerror(errno));
+                return E_MALLOC;
+            }
+            strcpy(config->databaseDirectory, argv[i]);
+            continue;
+        }
+        if (strcmp(argv[i], "--import") == 0) {
+            char ** paths;
+
+            if (((paths = (char **)realloc(config->importPaths, (config->importCount + 1) * sizeof(char *))) == NULL) || ((paths[config->importCount] = strdup(argv[++i])) == NULL)) {
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                fprintf(stderr, "%s - Error claiming memory for import file name: %s\n", timeStringBuffer, strerror(errno));
+                if (paths != NULL)
+                    config->importPaths = paths;
+                return E_MALLOC;
+            }
+            config->importPaths = paths;
+            config->importCount++;
+            continue;
+        }
+        if (strcmp(argv[i], "--replay") == 0) {
+            struct tm replayTime;
+            char * end;
+
+            config->replayFrom = strtol(argv[++i], &end, 10);
+            if ((*end != '\0') || (config->replayFrom < 0)) {
+                memset(&replayTime, 0, sizeof(replayTime));
+                if (((end = strptime(argv[i], "%Y-%m-%d", &replayTime)) == NULL) || ((*end != '\0') && ((end = strptime(end, " %H:%M:%S", &replayTime)) == NULL)) || (*end != '\0')) {
+                    msgtime = time(NULL);
+                    tm_info = localtime(&msgtime);
+                    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+                    fprintf(stderr, "%s - Invalid replay time: %s\n", timeStringBuffer, argv[i]);
+                    return E_CLI_PARAM;
+                }
+                replayTime.tm_isdst = -1;
+                config->replayFrom = mktime(&replayTime);
+            }
+            continue;
+        }
+        if ((strcmp(argv[i], "-v") == 0) || (strcmp(argv[i], "--verbose") == 0)) {
+            verbose = 1;
+            continue;
+        }
+
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Unknown option \"%s\"\n\n", timeStringBuffer, argv[i]);
+        help_message(argv[0]);
+        return E_CLI_PARAM;
+    }
+
+    return E_OK;
+}
+
+/*
+ * Derive the state filename from the database directory when it is not set
+ *
+ * Returns E_OK or E_MALLOC
+ */
+int init_state_filename(struct _CONFIGSTRUCT *config) {
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if (config->stateFilename != NULL)
+        return E_OK;
+
+    if ((config->stateFilename = (char *)malloc(strlen(config->databaseDirectory) + 19)) == NULL) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error claiming memory for state filename: %s\n", timeStringBuffer, strerror(errno));
+        return E_MALLOC;
+    }
+    strcpy(config->stateFilename, config->databaseDirectory);
+    strcat(config->stateFilename, "/slimmemeter.state");
+
+    return E_OK;
+}
+
+/*
+ * Keep a string setting that only takes effect on restart, the new one
+ * is freed with the new configuration
+ *
+ * Returns 1 when the new configuration changed it, else 0
+ */
+int keep_setting(char **newSetting, char **setting) {
+    char * swapPointer = *newSetting;
+    int changed = ((*newSetting == NULL) != (*setting == NULL)) || ((*newSetting != NULL) && (strcmp(*newSetting, *setting) != 0));
+
+    *newSetting = *setting;
+    *setting = swapPointer;
+
+    return changed;
+}
+
+/*
+ * Re-read the configfile and apply what changed
+ *
+ * The serial port is only reopened and the databases are only
+ * re-initialised when their settings changed. When that fails the current
+ * port or database directory stays in use. The aggregation state is not
+ * touched. The derived channels and the sinks are set up at startup,
+ * changes to them are logged and take effect on restart.
+ *
+ * Parameters:
+ *   *config      - Pointer to the active configuration
+ *   *configFile  - The configfile to read
+ *   argc, **argv - Commandline options, these still override the configfile
+ *
+ * Returns E_OK or the error of the failing step
+ */
+int reload_config(struct _CONFIGSTRUCT *config, char *configFile, int argc, char **argv) {
+    struct _CONFIGSTRUCT newConfig;
+    int newSerialPort;
+    int switchedDirectory = 0;
+    int stagingFailed = 0;
+    int stagingMoved = 0;
+    int oldVerbose = verbose;
+    int changed;
+    int result;
+    char * swapPointer;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    printf("%s - Reloading configfile %s\n", timeStringBuffer, configFile);
+    fflush(stdout);
+
+    if ((result = init_config(&newConfig)) != E_OK)
+        return result;
+
+    if (((result = read_config(&newConfig, configFile)) != E_OK) || ((result = parse_cmdline(&newConfig, argc, argv)) != E_OK)) {
+        verbose = oldVerbose;
+        fprintf(stderr, "%s - Keeping current configuration\n", timeStringBuffer);
+        free_config(&newConfig);
+        return result;
+    }
+    verbose = oldVerbose;
+
+    // A detected serial port keeps its settings while auto stays configured
+    if (newConfig.serialAutodetect && config->serialAutodetect && (newConfig.serialPortFilename != NULL) && (config->serialPortFilename != NULL) && (strcmp(newConfig.serialPortFilename, config->serialPortFilename) == 0)) {
+        newConfig.serialPortSpeed = config->serialPortSpeed;
+        newConfig.serialPortBits = config->serialPortBits;
+        newConfig.serialPortParity = config->serialPortParity;
+        newConfig.serialPortStopbits = config->serialPortStopbits;
+        newConfig.serialPortCrc = config->serialPortCrc;
+    }
+
+    // Serial port
+    if ((newConfig.serialPortFilename == NULL) || (config->serialPortFilename == NULL) || (strcmp(newConfig.serialPortFilename, config->serialPortFilename) != 0) || (newConfig.serialPortSpeed != config->serialPortSpeed) || (newConfig.serialPortBits != config->serialPortBits) || (newConfig.serialPortParity != config->serialPortParity) || (newConfig.serialPortStopbits != config->serialPortStopbits)) {
+        if ((newSerialPort = init_serial(&newConfig)) < 0) {
+            fprintf(stderr, "%s - Keeping serial port %s\n", timeStringBuffer, config->serialPortFilename);
+
+            swapPointer = newConfig.serialPortFilename;
+            newConfig.serialPortFilename = config->serialPortFilename;
+            config->serialPortFilename = swapPointer;
+            newConfig.serialPortSpeed = config->serialPortSpeed;
+            newConfig.serialPortBits = config->serialPortBits;
+            newConfig.serialPortParity = config->serialPortParity;
+            newConfig.serialPortStopbits = config->serialPortStopbits;
+            newConfig.serialPortCrc = config->serialPortCrc;
         }
-        memcpy(value, &currLinePointer[matchPointer[2].rm_so], matchPointer[2].rm_eo - matchPointer[2].rm_so);
-        value[matchPointer[2].rm_eo - matchPointer[2].rm_so] = '\0';
+        else {
+            close(serialPort);
+            serialPort = newSerialPort;
+            init_framer(&serialFramer);
 
-        if (strcmp(key, "1-0:1.8.1") == 0)  {
-            // Usage KWh tariff 1
-            eCummPointer->kwh_1_in = atof(value);
-            continue;
+            printf("%s - Reopened serial port %s\n", timeStringBuffer, newConfig.serialPortFilename);
         }
+    }
 
-        if (strcmp(key, "1-0:1.8.2") == 0)  {
-            // Usage KWh tariff 2
-            eCummPointer->kwh_2_in = atof(value);
-            continue;
-        }
-        
-        if (strcmp(key, "1-0:2.8.1") == 0)  {
-            // Delivery KWh tariff 1
-            eCummPointer->kwh_1_out = atof(value);
-            continue;
-        }
-        
-        if (strcmp(key, "1-0:2.8.2") == 0)  {
-            // Delivery KWh tariff 2
-            eCummPointer->kwh_2_out = atof(value);
-            continue;
-        }
-        
-        if (strcmp(key, "1-0:1.7.0") == 0)  {
-            // Actual power usage KW
-            tempValue = atof(value);
-            if ((counter == 0) || (tempValue < eCummPointer->kw_in_min)) {
-                eCummPointer->kw_in_min = tempValue;
-            }
-            eCummPointer->kw_in_avg += tempValue;
-            if (tempValue > eCummPointer->kw_in_max) {
-                eCummPointer->kw_in_max = tempValue;
-            }
-        }
-        
-        if (strcmp(key, "1-0:2.7.0") == 0)  {
-            // Actual power delivery KW
-            tempValue = atof(value);
-            if ((counter == 0) || (tempValue < eCummPointer->kw_out_min)) {
-                eCummPointer->kw_out_min = tempValue;
-            }
-            eCummPointer->kw_out_avg += tempValue;
-            if (tempValue > eCummPointer->kw_out_max) {
-                eCummPointer->kw_out_max = tempValue;
-            }
-        }
-        
-        if (strcmp(key, "1-0:31.7.0") == 0)  {
-            // Actual current L1 in A
-            tempValue = atof(value);
-            if ((counter == 0) || (tempValue < eCummPointer->i_l1_min)) {
-                eCummPointer->i_l1_min = tempValue;
-            }
-            eCummPointer->i_l1_avg += tempValue;
-            if (tempValue > eCummPointer->i_l1_max) {
-                eCummPointer->i_l1_max = tempValue;
-            }
+    // Staging directory, the files in RAM stay where they are until a restart
+    if (((newConfig.stagingDirectory == NULL) != (config->stagingDirectory == NULL)) || ((newConfig.stagingDirectory != NULL) && (strcmp(newConfig.stagingDirectory, config->stagingDirectory) != 0)))
+        fprintf(stderr, "%s - Staging directory changes on restart\n", timeStringBuffer);
+    swapPointer = newConfig.stagingDirectory;
+    newConfig.stagingDirectory = config->stagingDirectory;
+    config->stagingDirectory = swapPointer;
+
+    // Derived channels, the open bucket and the databases are laid out for the current ones
+    changed = (newConfig.derivedCount != config->derivedCount);
+    for (int i = 0; i < newConfig.derivedCount; i++) {
+        if ((i >= config->derivedCount) || (strcmp(newConfig.derivedNames[i], config->derivedNames[i]) != 0) || (strcmp(newConfig.derivedExpressions[i], config->derivedExpressions[i]) != 0))
+            changed = 1;
+    }
+    if (changed)
+        fprintf(stderr, "%s - Derived channels change on restart\n", timeStringBuffer);
+    for (int i = 0; i < DERIVED_MAX; i++) {
+        keep_setting(&newConfig.derivedNames[i], &config->derivedNames[i]);
+        keep_setting(&newConfig.derivedExpressions[i], &config->derivedExpressions[i]);
+    }
+    changed = newConfig.derivedCount;
+    newConfig.derivedCount = config->derivedCount;
+    config->derivedCount = changed;
+
+    // Sinks, their threads copied the settings when they started
+    if (memcmp(newConfig.sinks, config->sinks, sizeof(config->sinks)) != 0)
+        fprintf(stderr, "%s - Sink settings change on restart\n", timeStringBuffer);
+    memcpy(newConfig.sinks, config->sinks, sizeof(config->sinks));
+
+    changed = keep_setting(&newConfig.influxUrl, &config->influxUrl);
+    changed |= keep_setting(&newConfig.influxMeasurement, &config->influxMeasurement);
+    changed |= keep_setting(&newConfig.influxTags, &config->influxTags);
+    changed |= keep_setting(&newConfig.influxToken, &config->influxToken);
+    changed |= (newConfig.influxTelegrams != config->influxTelegrams) || (newConfig.influxBatch != config->influxBatch) ||
+               (newConfig.influxFlushInterval != config->influxFlushInterval) || (newConfig.influxGzip != config->influxGzip);
+    if (changed)
+        fprintf(stderr, "%s - InfluxDB settings change on restart\n", timeStringBuffer);
+    newConfig.influxTelegrams = config->influxTelegrams;
+    newConfig.influxBatch = config->influxBatch;
+    newConfig.influxFlushInterval = config->influxFlushInterval;
+    newConfig.influxGzip = config->influxGzip;
+
+    changed = keep_setting(&newConfig.mqttUrl, &config->mqttUrl);
+    changed |= keep_setting(&newConfig.mqttClientId, &config->mqttClientId);
+    changed |= keep_setting(&newConfig.mqttUsername, &config->mqttUsername);
+    changed |= keep_setting(&newConfig.mqttPassword, &config->mqttPassword);
+    changed |= keep_setting(&newConfig.mqttLiveTopic, &config->mqttLiveTopic);
+    changed |= keep_setting(&newConfig.mqttBucketTopic, &config->mqttBucketTopic);
+    changed |= (newConfig.mqttQos != config->mqttQos) || (newConfig.mqttRetain != config->mqttRetain) ||
+               (newConfig.mqttInterval != config->mqttInterval) || (newConfig.mqttBuffer != config->mqttBuffer);
+    if (changed)
+        fprintf(stderr, "%s - MQTT settings change on restart\n", timeStringBuffer);
+    newConfig.mqttQos = config->mqttQos;
+    newConfig.mqttRetain = config->mqttRetain;
+    newConfig.mqttInterval = config->mqttInterval;
+    newConfig.mqttBuffer = config->mqttBuffer;
+
+    // The sinks use the database files, they wait until the switch is done
+    suspend_sinks();
+
+    // Staged files go back before those of another database directory are restored
+    if ((newConfig.stagingDirectory != NULL) && (strcmp(newConfig.databaseDirectory, config->databaseDirectory) != 0)) {
+        if (sync_staging(newConfig.stagingDirectory, config->databaseDirectory) != E_OK) {
+            stagingFailed = 1;
         }
-        
-        if (strcmp(key, "1-0:32.7.0") == 0)  {
-            // Actual voltage L1 in V
-            tempValue = atof(value);
-            if ((counter == 0) || (tempValue < eCummPointer->v_l1_min)) {
-                eCummPointer->v_l1_min = tempValue;
-            }
-            eCummPointer->v_l1_avg += tempValue;
-            if (tempValue > eCummPointer->v_l1_max) {
-                eCummPointer->v_l1_max = tempValue;
-            }
+        else {
+            clear_staging(newConfig.stagingDirectory);
+            stagingMoved = 1;
+            if (restore_staging(newConfig.stagingDirectory, newConfig.databaseDirectory) != E_OK)
+                stagingFailed = 1;
         }
+    }
 
-        if (strcmp(key, "1-0:51.7.0") == 0)  {
-            // Actual current L1 in A
-            tempValue = atof(value);
-            if ((counter == 0) || (tempValue < eCummPointer->i_l2_min)) {
-                eCummPointer->i_l2_min = tempValue;
-            }
-            eCummPointer->i_l2_avg += tempValue;
-            if (tempValue > eCummPointer->i_l2_max) {
-                eCummPointer->i_l2_max = tempValue;
-            }
-        }
+    // Database directory
+    if ((strcmp(newConfig.databaseDirectory, config->databaseDirectory) == 0) || stagingFailed || (init_rrd_database(&newConfig) != E_OK)) {
+        if (strcmp(newConfig.databaseDirectory, config->databaseDirectory) != 0)
+            fprintf(stderr, "%s - Keeping database directory %s\n", timeStringBuffer, config->databaseDirectory);
 
-        if (strcmp(key, "1-0:52.7.0") == 0)  {
-            // Actual voltage L1 in V
-            tempValue = atof(value);
-            if ((counter == 0) || (tempValue < eCummPointer->v_l2_min)) {
-                eCummPointer->v_l2_min = tempValue;
-            }
-            eCummPointer->v_l2_avg += tempValue;
-            if (tempValue > eCummPointer->v_l2_max) {
-                eCummPointer->v_l2_max = tempValue;
-            }
+        if (stagingMoved) {
+            clear_staging(newConfig.stagingDirectory);
+            restore_staging(newConfig.stagingDirectory, config->databaseDirectory);
         }
 
-        if (strcmp(key, "1-0:71.7.0") == 0)  {
-            // Actual current L1 in A
-            tempValue = atof(value);
-            if ((counter == 0) || (tempValue < eCummPointer->i_l3_min)) {
-                eCummPointer->i_l3_min = tempValue;
-            }
-            eCummPointer->i_l3_avg += tempValue;
-            if (tempValue > eCummPointer->i_l3_max) {
-                eCummPointer->i_l3_max = tempValue;
-            }
-        }
-        
-        if (strcmp(key, "1-0:72.7.0") == 0)  {
-            // Actual voltage L1 in V
-            tempValue = atof(value);
-            if ((counter == 0) || (tempValue < eCummPointer->v_l3_min)) {
-                eCummPointer->v_l3_min = tempValue;
-            }
-            eCummPointer->v_l3_avg += tempValue;
-            if (tempValue > eCummPointer->v_l3_max) {
-                eCummPointer->v_l3_max = tempValue;
-            }
+        swapPointer = newConfig.databaseDirectory;
+        newConfig.databaseDirectory = config->databaseDirectory;
+        config->databaseDirectory = swapPointer;
+        for (int i = 0; i < RRD_FILES; i++) {
+            swapPointer = newConfig.rrdFilenames[i];
+            newConfig.rrdFilenames[i] = config->rrdFilenames[i];
+            config->rrdFilenames[i] = swapPointer;
         }
-        
-        if (strcmp(key, "1-0:21.7.0") == 0)  {
-            // Actual power usage L1 in KW
+        for (int i = 0; i < SKETCH_RESOLUTIONS; i++) {
+            swapPointer = newConfig.percentileFilenames[i];
+            newConfig.percentileFilenames[i] = config->percentileFilenames[i];
+            config->percentileFilenames[i] = swapPointer;
         }
+    }
+    else {
+        printf("%s - Switched to database directory %s\n", timeStringBuffer, newConfig.databaseDirectory);
+        switchedDirectory = 1;
+        warm_history(&newConfig);
+        init_calendar(&calendar, newConfig.databaseDirectory);
+    }
 
-        if (strcmp(key, "1-0:22.7.0") == 0)  {
-            // Actual power delivery L1 in KW
-        }
-        
-        if (strcmp(key, "1-0:41.7.0") == 0)  {
-            // Actual power usage L1 in KW
+    // Telegram archive, follows the database directory
+    if (switchedDirectory || (newConfig.archive != config->archive)) {
+        close_archive(&telegramArchive);
+        if (newConfig.archive && (open_archive(&telegramArchive, newConfig.databaseDirectory) != E_OK)) {
+            fprintf(stderr, "%s - Telegram archive disabled\n", timeStringBuffer);
+            newConfig.archive = 0;
         }
+    }
 
-        if (strcmp(key, "1-0:42.7.0") == 0)  {
-            // Actual power delivery L1 in KW
+    // Demand window, the rolling average starts over
+    if (newConfig.demandWindow != config->demandWindow) {
+        if (init_demand(&demandState, newConfig.demandWindow) != E_OK) {
+            fprintf(stderr, "%s - Demand engine disabled\n", timeStringBuffer);
+            newConfig.demandWindow = 0;
         }
-        
-        if (strcmp(key, "1-0:61.7.0") == 0)  {
-            // Actual power usage L1 in KW
+    }
+
+    if ((result = init_state_filename(&newConfig)) != E_OK) {
+        resume_sinks();
+        free_config(&newConfig);
+        return result;
+    }
+
+    // Control socket
+    if (((newConfig.controlSocketFilename == NULL) != (config->controlSocketFilename == NULL)) || ((newConfig.controlSocketFilename != NULL) && (strcmp(newConfig.controlSocketFilename, config->controlSocketFilename) != 0))) {
+        close_control(config);
+        if (init_control(&newConfig) != E_OK) {
+            fprintf(stderr, "%s - Control socket disabled\n", timeStringBuffer);
+            free(newConfig.controlSocketFilename);
+            newConfig.controlSocketFilename = NULL;
         }
+    }
 
-        if (strcmp(key, "1-0:62.7.0") == 0)  {
-            // Actual power delivery L1 in KW
+    // Relay, subscribers reconnect when it moves
+    if (((newConfig.relayListen == NULL) != (config->relayListen == NULL)) || ((newConfig.relayListen != NULL) && (strcmp(newConfig.relayListen, config->relayListen) != 0)) ||
+        ((newConfig.relaySocketFilename == NULL) != (config->relaySocketFilename == NULL)) || ((newConfig.relaySocketFilename != NULL) && (strcmp(newConfig.relaySocketFilename, config->relaySocketFilename) != 0))) {
+        close_relay(config);
+        if (init_relay(&newConfig) != E_OK) {
+            fprintf(stderr, "%s - Relay disabled\n", timeStringBuffer);
+            close_relay(&newConfig);
+            free(newConfig.relayListen);
+            free(newConfig.relaySocketFilename);
+            newConfig.relayListen = NULL;
+            newConfig.relaySocketFilename = NULL;
         }
+    }
 
-        if (strcmp(key, "0-1:24.2.1") == 0)  {
-            // Gas delivery m3
-            *gCummPointer = atof(value);
+    // Live stream, clients reconnect when it moves
+    if (((newConfig.liveListen == NULL) != (config->liveListen == NULL)) || ((newConfig.liveListen != NULL) && (strcmp(newConfig.liveListen, config->liveListen) != 0))) {
+        close_live();
+        if (init_live(&newConfig) != E_OK) {
+            fprintf(stderr, "%s - Live stream disabled\n", timeStringBuffer);
+            close_live();
+            free(newConfig.liveListen);
+            newConfig.liveListen = NULL;
         }
     }
 
-    counter++;
-    return 0;
-}
+    // Graphs, the cached ones that are still current are kept
+    close_graphs();
+    if (init_graphs(&newConfig) != E_OK) {
+        fprintf(stderr, "%s - Graphs disabled\n", timeStringBuffer);
+        free(newConfig.graphDirectory);
+        newConfig.graphDirectory = NULL;
+    }
+
+    free_config(config);
+    *config = newConfig;
+    resume_sinks();
+
+    // Checkpoint right away, the state file may have moved
+    save_state(config);
 
-void help_message(char * name) {
-    printf("Usage: %s [OPTIONS]\n\nOptions:\n", name);
-    printf("  -h|--help                      This message/n");
-    printf("  -v|--verbose                   /n");
-    printf("/n");
-    printf("  -c|--config <configfile>       The configfile location\n");
-    printf("  -d|--device <serialdevice>     The serial port to the meter\n");
-    printf("  -s|--speed <serialspeed>       Communication speed (115200)\n");
-    printf("  -p|--parity <parity>           Protocol parity bit (None)\n");
-    printf("  -b|--bits <databits>           Protocol databits   (8)\n");
-    printf("  -t|--stopbits <stopbits>       Protocol stopbits   (1)\n");
-    printf("/n");
-    printf("  --dbdir|--db-directory <Dir>   Directory to store databases>\n");
-    printf("/n");
     fflush(stdout);
+    fflush(stderr);
+
+    return E_OK;
+}
+
+/*
+ * Handle a signal delivered through the signalfd
+ *
+ * SIGUSR1 toggles verbose mode, SIGHUP reloads the configfile and
+ * SIGTERM/SIGINT stop the main loop.
+ */
+void handle_signal(int signal, struct _CONFIGSTRUCT *config, char *configFile, int argc, char **argv) {
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    switch (signal) {
+    case SIGUSR1:
+        if ((verbose = (verbose == 0)?1:0) == 1) {
+            printf("%s - Enable verbose mode\n", timeStringBuffer);
+        }
+        else {
+            printf("%s - Disable verbose mode\n", timeStringBuffer);
+        }
+
+        fflush(stdout);
+        break;
+    case SIGHUP:
+        if (config->serverListen != NULL) {
+            fprintf(stderr, "%s - Reload is not supported in concentrator mode\n", timeStringBuffer);
+            break;
+        }
+
+        reload_config(config, configFile, argc, argv);
+        break;
+    case SIGTERM:
+    case SIGINT:
+        terminate = 1;
+        break;
+    }
 }
 
 int main(int argc, char **argv) {
     struct _CONFIGSTRUCT config;
     char defaultConfigFile[] = "/etc/slimmemeter.conf";
 
-    char checksumStr[5];
     char iobuffer[8192];
-    char dataBlock[2048];
-    char buffer;
     char * configFile = NULL;
-    char * dataPointer = dataBlock;
-    char * checksumPointer;
-    char * defaultDirectory;
     int result;
-    int status = S_IDLE;
-    int numchars;
-    int rrdErrors = 0;
-    unsigned short crc;
+    int signalFd;
+    int pollCount;
+    int controlCount;
+    int relayCount;
     char timeStringBuffer[26];
     struct tm * tm_info;
     time_t msgtime;
-
-    // Catch SIGUSR1
-    signal(SIGUSR1, signal_handler);
-
-    // Prepare config to defaults
-    if ((config.databaseDirectory = (char *)malloc(sizeof(char) * 2)) == NULL) {
+    sigset_t sigMask;
+    struct signalfd_siginfo sigInfo;
+    struct pollfd pollFds[2 + CONTROL_MAX_CLIENTS + 1 + RELAY_MAX_CLIENTS + 2 + LIVE_MAX_CLIENTS + 1];
+
+    // Deliver SIGUSR1, SIGHUP, SIGTERM and SIGINT through a signalfd
+    sigemptyset(&sigMask);
+    sigaddset(&sigMask, SIGUSR1);
+    sigaddset(&sigMask, SIGHUP);
+    sigaddset(&sigMask, SIGTERM);
+    sigaddset(&sigMask, SIGINT);
+    sigprocmask(SIG_BLOCK, &sigMask, NULL);
+
+    if ((signalFd = signalfd(-1, &sigMask, SFD_CLOEXEC)) < 0) {
         msgtime = time(NULL);
         tm_info = localtime(&msgtime);
         strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-        fprintf(stderr, "%s - Error claiming memory for database directory name: %s\n", timeStringBuffer, strerror(errno));
-        return E_MALLOC;
+        fprintf(stderr, "%s - Error %i from signalfd: %s\n", timeStringBuffer, errno, strerror(errno));
+        return E_FILE_ACCESS;
     }
 
-    config.serialPortFilename = NULL;
-    config.serialPortSpeed = B115200;
-    config.serialPortBits = CS8;
-    config.serialPortParity = PARNON;
-    config.serialPortStopbits = NSTOPB;
-    strcpy(config.databaseDirectory, ".");
-    config.countersFilename = NULL;
-    config.voltageFilename = NULL;
-    config.kwInOutFilename = NULL;
+    // Prepare config to defaults
+    if ((result = init_config(&config)) != E_OK)
+        return result;
 
     // Check cmdline parameters for configfile
     if (argc > 1) {
         for (int i = 1; i < argc; i++) {
-            if ((strcmp(argv[i], "-c") == 0) || (strcmp(argv[i], "--config") == 0)) {
+            if ((strcmp(argv[i], "-h") == 0) || (strcmp(argv[i], "--help") == 0)) {
+                help_message(argv[0]);
+                return 0;
+            }
+            if (((strcmp(argv[i], "-c") == 0) || (strcmp(argv[i], "--config") == 0)) && (i + 1 < argc)) {
                 configFile = argv[i + 1];
                 break;
             }
@@ -1028,239 +2776,244 @@ int main(int argc, char **argv) {
     if ((result = read_config(&config, configFile)) != 0)
         return result;
 
-    // Check cmdline parameters for configfile
-    if (argc > 1) {
-        for (int i = 1; i < argc; i++) {
-            if ((strcmp(argv[i], "-h") == 0) || (strcmp(argv[i], "--help") == 0)) {
-                help_message(argv[0]);
-                return 0;
-            }
-            if ((strcmp(argv[i], "-c") == 0) || (strcmp(argv[i], "--config") == 0)) {
-                // Skip, already read
-                i++;
-                continue;
-            }
-            if ((strcmp(argv[i], "-d") == 0) || (strcmp(argv[i], "--device") == 0)) {
-                i++;
-                if (config.serialPortFilename != NULL)
-                    free(config.serialPortFilename);
-                if ((config.serialPortFilename = (char *)malloc(strlen(argv[i]) + 1)) == NULL) {
-                    msgtime = time(NULL);
-                    tm_info = localtime(&msgtime);
-                    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
-
-                    fprintf(stderr, "%s - Error claiming memory for serial device name: %s\n", timeStringBuffer, strerror(errno));
-                    return E_MALLOC;
-                }
-                strcpy(config.serialPortFilename, argv[i]);
-                continue;
-            }
-            if ((strcmp(argv[i], "-s") == 0) || (strcmp(argv[i], "--speed") == 0)) {
-                if ((config.serialPortSpeed = get_baudrate(atoi(argv[++i]))) == 0) {
-                    msgtime = time(NULL);
-                    tm_info = localtime(&msgtime);
-                    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+    // Commandline options override the configfile
+    if ((result = parse_cmdline(&config, argc, argv)) != E_OK)
+        return result;
 
-                    fprintf(stderr, "%s - Invalid baudrate value: %s\n", timeStringBuffer, argv[i]);
-                    return E_CLI_PARAM;
-                }
-                continue;
-            }
-            if ((strcmp(argv[i], "-p") == 0) || (strcmp(argv[i], "--parity") == 0)) {
-                char * val = str_tolower(argv[++i]);
+    if ((result = init_derived(&config)) != E_OK)
+        return result;
 
-                if ((strcmp(val, "n") == 0) || (strcmp(val, "none") == 0))
-                    config.serialPortParity = PARNON;
-                else if ((strcmp(val, "e") == 0) || (strcmp(val, "even") == 0))
-                    config.serialPortParity = PARENB;
-                else if ((strcmp(val, "o") == 0) || (strcmp(val, "odd") == 0))
-                    config.serialPortParity = PARENB | PARODD;
-                else {
-                    msgtime = time(NULL);
-                    tm_info = localtime(&msgtime);
-                    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+    // Replay the archive and exit
+    if (config.replayFrom >= 0)
+        return replay_archive(config.databaseDirectory, config.replayFrom, stdout);
 
-                    fprintf(stderr, "%s - Invalid parity: %s\n", timeStringBuffer, argv[i]);
-                    return E_CLI_PARAM;
-                }
-                continue;
-            }
-            if ((strcmp(argv[i], "-b") == 0) || (strcmp(argv[i], "--bits") == 0)) {
-                int bits = atoi(argv[++i]);
-                if ((bits < 5) || (bits > 8)) {
-                    msgtime = time(NULL);
-                    tm_info = localtime(&msgtime);
-                    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+    // Import capture files or archives and exit
+    if (config.importCount > 0)
+        return run_import(&config);
 
-                    fprintf(stderr, "%s - Invalid number of bits: %s\n", timeStringBuffer, argv[i]);
-                    return E_CLI_PARAM;
-                }
-                config.serialPortBits = ((bits - 5) << 4);
-                continue;
-            }
-            if ((strcmp(argv[i], "-t") == 0) || (strcmp(argv[i], "--stopbits") == 0)) {
-                int stopbits = atoi(argv[++i]);
-                if ((stopbits < 1) || (stopbits > 2)) {
-                    msgtime = time(NULL);
-                    tm_info = localtime(&msgtime);
-                    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+    printf("Configuration\nConfigfile: \"%s\"\nSerialPort: \"%s\"\nSpeed: %07o\nBits: %07o\nParity: %07o\nStopbits: %07o\nDatabase directory: %s\n\n", configFile, config.serialPortFilename, config.serialPortSpeed, config.serialPortBits, config.serialPortParity, config.serialPortStopbits, config.databaseDirectory);
+    fflush(stdout);
 
-                    fprintf(stderr, "%s - Invalid number of stopbits: %s\n", timeStringBuffer, argv[i]);
-                    return E_CLI_PARAM;
-                }
-                config.serialPortStopbits = ((stopbits - 1) << 6);
-                continue;
-            }
-            if ((strcmp(argv[i], "--dbdir") == 0) || (strcmp(argv[i], "--db-directory") == 0)) {
-                if ((config.databaseDirectory = (char *)malloc(sizeof(char) * (strlen(argv[++i]) + 1))) == NULL) {
-                    msgtime = time(NULL);
-                    tm_info = localtime(&msgtime);
-                    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+    // Concentrator mode, streams are pushed by the dongles
+    if (config.serverListen != NULL) {
+        if ((result = init_control(&config)) != E_OK) {
+            return result;
+        }
 
-                    fprintf(stderr, "%s - Error claiming memory for database directory name: %s\n", timeStringBuffer, strerror(errno));
-                    return E_MALLOC;
-                }
-                strcpy(config.databaseDirectory, argv[i]);
-                continue;
-            }
-            if ((strcmp(argv[i], "-v") == 0) || (strcmp(argv[i], "--verbose") == 0)) {
-                verbose = 1;
-                continue;
-            }
+        stats.startTime = time(NULL);
+        result = run_server(&config, signalFd);
 
-            msgtime = time(NULL);
-            tm_info = localtime(&msgtime);
-            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+        close(signalFd);
+        close_control(&config);
 
-            fprintf(stderr, "%s - Unknown option \"%s\"\n\n", timeStringBuffer, argv[i]);
-            help_message(argv[0]);
-            return E_CLI_PARAM;
-        }
+        return result;
     }
 
-    printf("Configuration\nConfigfile: \"%s\"\nSerialPort: \"%s\"\nSpeed: %07o\nBits: %07o\nParity: %07o\nStopbits: %07o\nDatabase directory: %s\n\n", configFile, config.serialPortFilename, config.serialPortSpeed, config.serialPortBits, config.serialPortParity, config.serialPortStopbits, config.databaseDirectory);
-    fflush(stdout);
+    if (config.serialAutodetect && !is_tcp_device(config.serialPortFilename))
+        serialPort = detect_serial(&config);
+    else
+        serialPort = init_serial(&config);
 
-    if ((serialPort = init_serial(&config)) < 0) {
+    if ((serialPort < 0) && !is_tcp_device(config.serialPortFilename)) {
         return E_SERIAL_PORT;
     }
 
+    if ((result = init_staging(&config)) != E_OK) {
+        return result;
+    }
+
     if (init_rrd_database(&config) != E_OK) {
         return E_RRD;
     }
+    warm_history(&config);
+    init_calendar(&calendar, config.databaseDirectory);
 
-    init_arrays();
+    init_arrays(&bucketQueue);
+    init_arrays(&rrdQueue);
+
+    if ((result = init_demand(&demandState, config.demandWindow)) != E_OK) {
+        return result;
+    }
+
+    if (config.archive && ((result = open_archive(&telegramArchive, config.databaseDirectory)) != E_OK)) {
+        return result;
+    }
+
+    if ((result = init_state_filename(&config)) != E_OK) {
+        return result;
+    }
+
+    if ((result = restore_state(&config)) != E_OK) {
+        return result;
+    }
+
+    if ((result = init_graphs(&config)) != E_OK) {
+        return result;
+    }
+
+    if ((result = start_sinks(&config)) != E_OK) {
+        return result;
+    }
+
+    if ((result = init_control(&config)) != E_OK) {
+        return result;
+    }
+
+    if ((result = init_live(&config)) != E_OK) {
+        return result;
+    }
+
+    if ((result = init_relay(&config)) != E_OK) {
+        return result;
+    }
+
+    // Buckets restored from the state file, after init_live() set up the client slots.
+    // The older ones only the RRD sink missed
+    store_rrd_queue(&rrdQueue);
+    store_queue(&bucketQueue);
+
+    stats.startTime = time(NULL);
+    init_framer(&serialFramer);
+    serialFramer.noCrc = !config.serialPortCrc;
+
+    pollFds[1].fd = signalFd;
+    pollFds[1].events = POLLIN;
+
+    while (terminate == 0) {
+        // A network dongle that dropped is reconnected with back-off
+        if (is_tcp_device(config.serialPortFilename) && reconnect_tcp(&config))
+            init_framer(&serialFramer);
+
+        pollFds[0].fd = serialPort;
+        pollFds[0].events = POLLIN;
+        controlCount = control_poll_fds(&pollFds[2], CONTROL_MAX_CLIENTS + 1);
+        relayCount = relay_poll_fds(&pollFds[2 + controlCount], RELAY_MAX_CLIENTS + 2);
+        pollCount = 2 + controlCount + relayCount + live_poll_fds(&pollFds[2 + controlCount + relayCount], LIVE_MAX_CLIENTS + 1);
+
+        if (poll(pollFds, pollCount, tcp_poll_timeout(&config)) < 0) {
+            if (errno == EINTR)
+                continue;
 
-    while (1) {
-        result = read(serialPort, iobuffer, 8192);
-        if (result == 0) {
-            // End of file
-            break;
-        }
-        if (result == -1) {
-            // Error condition
             msgtime = time(NULL);
             tm_info = localtime(&msgtime);
             strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-            fprintf(stderr, "%s - Error while reading serial port \"%s\": %s\n", timeStringBuffer, config.serialPortFilename, strerror(errno));
-            return E_SERIAL_PORT;
+            fprintf(stderr, "%s - Error %i from poll: %s\n", timeStringBuffer, errno, strerror(errno));
+            result = E_SERIAL_PORT;
+            goto EXIT;
         }
-        for (int index = 0; index < result; index++){
-            buffer= iobuffer[index];
 
+        if (pollFds[1].revents & POLLIN) {
+            if (read(signalFd, &sigInfo, sizeof(sigInfo)) == sizeof(sigInfo))
+                handle_signal(sigInfo.ssi_signo, &config, configFile, argc, argv);
 
+            // The serial port may have been reopened
+            serialFramer.noCrc = !config.serialPortCrc;
+            continue;
+        }
 
-            switch (status) {
-            case S_IDLE:
-                if (buffer != '/')
-                    break;
+        control_handle(&pollFds[2], controlCount, &config);
+        relay_handle(&pollFds[2 + controlCount], relayCount);
+        live_handle(&pollFds[2 + controlCount + relayCount], pollCount - 2 - controlCount - relayCount);
 
-                dataPointer = dataBlock;
-                status = S_DATA;
-            case S_DATA:
-                if(dataPointer>=dataBlock+sizeof (dataBlock)){
-                    status = S_IDLE;
-                    break;
-                }
+        // The serial port may have been reopened from the control socket
+        if (pollFds[0].fd != serialPort)
+            continue;
 
-                *dataPointer = buffer;
-                dataPointer++;
+        if (pollFds[0].revents == 0) {
+            if ((serialPort >= 0) && is_tcp_device(config.serialPortFilename) && (config.networkTimeout > 0) && (time(NULL) - lastDataTime >= config.networkTimeout)) {
+                drop_tcp(&config, "no data");
+                init_framer(&serialFramer);
+            }
+            continue;
+        }
 
-                if (buffer == '!') {
-                    *dataPointer = '\0';
-                    checksumPointer = checksumStr;
-                    status = S_CHECKSUM;
-                    numchars = 4;
-                }
+        result = read(serialPort, iobuffer, 8192);
+        if ((result <= 0) && is_tcp_device(config.serialPortFilename)) {
+            if ((result < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+                continue;
 
-                break;
-            case S_CHECKSUM:
-                if (numchars-- > 0) {
-                    *checksumPointer++ = buffer;
-                }
-                else {
-                    *checksumPointer = '\0';
-                    status = S_READY;
-                }
+            // Discard the partial telegram and reconnect
+            drop_tcp(&config, (result == 0) ? "closed by peer" : strerror(errno));
+            init_framer(&serialFramer);
+            continue;
+        }
+        if (result > 0) {
+            lastDataTime = time(NULL);
+            reconnectDelay = 1;
+        }
+        if (result == 0) {
+            // End of file
+            break;
+        }
+        if (result == -1) {
+            if (errno == EINTR)
+                continue;
 
-                if (buffer == '\n') {
-                    *checksumPointer = '\0';
-                    status = S_READY;
-                }
+            // Error condition
+            msgtime = time(NULL);
+            tm_info = localtime(&msgtime);
+            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
+            fprintf(stderr, "%s - Error while reading serial port \"%s\": %s\n", timeStringBuffer, config.serialPortFilename, strerror(errno));
+            result = E_SERIAL_PORT;
+            goto EXIT;
+        }
+        for (int index = 0; index < result; index++) {
+            switch (p1_frame(&serialFramer, iobuffer[index])) {
+            case F_OVERRUN:
+                stats.overruns++;
                 break;
-            case S_READY:
-                crc = crc_16(dataBlock);
-                status = S_IDLE;
+            case F_CRC_ERROR:
+                msgtime = time(NULL);
+                tm_info = localtime(&msgtime);
+                strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
 
-                if (crc != (unsigned short)strtol(checksumStr, NULL, 16)) {
-                    msgtime = time(NULL);
-                    tm_info = localtime(&msgtime);
-                    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+                fprintf(stderr, "%s - CRC error in datagram\n", timeStringBuffer);
+                stats.crcErrors++;
+                break;
+            case F_TELEGRAM:
+                stats.telegrams++;
+                stats.lastTelegramTime = time(NULL);
 
-                    fprintf(stderr, "%s - CRC error in datagram\n", timeStringBuffer);
-                    break;
-                }
+                // Before parsing, parse_block() splits the telegram in place
+                relay_publish(&serialFramer);
+                archive_telegram(&telegramArchive, &serialFramer, (unsigned long)time(NULL));
+                sink_telegram(&serialFramer, (unsigned long)time(NULL));
 
-                if ((result = parse_block(dataBlock)) != E_OK) {
+                if ((result = parse_block(&aggrState, serialFramer.dataBlock, (unsigned long)time(NULL))) != E_OK) {
                     goto EXIT;
                 }
+                sink_live(&aggrState, (unsigned long)time(NULL));
+                live_telegram(&aggrState, (unsigned long)time(NULL));
 
-                while (timestampArray[readDataCounter] != 0) {
-                    if (verbose != 0)
-                        print_data(NULL);
+                store_queue(&bucketQueue);
 
-                    if ((result = update_rrd_database(&config)) != E_OK) {
-                        rrdErrors++;
-
-                        if (rrdErrors >= 9) {
-                            msgtime = time(NULL);
-                            tm_info = localtime(&msgtime);
-                            strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
-
-                            fprintf(stderr, "%s - To many errors updating RRD files", timeStringBuffer);
-                            goto EXIT;
-                        }
-
-                        break;
-                    }
-                    else {
-                        rrdErrors = 0;
-                    }
+                if ((config.checkpointInterval > 0) && (time(NULL) - lastCheckpoint >= config.checkpointInterval)) {
+                    save_state(&config);
                 }
 
                 break;
-            default:
-                dataPointer = dataBlock;
-                status = S_IDLE;
-
             }
         }
     }
 
+    result = E_OK;
+
 EXIT:
     close(serialPort);
+    close(signalFd);
+    close_control(&config);
+    close_relay(&config);
+    close_live();
+    close_archive(&telegramArchive);
+    stop_sinks();
+    close_graphs();
+    if (config.stagingDirectory != NULL)
+        sync_staging(config.stagingDirectory, config.databaseDirectory);
+    save_state(&config);
+    close_sinks();
+    free_demand(&demandState);
 
     fflush(stdout);
     fflush(stderr);
@@ -1,13 +1,88 @@
 #ifndef _SLIMMEMETER_H
 #define _SLIMMEMETER_H
 
+#include <stdio.h>
 #include <termios.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 #define CRC_POLY 0xA001
 
+#define CONTROL_MAX_CLIENTS 8
+#define RELAY_MAX_CLIENTS 16
+#define LIVE_MAX_CLIENTS 32
+
+// Percentiles per bucket, per hour and per day
+#define SKETCH_RESOLUTIONS 3
+
+// History kept in memory, as the archives of the databases
+#define HISTORY_RESOLUTIONS 4
+#define HISTORY_ROWS        800
+
+// Derived channels, the operations of an expression and its stack depth
+#define DERIVED_MAX     8
+#define DERIVED_PROGRAM 64
+#define DERIVED_STACK   16
+
+#define GRAPH_PNG 0
+#define GRAPH_SVG 1
+
+#define SERVER_IO_AUTO  0
+#define SERVER_IO_URING 1
+#define SERVER_IO_EPOLL 2
+
 #define PARNON 0000000
 #define NSTOPB 0000000
 
+/*
+ * The channels of a telegram, everything else is generated from these
+ * tables: the fields of elec_data, the parser dispatch, the RRD schemas
+ * and updates, the percentile sketches and the printed and JSON output.
+ *
+ * A counter keeps the last value of an interval:
+ *   X(name, OBIS reference, RRD file, data source, label, unit)
+ *
+ * A gauge keeps the max, average and min of an interval, and a sketch
+ * over the range from low to high:
+ *   X(name, OBIS reference, RRD file, max, avg and min data source,
+ *     percentile data source prefix, low, high, label, unit, format)
+ *
+ * The order within an RRD file is the order of its data sources, new
+ * channels are added in a new file so existing databases stay valid.
+ */
+#define P1_COUNTERS(X) \
+    X(kwh_1_in,  "1-0:1.8.1",  RRD_COUNTERS, "KWh_1_in",  "Energy consumed T1",  "KWh") \
+    X(kwh_2_in,  "1-0:1.8.2",  RRD_COUNTERS, "KWh_2_in",  "Energy consumed T2",  "KWh") \
+    X(kwh_1_out, "1-0:2.8.1",  RRD_COUNTERS, "KWh_1_out", "Energy delivered T1", "KWh") \
+    X(kwh_2_out, "1-0:2.8.2",  RRD_COUNTERS, "KWh_2_out", "Energy delivered T2", "KWh") \
+    X(gas,       "0-1:24.2.1", RRD_COUNTERS, "gas_in",    "Gas consumption",     "m3")
+
+#define P1_GAUGES(X) \
+    X(kw_in,  "1-0:1.7.0",  RRD_KWINOUT, "KW_max_in",  "KW_avg_in",  "KW_min_in",  "KW_in",  0.01,  50.0,  "Power consumption", "KW", "%.3lf") \
+    X(kw_out, "1-0:2.7.0",  RRD_KWINOUT, "KW_max_out", "KW_avg_out", "KW_min_out", "KW_out", 0.01,  50.0,  "Power delivery",    "KW", "%.3lf") \
+    X(v_l1,   "1-0:32.7.0", RRD_VOLTAGE, "V_max",      "V_avg",      "V_min",      "V_l1",   180.0, 280.0, "L1 voltage",        "V",  "%.1lf") \
+    X(v_l2,   "1-0:52.7.0", RRD_PHASES,  "V_l2_max",   "V_l2_avg",   "V_l2_min",   "V_l2",   180.0, 280.0, "L2 voltage",        "V",  "%.1lf") \
+    X(v_l3,   "1-0:72.7.0", RRD_PHASES,  "V_l3_max",   "V_l3_avg",   "V_l3_min",   "V_l3",   180.0, 280.0, "L3 voltage",        "V",  "%.1lf") \
+    X(i_l1,   "1-0:31.7.0", RRD_PHASES,  "I_l1_max",   "I_l1_avg",   "I_l1_min",   "I_l1",   0.1,   100.0, "L1 current",        "A",  "%.1lf") \
+    X(i_l2,   "1-0:51.7.0", RRD_PHASES,  "I_l2_max",   "I_l2_avg",   "I_l2_min",   "I_l2",   0.1,   100.0, "L2 current",        "A",  "%.1lf") \
+    X(i_l3,   "1-0:71.7.0", RRD_PHASES,  "I_l3_max",   "I_l3_avg",   "I_l3_min",   "I_l3",   0.1,   100.0, "L3 current",        "A",  "%.1lf")
+
+// X(file, filename, description)
+#define P1_RRD_FILES(X) \
+    X(RRD_COUNTERS, "/counters.rrd", "counters") \
+    X(RRD_VOLTAGE,  "/voltage.rrd",  "voltage") \
+    X(RRD_KWINOUT,  "/kwinout.rrd",  "kw") \
+    X(RRD_PHASES,   "/phases.rrd",   "phases")
+
+#define P1_ENUM_FILE(file, filename, description) file,
+enum RRD_FILES {
+    P1_RRD_FILES(P1_ENUM_FILE)
+    RRD_FILES
+};
+#undef P1_ENUM_FILE
+
 enum ERRORS {
     E_OK,
     E_CLI_PARAM,
@@ -20,6 +95,13 @@ enum ERRORS {
     E_FILE_ACCESS
 };
 
+enum INI_TOKENS {
+    INI_EMPTY,
+    INI_SECTION,
+    INI_KEYVALUE,
+    INI_ERROR
+};
+
 enum STATES {
     S_IDLE,
     S_DATA,
@@ -27,64 +109,749 @@ enum STATES {
     S_READY
 };
 
+#define P1_ENUM_COUNTER(name, obis, file, source, label, unit) FIELD_##name,
+#define P1_ENUM_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) FIELD_##name,
+enum FIELDS {
+    FIELD_NONE,
+    P1_COUNTERS(P1_ENUM_COUNTER)
+    P1_GAUGES(P1_ENUM_GAUGE)
+    FIELDS
+};
+#undef P1_ENUM_COUNTER
+#undef P1_ENUM_GAUGE
+
+enum FRAMES {
+    F_NONE,
+    F_TELEGRAM,
+    F_CRC_ERROR,
+    F_OVERRUN
+};
+
+/*
+ * State of the byte-wise telegram framer of one P1 stream
+ */
+typedef struct {
+    int    status;
+    int    numchars;
+    int    noCrc;
+    char * dataPointer;
+    char * checksumPointer;
+    char   checksumStr[5];
+    char   dataBlock[2048];
+} p1_framer;
+
 struct _baud_set {
     unsigned int speed;
     speed_t value;
 };
 
-struct _baud_set _baud_table[] = {
-    {1200, B1200},
-    {2400, B2400},
-    {4800, B4800},
-    {9600, B9600},
-    {19200, B19200},
-    {38400, B38400},
-    {57600, B57600},
-    {115200, B115200}
+/*
+ * Output sinks, every enabled sink gets the closed buckets on its own
+ * queue and thread
+ */
+enum SINK_TYPES {
+    SINK_RRD,
+    SINK_INFLUX,
+    SINK_MQTT,
+    SINK_TYPES
 };
 
+#define SINK_DROP_OLDEST 0
+#define SINK_DROP_NEWEST 1
+
+typedef struct {
+    int enabled;
+    int queueSize;
+    int retries;
+    int whenFull;
+} sink_settings;
+
 struct _CONFIGSTRUCT {
     char    *serialPortFilename;
     speed_t  serialPortSpeed;
     tcflag_t serialPortBits;
     tcflag_t serialPortParity;
     tcflag_t serialPortStopbits;
+    int      serialPortCrc;
+    int      serialAutodetect;
     char    *databaseDirectory;
-    char    *countersFilename;
-    char    *voltageFilename;
-    char    *kwInOutFilename
-};
-
-typedef struct {
-    double kwh_1_in;
-    double kwh_2_in;
-    double kwh_1_out;
-    double kwh_2_out;
-    long   tariff;
-    double kw_in_max;
-    double kw_in_avg;
-    double kw_in_min;
-    double kw_out_max;
-    double kw_out_avg;
-    double kw_out_min;
-    double v_l1_max;
-    double v_l1_avg;
-    double v_l1_min;
-    double v_l2_max;
-    double v_l2_avg;
-    double v_l2_min;
-    double v_l3_max;
-    double v_l3_avg;
-    double v_l3_min;
-    double i_l1_max;
-    double i_l1_avg;
-    double i_l1_min;
-    double i_l2_max;
-    double i_l2_avg;
-    double i_l2_min;
-    double i_l3_max;
-    double i_l3_avg;
-    double i_l3_min;
+    char    *stagingDirectory;
+    int      syncInterval;
+    char    *rrdFilenames[RRD_FILES];
+    char    *percentileFilenames[SKETCH_RESOLUTIONS];
+    char    *stateFilename;
+    int      checkpointInterval;
+    char    *controlSocketFilename;
+    int      networkTimeout;
+    char    *serverListen;
+    int      serverWorkers;
+    int      serverIo;
+    char    *relayListen;
+    char    *relaySocketFilename;
+    char    *liveListen;
+    int      archive;
+    int      demandWindow;
+    sink_settings sinks[SINK_TYPES];
+    char    *influxUrl;
+    char    *influxMeasurement;
+    char    *influxTags;
+    char    *influxToken;
+    int      influxTelegrams;
+    int      influxBatch;
+    int      influxFlushInterval;
+    int      influxGzip;
+    char    *mqttUrl;
+    char    *mqttClientId;
+    char    *mqttUsername;
+    char    *mqttPassword;
+    char    *mqttLiveTopic;
+    char    *mqttBucketTopic;
+    int      mqttQos;
+    int      mqttRetain;
+    int      mqttInterval;
+    int      mqttBuffer;
+    char    *graphDirectory;
+    char    *graphs;
+    int      graphFormat;
+    int      graphWidth;
+    int      graphHeight;
+    char    *derivedNames[DERIVED_MAX];
+    char    *derivedExpressions[DERIVED_MAX];
+    int      derivedCount;
+    long     replayFrom;
+    char   **importPaths;
+    int      importCount;
+};
+
+/*
+ * Fixed memory quantile sketch of the power, voltage and current channels
+ *
+ * Every channel counts its samples in SKETCH_BINS bins, logarithmic over
+ * the expected range of the channel with one bin below and one above it.
+ * Sketches of several intervals merge by adding the counts.
+ */
+#define SKETCH_BINS 64
+
+#define P1_ENUM_SKETCH(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) SKETCH_##name,
+enum SKETCH_CHANNELS {
+    P1_GAUGES(P1_ENUM_SKETCH)
+    SKETCH_CHANNELS
+};
+#undef P1_ENUM_SKETCH
+
+typedef struct {
+    unsigned int count[SKETCH_CHANNELS][SKETCH_BINS];
+} p1_sketch;
+
+/*
+ * Derived channels, computed from the channels of every telegram with an
+ * expression from the configuration. An expression is compiled once to a
+ * program for a small stack machine. A channel missing from the telegram
+ * makes the result NAN, which is left out of the interval.
+ */
+enum DERIVED_OPS {
+    OP_FIELD,
+    OP_DERIVED,
+    OP_CONST,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_NEG,
+    OP_MIN,
+    OP_MAX,
+    OP_ABS,
+    OP_SQRT
+};
+
+typedef struct {
+    int     op;
+    int     index;
+    double  constant;
+} derived_op;
+
+typedef struct {
+    int         count;
+    char        name[DERIVED_MAX][32];
+    int         length[DERIVED_MAX];
+    derived_op  program[DERIVED_MAX][DERIVED_PROGRAM];
+} p1_derived;
+
+/*
+ * One bucket of all channels, the averages are running sums until the
+ * interval is closed. A derived channel averages over derived_samples.
+ */
+#define P1_FIELD_COUNTER(name, obis, file, source, label, unit) double name;
+#define P1_FIELD_GAUGE(name, obis, file, sourceMax, sourceAvg, sourceMin, sketchName, low, high, label, unit, format) double name##_max; double name##_avg; double name##_min;
+typedef struct {
+    P1_COUNTERS(P1_FIELD_COUNTER)
+    P1_GAUGES(P1_FIELD_GAUGE)
+    double derived_max[DERIVED_MAX];
+    double derived_avg[DERIVED_MAX];
+    double derived_min[DERIVED_MAX];
+    int derived_samples[DERIVED_MAX];
+    p1_sketch sketch;
 } elec_data;
+#undef P1_FIELD_COUNTER
+#undef P1_FIELD_GAUGE
+
+/*
+ * Open merge of the bucket sketches of an hour or a day
+ */
+typedef struct {
+    unsigned long start;
+    double        min[SKETCH_CHANNELS];
+    double        max[SKETCH_CHANNELS];
+    p1_sketch     sketch;
+} sketch_rollup;
+
+/*
+ * Ring of closed buckets waiting to be stored
+ */
+#define QUEUE_SIZE 10
+
+typedef struct {
+    unsigned long timestampArray[QUEUE_SIZE];
+    elec_data   * elecDataArray[QUEUE_SIZE];
+    int           storeDataCounter;
+    int           readDataCounter;
+    sketch_rollup rollups[SKETCH_RESOLUTIONS - 1];
+} bucket_queue;
+
+/*
+ * Rolling demand of power usage (0) and delivery (1)
+ *
+ * samples holds the power of every second of the last window, sum their
+ * total. blockEnergy is the sum over the seconds of the open billing
+ * block that had data.
+ */
+#define DEMAND_MAX_WINDOW 3600
+
+typedef struct {
+    int             window;
+    float         * samples[2];
+    double          sum[2];
+    unsigned long   filled;
+    unsigned long   lastTime;
+    double          current[2];
+    unsigned long   blockStart;
+    unsigned long   blockSeconds;
+    double          blockEnergy[2];
+    double          lastBlock[2];
+    int             peakMonth;
+    double          peak[2];
+    unsigned long   peakTime[2];
+} p1_demand;
+
+/*
+ * Calendar index, the counters at the start of every local day, week
+ * (monday), month and year. The total of a period is the difference
+ * between its entry and the next one, or the latest counters for the
+ * period still open. calendar.idx in the database directory holds the
+ * calendar_index as it is in memory.
+ */
+#define CALENDAR_MAGIC   0x534d4349
+#define CALENDAR_VERSION 1
+#define CALENDAR_LEVELS  4
+#define CALENDAR_ENTRIES (400 + 110 + 40 + 16)
+
+#define P1_ENUM_COUNTER(name, obis, file, source, label, unit) COUNTER_##name,
+enum COUNTERS {
+    P1_COUNTERS(P1_ENUM_COUNTER)
+    COUNTERS
+};
+#undef P1_ENUM_COUNTER
+
+typedef struct {
+    unsigned long   start;
+    double          counters[COUNTERS];
+} calendar_entry;
+
+typedef struct {
+    unsigned int    magic;
+    unsigned int    version;
+    unsigned int    entrySize;
+    int             count[CALENDAR_LEVELS];
+    int             newest[CALENDAR_LEVELS];
+    unsigned long   latestTime;
+    double          latest[COUNTERS];
+    calendar_entry  entries[CALENDAR_ENTRIES];
+} calendar_index;
+
+typedef struct {
+    pthread_mutex_t lock;
+    char            filename[512];
+    int             saved;
+    calendar_index  index;
+} p1_calendar;
+
+/*
+ * A telegram line as decoded by the previous telegram, hash is the
+ * FNV-1a hash of the line
+ */
+#define PARSE_MAX_LINES 64
+
+typedef struct {
+    unsigned long long hash;
+    int                length;
+    int                field;
+    double             value;
+} line_fingerprint;
+
+/*
+ * Aggregation state of the interval that is currently being filled
+ */
+typedef struct {
+    unsigned long      lastMeasureTime;
+    int                counter;
+    elec_data        * eCummPointer;
+    bucket_queue     * queue;
+    p1_demand        * demand;
+    line_fingerprint   lines[PARSE_MAX_LINES];
+    int                lineCount;
+    double             derived[DERIVED_MAX];
+} aggr_state;
+
+/*
+ * An item on the queue of a sink, a closed bucket, a raw telegram or the
+ * live values of a parsed telegram by FIELD followed by the derived
+ * channels (NAN when not in the telegram), owned by the queue
+ */
+#define LIVE_VALUES (FIELDS + DERIVED_MAX)
+
+#define SINK_BUCKET   1
+#define SINK_TELEGRAM 2
+#define SINK_LIVE     4
+
+typedef struct {
+    int           type;
+    unsigned long timestamp;
+    elec_data   * data;
+    char        * telegram;
+    double      * values;
+} sink_item;
+
+/*
+ * Implementation of a sink
+ *
+ * write() gets a batch in time order and returns the number of items
+ * taken, the first item that was not taken is retried. A sink that
+ * buffers has a flush(), called flushInterval seconds after the first
+ * item was taken, or when the queue runs empty with an interval of 0. A
+ * failed flush is tried again later. init() and close() run on the main
+ * thread, write() and flush() on the thread of the sink.
+ */
+struct _SINK;
+
+typedef struct {
+    const char * name;
+    int          accepts;
+    int  (*init)(struct _SINK *sink);
+    int  (*write)(struct _SINK *sink, sink_item *items, int count);
+    int  (*flush)(struct _SINK *sink);
+    void (*close)(struct _SINK *sink);
+} sink_type;
+
+/*
+ * A running sink: a ring of size items starting at head, the batch that
+ * is being written, the thread and its counters. lock protects the ring,
+ * the batch bounds, the counters and the flags, busy is held while the
+ * sink writes.
+ */
+#define SINK_BATCH       32
+#define SINK_MAX_BACKOFF 60
+
+typedef struct _SINK {
+    const sink_type      * type;
+    struct _CONFIGSTRUCT * config;
+    void                 * data;
+    sink_item            * items;
+    int                    size;
+    int                    head;
+    int                    count;
+    sink_item              batch[SINK_BATCH];
+    int                    batchFirst;
+    int                    batchCount;
+    int                    retries;
+    int                    whenFull;
+    int                    accepts;
+    int                    flushInterval;
+    int                    dirty;
+    time_t                 flushAt;
+    int                    flushFailures;
+    int                    stop;
+    int                    wakeUp;
+    pthread_mutex_t        lock;
+    pthread_mutex_t        busy;
+    pthread_cond_t         wake;
+    pthread_t              thread;
+    unsigned long          queued;
+    unsigned long          written;
+    unsigned long          dropped;
+    unsigned long          errors;
+    unsigned long          retried;
+    time_t                 lastError;
+} p1_sink;
+
+/*
+ * InfluxDB line protocol sink, lines are collected in a buffer and sent
+ * per batch, over HTTP in one request or over UDP in datagrams of at
+ * most INFLUX_UDP_PAYLOAD bytes
+ */
+#define INFLUX_BUFFER_SIZE 262144
+#define INFLUX_MAX_LINE    2048
+#define INFLUX_UDP_PAYLOAD 1400
+#define INFLUX_TIMEOUT     10
+
+/*
+ * MQTT 3.1.1 sink, live values are coalesced and published at most once
+ * per interval, closed buckets are buffered while the broker is away
+ */
+#define MQTT_MAX_PACKET 4096
+#define MQTT_TIMEOUT    10
+
+/*
+ * Header of the checkpoint file, followed by queueLength pending buckets
+ * of { unsigned long timestamp, elec_data }, of which the first
+ * rrdPending were already handed to the other sinks, the open bucket (when
+ * counter > 0), the open percentile rollups and the monthly demand peaks
+ * { int month, double peak[2], unsigned long peakTime[2] }. Version 4
+ * files written before the queue and the open bucket were put in this
+ * order hold them the other way round and are not read.
+ */
+#define STATE_MAGIC   0x534d5354
+#define STATE_VERSION 6
+
+struct _STATEHEADER {
+    unsigned int  magic;
+    unsigned int  version;
+    unsigned int  elecDataSize;
+    unsigned long lastMeasureTime;
+    int           counter;
+    int           queueLength;
+    int           rrdPending;
+};
+
+/*
+ * Raw telegram archive, telegrams.arc holds compressed blocks of delta
+ * encoded telegrams, telegrams.idx one entry per block to seek by time.
+ */
+#define ARCHIVE_MAGIC      0x534d4152
+#define ARCHIVE_BLOCK_SIZE 65536
+
+struct _ARCHIVEBLOCK {
+    unsigned int  magic;
+    unsigned int  count;
+    unsigned int  compressedSize;
+    unsigned int  uncompressedSize;
+    unsigned long firstTime;
+    unsigned long lastTime;
+};
+
+struct _ARCHIVEINDEX {
+    unsigned long firstTime;
+    unsigned long lastTime;
+    unsigned long offset;
+};
+
+typedef struct {
+    int           dataFd;
+    int           indexFd;
+    unsigned long offset;
+    unsigned long indexOffset;
+    int           count;
+    unsigned long firstTime;
+    unsigned long lastTime;
+    int           length;
+    char        * block;
+    char        * compressed;
+    int           previousLength;
+    char          previous[2048];
+} p1_archive;
+
+typedef struct {
+    const char  * in;
+    const char  * end;
+    unsigned int  remaining;
+    int           previousLength;
+    char          previous[2048];
+} archive_cursor;
+
+/*
+ * Staged ingest pipeline: a reader and a framing thread hand buffers and
+ * telegrams to the caller through lock-free single producer, single
+ * consumer queues. For an archive a reader thread hands over inflated
+ * blocks the same way.
+ */
+#define PIPE_QUEUE_SIZE  64
+#define PIPE_BUFFER_SIZE 65536
+#define PIPE_BUFFERS     16
+#define PIPE_TELEGRAMS   64
+#define PIPE_BLOCKS      4
+
+typedef struct {
+    void         * items[PIPE_QUEUE_SIZE];
+    unsigned int   head;
+    unsigned int   tail;
+    int            producerWaiting;
+    int            consumerWaiting;
+} pipe_queue;
+
+typedef struct {
+    int  length;
+    char data[PIPE_BUFFER_SIZE];
+} pipe_buffer;
+
+typedef struct {
+    int       end;
+    p1_framer framer;
+} pipe_telegram;
+
+typedef struct {
+    int             fd;
+    int             error;
+    unsigned long   crcErrors;
+    pthread_t       reader;
+    pthread_t       framer;
+    pipe_queue      filled;
+    pipe_queue      empty;
+    pipe_queue      ready;
+    pipe_queue      spare;
+    pipe_buffer   * buffers;
+    pipe_telegram * telegrams;
+} p1_pipeline;
+
+typedef struct {
+    int                  found;
+    off_t                offset;
+    struct _ARCHIVEBLOCK header;
+    char                 block[ARCHIVE_BLOCK_SIZE];
+} pipe_block;
+
+typedef struct {
+    int             dataFd;
+    off_t           offset;
+    int             blockCount;
+    int             found;
+    pthread_t       reader;
+    pipe_queue      filled;
+    pipe_queue      empty;
+    pipe_block    * blocks;
+    char          * compressed;
+} block_pipeline;
+
+/*
+ * An io_uring instance, set up on the raw system calls
+ */
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+typedef struct _URING {
+    int                   fd;
+    void                * ring;
+    size_t                ringSize;
+    struct io_uring_sqe * sqes;
+    size_t                sqesSize;
+    unsigned int        * sqHead;
+    unsigned int        * sqTail;
+    unsigned int          sqMask;
+    unsigned int        * sqArray;
+    unsigned int          sqEntries;
+    unsigned int        * cqHead;
+    unsigned int        * cqTail;
+    unsigned int          cqMask;
+    struct io_uring_cqe * cqes;
+    unsigned int          queued;
+} p1_uring;
+
+/*
+ * Runtime statistics, reported on the control socket
+ */
+struct _STATS {
+    time_t        startTime;
+    time_t        lastTelegramTime;
+    unsigned long telegrams;
+    unsigned long crcErrors;
+    unsigned long overruns;
+    unsigned long bucketsStored;
+    unsigned long rrdErrors;
+    unsigned long syncs;
+    unsigned long syncErrors;
+    time_t        lastSyncTime;
+};
+
+extern int serialPort;
+extern p1_framer serialFramer;
+extern bucket_queue bucketQueue;
+extern bucket_queue rrdQueue;
+extern int verbose;
+extern int terminate;
+extern aggr_state aggrState;
+extern p1_demand demandState;
+extern struct _STATS stats;
+extern p1_archive telegramArchive;
+extern p1_sink sinks[SINK_TYPES];
+extern time_t lastDataTime;
+extern int reconnectDelay;
+
+// slimmemeter.c
+void free_config(struct _CONFIGSTRUCT *config);
+void handle_signal(int signal, struct _CONFIGSTRUCT *config, char *configFile, int argc, char **argv);
+speed_t get_baudrate(int baudrate);
+void init_framer(p1_framer *framer);
+int p1_frame(p1_framer *framer, char buffer);
+int init_serial(struct _CONFIGSTRUCT * config);
+int init_rrd_database(struct _CONFIGSTRUCT *config);
+void init_arrays(bucket_queue *queue);
+int update_rrd_bucket(struct _CONFIGSTRUCT *config, unsigned long timestamp, const elec_data *data);
+void average_data(elec_data *data, int counter);
+int format_rrd_update(char *buffer, size_t size, int file, unsigned long timestamp, const elec_data *data);
+int store_data(bucket_queue *queue, unsigned long timestamp, elec_data * eCummPointer, int counter);
+int parse_block(aggr_state *state, char * dataPointer, unsigned long currentMeasureTime);
+int store_queue(bucket_queue *queue);
+int store_rrd_queue(bucket_queue *queue);
+int save_state(struct _CONFIGSTRUCT *config);
+int keep_setting(char **newSetting, char **setting);
+
+// detect.c
+int detect_serial(struct _CONFIGSTRUCT *config);
+
+// demand.c
+int init_demand(p1_demand *demand, int window);
+void free_demand(p1_demand *demand);
+void demand_update(p1_demand *demand, unsigned long timestamp, double kwIn, double kwOut);
+int json_demand(char *buffer, size_t size, p1_demand *demand);
+
+// import.c
+int run_import(struct _CONFIGSTRUCT *config);
+
+// network.c
+int is_tcp_device(const char *device);
+int split_tcp_device(const char *device, char *host, size_t hostSize, char *port, size_t portSize);
+int init_listen_socket(const char *address);
+int init_tcp(struct _CONFIGSTRUCT *config);
+void drop_tcp(struct _CONFIGSTRUCT *config, const char *reason);
+int reconnect_tcp(struct _CONFIGSTRUCT *config);
+int tcp_poll_timeout(struct _CONFIGSTRUCT *config);
+int split_url(const char *url, char *scheme, size_t schemeSize, char *host, size_t hostSize, char *port, size_t portSize, char *path, size_t pathSize);
+int connect_host(const char *host, const char *port, int type, int timeout);
+
+// server.c
+int run_server(struct _CONFIGSTRUCT *config, int signalFd);
+int json_meter_totals(char *buffer, size_t size, const char *id, const char *period, int offset);
+
+// control.c
+int init_control(struct _CONFIGSTRUCT *config);
+void close_control(struct _CONFIGSTRUCT *config);
+int control_poll_fds(struct pollfd *pollFds, int maxFds);
+void control_handle(struct pollfd *pollFds, int numFds, struct _CONFIGSTRUCT *config);
+int json_bucket(char *buffer, size_t size, unsigned long timestamp, int samples, elec_data *data);
+
+// archive.c
+int open_archive(p1_archive *archive, const char *directory);
+int flush_archive(p1_archive *archive);
+void close_archive(p1_archive *archive);
+int archive_telegram(p1_archive *archive, p1_framer *framer, unsigned long timestamp);
+int read_archive_block(int dataFd, off_t offset, struct _ARCHIVEBLOCK *header, char *compressed, char *block);
+void init_archive_cursor(archive_cursor *cursor, const char *block, struct _ARCHIVEBLOCK *header);
+int next_archive_telegram(archive_cursor *cursor, char *telegram, int *length, unsigned long *timestamp, char *checksum);
+int seek_archive(int indexFd, unsigned long from, off_t *offset);
+int replay_archive(const char *directory, unsigned long from, FILE *stream);
+
+// pipeline.c
+int start_pipeline(p1_pipeline *pipeline, int fd);
+pipe_telegram * next_pipeline_telegram(p1_pipeline *pipeline);
+void release_pipeline_telegram(p1_pipeline *pipeline, pipe_telegram *telegram);
+void stop_pipeline(p1_pipeline *pipeline);
+int start_block_pipeline(block_pipeline *pipeline, int dataFd, off_t offset, int blockCount);
+pipe_block * next_pipeline_block(block_pipeline *pipeline);
+void release_pipeline_block(block_pipeline *pipeline, pipe_block *block);
+void stop_block_pipeline(block_pipeline *pipeline);
+
+// relay.c
+int init_relay(struct _CONFIGSTRUCT *config);
+void close_relay(struct _CONFIGSTRUCT *config);
+void relay_publish(p1_framer *framer);
+int relay_poll_fds(struct pollfd *pollFds, int maxFds);
+void relay_handle(struct pollfd *pollFds, int numFds);
+
+// live.c
+int init_live(struct _CONFIGSTRUCT *config);
+void close_live(void);
+void live_telegram(const aggr_state *state, unsigned long timestamp);
+void live_bucket(unsigned long timestamp, elec_data *data);
+int live_poll_fds(struct pollfd *pollFds, int maxFds);
+void live_handle(struct pollfd *pollFds, int numFds);
+
+// staging.c
+const char * rrd_directory(const struct _CONFIGSTRUCT *config);
+int restore_staging(const char *stagingDirectory, const char *directory);
+int init_staging(struct _CONFIGSTRUCT *config);
+void clear_staging(const char *stagingDirectory);
+int sync_staging(const char *stagingDirectory, const char *directory);
+void sync_staging_due(struct _CONFIGSTRUCT *config);
+
+// sink.c
+int find_sink_key(const char *key, const char **setting);
+void init_sink_settings(sink_settings *settings);
+int start_sinks(struct _CONFIGSTRUCT *config);
+void sink_bucket_to(p1_sink *sink, unsigned long timestamp, const elec_data *data);
+void sink_bucket(unsigned long timestamp, const elec_data *data);
+void sink_telegram(p1_framer *framer, unsigned long timestamp);
+void sink_live(const aggr_state *state, unsigned long timestamp);
+void wake_sinks(void);
+void suspend_sinks(void);
+void resume_sinks(void);
+void stop_sinks(void);
+void close_sinks(void);
+int sink_pending(p1_sink *sink, unsigned long *timestamps, elec_data *data, int max);
+void sink_snapshot(p1_sink *sink, void *copy, const void *state, size_t size);
+int json_sinks(char *buffer, size_t size);
+
+// history.c
+void warm_history(struct _CONFIGSTRUCT *config);
+void history_add(unsigned long timestamp, const elec_data *data);
+int json_history(char *buffer, size_t size, const char *channel, const char *span);
+
+// calendar.c
+extern p1_calendar calendar;
+void init_calendar(p1_calendar *cal, const char *directory);
+void calendar_add(p1_calendar *cal, unsigned long timestamp, const elec_data *data);
+int json_totals(char *buffer, size_t size, p1_calendar *cal, const char *period, int offset);
+
+// derive.c
+extern p1_derived derivedChannels;
+const char * check_derived_name(struct _CONFIGSTRUCT *config, const char *name);
+int init_derived(struct _CONFIGSTRUCT *config);
+void derive_telegram(aggr_state *state, elec_data *bucket, const double *values);
+void average_derived(elec_data *data);
+
+// graph.c
+int render_graph(int graph, unsigned long end);
+int init_graphs(struct _CONFIGSTRUCT *config);
+void graph_update(unsigned long timestamp);
+void close_graphs(void);
+int json_graphs(char *buffer, size_t size);
+
+// influx.c
+extern const sink_type influxSink;
+
+// mqtt.c
+extern const sink_type mqttSink;
+
+// sketch.c
+void sketch_add(p1_sketch *sketch, int channel, double value);
+void sketch_merge(p1_sketch *into, const p1_sketch *from);
+double sketch_quantile(const p1_sketch *sketch, int channel, double q, double min, double max);
+void bucket_range(const elec_data *data, double *min, double *max);
+int format_percentiles(char *buffer, size_t size, unsigned long timestamp, const p1_sketch *sketch, const double *min, const double *max);
+int store_rollups(struct _CONFIGSTRUCT *config, sketch_rollup *rollups, unsigned long timestamp, const elec_data *data);
+
+// uring.c
+int init_uring(p1_uring *ring, unsigned int entries);
+void close_uring(p1_uring *ring);
+int uring_submit(p1_uring *ring, unsigned int waitFor);
+struct io_uring_sqe * uring_sqe(p1_uring *ring);
+int uring_cqe(p1_uring *ring, struct io_uring_cqe *cqe);
 
 #endif
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "slimmemeter.h"
+
+/*
+ * Directory of the RRD files, the staging directory when they are kept
+ * in RAM
+ */
+const char * rrd_directory(const struct _CONFIGSTRUCT *config) {
+    return (config->stagingDirectory != NULL) ? config->stagingDirectory : config->databaseDirectory;
+}
+
+static int is_rrd_file(const char *name) {
+    size_t length = strlen(name);
+
+    return (length > 4) && (strcmp(name + length - 4, ".rrd") == 0);
+}
+
+/*
+ * Copy a file through a temporary file that is flushed to disk and
+ * renamed over the target, the target is either the old or the new copy
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+static int copy_file(const char *from, const char *to) {
+    char tempFilename[1040];
+    char buffer[65536];
+    ssize_t length;
+    int in;
+    int out;
+    int result = E_OK;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    snprintf(tempFilename, sizeof(tempFilename), "%s.tmp", to);
+
+    if ((in = open(from, O_RDONLY | O_CLOEXEC)) < 0) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error %i from open %s: %s\n", timeStringBuffer, errno, from, strerror(errno));
+        return E_FILE_ACCESS;
+    }
+
+    if ((out = open(tempFilename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error %i from open %s: %s\n", timeStringBuffer, errno, tempFilename, strerror(errno));
+        close(in);
+        return E_FILE_ACCESS;
+    }
+
+    while ((length = read(in, buffer, sizeof(buffer))) != 0) {
+        if ((length < 0) && (errno == EINTR))
+            continue;
+        if ((length < 0) || (write(out, buffer, length) != length)) {
+            result = E_FILE_ACCESS;
+            break;
+        }
+    }
+
+    if ((fsync(out) != 0) || (close(out) != 0))
+        result = E_FILE_ACCESS;
+    close(in);
+
+    if ((result != E_OK) || (rename(tempFilename, to) != 0)) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error copying %s to %s: %s\n", timeStringBuffer, from, to, strerror(errno));
+        unlink(tempFilename);
+        return E_FILE_ACCESS;
+    }
+
+    return E_OK;
+}
+
+/*
+ * Restore the RRD files of a database directory to the staging directory
+ *
+ * A staged file newer than the one in the database directory survived a
+ * restart without a reboot and holds the latest buckets, it is kept.
+ *
+ * Parameters:
+ *   *stagingDirectory  - The staging directory
+ *   *directory         - The database directory
+ *
+ * Returns E_OK, or E_FILE_ACCESS when a file could not be restored
+ */
+int restore_staging(const char *stagingDirectory, const char *directory) {
+    char filename[1024];
+    char stagedFilename[1024];
+    struct stat fileStat;
+    struct stat stagedStat;
+    struct dirent * entry;
+    DIR * dir;
+    int restored = 0;
+    int result = E_OK;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if ((dir = opendir(directory)) == NULL) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error %i from open directory %s: %s\n", timeStringBuffer, errno, directory, strerror(errno));
+        return E_FILE_ACCESS;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (!is_rrd_file(entry->d_name))
+            continue;
+
+        snprintf(filename, sizeof(filename), "%s/%s", directory, entry->d_name);
+        snprintf(stagedFilename, sizeof(stagedFilename), "%s/%s", stagingDirectory, entry->d_name);
+
+        if ((stat(filename, &fileStat) != 0) || !S_ISREG(fileStat.st_mode))
+            continue;
+        if ((stat(stagedFilename, &stagedStat) == 0) && (stagedStat.st_mtime > fileStat.st_mtime))
+            continue;
+
+        if (copy_file(filename, stagedFilename) != E_OK) {
+            result = E_FILE_ACCESS;
+            continue;
+        }
+        restored++;
+    }
+    closedir(dir);
+
+    __atomic_store_n(&stats.lastSyncTime, time(NULL), __ATOMIC_RELAXED);
+
+    msgtime = time(NULL);
+    tm_info = localtime(&msgtime);
+    strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+    printf("%s - Restored %d database files from %s to staging directory %s\n", timeStringBuffer, restored, directory, stagingDirectory);
+    fflush(stdout);
+
+    return result;
+}
+
+/*
+ * Prepare the staging directory and restore the database files to it
+ *
+ * Parameters:
+ *   *config  - Pointer to the configuration
+ *
+ * Returns E_OK, or E_FILE_ACCESS when the staging directory cannot be
+ * used, the RRD files are then not created in an empty one
+ */
+int init_staging(struct _CONFIGSTRUCT *config) {
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if (config->stagingDirectory == NULL)
+        return E_OK;
+
+    if (((mkdir(config->stagingDirectory, 0755) != 0) && (errno != EEXIST)) || (access(config->stagingDirectory, R_OK | W_OK | X_OK) != 0)) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Cannot write in staging directory %s\n", timeStringBuffer, config->stagingDirectory);
+        return E_FILE_ACCESS;
+    }
+
+    return restore_staging(config->stagingDirectory, config->databaseDirectory);
+}
+
+/*
+ * Remove the staged RRD files, before the files of another database
+ * directory are restored
+ */
+void clear_staging(const char *stagingDirectory) {
+    char stagedFilename[1024];
+    struct dirent * entry;
+    DIR * dir;
+
+    if ((dir = opendir(stagingDirectory)) == NULL)
+        return;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (!is_rrd_file(entry->d_name))
+            continue;
+
+        snprintf(stagedFilename, sizeof(stagedFilename), "%s/%s", stagingDirectory, entry->d_name);
+        unlink(stagedFilename);
+    }
+    closedir(dir);
+}
+
+/*
+ * Write the staged RRD files back to the database directory
+ *
+ * Every file is replaced atomically. The caller keeps the sinks from
+ * writing the files while they are copied.
+ *
+ * Parameters:
+ *   *stagingDirectory  - The staging directory
+ *   *directory         - The database directory
+ *
+ * Returns E_OK or E_FILE_ACCESS
+ */
+int sync_staging(const char *stagingDirectory, const char *directory) {
+    char filename[1024];
+    char stagedFilename[1024];
+    struct dirent * entry;
+    DIR * dir;
+    int directoryFd;
+    int result = E_OK;
+    char timeStringBuffer[26];
+    struct tm * tm_info;
+    time_t msgtime;
+
+    if ((dir = opendir(stagingDirectory)) == NULL) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        fprintf(stderr, "%s - Error %i from open directory %s: %s\n", timeStringBuffer, errno, stagingDirectory, strerror(errno));
+        __atomic_add_fetch(&stats.syncErrors, 1, __ATOMIC_RELAXED);
+        return E_FILE_ACCESS;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (!is_rrd_file(entry->d_name))
+            continue;
+
+        snprintf(stagedFilename, sizeof(stagedFilename), "%s/%s", stagingDirectory, entry->d_name);
+        snprintf(filename, sizeof(filename), "%s/%s", directory, entry->d_name);
+
+        if (copy_file(stagedFilename, filename) != E_OK)
+            result = E_FILE_ACCESS;
+    }
+    closedir(dir);
+
+    // The renames are durable once the directory is
+    if ((directoryFd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+        fsync(directoryFd);
+        close(directoryFd);
+    }
+
+    if (result != E_OK) {
+        __atomic_add_fetch(&stats.syncErrors, 1, __ATOMIC_RELAXED);
+        return result;
+    }
+
+    __atomic_add_fetch(&stats.syncs, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.lastSyncTime, time(NULL), __ATOMIC_RELAXED);
+
+    if (verbose) {
+        msgtime = time(NULL);
+        tm_info = localtime(&msgtime);
+        strftime(timeStringBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        printf("%s - Synced staging directory %s to %s\n", timeStringBuffer, stagingDirectory, directory);
+        fflush(stdout);
+    }
+
+    return E_OK;
+}
+
+/*
+ * Sync the staged RRD files when the sync interval has passed, called
+ * by the writer of the files after a write
+ */
+void sync_staging_due(struct _CONFIGSTRUCT *config) {
+    if ((config->stagingDirectory == NULL) || (config->syncInterval <= 0))
+        return;
+
+    if (time(NULL) - __atomic_load_n(&stats.lastSyncTime, __ATOMIC_RELAXED) >= config->syncInterval)
+        sync_staging(config->stagingDirectory, config->databaseDirectory);
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Server mode under load: many meters push telegrams at once and every
+# telegram must be parsed. Run p1load by hand for 10000 meters.
+#
+#   load_test.sh <slimmemeter> <p1load> [meters] [seconds]
+#
+
+server=$1
+load=$2
+meters=${3:-200}
+seconds=${4:-3}
+
+dir=$(mktemp -d) || exit 1
+port=$((20000 + $$ % 20000))
+
+mkdir "$dir/db"
+cat > "$dir/slimmemeter.conf" <<CONF
+db-directory = $dir/db
+control-socket = $dir/control.sock
+server-listen = tcp://127.0.0.1:$port
+CONF
+
+"$server" -c "$dir/slimmemeter.conf" > "$dir/log" 2>&1 &
+pid=$!
+
+wait=0
+while [ ! -S "$dir/control.sock" ] && [ $wait -lt 50 ]; do
+    sleep 0.1
+    wait=$((wait + 1))
+done
+
+"$load" 127.0.0.1 $port $meters $seconds "$dir/control.sock"
+result=$?
+
+kill $pid
+wait $pid
+
+[ $result -ne 0 ] && cat "$dir/log"
+rm -rf "$dir"
+
+exit $result
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * Load harness for the server mode
+ *
+ * Opens a connection per simulated meter, every meter has its own
+ * equipment identifier, and pushes a telegram on each of them every
+ * second. With a control socket the count of telegrams the server
+ * parsed is checked against the count sent.
+ *
+ *   p1load <host> <port> <meters> [seconds] [control-socket]
+ *
+ * 10000 meters need as many descriptors on both sides, the harness and
+ * the server raise their limit to the hard limit.
+ */
+
+#define CRC_POLY 0xA001
+
+static unsigned short crc_16(const char *data, size_t length) {
+    unsigned short crc = 0;
+
+    while (length--) {
+        crc ^= (unsigned char)*data++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x0001) ? ((crc >> 1) ^ CRC_POLY) : (crc >> 1);
+    }
+
+    return crc;
+}
+
+/*
+ * Format the telegram of a meter, the counters rise with every round
+ *
+ * Returns the length of the telegram
+ */
+static int make_telegram(char *buffer, size_t size, int meter, int round) {
+    char timestamp[16];
+    time_t now = time(NULL);
+    int length;
+
+    strftime(timestamp, sizeof(timestamp), "%y%m%d%H%M%S", localtime(&now));
+
+    length = snprintf(buffer, size,
+        "/ISK5\\2M550T-1012\r\n\r\n"
+        "1-3:0.2.8(50)\r\n"
+        "0-0:1.0.0(%sS)\r\n"
+        "0-0:96.1.1(4C4F4144%08d)\r\n"
+        "1-0:1.8.1(%010.3f*kWh)\r\n"
+        "1-0:1.8.2(%010.3f*kWh)\r\n"
+        "1-0:2.8.1(%010.3f*kWh)\r\n"
+        "1-0:2.8.2(%010.3f*kWh)\r\n"
+        "0-0:96.14.0(0002)\r\n"
+        "1-0:1.7.0(%06.3f*kW)\r\n"
+        "1-0:2.7.0(00.000*kW)\r\n"
+        "1-0:32.7.0(230.1*V)\r\n"
+        "1-0:31.7.0(004*A)\r\n"
+        "0-1:24.1.0(003)\r\n"
+        "0-1:24.2.1(%sW)(%09.3f*m3)\r\n"
+        "!",
+        timestamp, meter, 1000.0 + round * 0.001, 2000.0, 10.0, 20.0, 0.5 + (meter % 100) * 0.01, timestamp, 500.0 + round * 0.0001);
+
+    length += snprintf(buffer + length, size - length, "%04X\r\n", crc_16(buffer, length));
+
+    return length;
+}
+
+static int connect_meter(const char *host, const char *port) {
+    struct addrinfo hints;
+    struct addrinfo * addresses;
+    int option = 1;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &addresses) != 0)
+        return -1;
+
+    if ((fd = socket(addresses->ai_family, addresses->ai_socktype | SOCK_CLOEXEC, addresses->ai_protocol)) >= 0) {
+        if (connect(fd, addresses->ai_addr, addresses->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        } else {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+        }
+    }
+    freeaddrinfo(addresses);
+
+    return fd;
+}
+
+static int write_all(int fd, const char *data, int length) {
+    ssize_t written;
+
+    while (length > 0) {
+        if ((written = write(fd, data, length)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+/*
+ * Ask the server for a counter of the stats command
+ *
+ * Returns the counter, or -1 when the control socket does not answer
+ */
+static long control_counter(const char *path, const char *name) {
+    struct sockaddr_un address;
+    struct pollfd pollFd;
+    char reply[4096];
+    char key[64];
+    const char * p;
+    int length = 0;
+    ssize_t received;
+    int fd;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+
+    if ((connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) || (write_all(fd, "stats\n", 6) != 0)) {
+        close(fd);
+        return -1;
+    }
+
+    pollFd.fd = fd;
+    pollFd.events = POLLIN;
+    while ((length < (int)sizeof(reply) - 1) && (memchr(reply, '\n', length) == NULL) && (poll(&pollFd, 1, 2000) > 0)) {
+        if ((received = read(fd, reply + length, sizeof(reply) - 1 - length)) <= 0)
+            break;
+        length += received;
+    }
+    close(fd);
+    reply[length] = '\0';
+
+    snprintf(key, sizeof(key), "\"%s\":", name);
+    if ((p = strstr(reply, key)) == NULL)
+        return -1;
+
+    return strtol(p + strlen(key), NULL, 10);
+}
+
+int main(int argc, char *argv[]) {
+    struct rlimit limit;
+    struct timespec start;
+    struct timespec end;
+    char telegram[1024];
+    int * fds;
+    int meters;
+    int seconds = 10;
+    int length;
+    long baseline = 0;
+    long parsed = -1;
+    long crcErrors = 0;
+    unsigned long sent = 0;
+    unsigned long failed = 0;
+    double elapsed;
+
+    if ((argc < 4) || ((meters = atoi(argv[3])) <= 0)) {
+        fprintf(stderr, "Usage: %s <host> <port> <meters> [seconds] [control-socket]\n", argv[0]);
+        return 2;
+    }
+    if (argc > 4)
+        seconds = atoi(argv[4]);
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if ((fds = (int *)malloc(sizeof(int) * meters)) == NULL)
+        return 2;
+
+    if (argc > 5)
+        baseline = control_counter(argv[5], "telegrams");
+
+    for (int meter = 0; meter < meters; meter++) {
+        if ((fds[meter] = connect_meter(argv[1], argv[2])) < 0) {
+            fprintf(stderr, "Meter %d cannot connect to %s:%s: %s\n", meter, argv[1], argv[2], strerror(errno));
+            return 1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int round = 0; round < seconds; round++) {
+        for (int meter = 0; meter < meters; meter++) {
+            length = make_telegram(telegram, sizeof(telegram), meter, round);
+            if (write_all(fds[meter], telegram, length) != 0)
+                failed++;
+            else
+                sent++;
+        }
+
+        // One telegram per meter per second, as a DSMR 5 meter sends them
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (elapsed < round + 1)
+            usleep((useconds_t)((round + 1 - elapsed) * 1e6));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%d meters sent %lu telegrams in %.1f seconds, %.0f per second, %lu writes failed\n", meters, sent, elapsed, sent / elapsed, failed);
+
+    if (argc > 5) {
+        // Give the workers time to parse what is still buffered
+        for (int wait = 0; wait < 100; wait++) {
+            parsed = control_counter(argv[5], "telegrams");
+            if ((parsed < 0) || (parsed - baseline >= (long)sent))
+                break;
+            usleep(100000);
+        }
+        crcErrors = control_counter(argv[5], "crc_errors");
+
+        printf("Server parsed %ld telegrams, %ld CRC errors\n", parsed - baseline, crcErrors);
+    }
+
+    for (int meter = 0; meter < meters; meter++)
+        close(fds[meter]);
+    free(fds);
+
+    if ((failed > 0) || ((argc > 5) && ((parsed - baseline != (long)sent) || (crcErrors != 0))))
+        return 1;
+
+    return 0;
+}
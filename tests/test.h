@@ -0,0 +1,61 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * Minimal checks for the tests, a failed check is reported and the test
+ * goes on so one run shows every failure
+ */
+static int testFailures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            testFailures++; \
+        } \
+    } while (0)
+
+#define TEST_RESULT() \
+    ((testFailures == 0) ? (printf("All checks passed\n"), 0) : (fprintf(stderr, "%d checks failed\n", testFailures), 1))
+
+/*
+ * Open a stand-in listener on the loopback interface
+ *
+ * Parameters:
+ *   type   - SOCK_STREAM or SOCK_DGRAM
+ *   *port  - Receives the port the kernel picked
+ *
+ * Returns the socket or -1
+ */
+static inline int test_listen(int type, int *port) {
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    int option = 1;
+    int fd;
+
+    if ((fd = socket(AF_INET, type, 0)) < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ((bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) || ((type == SOCK_STREAM) && (listen(fd, 16) != 0)) ||
+        (getsockname(fd, (struct sockaddr *)&address, &addressLength) != 0)) {
+        close(fd);
+        return -1;
+    }
+
+    *port = ntohs(address.sin_port);
+    return fd;
+}
+
+#endif
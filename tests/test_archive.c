@@ -0,0 +1,85 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "slimmemeter.h"
+#include "test.h"
+
+/*
+ * Telegram archive written and replayed, up to the largest telegram the
+ * framer accepts
+ */
+
+// The parts of slimmemeter.c the stream stages of pipeline.c use, replay
+// only runs the archive reader
+void init_framer(p1_framer *framer) {
+    framer->dataPointer = framer->dataBlock;
+}
+
+int p1_frame(p1_framer *framer, char buffer) {
+    (void)framer;
+    (void)buffer;
+    return F_NONE;
+}
+
+/*
+ * Fill a framer with a telegram of the given length, the lines change
+ * with the sequence number so they are not all stored as the same
+ */
+static void make_telegram(p1_framer *framer, int length, int sequence) {
+    int used;
+
+    used = snprintf(framer->dataBlock, sizeof(framer->dataBlock), "/ISK5\\2M550T-1012\r\n\r\n1-0:1.8.1(%06d.000*kWh)\r\n", sequence);
+    while (used < length - 1) {
+        framer->dataBlock[used] = ((used % 64) == 63) ? '\n' : 'a' + (used + sequence) % 26;
+        used++;
+    }
+    framer->dataBlock[used++] = '!';
+    framer->dataBlock[used] = '\0';
+
+    framer->dataPointer = framer->dataBlock + used;
+    memcpy(framer->checksumStr, "1A2B", 4);
+}
+
+int main(void) {
+    static p1_archive archive = { .dataFd = -1, .indexFd = -1 };
+    static p1_framer framers[3];
+    static const int lengths[3] = { 200, sizeof(framers[0].dataBlock) - 1, 300 };
+    char directory[] = "/tmp/test_archive.XXXXXX";
+    char * replayed = NULL;
+    size_t replayedLength = 0;
+    size_t offset = 0;
+    FILE * stream;
+
+    CHECK(mkdtemp(directory) != NULL);
+    CHECK(open_archive(&archive, directory) == E_OK);
+
+    for (int i = 0; i < 3; i++) {
+        make_telegram(&framers[i], lengths[i], i);
+        CHECK(archive_telegram(&archive, &framers[i], 1700000000 + i * 10) == E_OK);
+    }
+    close_archive(&archive);
+
+    // The largest telegram does not make its block corrupt
+    CHECK((stream = open_memstream(&replayed, &replayedLength)) != NULL);
+    CHECK(replay_archive(directory, 0, stream) == E_OK);
+    fclose(stream);
+
+    CHECK(replayedLength == (size_t)(lengths[0] + lengths[1] + lengths[2] + 3 * 6));
+    for (int i = 0; (i < 3) && (offset + lengths[i] + 6 <= replayedLength); i++) {
+        CHECK(memcmp(replayed + offset, framers[i].dataBlock, lengths[i]) == 0);
+        CHECK(memcmp(replayed + offset + lengths[i], "1A2B\r\n", 6) == 0);
+        offset += lengths[i] + 6;
+    }
+    free(replayed);
+
+    snprintf(framers[0].dataBlock, sizeof(framers[0].dataBlock), "%s/telegrams.arc", directory);
+    unlink(framers[0].dataBlock);
+    snprintf(framers[0].dataBlock, sizeof(framers[0].dataBlock), "%s/telegrams.idx", directory);
+    unlink(framers[0].dataBlock);
+    rmdir(directory);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "slimmemeter.h"
+#include "test.h"
+
+/*
+ * Calendar index written in place and loaded back
+ */
+
+static long file_size(const char *filename) {
+    struct stat fileStat;
+
+    return (stat(filename, &fileStat) == 0) ? (long)fileStat.st_size : -1;
+}
+
+int main(void) {
+    static p1_calendar written = { .lock = PTHREAD_MUTEX_INITIALIZER };
+    static p1_calendar loaded = { .lock = PTHREAD_MUTEX_INITIALIZER };
+    char directory[] = "/tmp/test_calendar.XXXXXX";
+    char filename[600];
+    char json[1024];
+    elec_data bucket;
+    unsigned long timestamp = 1700000000 / 300 * 300;
+
+    CHECK(mkdtemp(directory) != NULL);
+    snprintf(filename, sizeof(filename), "%s/calendar.idx", directory);
+
+    init_calendar(&written, directory);
+    CHECK(access(filename, F_OK) != 0);
+
+    // Five days of hourly buckets, the first writes the whole index
+    memset(&bucket, 0, sizeof(bucket));
+    for (int hour = 0; hour < 5 * 24; hour++) {
+        bucket.kwh_1_in = 1000.0 + hour * 0.5;
+        bucket.gas = 500.0 + hour * 0.1;
+        calendar_add(&written, timestamp + hour * 3600, &bucket);
+
+        if (hour == 0)
+            CHECK(file_size(filename) == (long)sizeof(calendar_index));
+    }
+
+    // Updated in place, no temporary file is left and the size is the same
+    CHECK(file_size(filename) == (long)sizeof(calendar_index));
+    snprintf(json, sizeof(json), "%s.tmp", filename);
+    CHECK(access(json, F_OK) != 0);
+
+    init_calendar(&loaded, directory);
+    CHECK(memcmp(&loaded.index, &written.index, sizeof(calendar_index)) == 0);
+    CHECK(loaded.index.count[0] >= 5);
+
+    CHECK(json_totals(json, sizeof(json), &loaded, "day", 1) > 0);
+    CHECK(strstr(json, "\"kwh_1_in\":12.000") != NULL);
+
+    // An index that cannot be read starts over and is written whole
+    CHECK(truncate(filename, 100) == 0);
+    init_calendar(&loaded, directory);
+    CHECK(loaded.index.count[0] == 0);
+    calendar_add(&loaded, timestamp + 10 * 86400, &bucket);
+    CHECK(file_size(filename) == (long)sizeof(calendar_index));
+
+    unlink(filename);
+    rmdir(directory);
+
+    return TEST_RESULT();
+}
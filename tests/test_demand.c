@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "slimmemeter.h"
+#include "test.h"
+
+/*
+ * Rolling window and billing blocks of the demand engine, over short
+ * intervals, a gap of a window and a long gap
+ */
+
+static int near(double value, double expected) {
+    return fabs(value - expected) < 1e-9;
+}
+
+int main(void) {
+    static p1_demand demand;
+    unsigned long start = 1690000020;
+
+    CHECK(init_demand(&demand, 60) == E_OK);
+
+    // The first telegram only starts the block
+    demand_update(&demand, start, 2.0, 0.5);
+    CHECK((demand.filled == 0) && (demand.blockStart == start) && (demand.blockSeconds == 0));
+
+    // The power holds for the seconds since the previous telegram
+    demand_update(&demand, start + 10, 2.0, 0.5);
+    CHECK(demand.filled == 10);
+    CHECK(near(demand.sum[0], 20.0) && near(demand.sum[1], 5.0));
+    CHECK((demand.blockSeconds == 10) && near(demand.blockEnergy[0], 20.0));
+
+    // A gap of a window replaces it and closes the block on the way
+    demand_update(&demand, start + 70, 1.0, 0.0);
+    CHECK(demand.filled == 60);
+    CHECK(near(demand.sum[0], 60.0) && near(demand.sum[1], 0.0));
+    CHECK(near(demand.lastBlock[0], 69.0 / 59.0) && near(demand.peak[0], 69.0 / 59.0));
+    CHECK((demand.blockStart == start + 60) && (demand.blockSeconds == 11) && near(demand.blockEnergy[0], 11.0));
+
+    // Of a long gap only the last window counts, in at most two blocks
+    demand_update(&demand, start + 100000, 3.0, 1.0);
+    CHECK(demand.filled == 60);
+    CHECK(near(demand.sum[0], 180.0) && near(demand.sum[1], 60.0));
+    CHECK(near(demand.lastBlock[0], 3.0) && near(demand.peak[0], 3.0));
+    CHECK(demand.peakTime[0] == start + 99900);
+    CHECK((demand.blockStart == start + 99960) && (demand.blockSeconds == 41));
+
+    // Every slot of the window is replaced once per window
+    for (unsigned long second = start + 100001; second <= start + 100060; second++)
+        demand_update(&demand, second, 0.5, 0.0);
+    CHECK(near(demand.sum[0], 30.0) && near(demand.sum[1], 0.0));
+
+    // Older telegrams are ignored
+    demand_update(&demand, start + 100000, 9.0, 9.0);
+    CHECK(near(demand.current[0], 0.5) && (demand.lastTime == start + 100060));
+
+    free_demand(&demand);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <rrd.h>
+
+#include "slimmemeter.h"
+#include "test.h"
+
+/*
+ * History rings warmed from a stand-in for the databases, then fed with
+ * live buckets
+ */
+
+/*
+ * Stand-in for librrd: the counters database has 1 kWh per hour on
+ * KWh_1_in in every archive, the other databases cannot be read
+ */
+static const char * fetchError = "";
+
+void rrd_clear_error(void) {
+    fetchError = "";
+}
+
+int rrd_test_error(void) {
+    return *fetchError != '\0';
+}
+
+char * rrd_get_error(void) {
+    return (char *)fetchError;
+}
+
+void rrd_freemem(void *pointer) {
+    free(pointer);
+}
+
+int rrd_fetch_r(const char *filename, const char *cf, time_t *start, time_t *end, unsigned long *step, unsigned long *sourceCount, char ***sourceNames, rrd_value_t **data) {
+    unsigned long rows;
+
+    (void)cf;
+
+    if (strcmp(filename, "counters") != 0) {
+        fetchError = "no such file";
+        return -1;
+    }
+
+    rows = (*end - *start) / *step;
+    *sourceCount = 1;
+    *sourceNames = (char **)malloc(sizeof(char *));
+    (*sourceNames)[0] = strdup("KWh_1_in");
+    *data = (rrd_value_t *)malloc(rows * sizeof(rrd_value_t));
+    for (unsigned long i = 0; i < rows; i++)
+        (*data)[i] = 1.0 / 3600;
+
+    return 0;
+}
+
+/*
+ * The value of the last row of a history, -1 for null
+ */
+static double last_value(const char *json) {
+    const char * row = strrchr(json, '[');
+    const char * value;
+
+    if ((row == NULL) || ((value = strchr(row, ',')) == NULL) || (strncmp(value + 1, "null", 4) == 0))
+        return -1;
+
+    return atof(value + 1);
+}
+
+int main(void) {
+    static char json[65536];
+    struct _CONFIGSTRUCT config;
+    elec_data bucket;
+    unsigned long first;
+    char expected[64];
+
+    memset(&config, 0, sizeof(config));
+    config.rrdFilenames[RRD_COUNTERS] = "counters";
+    config.rrdFilenames[RRD_VOLTAGE] = "voltage";
+    config.rrdFilenames[RRD_KWINOUT] = "kwinout";
+    config.rrdFilenames[RRD_PHASES] = "phases";
+
+    warm_history(&config);
+
+    // The warmed rows hold the rate per hour
+    CHECK(json_history(json, sizeof(json), "kwh_1_in", "hour") > 0);
+    CHECK(strstr(json, "\"step\":300") != NULL);
+    CHECK(last_value(json) == 1.0);
+    CHECK(json_history(json, sizeof(json), "kwh_1_in", "week") > 0);
+    CHECK(last_value(json) == 1.0);
+
+    // Live buckets on the next half hour, both in one row of the week
+    first = ((unsigned long)time(NULL) + 1799) / 1800 * 1800;
+
+    memset(&bucket, 0, sizeof(bucket));
+    bucket.kwh_1_in = 5000.0;
+    bucket.kw_in_min = 0.5;
+    bucket.kw_in_avg = 1.0;
+    bucket.kw_in_max = 1.5;
+    history_add(first, &bucket);
+
+    // No earlier reading, no rate
+    CHECK(json_history(json, sizeof(json), "kwh_1_in", "hour") > 0);
+    snprintf(expected, sizeof(expected), "[%lu,null]", first + 300);
+    CHECK(strstr(json, expected) != NULL);
+
+    // A quarter kWh in five minutes is 3 kWh per hour, not the reading
+    bucket.kwh_1_in = 5000.25;
+    history_add(first + 300, &bucket);
+
+    CHECK(json_history(json, sizeof(json), "kwh_1_in", "hour") > 0);
+    snprintf(expected, sizeof(expected), "[%lu,3.000]", first + 600);
+    CHECK(strstr(json, expected) != NULL);
+
+    // The unknown rate is left out of the coarser row
+    CHECK(json_history(json, sizeof(json), "kwh_1_in", "week") > 0);
+    snprintf(expected, sizeof(expected), "[%lu,3.000]", first + 1800);
+    CHECK(strstr(json, expected) != NULL);
+
+    // Gauges are stored as they are
+    CHECK(json_history(json, sizeof(json), "kw_in", "hour") > 0);
+    snprintf(expected, sizeof(expected), "[%lu,0.500,1.000,1.500]", first + 600);
+    CHECK(strstr(json, expected) != NULL);
+
+    // A counter that went back has no rate
+    bucket.kwh_1_in = 10.0;
+    history_add(first + 600, &bucket);
+    CHECK(json_history(json, sizeof(json), "kwh_1_in", "hour") > 0);
+    snprintf(expected, sizeof(expected), "[%lu,null]", first + 900);
+    CHECK(strstr(json, expected) != NULL);
+
+    return TEST_RESULT();
+}
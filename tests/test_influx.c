@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <sys/socket.h>
+
+#include "slimmemeter.h"
+#include "test.h"
+
+/*
+ * InfluxDB sink against loopback stand-ins for the HTTP and UDP listeners
+ */
+
+// The parts of slimmemeter.c the sink and the network code use
+int serialPort = -1;
+p1_derived derivedChannels;
+
+int init_serial(struct _CONFIGSTRUCT *config) {
+    (void)config;
+    return -1;
+}
+
+#define MAX_REQUESTS 8
+
+/*
+ * Stand-in HTTP server, answers the requests with the statuses in turn
+ * and keeps the inflated bodies
+ */
+static int httpListener;
+static int httpAccepts = 0;
+static int httpRequests = 0;
+static int httpGzip = 0;
+static const int httpStatus[MAX_REQUESTS] = { 204, 204, 400, 503, 204 };
+static char * httpBody[MAX_REQUESTS];
+
+static char * inflate_body(const char *body, size_t length) {
+    z_stream stream;
+    char * text;
+    size_t size = 1 << 20;
+
+    if ((text = (char *)calloc(1, size)) == NULL)
+        return NULL;
+
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+        free(text);
+        return NULL;
+    }
+    stream.next_in = (unsigned char *)body;
+    stream.avail_in = length;
+    stream.next_out = (unsigned char *)text;
+    stream.avail_out = size - 1;
+
+    if (inflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        free(text);
+        text = NULL;
+    }
+    inflateEnd(&stream);
+
+    return text;
+}
+
+static void * http_server(void *argument) {
+    static char request[1 << 20];
+    char response[256];
+    char * end;
+    char * header;
+    int length;
+    int bodyLength;
+    int client;
+    int status;
+    ssize_t result;
+
+    (void)argument;
+
+    while ((client = accept(httpListener, NULL, NULL)) >= 0) {
+        httpAccepts++;
+        length = 0;
+
+        for (;;) {
+            // Headers and the whole body of the next request
+            while (((end = memmem(request, length, "\r\n\r\n", 4)) == NULL) ||
+                   ((header = strcasestr(request, "\r\nContent-Length:")) == NULL) || (length < (end + 4 - request) + atoi(header + 17))) {
+                if ((result = recv(client, request + length, sizeof(request) - 1 - length, 0)) <= 0)
+                    break;
+                length += result;
+                request[length] = '\0';
+            }
+            if ((end == NULL) || (header == NULL) || (length < (end + 4 - request) + atoi(header + 17)))
+                break;
+
+            bodyLength = atoi(header + 17);
+            *end = '\0';
+            if (strcasestr(request, "\r\nContent-Encoding: gzip") != NULL) {
+                httpGzip++;
+                httpBody[httpRequests] = inflate_body(end + 4, bodyLength);
+            } else {
+                httpBody[httpRequests] = strndup(end + 4, bodyLength);
+            }
+
+            status = httpStatus[httpRequests++];
+            if (status == 400)
+                snprintf(response, sizeof(response), "HTTP/1.1 400 Bad Request\r\nContent-Type: application/json\r\nContent-Length: 17\r\n\r\n{\"error\":\"field\"}");
+            else
+                snprintf(response, sizeof(response), "HTTP/1.1 %d Status\r\nContent-Length: 0\r\n\r\n", status);
+            send(client, response, strlen(response), MSG_NOSIGNAL);
+
+            length -= (end + 4 - request) + bodyLength;
+            memmove(request, end + 4 + bodyLength, length);
+            request[length] = '\0';
+        }
+        close(client);
+    }
+
+    return NULL;
+}
+
+static int count_lines(const char *text, const char *measurement) {
+    int lines = 0;
+
+    for (const char * line = text; (line != NULL) && (*line != '\0'); line = strchr(line, '\n'), line = (line != NULL) ? line + 1 : NULL) {
+        if (strncmp(line, measurement, strlen(measurement)) == 0)
+            lines++;
+    }
+
+    return lines;
+}
+
+static int write_buckets(p1_sink *sink, int count, unsigned long timestamp) {
+    sink_item items[64];
+    int written;
+
+    for (int i = 0; i < count; i++) {
+        memset(&items[i], 0, sizeof(sink_item));
+        items[i].type = SINK_BUCKET;
+        items[i].timestamp = timestamp + i * 60;
+        items[i].data = (elec_data *)calloc(1, sizeof(elec_data));
+        items[i].data->kwh_1_in = 1000.0 + i;
+    }
+
+    written = influxSink.write(sink, items, count);
+
+    for (int i = 0; i < count; i++)
+        free(items[i].data);
+
+    return written;
+}
+
+int main(void) {
+    struct _CONFIGSTRUCT config;
+    struct pollfd pollFd;
+    p1_sink sink;
+    pthread_t thread;
+    char url[128];
+    char datagram[65536];
+    char * received;
+    size_t receivedLength = 0;
+    int udpListener;
+    int listenPort;
+    int datagrams = 0;
+    int whole = 1;
+    ssize_t length;
+
+    // HTTP with gzip on a kept alive connection
+    httpListener = test_listen(SOCK_STREAM, &listenPort);
+    CHECK(httpListener >= 0);
+    pthread_create(&thread, NULL, http_server, NULL);
+
+    memset(&config, 0, sizeof(config));
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/write?db=p1", listenPort);
+    config.influxUrl = url;
+    config.influxMeasurement = "p1";
+    config.influxGzip = 1;
+    config.influxBatch = 100;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.type = &influxSink;
+    sink.config = &config;
+    CHECK(influxSink.init(&sink) == E_OK);
+
+    CHECK(write_buckets(&sink, 2, 1700000000) == 2);
+    CHECK(influxSink.flush(&sink) == E_OK);
+    CHECK(write_buckets(&sink, 1, 1700000120) == 1);
+    CHECK(influxSink.flush(&sink) == E_OK);
+
+    CHECK(httpRequests == 2);
+    CHECK(httpGzip == 2);
+    CHECK((httpBody[0] != NULL) && (count_lines(httpBody[0], "p1 ") == 2));
+    CHECK((httpBody[0] != NULL) && (strstr(httpBody[0], "kwh_1_in=1000.000") != NULL) && (strstr(httpBody[0], " 1700000000000000000\n") != NULL));
+    CHECK((httpBody[1] != NULL) && (count_lines(httpBody[1], "p1 ") == 1));
+
+    // A rejected batch is dropped, its error body is skipped
+    CHECK(write_buckets(&sink, 1, 1700000180) == 1);
+    CHECK(influxSink.flush(&sink) == E_OK);
+    CHECK(influxSink.flush(&sink) == E_OK);
+    CHECK(httpRequests == 3);
+
+    // A server error keeps the batch for the next flush
+    CHECK(write_buckets(&sink, 1, 1700000240) == 1);
+    CHECK(influxSink.flush(&sink) == E_FILE_ACCESS);
+    CHECK(influxSink.flush(&sink) == E_OK);
+    CHECK(httpRequests == 5);
+    CHECK((httpBody[3] != NULL) && (httpBody[4] != NULL) && (strcmp(httpBody[3], httpBody[4]) == 0));
+    CHECK((httpBody[4] != NULL) && (strstr(httpBody[4], " 1700000240000000000\n") != NULL));
+
+    // Every request went over the first connection
+    CHECK(httpAccepts == 1);
+
+    influxSink.close(&sink);
+    shutdown(httpListener, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(httpListener);
+
+    for (int i = 0; i < MAX_REQUESTS; i++)
+        free(httpBody[i]);
+
+    // UDP, the batch is split between lines in datagrams that fit
+    udpListener = test_listen(SOCK_DGRAM, &listenPort);
+    CHECK(udpListener >= 0);
+
+    snprintf(url, sizeof(url), "udp://127.0.0.1:%d", listenPort);
+    config.influxBatch = 1000;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.type = &influxSink;
+    sink.config = &config;
+    CHECK(influxSink.init(&sink) == E_OK);
+
+    CHECK(write_buckets(&sink, 40, 1700000000) == 40);
+    CHECK(influxSink.flush(&sink) == E_OK);
+
+    received = (char *)calloc(1, INFLUX_BUFFER_SIZE);
+    pollFd.fd = udpListener;
+    pollFd.events = POLLIN;
+    while ((poll(&pollFd, 1, 500) > 0) && ((length = recv(udpListener, datagram, sizeof(datagram), 0)) > 0)) {
+        datagrams++;
+        if ((length > INFLUX_UDP_PAYLOAD) || (datagram[length - 1] != '\n'))
+            whole = 0;
+        memcpy(received + receivedLength, datagram, length);
+        receivedLength += length;
+    }
+
+    CHECK(datagrams > 1);
+    CHECK(whole);
+    CHECK(count_lines(received, "p1 ") == 40);
+    CHECK(strstr(received, " 1700002340000000000\n") != NULL);
+
+    free(received);
+    influxSink.close(&sink);
+    close(udpListener);
+
+    return TEST_RESULT();
+}
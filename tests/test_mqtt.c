@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "slimmemeter.h"
+#include "test.h"
+
+/*
+ * MQTT sink against a loopback stand-in for a broker
+ */
+
+// The parts of slimmemeter.c the sink and the network code use
+int serialPort = -1;
+p1_derived derivedChannels;
+
+int init_serial(struct _CONFIGSTRUCT *config) {
+    (void)config;
+    return -1;
+}
+
+#define MAX_MESSAGES 16
+
+/*
+ * Stand-in broker, hangs up on the first connection as if it were down
+ * and acknowledges every publish on the next ones
+ */
+static int brokerListener;
+static int brokerAccepts = 0;
+static int brokerConnects = 0;
+static int brokerCleanSession = 0;
+static char brokerClientId[64];
+static size_t brokerPasswordLength = 0;
+static int brokerMessages = 0;
+static int brokerQos1 = 0;
+static unsigned short brokerPacketIds[MAX_MESSAGES];
+static char brokerTopics[MAX_MESSAGES][128];
+static unsigned long brokerTimes[MAX_MESSAGES];
+
+/*
+ * Read one packet
+ *
+ * Returns the fixed header, or -1 when the connection closed
+ */
+static int read_packet(int fd, unsigned char *payload, size_t size, size_t *length) {
+    unsigned char header;
+    unsigned char byte;
+    size_t remaining = 0;
+    int shift = 0;
+
+    if (recv(fd, &header, 1, MSG_WAITALL) != 1)
+        return -1;
+
+    do {
+        if (recv(fd, &byte, 1, MSG_WAITALL) != 1)
+            return -1;
+        remaining |= (size_t)(byte & 127) << shift;
+        shift += 7;
+    } while (byte & 128);
+
+    if ((remaining > size) || ((remaining > 0) && (recv(fd, payload, remaining, MSG_WAITALL) != (ssize_t)remaining)))
+        return -1;
+    *length = remaining;
+
+    return header;
+}
+
+static void * broker(void *argument) {
+    static unsigned char payload[MQTT_MAX_PACKET];
+    unsigned char reply[4];
+    const char * time;
+    size_t length;
+    size_t topicLength;
+    size_t used;
+    int header;
+    int client;
+
+    (void)argument;
+
+    while ((client = accept(brokerListener, NULL, NULL)) >= 0) {
+        if (brokerAccepts++ == 0) {
+            close(client);
+            continue;
+        }
+
+        while ((header = read_packet(client, payload, sizeof(payload) - 1, &length)) >= 0) {
+            if (header == 0x10) {
+                // Protocol name, level, flags, keep alive and the client identifier
+                brokerConnects++;
+                brokerCleanSession = ((length > 9) && (memcmp(payload, "\0\4MQTT\4", 7) == 0) && ((payload[7] & 0x02) != 0));
+                topicLength = (payload[10] << 8) | payload[11];
+                snprintf(brokerClientId, sizeof(brokerClientId), "%.*s", (int)topicLength, payload + 12);
+                used = 12 + topicLength;
+                if ((payload[7] & 0x80) != 0)
+                    used += 2 + ((payload[used] << 8) | payload[used + 1]);
+                if ((payload[7] & 0x40) != 0)
+                    brokerPasswordLength = (payload[used] << 8) | payload[used + 1];
+
+                reply[0] = 0x20;
+                reply[1] = 2;
+                reply[2] = 0;
+                reply[3] = 0;
+                send(client, reply, 4, MSG_NOSIGNAL);
+                continue;
+            }
+
+            if (((header & 0xf0) != 0x30) || (brokerMessages == MAX_MESSAGES))
+                continue;
+
+            topicLength = (payload[0] << 8) | payload[1];
+            snprintf(brokerTopics[brokerMessages], sizeof(brokerTopics[0]), "%.*s", (int)topicLength, payload + 2);
+            used = 2 + topicLength;
+
+            reply[0] = 0;
+            if ((header & 0x06) == 0x02) {
+                brokerQos1++;
+                brokerPacketIds[brokerMessages] = (payload[used] << 8) | payload[used + 1];
+
+                reply[0] = 0x40;
+                reply[1] = 2;
+                reply[2] = payload[used];
+                reply[3] = payload[used + 1];
+                used += 2;
+            }
+
+            payload[length] = '\0';
+            if ((time = strstr((char *)payload + used, "\"time\":")) != NULL)
+                brokerTimes[brokerMessages] = strtoul(time + 7, NULL, 10);
+            brokerMessages++;
+
+            // Acknowledged once recorded, the sink goes on after the PUBACK
+            if (reply[0] == 0x40)
+                send(client, reply, 4, MSG_NOSIGNAL);
+        }
+        close(client);
+    }
+
+    return NULL;
+}
+
+static int write_buckets(p1_sink *sink, int count, unsigned long timestamp) {
+    sink_item items[16];
+    int written;
+
+    for (int i = 0; i < count; i++) {
+        memset(&items[i], 0, sizeof(sink_item));
+        items[i].type = SINK_BUCKET;
+        items[i].timestamp = timestamp + i * 60;
+        items[i].data = (elec_data *)calloc(1, sizeof(elec_data));
+    }
+
+    written = mqttSink.write(sink, items, count);
+
+    // The sink takes the buckets it buffers
+    for (int i = 0; i < count; i++)
+        free(items[i].data);
+
+    return written;
+}
+
+int main(void) {
+    struct _CONFIGSTRUCT config;
+    p1_sink sink;
+    pthread_t thread;
+    static char password[MQTT_MAX_PACKET + 1];
+    char url[64];
+    int listenPort;
+
+    brokerListener = test_listen(SOCK_STREAM, &listenPort);
+    CHECK(brokerListener >= 0);
+    pthread_create(&thread, NULL, broker, NULL);
+
+    memset(&config, 0, sizeof(config));
+    snprintf(url, sizeof(url), "mqtt://127.0.0.1:%d", listenPort);
+    config.mqttUrl = url;
+    config.mqttQos = 1;
+    config.mqttBuffer = 4;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.type = &mqttSink;
+    sink.config = &config;
+    pthread_mutex_init(&sink.lock, NULL);
+    CHECK(mqttSink.init(&sink) == E_OK);
+
+    // The broker is down, the buckets stay buffered
+    CHECK(write_buckets(&sink, 2, 1700000000) == 2);
+    CHECK(mqttSink.flush(&sink) == E_FILE_ACCESS);
+    CHECK(brokerConnects == 0);
+
+    // Back up, the buffer goes out oldest first with QoS 1
+    CHECK(write_buckets(&sink, 1, 1700000120) == 1);
+    CHECK(mqttSink.flush(&sink) == E_OK);
+
+    CHECK(brokerConnects == 1);
+    CHECK(brokerCleanSession);
+    CHECK(strcmp(brokerClientId, "slimmemeter") == 0);
+    CHECK(brokerMessages == 3);
+    CHECK(brokerQos1 == 3);
+    CHECK((brokerTimes[0] == 1700000000) && (brokerTimes[1] == 1700000060) && (brokerTimes[2] == 1700000120));
+    CHECK(strcmp(brokerTopics[0], "p1/interval") == 0);
+    CHECK((brokerPacketIds[0] != 0) && (brokerPacketIds[1] != brokerPacketIds[0]) && (brokerPacketIds[2] != brokerPacketIds[1]));
+
+    // A full buffer drops its oldest buckets
+    CHECK(write_buckets(&sink, 6, 1700000180) == 6);
+    CHECK(sink.dropped == 2);
+    CHECK(mqttSink.flush(&sink) == E_OK);
+    CHECK(brokerMessages == 7);
+    CHECK((brokerTimes[3] == 1700000300) && (brokerTimes[6] == 1700000480));
+
+    // The connection is kept between flushes
+    CHECK(brokerAccepts == 2);
+
+    mqttSink.close(&sink);
+
+    // A 2KB password fits in the CONNECT packet
+    memset(password, 'p', 2048);
+    password[2048] = '\0';
+    config.mqttPassword = password;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.type = &mqttSink;
+    sink.config = &config;
+    pthread_mutex_init(&sink.lock, NULL);
+    CHECK(mqttSink.init(&sink) == E_OK);
+    CHECK(write_buckets(&sink, 1, 1700000540) == 1);
+    CHECK(mqttSink.flush(&sink) == E_OK);
+    CHECK(brokerConnects == 2);
+    CHECK(brokerPasswordLength == 2048);
+    CHECK(brokerMessages == 8);
+    mqttSink.close(&sink);
+
+    // One that does not fit is refused before connecting
+    memset(password, 'p', sizeof(password) - 1);
+    password[sizeof(password) - 1] = '\0';
+
+    memset(&sink, 0, sizeof(sink));
+    sink.type = &mqttSink;
+    sink.config = &config;
+    pthread_mutex_init(&sink.lock, NULL);
+    CHECK(mqttSink.init(&sink) == E_OK);
+    CHECK(write_buckets(&sink, 1, 1700000600) == 1);
+    CHECK(mqttSink.flush(&sink) == E_FILE_ACCESS);
+    CHECK(brokerAccepts == 3);
+    CHECK(brokerMessages == 8);
+    mqttSink.close(&sink);
+
+    shutdown(brokerListener, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(brokerListener);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "slimmemeter.h"
+#include "test.h"
+
+/*
+ * Network P1 input against a loopback stand-in for a dongle
+ */
+
+// The parts of slimmemeter.c the network input uses
+int serialPort = -1;
+
+int init_serial(struct _CONFIGSTRUCT *config) {
+    return init_tcp(config);
+}
+
+extern time_t reconnectTime;
+
+static const char telegram[] =
+    "/ISK5\\2M550T-1012\r\n\r\n1-3:0.2.8(50)\r\n1-0:1.8.1(001000.123*kWh)\r\n1-0:1.7.0(01.234*kW)\r\n!1E5F\r\n";
+
+/*
+ * Read until a number of bytes arrived, the end of the stream or a timeout
+ *
+ * Returns the number of bytes read
+ */
+static int read_stream(int fd, char *buffer, int size, int *closed) {
+    struct pollfd pollFd = { .fd = fd, .events = POLLIN };
+    int length = 0;
+    int result;
+
+    *closed = 0;
+    while ((length < size) && (poll(&pollFd, 1, 2000) > 0)) {
+        if ((result = read(fd, buffer + length, size - length)) <= 0) {
+            *closed = 1;
+            break;
+        }
+        length += result;
+    }
+
+    return length;
+}
+
+int main(void) {
+    struct _CONFIGSTRUCT config;
+    char device[64];
+    char host[64];
+    char port[16];
+    char buffer[sizeof(telegram) * 2];
+    int listener;
+    int listenPort;
+    int client;
+    int closed;
+    int option;
+    socklen_t optionLength = sizeof(option);
+
+    // Device names
+    CHECK(is_tcp_device("tcp://dongle:2000"));
+    CHECK(!is_tcp_device("/dev/ttyUSB0"));
+    CHECK(split_tcp_device("tcp://dongle.local:2000", host, sizeof(host), port, sizeof(port)) == E_OK);
+    CHECK((strcmp(host, "dongle.local") == 0) && (strcmp(port, "2000") == 0));
+    CHECK(split_tcp_device("tcp://[::1]:23", host, sizeof(host), port, sizeof(port)) == E_OK);
+    CHECK((strcmp(host, "::1") == 0) && (strcmp(port, "23") == 0));
+    CHECK(split_tcp_device("tcp://dongle", host, sizeof(host), port, sizeof(port)) == E_CONF_FILE);
+    CHECK(split_tcp_device("tcp://:2000", host, sizeof(host), port, sizeof(port)) == E_CONF_FILE);
+    CHECK(split_tcp_device("tcp://dongle:", host, sizeof(host), port, sizeof(port)) == E_CONF_FILE);
+
+    listener = test_listen(SOCK_STREAM, &listenPort);
+    CHECK(listener >= 0);
+
+    memset(&config, 0, sizeof(config));
+    snprintf(device, sizeof(device), "tcp://127.0.0.1:%d", listenPort);
+    config.serialPortFilename = device;
+    config.networkTimeout = 30;
+
+    // A non-blocking connection with keepalive, the stream arrives as sent
+    serialPort = init_serial(&config);
+    CHECK(serialPort >= 0);
+    CHECK((fcntl(serialPort, F_GETFL) & O_NONBLOCK) != 0);
+    CHECK((getsockopt(serialPort, SOL_SOCKET, SO_KEEPALIVE, &option, &optionLength) == 0) && (option == 1));
+    CHECK(tcp_poll_timeout(&config) == 1000);
+
+    client = accept(listener, NULL, NULL);
+    CHECK(client >= 0);
+    CHECK(write(client, telegram, sizeof(telegram) - 1) == (ssize_t)sizeof(telegram) - 1);
+    CHECK(read_stream(serialPort, buffer, sizeof(telegram) - 1, &closed) == (int)sizeof(telegram) - 1);
+    CHECK(memcmp(buffer, telegram, sizeof(telegram) - 1) == 0);
+
+    // The dongle hangs up, the input backs off and reconnects
+    close(client);
+    read_stream(serialPort, buffer, sizeof(buffer), &closed);
+    CHECK(closed);
+
+    reconnectDelay = 1;
+    drop_tcp(&config, "closed by peer");
+    CHECK(serialPort < 0);
+    CHECK(reconnectDelay == 2);
+    CHECK((tcp_poll_timeout(&config) >= 0) && (tcp_poll_timeout(&config) <= 1000));
+    CHECK(reconnect_tcp(&config) == 0);
+
+    reconnectTime = time(NULL);
+    CHECK(reconnect_tcp(&config) == 1);
+    CHECK(serialPort >= 0);
+
+    client = accept(listener, NULL, NULL);
+    CHECK(client >= 0);
+    CHECK(write(client, telegram, sizeof(telegram) - 1) == (ssize_t)sizeof(telegram) - 1);
+    CHECK(read_stream(serialPort, buffer, sizeof(telegram) - 1, &closed) == (int)sizeof(telegram) - 1);
+    CHECK(memcmp(buffer, telegram, sizeof(telegram) - 1) == 0);
+
+    // The delay doubles up to a minute
+    for (int i = 0; i < 8; i++)
+        drop_tcp(&config, "test");
+    CHECK(reconnectDelay == 60);
+
+    close(client);
+    close(listener);
+
+    return TEST_RESULT();
+}
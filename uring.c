@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "slimmemeter.h"
+
+/*
+ * Minimal io_uring support on the raw system calls, so there is no
+ * dependency on liburing. Only what the concentrator needs is here.
+ *
+ * The serial port of the single meter mode stays on poll() and read().
+ * A tty has no asynchronous read, io_uring would run every read on a
+ * kernel worker blocked in read(), and a read still posted on the port
+ * would have to be cancelled before it is reopened on a reload.
+ */
+
+/*
+ * Set up an io_uring instance
+ *
+ * Parameters:
+ *   *ring    - The ring
+ *   entries  - Number of submission queue entries
+ *
+ * Returns E_OK, or E_FILE_ACCESS when io_uring is not available
+ */
+int init_uring(p1_uring *ring, unsigned int entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(p1_uring));
+    memset(&params, 0, sizeof(params));
+
+    if ((ring->fd = syscall(__NR_io_uring_setup, entries, &params)) < 0)
+        return E_FILE_ACCESS;
+
+    // Kernels before 5.4 map the rings separately, these are not supported
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+        close(ring->fd);
+        ring->fd = -1;
+        return E_FILE_ACCESS;
+    }
+
+    ring->ringSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ring->ringSize)
+        ring->ringSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if ((ring->ring = mmap(NULL, ring->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+        close(ring->fd);
+        ring->fd = -1;
+        return E_FILE_ACCESS;
+    }
+
+    if ((ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        munmap(ring->ring, ring->ringSize);
+        close(ring->fd);
+        ring->fd = -1;
+        return E_FILE_ACCESS;
+    }
+
+    ring->sqHead = (unsigned int *)((char *)ring->ring + params.sq_off.head);
+    ring->sqTail = (unsigned int *)((char *)ring->ring + params.sq_off.tail);
+    ring->sqMask = *(unsigned int *)((char *)ring->ring + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned int *)((char *)ring->ring + params.sq_off.array);
+    ring->sqEntries = params.sq_entries;
+    ring->cqHead = (unsigned int *)((char *)ring->ring + params.cq_off.head);
+    ring->cqTail = (unsigned int *)((char *)ring->ring + params.cq_off.tail);
+    ring->cqMask = *(unsigned int *)((char *)ring->ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->ring + params.cq_off.cqes);
+
+    return E_OK;
+}
+
+void close_uring(p1_uring *ring) {
+    if (ring->fd < 0)
+        return;
+
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->ring, ring->ringSize);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/*
+ * Submit the queued entries and wait for completions
+ *
+ * Parameters:
+ *   *ring    - The ring
+ *   waitFor  - Number of completions to wait for, 0 to only submit
+ *
+ * Returns the number of entries submitted, or a negative value on error
+ */
+int uring_submit(p1_uring *ring, unsigned int waitFor) {
+    unsigned int queued = ring->queued;
+    int result;
+
+    ring->queued = 0;
+
+    while (((result = syscall(__NR_io_uring_enter, ring->fd, queued, waitFor, (waitFor > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0) && (errno == EINTR)) {
+        // Entries are consumed even when the wait is interrupted
+        queued = 0;
+    }
+
+    return result;
+}
+
+/*
+ * Get a cleared submission queue entry
+ *
+ * The submission queue is flushed when it is full, so this never fails.
+ */
+struct io_uring_sqe * uring_sqe(p1_uring *ring) {
+    unsigned int tail = *ring->sqTail;
+    struct io_uring_sqe * sqe;
+
+    if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+        uring_submit(ring, 0);
+        tail = *ring->sqTail;
+    }
+
+    sqe = &ring->sqes[tail & ring->sqMask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqArray[tail & ring->sqMask] = tail & ring->sqMask;
+
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+
+    return sqe;
+}
+
+/*
+ * Take the next completion, when there is one
+ *
+ * Parameters:
+ *   *ring  - The ring
+ *   *cqe   - Receives a copy of the completion
+ *
+ * Returns 1 for a completion, 0 when there is none
+ */
+int uring_cqe(p1_uring *ring, struct io_uring_cqe *cqe) {
+    unsigned int head = *ring->cqHead;
+
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    *cqe = ring->cqes[head & ring->cqMask];
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}